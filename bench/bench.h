@@ -0,0 +1,100 @@
+/* shared helpers for the benchmark programs
+ *
+ * Benchmarks re-execute themselves with libintercept preloaded, so they can
+ * compare plain libc against the intercept stack within one run. Each run
+ * operates in a fresh scratch tree, which also serves as HOME and holds the
+ * Unison profile directory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define ARCHIVE_FILE ".unison/ar00000000000000000000000000000000"
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* path below the scratch tree, returned in one of a few rotating buffers */
+static inline const char *bench_path(const char *relative)
+{
+	static char buffer[4][4096];
+	static unsigned index = 0;
+	index = (index + 1) % (sizeof(buffer) / sizeof(buffer[0]));
+	snprintf(buffer[index], sizeof(buffer[index]), "%s/%s", getenv("HOME"), relative);
+	return buffer[index];
+}
+
+static inline void bench_file(const char *relative, size_t size)
+{
+	char block[64 * 1024];
+	for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)(i * 7 + i / 251);
+	FILE *file = fopen(bench_path(relative), "w");
+	if (!file) abort();
+	for (size_t written = 0; written < size; written += sizeof(block))
+		fwrite(block, 1, size - written < sizeof(block) ? size - written : sizeof(block), file);
+	fclose(file);
+}
+
+/* feed a profile through open()/read() so the config layer parses it, then
+ * touch the archive file like Unison does when synchronization starts */
+static inline void bench_profile(const char *profile)
+{
+	FILE *file = fopen(bench_path(".unison/default.prf"), "w");
+	if (!file) abort();
+	fputs(profile, file);
+	fclose(file);
+
+	int fd = open(bench_path(".unison/default.prf"), O_RDONLY);
+	char buffer[4096];
+	while (read(fd, buffer, sizeof(buffer)) > 0) {}
+	close(fd);
+
+	close(open(bench_path(ARCHIVE_FILE), O_CREAT | O_WRONLY, 0600));
+}
+
+static int bench_remove(const char *path, const struct stat *, int, struct FTW *)
+{
+	return remove(path);
+}
+
+/* run the benchmark binary again in a fresh scratch tree, optionally preloaded */
+static inline void bench_spawn(const char *self, const char *mode, bool preload)
+{
+	char tree[] = "/tmp/unison-bench.XXXXXX";
+	if (!mkdtemp(tree)) abort();
+	char unison[sizeof(tree) + sizeof("/.unison")];
+	snprintf(unison, sizeof(unison), "%s/.unison", tree);
+	mkdir(unison, S_IRWXU);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		setenv("HOME", tree, 1);
+		setenv("UNISON", unison, 1);
+		if (preload) {
+			const char *library = getenv("INTERCEPT_LIB");
+			char resolved[4096];
+			if (!realpath(library ? library : "libintercept.so", resolved)) abort();
+			setenv("LD_PRELOAD", resolved, 1);
+		} else {
+			unsetenv("LD_PRELOAD");
+		}
+		execl(self, self, mode, (char *)NULL);
+		_exit(127);
+	}
+	waitpid(pid, NULL, 0);
+
+	nftw(tree, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,165 @@
+/* bytes an rsync-style transfer resends after small edits to an encrypted file
+ *
+ * Unison transfers changed files by matching blocks of the old version on the
+ * receiving side. Each run encrypts an original file and edited copies of it,
+ * then counts the bytes of each encrypted copy not covered by a block of the
+ * encrypted original, which is what the transfer sends literally. */
+
+#include "bench.h"
+
+#define FILE_SIZE (32 * 1024 * 1024)
+#define BLOCK 2048  // roughly the block size Unison chooses for files of this size
+
+static const struct edit_s {
+	const char *name;
+	size_t offset;   // in eighths of the file
+	size_t removed;
+	size_t inserted;
+} edit[] = {
+	{ "change", 3, 1, 1 },
+	{ "insert", 4, 0, 100 },
+	{ "delete", 5, 4096, 0 },
+	{ "append", 8, 0, 65536 },
+};
+
+static unsigned char *content(size_t size)
+{
+	// incompressible, so all matches come from the content itself
+	unsigned char *buffer = malloc(size);
+	if (!buffer) abort();
+	uint64_t state = 0x2545f4914f6cdd1d;
+	for (size_t i = 0; i < size; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buffer[i] = (unsigned char)state;
+	}
+	return buffer;
+}
+
+static void write_edited(const char *relative, const unsigned char *original, const struct edit_s *change)
+{
+	const size_t offset = FILE_SIZE / 8 * change->offset;
+	unsigned char insert[65536];
+	for (size_t i = 0; i < change->inserted; i++) insert[i] = (unsigned char)(original[i] + 1);
+
+	FILE *file = fopen(bench_path(relative), "w");
+	if (!file) abort();
+	fwrite(original, 1, offset, file);
+	fwrite(insert, 1, change->inserted, file);
+	if (offset + change->removed < FILE_SIZE) fwrite(original + offset + change->removed, 1, FILE_SIZE - offset - change->removed, file);
+	fclose(file);
+}
+
+static unsigned char *read_encrypted(const char *relative, size_t *size_out)
+{
+	struct stat buf;
+	if (stat(bench_path(relative), &buf) != 0) abort();
+	unsigned char *buffer = malloc((size_t)buf.st_size);
+	if (!buffer) abort();
+	int fd = open(bench_path(relative), O_RDONLY);
+	size_t size = 0;
+	ssize_t result;
+	while ((result = read(fd, buffer + size, (size_t)buf.st_size - size)) > 0) size += (size_t)result;
+	close(fd);
+	*size_out = size;
+	return buffer;
+}
+
+/* rsync’s weak checksum, rolled one byte at a time */
+static uint32_t weak(const unsigned char *data, size_t length)
+{
+	uint32_t a = 0, b = 0;
+	for (size_t i = 0; i < length; i++) {
+		a += data[i];
+		b += a;
+	}
+	return (a & 0xffff) | b << 16;
+}
+
+/* bytes of the new version not found in whole blocks of the old one */
+static size_t literal(const unsigned char *old, size_t old_size, const unsigned char *new, size_t new_size)
+{
+	// index the blocks of the old version by their weak checksum
+	const size_t blocks = old_size / BLOCK;
+	const size_t slots = 1 << 20;
+	uint32_t *table = calloc(slots, sizeof(uint32_t));  // block index plus one
+	if (!table) abort();
+	for (size_t i = 0; i < blocks; i++) {
+		size_t slot = weak(old + i * BLOCK, BLOCK) % slots;
+		while (table[slot]) slot = (slot + 1) % slots;
+		table[slot] = (uint32_t)(i + 1);
+	}
+
+	size_t result = 0, position = 0;
+	uint32_t a = 0, b = 0;
+	bool rolling = false;
+	while (position + BLOCK <= new_size) {
+		if (!rolling) {
+			const uint32_t sum = weak(new + position, BLOCK);
+			a = sum & 0xffff;
+			b = sum >> 16;
+			rolling = true;
+		}
+		bool found = false;
+		for (size_t slot = ((a & 0xffff) | b << 16) % slots; table[slot]; slot = (slot + 1) % slots) {
+			if (memcmp(old + (table[slot] - 1) * BLOCK, new + position, BLOCK) == 0) {
+				found = true;
+				break;
+			}
+		}
+		if (found) {
+			position += BLOCK;
+			rolling = false;
+			continue;
+		}
+		// slide the window by one byte
+		if (position + BLOCK < new_size) {
+			a = (a - new[position] + new[position + BLOCK]) & 0xffff;
+			b = (b - (uint32_t)BLOCK * new[position] + a) & 0xffff;
+		}
+		result++;
+		position++;
+	}
+	free(table);
+	return result + (new_size - position);
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t edits = sizeof(edit) / sizeof(edit[0]);
+	if (argc > 1) {
+		printf("%-16s", argv[1]);
+		unsigned char *original = content(FILE_SIZE);
+		FILE *file = fopen(bench_path("original"), "w");
+		if (!file) abort();
+		fwrite(original, 1, FILE_SIZE, file);
+		fclose(file);
+		for (size_t i = 0; i < edits; i++) write_edited(edit[i].name, original, &edit[i]);
+		free(original);
+
+		char profile[4096];
+		snprintf(profile, sizeof(profile), "root = %s\n#encrypt = Path * -> %s:benchmark\n", getenv("HOME"), argv[1]);
+		bench_profile(profile);
+
+		size_t old_size;
+		unsigned char *old = read_encrypted("original", &old_size);
+		for (size_t i = 0; i < edits; i++) {
+			size_t new_size;
+			unsigned char *new = read_encrypted(edit[i].name, &new_size);
+			printf(" %10.1f", (double)literal(old, old_size, new, new_size) / 1024);
+			free(new);
+		}
+		free(old);
+		printf("\n");
+		return EXIT_SUCCESS;
+	}
+
+	printf("KiB resent of a %u MiB file after an edit\n%-16s", FILE_SIZE / 1024 / 1024, "");
+	for (size_t i = 0; i < edits; i++) printf(" %10s", edit[i].name);
+	printf("\n");
+	bench_spawn(argv[0], "aes-256-gcm", true);
+	bench_spawn(argv[0], "aes-256-gcm-v2", true);
+	bench_spawn(argv[0], "aes-256-gcm-cdc", true);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+/* cost per call of the intercept dispatch
+ *
+ * Compares raw libc, the preloaded library without any configuration, and the
+ * full stack with a profile that activates all layers. The files touched by
+ * the benchmark do not match any rule, so the numbers reflect dispatch and
+ * rule matching overhead, not encryption. */
+
+#include "bench.h"
+
+#include <dirent.h>
+
+#define ITERATIONS 200000
+
+static const char *profile =
+	"root = /nonexistent\n"
+	"#precmd = true\n"
+	"#postcmd = true\n"
+	"#post = Path other/file -> true\n"
+	"#symlink = Path other/link -> target\n"
+	"#encrypt = Path other/secret -> aes-256-gcm:benchmark\n"
+	"#encrypt = Path other/*.key -> aes-256-gcm:benchmark\n";
+
+static void measure(void)
+{
+	bench_file("file", 4096);
+	const char *file = bench_path("file");
+	struct stat buf;
+	char byte;
+
+	uint64_t start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) stat(file, &buf);
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+
+	start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) lstat(file, &buf);
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+
+	start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) close(open(file, O_RDONLY));
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+
+	int fd = open("/dev/zero", O_RDONLY);
+	start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) (void)!read(fd, &byte, 1);
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+	close(fd);
+
+	fd = open("/dev/null", O_WRONLY);
+	start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) (void)!write(fd, &byte, 1);
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+	close(fd);
+
+	start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) closedir(opendir(getenv("HOME")));
+	printf(" %10.1f\n", (double)(bench_now() - start) / ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		printf("%-6s", argv[1]);
+		if (strcmp(argv[1], "full") == 0) bench_profile(profile);
+		measure();
+		return EXIT_SUCCESS;
+	}
+
+	printf("nanoseconds per call\n");
+	printf("%-6s %10s %10s %10s %10s %10s %10s\n", "", "stat", "lstat", "open+close", "read", "write", "opendir+cd");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "empty", true);
+	bench_spawn(argv[0], "full", true);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/* throughput of concurrent encrypted reads
+ *
+ * Each thread streams its own file through the encrypt layer, like parallel
+ * Unison transfers do. Aggregate throughput should grow with the number of
+ * threads as long as cores are available, because encrypted files do not
+ * share any lock beyond the descriptor lookup. */
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define FILE_SIZE (32 * 1024 * 1024)
+#define BLOCK_SIZE (64 * 1024)
+#define MAX_THREADS 8
+
+static void *stream(void *argument)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "data/%u", (unsigned)(uintptr_t)argument);
+
+	static _Thread_local char block[BLOCK_SIZE];
+	int fd = open(bench_path(name), O_RDONLY);
+	if (fd < 0) abort();
+	while (read(fd, block, sizeof(block)) > 0) {}
+	close(fd);
+
+	return NULL;
+}
+
+static void measure(unsigned threads)
+{
+	pthread_t thread[MAX_THREADS];
+
+	uint64_t start = bench_now();
+	for (unsigned i = 0; i < threads; i++)
+		pthread_create(&thread[i], NULL, stream, (void *)(uintptr_t)i);
+	for (unsigned i = 0; i < threads; i++)
+		pthread_join(thread[i], NULL);
+	uint64_t elapsed = bench_now() - start;
+
+	printf(" %10.1f", (double)threads * FILE_SIZE / (1024 * 1024) / ((double)elapsed / 1000000000));
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		printf("%-8s", argv[1]);
+		mkdir(bench_path("data"), S_IRWXU);
+		for (unsigned i = 0; i < MAX_THREADS; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "data/%u", i);
+			bench_file(name, FILE_SIZE);
+		}
+		if (strcmp(argv[1], "encrypt") == 0) {
+			char profile[4096];
+			snprintf(profile, sizeof(profile), "root = %s\n#encrypt = Path data -> aes-256-gcm:benchmark\n", getenv("HOME"));
+			bench_profile(profile);
+		}
+		for (unsigned threads = 1; threads <= MAX_THREADS; threads *= 2) measure(threads);
+		printf("\n");
+		return EXIT_SUCCESS;
+	}
+
+	printf("aggregate MiB/s by number of threads\n");
+	printf("%-8s %10s %10s %10s %10s\n", "", "1", "2", "4", "8");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "encrypt", true);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+/* throughput of encrypted reads for each AES-GCM implementation
+ *
+ * A file is read through the encrypt layer once to fill the IV cache, so the
+ * measured passes only encrypt. Every implementation supported by the
+ * processor is selected in turn through UNISON_INTERCEPT_GCM. */
+
+#include "bench.h"
+
+#define FILE_SIZE (64 * 1024 * 1024)
+#define BLOCK_SIZE (256 * 1024)
+#define PASSES 4
+
+static void stream(char *block)
+{
+	int fd = open(bench_path("data/file"), O_RDONLY);
+	if (fd < 0) abort();
+	while (read(fd, block, BLOCK_SIZE) > 0) {}
+	close(fd);
+}
+
+static bool supported(const char *backend)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	bool aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+	if (strcmp(backend, "aesni") == 0) return aesni;
+	if (strcmp(backend, "vaes") == 0)
+		return aesni && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq");
+#endif
+	return strcmp(backend, "mbedtls") == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		static char block[BLOCK_SIZE];
+		mkdir(bench_path("data"), S_IRWXU);
+		bench_file("data/file", FILE_SIZE);
+		char profile[4096];
+		snprintf(profile, sizeof(profile), "root = %s\n#encrypt = Path data -> aes-256-gcm:benchmark\n", getenv("HOME"));
+		bench_profile(profile);
+		stream(block);
+
+		uint64_t start = bench_now();
+		for (unsigned pass = 0; pass < PASSES; pass++) stream(block);
+		uint64_t elapsed = bench_now() - start;
+
+		printf("%-8s %10.1f\n", argv[1], (double)PASSES * FILE_SIZE / (1024 * 1024) / ((double)elapsed / 1000000000));
+		return EXIT_SUCCESS;
+	}
+
+	printf("encrypted read MiB/s by implementation\n");
+	const char *backends[] = { "mbedtls", "aesni", "vaes" };
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (!supported(backends[i])) continue;
+		setenv("UNISON_INTERCEPT_GCM", backends[i], 1);
+		bench_spawn(argv[0], backends[i], true);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+/* throughput of a single large encrypted read by number of worker threads
+ *
+ * A file above the pipeline threshold is read through the encrypt layer once
+ * to fill the IV cache, so the measured passes only encrypt. The worker count
+ * is selected in turn through UNISON_INTERCEPT_THREADS, one thread meaning the
+ * reader encrypts on its own. */
+
+#include "bench.h"
+
+#define FILE_SIZE (256 * 1024 * 1024)
+#define BLOCK_SIZE (256 * 1024)
+#define PASSES 4
+#define MAX_THREADS 8
+
+static void stream(char *block)
+{
+	int fd = open(bench_path("data/file"), O_RDONLY);
+	if (fd < 0) abort();
+	while (read(fd, block, BLOCK_SIZE) > 0) {}
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		static char block[BLOCK_SIZE];
+		mkdir(bench_path("data"), S_IRWXU);
+		bench_file("data/file", FILE_SIZE);
+		char profile[4096];
+		snprintf(profile, sizeof(profile), "root = %s\n#encrypt = Path data -> aes-256-gcm:benchmark\n", getenv("HOME"));
+		bench_profile(profile);
+		stream(block);
+
+		uint64_t start = bench_now();
+		for (unsigned pass = 0; pass < PASSES; pass++) stream(block);
+		uint64_t elapsed = bench_now() - start;
+
+		printf("%-8s %10.1f\n", argv[1], (double)PASSES * FILE_SIZE / (1024 * 1024) / ((double)elapsed / 1000000000));
+		return EXIT_SUCCESS;
+	}
+
+	printf("encrypted read MiB/s by worker threads\n");
+	for (unsigned threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		char count[16];
+		snprintf(count, sizeof(count), "%u", threads);
+		setenv("UNISON_INTERCEPT_THREADS", count, 1);
+		bench_spawn(argv[0], count, true);
+	}
+	return EXIT_SUCCESS;
+}
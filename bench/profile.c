@@ -0,0 +1,67 @@
+/* time to parse large generated profiles
+ *
+ * Profiles with tens of thousands of ignore, #post, and #encrypt lines are
+ * read with large and with small buffers, the latter splitting most lines
+ * across reads. Directive lines are also stored and indexed, which adds to
+ * their parsing time. Compares raw libc against the preloaded library, so the
+ * difference is the time the config layer spends parsing. */
+
+#include "bench.h"
+
+#define IGNORES 40000
+#define DIRECTIVES 5000
+
+static char *generate(unsigned ignores, unsigned posts, unsigned encrypts)
+{
+	size_t size = (size_t)(ignores + posts + encrypts + 1) * 128;
+	char *profile = malloc(size);
+	if (!profile) abort();
+	size_t length = (size_t)snprintf(profile, size, "root = %s\n", getenv("HOME"));
+	for (unsigned i = 0; i < ignores; i++)
+		length += (size_t)snprintf(profile + length, size - length, "ignore = Path {project%u/build,project%u/*.tmp}\n", i, i);
+	for (unsigned i = 0; i < posts; i++)
+		length += (size_t)snprintf(profile + length, size - length, "#post = Path project%u/Makefile -> make -C project%u\n", i, i);
+	for (unsigned i = 0; i < encrypts; i++)
+		length += (size_t)snprintf(profile + length, size - length, "#encrypt = Path project%u/secret -> aes-256-gcm:benchmark\n", i);
+	return profile;
+}
+
+static void measure(const char *profile, size_t chunk)
+{
+	FILE *file = fopen(bench_path(".unison/default.prf"), "w");
+	if (!file) abort();
+	fputs(profile, file);
+	fclose(file);
+
+	char *buffer = malloc(chunk);
+	if (!buffer) abort();
+	uint64_t start = bench_now();
+	int fd = open(bench_path(".unison/default.prf"), O_RDONLY);
+	while (read(fd, buffer, chunk) > 0) {}
+	close(fd);
+	printf(" %10.2f", (double)(bench_now() - start) / 1000000);
+	free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		printf("%-6s", argv[1]);
+		char *profile = generate(IGNORES, 0, 0);
+		measure(profile, 64 * 1024);
+		measure(profile, 100);
+		free(profile);
+		// directives accumulate in the configuration, so the mixed profile is read once
+		profile = generate(IGNORES, DIRECTIVES, DIRECTIVES);
+		measure(profile, 100);
+		free(profile);
+		printf("\n");
+		return EXIT_SUCCESS;
+	}
+
+	printf("milliseconds to read a profile of %u ignore lines, alone and with %u #post and %u #encrypt lines\n", IGNORES, DIRECTIVES, DIRECTIVES);
+	printf("%-6s %10s %10s %10s\n", "", "ignore 64k", "ignore 100", "mixed 100");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "parse", true);
+	return EXIT_SUCCESS;
+}
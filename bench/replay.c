@@ -0,0 +1,556 @@
+/* replay of a recorded call trace
+ *
+ * Runs a trace written by libintercept with UNISON_INTERCEPT_TRACE set against
+ * a synthetic tree, with and without the intercept stack. The recorded HOME
+ * maps to the scratch tree, all other absolute paths map below its rootfs
+ * directory. Paths whose first recorded use found them existing are created
+ * beforehand, with file sizes taken from stat results and reads. Calls are
+ * replayed sequentially in recording order, even if several threads made them.
+ * Written data is synthetic, so calls whose outcome depends on file contents,
+ * like authenticating encrypted data, may diverge from the recording.
+ *
+ * The trace is named by REPLAY_TRACE. Profile files in the trace receive the
+ * contents of REPLAY_PROFILE, with absolute root paths moved into the tree. */
+
+#include "bench.h"
+#include "../trace.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#ifndef __APPLE__
+#include <sys/sendfile.h>
+#endif
+
+#define MAX_FD 65536
+#define MAX_IOV 64
+
+struct event_s {
+	const struct trace_record_s *record;
+	const char *path[2];
+};
+
+struct entry_s {
+	char *path;         // mapped absolute path
+	bool decided;       // first use seen
+	bool exists;        // existed at first use
+	bool directory;
+	uint64_t size;
+};
+
+static struct {
+	char *home, *cwd;
+	struct event_s *event;
+	size_t events, events_allocated;
+	struct entry_s *entry;
+	size_t entries, entries_allocated;
+	size_t *slot;  // hash table of entry index + 1 by path, at most half full
+	size_t slots;
+} trace;
+
+static char *string(const char *data, size_t length)
+{
+	char *result = malloc(length + 1);
+	if (!result) abort();
+	memcpy(result, data, length);
+	result[length] = '\0';
+	return result;
+}
+
+static void load(const char *file)
+{
+	FILE *input = fopen(file, "r");
+	if (!input) abort();
+	fseek(input, 0, SEEK_END);
+	size_t size = (size_t)ftell(input);
+	fseek(input, 0, SEEK_SET);
+	char *data = malloc(size);
+	if (!data || fread(data, 1, size, input) != size) abort();
+	fclose(input);
+
+	struct trace_header_s header;
+	if (size < sizeof(header)) abort();
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) abort();
+	size_t position = sizeof(header);
+	if (size - position < (size_t)header.home_length + header.cwd_length) abort();
+	trace.home = string(data + position, header.home_length);
+	position += header.home_length;
+	trace.cwd = string(data + position, header.cwd_length);
+	position += header.cwd_length;
+
+	while (size - position >= sizeof(struct trace_record_s)) {
+		// records are not aligned within the file, so each is copied out
+		struct trace_record_s *record = malloc(sizeof(*record));
+		if (!record) abort();
+		memcpy(record, data + position, sizeof(*record));
+		position += sizeof(*record);
+		if (record->function >= INTERCEPT_FUNCTION_COUNT) abort();
+		if (size - position < (size_t)record->path_length[0] + record->path_length[1]) break;
+
+		struct event_s event = { .record = record };
+		for (unsigned i = 0; i < 2; i++) {
+			event.path[i] = record->path_length[i] ? string(data + position, record->path_length[i]) : NULL;
+			position += record->path_length[i];
+		}
+		if (trace.events == trace.events_allocated) {
+			trace.events_allocated = trace.events_allocated ? 2 * trace.events_allocated : 1024;
+			trace.event = realloc(trace.event, trace.events_allocated * sizeof(struct event_s));
+			if (!trace.event) abort();
+		}
+		trace.event[trace.events++] = event;
+	}
+	free(data);
+}
+
+/* location of a recorded absolute or working directory relative path in the tree */
+static void map(char *result, size_t size, const char *path)
+{
+	const char *tree = getenv("HOME");
+	char absolute[8192];
+	int length;
+	if (path[0] == '/')
+		length = snprintf(absolute, sizeof(absolute), "%s", path);
+	else
+		length = snprintf(absolute, sizeof(absolute), "%s/%s", trace.cwd, path);
+	if (length >= (int)sizeof(absolute)) abort();
+
+	const size_t home_length = strlen(trace.home);
+	if (home_length && strncmp(absolute, trace.home, home_length) == 0 &&
+	    (absolute[home_length] == '/' || absolute[home_length] == '\0'))
+		length = snprintf(result, size, "%s%s", tree, absolute + home_length);
+	else
+		length = snprintf(result, size, "%s/rootfs%s", tree, absolute);
+	if (length >= (int)size) abort();
+}
+
+/* path argument of a replayed call, *at() paths relative to a descriptor stay as they are */
+static const char *argument(char *result, size_t size, const char *path, int dirfd)
+{
+	if (!path) return "";
+	if (path[0] != '/' && dirfd != AT_FDCWD) return path;
+	map(result, size, path);
+	return result;
+}
+
+/* slot of the entry for a path, or the empty slot where it belongs */
+static size_t *slot(const char *mapped)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (const char *c = mapped; *c; c++) hash = (hash ^ (unsigned char)*c) * 0x100000001b3;
+
+	size_t index = hash & (trace.slots - 1);
+	while (trace.slot[index] && strcmp(trace.entry[trace.slot[index] - 1].path, mapped) != 0)
+		index = (index + 1) & (trace.slots - 1);
+	return &trace.slot[index];
+}
+
+static struct entry_s *find(const char *mapped)
+{
+	if (!trace.slots) return NULL;
+	const size_t index = *slot(mapped);
+	return index ? &trace.entry[index - 1] : NULL;
+}
+
+static struct entry_s *lookup(const char *mapped)
+{
+	struct entry_s *entry = find(mapped);
+	if (entry) return entry;
+
+	if (2 * (trace.entries + 1) > trace.slots) {
+		free(trace.slot);
+		trace.slots = trace.slots ? 2 * trace.slots : 1024;
+		trace.slot = calloc(trace.slots, sizeof(size_t));
+		if (!trace.slot) abort();
+		for (size_t i = 0; i < trace.entries; i++) *slot(trace.entry[i].path) = i + 1;
+	}
+	if (trace.entries == trace.entries_allocated) {
+		trace.entries_allocated = trace.entries_allocated ? 2 * trace.entries_allocated : 1024;
+		trace.entry = realloc(trace.entry, trace.entries_allocated * sizeof(struct entry_s));
+		if (!trace.entry) abort();
+	}
+	trace.entry[trace.entries] = (struct entry_s){ .path = string(mapped, strlen(mapped)) };
+	*slot(mapped) = trace.entries + 1;
+	return &trace.entry[trace.entries++];
+}
+
+static void decide(struct entry_s *entry, bool exists, bool directory)
+{
+	if (entry->decided) return;
+	entry->decided = true;
+	entry->exists = exists;
+	entry->directory = directory;
+}
+
+/* derive the initial tree from the first use of every path */
+static void survey(void)
+{
+	// entries are reallocated while the survey runs, so descriptors refer to them by index + 1
+	static size_t open_file[MAX_FD];
+	static uint64_t position[MAX_FD];
+
+	for (size_t i = 0; i < trace.events; i++) {
+		const struct trace_record_s *record = trace.event[i].record;
+		// the link is the second path of symlink(), its target is never resolved
+		const char *path = trace.event[i].path[record->function == INTERCEPT_symlink ? 1 : 0];
+		const bool success = record->result >= 0;
+		const int fd = (int)record->fd[0];
+
+		// paths of *at() calls are relative to the directory descriptor, if known
+		char mapped[8192];
+		struct entry_s *entry = NULL;
+		if (path && (path[0] == '/' || record->function < INTERCEPT_openat || fd == AT_FDCWD)) {
+			map(mapped, sizeof(mapped), path);
+			entry = lookup(mapped);
+		} else if (path && fd >= 0 && fd < MAX_FD && open_file[fd]) {
+			if (snprintf(mapped, sizeof(mapped), "%s/%s", trace.entry[open_file[fd] - 1].path, path) >= (int)sizeof(mapped)) abort();
+			entry = lookup(mapped);
+		}
+
+		switch (record->function) {
+		case INTERCEPT_open:
+		case INTERCEPT_openat:
+			if (!entry) break;
+			// whether O_CREAT found the file is unknown, so the replay creates it
+			decide(entry, success && !(record->flags & O_CREAT), (record->flags & O_DIRECTORY) != 0);
+			if (success && record->result < MAX_FD) {
+				open_file[record->result] = (size_t)(entry - trace.entry) + 1;
+				position[record->result] = 0;
+			}
+			break;
+		case INTERCEPT_close:
+			if (fd >= 0 && fd < MAX_FD) open_file[fd] = 0;
+			break;
+		case INTERCEPT_read:
+		case INTERCEPT_readv:
+		case INTERCEPT_pread:
+		case INTERCEPT_preadv:
+			if (fd >= 0 && fd < MAX_FD && open_file[fd] && success) {
+				uint64_t end = (record->offset[0] < 0 ? position[fd] : (uint64_t)record->offset[0]) + (uint64_t)record->result;
+				if (record->offset[0] < 0) position[fd] = end;
+				if (end > trace.entry[open_file[fd] - 1].size) trace.entry[open_file[fd] - 1].size = end;
+			}
+			break;
+		case INTERCEPT_stat:
+		case INTERCEPT_lstat:
+		case INTERCEPT_fstatat:
+		case INTERCEPT_statx:
+			if (!entry) break;
+			if (!entry->decided && success) entry->size = record->size;
+			decide(entry, success, success && S_ISDIR(record->mode));
+			break;
+		case INTERCEPT_opendir:
+			if (entry) decide(entry, success, true);
+			break;
+		case INTERCEPT_rmdir:
+			if (entry) decide(entry, success, true);
+			break;
+		case INTERCEPT_unlinkat:
+			if (entry) decide(entry, success, (record->flags & AT_REMOVEDIR) != 0);
+			break;
+		case INTERCEPT_rename:
+		case INTERCEPT_renameat:
+		case INTERCEPT_renameat2:
+		case INTERCEPT_unlink:
+		case INTERCEPT_getattrlist:
+			if (entry) decide(entry, success, false);
+			break;
+		case INTERCEPT_mkdir:
+		case INTERCEPT_mkdirat:
+		case INTERCEPT_symlink:
+			if (entry) decide(entry, !success && record->error == EEXIST, record->function != INTERCEPT_symlink);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* create the ancestors of a path, unless the replay creates one of them itself */
+static bool make_parents(const char *path)
+{
+	char parent[8192];
+	snprintf(parent, sizeof(parent), "%s", path);
+	for (char *slash = strchr(parent + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		const struct entry_s *entry = find(parent);
+		if (entry && entry->decided && !entry->exists) return false;
+		mkdir(parent, S_IRWXU);
+		*slash = '/';
+	}
+	return true;
+}
+
+/* profile contents with absolute roots rewritten into the tree */
+static char *profile(void)
+{
+	const char *file = getenv("REPLAY_PROFILE");
+	if (!file) return NULL;
+	FILE *input = fopen(file, "r");
+	if (!input) abort();
+
+	size_t size = 0;
+	char *result = NULL, line[4096], mapped[8192];
+	while (fgets(line, sizeof(line), input)) {
+		const char *value = line + strspn(line, " \t");
+		if (strncmp(value, "root", 4) == 0) {
+			value += 4 + strspn(value + 4, " \t");
+			if (*value == '=') value += 1 + strspn(value + 1, " \t");
+			if (*value == '/') {
+				char path[4096];
+				snprintf(path, sizeof(path), "%.*s", (int)strcspn(value, "\r\n"), value);
+				map(mapped, sizeof(mapped), path);
+				if (snprintf(line, sizeof(line), "root = %s\n", mapped) >= (int)sizeof(line)) abort();
+			}
+		}
+		result = realloc(result, size + strlen(line) + 1);
+		if (!result) abort();
+		strcpy(result + size, line);
+		size += strlen(line);
+	}
+	fclose(input);
+	return result;
+}
+
+static void synthesize(void)
+{
+	char *contents = profile();
+	char rootfs[4096];
+	snprintf(rootfs, sizeof(rootfs), "%s/rootfs", getenv("HOME"));
+	mkdir(rootfs, S_IRWXU);
+
+	for (size_t i = 0; i < trace.entries; i++) {
+		const struct entry_s *entry = &trace.entry[i];
+		if (!entry->exists || !make_parents(entry->path)) continue;
+		if (entry->directory) {
+			mkdir(entry->path, S_IRWXU);
+			continue;
+		}
+		const size_t length = strlen(entry->path);
+		if (contents && length > 4 && strcmp(entry->path + length - 4, ".prf") == 0) {
+			FILE *file = fopen(entry->path, "w");
+			if (!file) abort();
+			fputs(contents, file);
+			fclose(file);
+		} else {
+			bench_file(entry->path + strlen(getenv("HOME")) + 1, entry->size);
+		}
+	}
+	// parents of paths created during the replay
+	for (size_t i = 0; i < trace.entries; i++)
+		if (!trace.entry[i].exists) make_parents(trace.entry[i].path);
+
+	free(contents);
+}
+
+static int fd_map[MAX_FD];
+static DIR *dir_map[MAX_FD];
+
+static int descriptor(int32_t fd)
+{
+	if (fd == AT_FDCWD) return AT_FDCWD;
+	if (fd < 0 || fd >= MAX_FD) return -1;
+	return fd_map[fd];
+}
+
+static void remember(int64_t recorded, int fd)
+{
+	if (recorded >= 0 && recorded < MAX_FD) fd_map[recorded] = fd;
+	else if (fd >= 0) close(fd);
+}
+
+/* split the recorded total into the recorded number of vectors */
+static int vectors(struct iovec iov[MAX_IOV], const struct trace_record_s *record, char *buffer)
+{
+	int count = record->flags > 0 ? record->flags : 1;
+	if (count > MAX_IOV) count = MAX_IOV;
+	for (int i = 0; i < count; i++) {
+		iov[i].iov_base = buffer + record->size / (uint64_t)count * (uint64_t)i;
+		iov[i].iov_len = record->size / (uint64_t)count + (i == count - 1 ? record->size % (uint64_t)count : 0);
+	}
+	return count;
+}
+
+static void replay(void)
+{
+	char path1[8192], path2[8192];
+	size_t buffer_size = 0, divergent = 0, skipped = 0;
+	char *buffer = NULL;
+	for (size_t i = 0; i < MAX_FD; i++) fd_map[i] = -1;
+	for (size_t i = 0; i < trace.events; i++)
+		if (trace.event[i].record->size > buffer_size) buffer_size = trace.event[i].record->size;
+	if (buffer_size > 256 * 1024 * 1024) buffer_size = 256 * 1024 * 1024;
+	buffer = calloc(1, buffer_size + 1);
+	if (!buffer) abort();
+
+	const uint64_t start = bench_now();
+	for (size_t i = 0; i < trace.events; i++) {
+		const struct trace_record_s *record = trace.event[i].record;
+		const struct event_s *event = &trace.event[i];
+		const int fd = descriptor(record->fd[0]);
+		const size_t size = record->size < buffer_size ? (size_t)record->size : buffer_size;
+		struct iovec iov[MAX_IOV];
+		struct stat buf;
+		int64_t result = 0;
+
+		switch (record->function) {
+		case INTERCEPT_open:
+			result = open(argument(path1, sizeof(path1), event->path[0], AT_FDCWD), record->flags, record->mode);
+			remember(record->result, (int)result);
+			break;
+		case INTERCEPT_openat:
+			result = openat(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]), record->flags, record->mode);
+			remember(record->result, (int)result);
+			break;
+		case INTERCEPT_close:
+			result = close(fd);
+			if (record->fd[0] >= 0 && record->fd[0] < MAX_FD) fd_map[record->fd[0]] = -1;
+			break;
+		case INTERCEPT_read:
+			result = read(fd, buffer, size);
+			break;
+		case INTERCEPT_write:
+			result = write(fd, buffer, size);
+			break;
+		case INTERCEPT_pread:
+			result = pread(fd, buffer, size, record->offset[0]);
+			break;
+		case INTERCEPT_pwrite:
+			result = pwrite(fd, buffer, size, record->offset[0]);
+			break;
+		case INTERCEPT_readv:
+			result = readv(fd, iov, vectors(iov, record, buffer));
+			break;
+		case INTERCEPT_writev:
+			result = writev(fd, iov, vectors(iov, record, buffer));
+			break;
+		case INTERCEPT_preadv:
+			result = preadv(fd, iov, vectors(iov, record, buffer), record->offset[0]);
+			break;
+		case INTERCEPT_pwritev:
+			result = pwritev(fd, iov, vectors(iov, record, buffer), record->offset[0]);
+			break;
+		case INTERCEPT_lseek:
+			result = lseek(fd, record->offset[0], record->flags);
+			break;
+		case INTERCEPT_fstat:
+			result = fstat(fd, &buf);
+			break;
+		case INTERCEPT_ftruncate:
+			result = ftruncate(fd, (off_t)record->size);
+			break;
+#ifndef __APPLE__
+		case INTERCEPT_copy_file_range: {
+			off_t offset_in = record->offset[0], offset_out = record->offset[1];
+			result = copy_file_range(fd, offset_in < 0 ? NULL : &offset_in,
+			                         descriptor(record->fd[1]), offset_out < 0 ? NULL : &offset_out,
+			                         size, (unsigned)record->flags);
+			break;
+		}
+		case INTERCEPT_sendfile: {
+			off_t offset = record->offset[1];
+			result = sendfile(fd, descriptor(record->fd[1]), offset < 0 ? NULL : &offset, size);
+			break;
+		}
+		case INTERCEPT_statx: {
+			struct statx statx_buf;
+			result = statx(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]), record->flags, STATX_BASIC_STATS, &statx_buf);
+			break;
+		}
+		case INTERCEPT_renameat2:
+			result = renameat2(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]),
+			                   descriptor(record->fd[1]), argument(path2, sizeof(path2), event->path[1], record->fd[1]),
+			                   (unsigned)record->flags);
+			break;
+#endif
+		case INTERCEPT_stat:
+			result = stat(argument(path1, sizeof(path1), event->path[0], AT_FDCWD), &buf);
+			break;
+		case INTERCEPT_lstat:
+			result = lstat(argument(path1, sizeof(path1), event->path[0], AT_FDCWD), &buf);
+			break;
+		case INTERCEPT_fstatat:
+			result = fstatat(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]), &buf, record->flags);
+			break;
+		case INTERCEPT_rename:
+			result = rename(argument(path1, sizeof(path1), event->path[0], AT_FDCWD),
+			                argument(path2, sizeof(path2), event->path[1], AT_FDCWD));
+			break;
+		case INTERCEPT_renameat:
+			result = renameat(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]),
+			                  descriptor(record->fd[1]), argument(path2, sizeof(path2), event->path[1], record->fd[1]));
+			break;
+		case INTERCEPT_symlink:
+			// the link target is stored verbatim, only the link itself moves into the tree
+			result = symlink(event->path[0] ? event->path[0] : "", argument(path2, sizeof(path2), event->path[1], AT_FDCWD));
+			break;
+		case INTERCEPT_unlink:
+			result = unlink(argument(path1, sizeof(path1), event->path[0], AT_FDCWD));
+			break;
+		case INTERCEPT_unlinkat:
+			result = unlinkat(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]), record->flags);
+			break;
+		case INTERCEPT_mkdir:
+			result = mkdir(argument(path1, sizeof(path1), event->path[0], AT_FDCWD), record->mode);
+			break;
+		case INTERCEPT_mkdirat:
+			result = mkdirat(fd, argument(path1, sizeof(path1), event->path[0], record->fd[0]), record->mode);
+			break;
+		case INTERCEPT_rmdir:
+			result = rmdir(argument(path1, sizeof(path1), event->path[0], AT_FDCWD));
+			break;
+		case INTERCEPT_opendir: {
+			DIR *dir = opendir(argument(path1, sizeof(path1), event->path[0], AT_FDCWD));
+			result = dir ? dirfd(dir) : -1;
+			// Unison lists the directory right after opening it
+			if (dir) while (readdir(dir)) {}
+			if (record->result >= 0 && record->result < MAX_FD) dir_map[record->result] = dir;
+			else if (dir) closedir(dir);
+			break;
+		}
+		case INTERCEPT_closedir:
+			if (record->fd[0] >= 0 && record->fd[0] < MAX_FD && dir_map[record->fd[0]]) {
+				result = closedir(dir_map[record->fd[0]]);
+				dir_map[record->fd[0]] = NULL;
+			} else {
+				result = -1;
+			}
+			break;
+		default:
+			// getattrlist() arguments are not recorded, other calls are not available here
+			skipped++;
+			continue;
+		}
+
+		if ((result < 0) != (record->result < 0)) divergent++;
+	}
+	const uint64_t elapsed = bench_now() - start;
+
+	printf(" %10zu %10.1f %10zu %10zu\n", trace.events - skipped, (double)elapsed / 1000000, divergent, skipped);
+	free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *file = getenv("REPLAY_TRACE");
+	if (!file) {
+		printf("replay: set REPLAY_TRACE to a trace recorded with UNISON_INTERCEPT_TRACE\n");
+		return EXIT_SUCCESS;
+	}
+
+	load(file);
+	if (argc > 1) {
+		printf("%-8s", argv[1]);
+		survey();
+		synthesize();
+		replay();
+		return EXIT_SUCCESS;
+	}
+
+	printf("replay of %zu recorded calls\n", trace.events);
+	printf("%-8s %10s %10s %10s %10s\n", "", "calls", "ms", "divergent", "skipped");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "preload", true);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+/* cost per call of encrypt rule matching with many rules
+ *
+ * A profile with 1000 encrypt directives, half literal paths and half globs,
+ * is loaded before stat() and open() are timed on a file matching one of the
+ * shortest rules and on a file matching none. Compares raw libc against the
+ * preloaded library. */
+
+#include "bench.h"
+
+#define RULES 1000
+#define ITERATIONS 10000
+
+static void measure(const char *relative)
+{
+	const char *file = bench_path(relative);
+	struct stat buf;
+
+	uint64_t start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) stat(file, &buf);
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+
+	start = bench_now();
+	for (unsigned i = 0; i < ITERATIONS; i++) close(open(file, O_RDONLY));
+	printf(" %10.1f", (double)(bench_now() - start) / ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		printf("%-6s", argv[1]);
+		mkdir(bench_path("data"), S_IRWXU);
+		bench_file("data/a.key", 4096);
+		bench_file("data/plain", 4096);
+		if (strcmp(argv[1], "rules") == 0) {
+			size_t size = RULES * 128;
+			char *profile = malloc(size);
+			if (!profile) abort();
+			size_t length = (size_t)snprintf(profile, size, "root = %s\n", getenv("HOME"));
+			for (unsigned i = 0; i < RULES / 2; i++) {
+				length += (size_t)snprintf(profile + length, size - length, "#encrypt = Path project%u/documents/secret -> aes-256-gcm:benchmark\n", i);
+				length += (size_t)snprintf(profile + length, size - length, "#encrypt = Path project%u/keys/*.key -> aes-256-gcm:benchmark\n", i);
+			}
+			snprintf(profile + length, size - length, "#encrypt = Path data/*.key -> aes-256-gcm:benchmark\n");
+			bench_profile(profile);
+			free(profile);
+		}
+		measure("data/a.key");
+		measure("data/plain");
+		printf("\n");
+		return EXIT_SUCCESS;
+	}
+
+	printf("nanoseconds per call with %u encrypt rules\n", RULES);
+	printf("%-6s %10s %10s %10s %10s\n", "", "stat hit", "open hit", "stat miss", "open miss");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "rules", true);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+/* throughput of encrypted reads of many small files
+ *
+ * Scans like Unison’s update detection open and read thousands of small files
+ * below one encrypt directive. The files are read once to fill the IV cache,
+ * so the measured passes show the per-file cost of setting up encryption. */
+
+#include "bench.h"
+
+#define FILES 2000
+#define FILE_SIZE 1024
+#define PASSES 4
+
+static void scan(void)
+{
+	char block[FILE_SIZE + 4096];
+	for (unsigned i = 0; i < FILES; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "data/%u", i);
+		int fd = open(bench_path(name), O_RDONLY);
+		if (fd < 0) abort();
+		while (read(fd, block, sizeof(block)) > 0) {}
+		close(fd);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		printf("%-8s", argv[1]);
+		mkdir(bench_path("data"), S_IRWXU);
+		for (unsigned i = 0; i < FILES; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "data/%u", i);
+			bench_file(name, FILE_SIZE);
+		}
+		if (strcmp(argv[1], "encrypt") == 0) {
+			char profile[4096];
+			snprintf(profile, sizeof(profile), "root = %s\n#encrypt = Path data -> aes-256-gcm:benchmark\n", getenv("HOME"));
+			bench_profile(profile);
+		}
+		scan();
+
+		uint64_t start = bench_now();
+		for (unsigned pass = 0; pass < PASSES; pass++) scan();
+		uint64_t elapsed = bench_now() - start;
+
+		printf(" %10.2f\n", (double)elapsed / 1000 / (PASSES * FILES));
+		return EXIT_SUCCESS;
+	}
+
+	printf("microseconds per file\n");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "encrypt", true);
+	return EXIT_SUCCESS;
+}
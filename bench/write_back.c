@@ -0,0 +1,74 @@
+/* write system calls and throughput of decrypting writes by chunk size
+ *
+ * An encrypted stream is written to a file covered by an encrypt directive in
+ * chunks of several sizes, like Unison delivers transferred content. Without
+ * coalescing, every chunk turns into its own write() of the plaintext. The
+ * system calls are counted with the syscw field of /proc/self/io on Linux. */
+
+#include "bench.h"
+
+#define FILE_SIZE (64 * 1024 * 1024)
+#define PASSES 4
+
+static long long write_calls(void)
+{
+	long long calls = -1;
+	FILE *io = fopen("/proc/self/io", "r");
+	if (!io) return calls;
+	char line[256];
+	while (fgets(line, sizeof(line), io))
+		if (sscanf(line, "syscw: %lld", &calls) == 1) break;
+	fclose(io);
+	return calls;
+}
+
+static void measure(const unsigned char *stream, size_t size, size_t chunk)
+{
+	long long calls = write_calls();
+	uint64_t start = bench_now();
+	for (unsigned pass = 0; pass < PASSES; pass++) {
+		int fd = open(bench_path("data/copy"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) abort();
+		for (size_t done = 0; done < size; done += chunk)
+			if (write(fd, stream + done, size - done < chunk ? size - done : chunk) < 0) abort();
+		if (close(fd) != 0) abort();
+	}
+	uint64_t elapsed = bench_now() - start;
+	if (calls >= 0) calls = (write_calls() - calls) / PASSES;
+
+	printf(" %8lld %8.1f", calls, (double)PASSES * FILE_SIZE / (1024 * 1024) / ((double)elapsed / 1000000000));
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		printf("%-8s", argv[1]);
+		mkdir(bench_path("data"), S_IRWXU);
+		bench_file("data/file", FILE_SIZE);
+		if (strcmp(argv[1], "encrypt") == 0) {
+			char profile[4096];
+			snprintf(profile, sizeof(profile), "root = %s\n#encrypt = Path data -> aes-256-gcm:benchmark\n", getenv("HOME"));
+			bench_profile(profile);
+		}
+
+		// the stream as a Unison client would receive it
+		unsigned char *stream = malloc(FILE_SIZE + 4096);
+		if (!stream) abort();
+		int fd = open(bench_path("data/file"), O_RDONLY);
+		size_t size = 0;
+		for (ssize_t n; (n = read(fd, stream + size, FILE_SIZE + 4096 - size)) > 0;) size += (size_t)n;
+		close(fd);
+
+		const size_t chunks[] = { 4 * 1024, 32 * 1024, 256 * 1024 };
+		for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) measure(stream, size, chunks[i]);
+		printf("\n");
+		free(stream);
+		return EXIT_SUCCESS;
+	}
+
+	printf("write calls per file and MiB/s by chunk size\n");
+	printf("%-8s %17s %17s %17s\n", "", "4 KiB", "32 KiB", "256 KiB");
+	bench_spawn(argv[0], "raw", false);
+	bench_spawn(argv[0], "encrypt", true);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1045 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <zlib.h>
+
+#ifndef __APPLE__
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "config.h"
+#include "fdmap.h"
+#include "ivcache.h"
+#include "iobuf.h"
+#include "compress.h"
+
+
+// never compress Unison’s internal files
+static bool sync_started = false;
+
+// we add this to the beginning of the compressed view
+struct view_header_s {
+	char magic[4];
+	uint32_t body;            // enum view_body
+	_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+	               "storing integers in the compressed view assumes little endian processors");
+	uint64_t content_length;
+};
+
+enum view_body {
+	BODY_STORED,  // the content as is, because its sample did not compress
+	BODY_ZLIB     // the content as a zlib stream
+};
+
+#define VIEW_MAGIC "UNCZ"
+#define VIEW_HEADER sizeof(struct view_header_s)
+
+// compressed sizes are cached under a key derived from the method, so a change of method misses
+#define SIZE_KEY "compressed view size"
+
+// the compressor is fed in steps of this size, so every pass produces the same stream
+#define INPUT_STEP IOBUF_MIN
+#define OUTPUT_SIZE (256 * 1024)
+
+// evenly spaced pieces of the content are compressed quickly to decide whether the whole file is worth it
+#define SAMPLE_PIECES 4
+#define SAMPLE_PIECE (16 * 1024)
+#define SAMPLE_LEVEL 1
+#define SAMPLE_SAVING 10  // percent the sample must shrink by
+
+struct compressmap_s {
+	struct fdmap_reference_s reference;  // held by the fd table and calls in progress
+	pthread_mutex_t lock;  // serializes operations on this file only
+	enum { UNDECIDED, READ, WRITE, WRITE_COMPLETE, FAILED } state;
+	enum compress_method method;
+	size_t position;              // in the compressed view
+	struct view_header_s header;  // emitted when reading, received when writing
+	bool prepared;                // header of a file being read is known
+	bool size_known;              // view size of a file being read is known
+	uint64_t view_size;
+	struct deflater_s {
+		z_stream stream;
+		bool active;
+		bool finished;
+		uint64_t content_offset;  // content handed to the compressor
+		uint64_t content_length;
+		unsigned char *input;
+		size_t input_size;
+	} deflater;
+	z_stream inflater;
+	bool inflating;
+	uint64_t content_written;
+	unsigned char *output;        // compressed view produced or decompressed content received
+	size_t output_size;
+	uint64_t output_start;        // offset of the first buffered byte within the compressed body
+	size_t output_filled;
+};
+
+static bool compress_search(const char *path, enum compress_method *method_out);
+static void file_attach(int fd, const char *path, int flags);
+static void file_release(void *state);
+static bool file_direction(struct compressmap_s *file, bool writing);
+static ssize_t file_readv(struct compressmap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+static ssize_t file_writev(struct compressmap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+static off_t file_seek(struct compressmap_s *file, int fd, off_t offset, int whence);
+static bool view_prepare(struct compressmap_s *file, int fd);
+static bool view_size(struct compressmap_s *file, int fd, uint64_t *size_out);
+static ssize_t view_read(struct compressmap_s *file, int fd, unsigned char *buffer, size_t bytes, size_t position);
+static ssize_t view_write(struct compressmap_s *file, int fd, const unsigned char *buffer, size_t bytes);
+static bool view_accept(struct compressmap_s *file);
+static bool view_flush(struct compressmap_s *file, int fd);
+static ssize_t view_fail(struct compressmap_s *file, int fd, int error);
+static bool view_measure(int fd, const struct stat *buf, enum compress_method method, enum view_body *body_out, uint64_t *size_out);
+static void path_size(int dirfd, const char *path, int flags, const struct stat *buf, enum compress_method method, off_t *size_out);
+static bool sample_compressible(int fd, uint64_t length);
+static void deflater_start(struct deflater_s *deflater, uint64_t content_length);
+static void deflater_restart(struct deflater_s *deflater);
+static ssize_t deflater_run(struct deflater_s *deflater, int fd, unsigned char *output, size_t size);
+static void deflater_end(struct deflater_s *deflater);
+static bool size_lookup(const struct stat *buf, enum compress_method method, enum view_body *body_out, uint64_t *size_out);
+static void size_store(int fd, const struct stat *buf, enum compress_method method, enum view_body body, uint64_t size);
+static void size_key(enum compress_method method, unsigned char key_out[256 / CHAR_BIT]);
+#ifndef __APPLE__
+static void statx_convert(const struct statx *source, struct stat *target);
+#endif
+
+
+/* MARK: - Intercepted Functions */
+
+int compress_open(const char *path, int flags, ...)
+{
+	int result;
+	va_list arg;
+	va_start(arg, flags);
+
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		result = open(path, flags, mode);
+	} else {
+		result = open(path, flags);
+	}
+
+	file_attach(result, path, flags);
+
+	va_end(arg);
+	return result;
+}
+
+int compress_openat(int dirfd, const char *path, int flags, ...)
+{
+	int result;
+	va_list arg;
+	va_start(arg, flags);
+
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		result = openat(dirfd, path, flags, mode);
+	} else {
+		result = openat(dirfd, path, flags);
+	}
+
+	if (result >= 0) {
+		char *resolved = fdmap_path(dirfd, path, 0);
+		file_attach(result, resolved ? resolved : path, flags);
+		free(resolved);
+	}
+
+	va_end(arg);
+	return result;
+}
+
+int compress_close(int fd)
+{
+	struct compressmap_s *file = fdmap_set(fd, FDMAP_COMPRESS, NULL);
+
+	if (file) {
+		// wait for concurrent operations on the file to finish
+		pthread_mutex_lock(&file->lock);
+		pthread_mutex_unlock(&file->lock);
+
+		if (file->state == FAILED || (file->state == WRITE && file->position > 0)) {
+			// the compressed view was cut short or corrupted
+			(void)ftruncate(fd, 0);
+			file_release(file);
+			close(fd);
+			errno = EIO;
+			return -1;
+		}
+		file_release(file);
+	}
+
+	return close(fd);
+}
+
+ssize_t compress_read(int fd, void *buf, size_t bytes)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return read(fd, buf, bytes);
+
+	const struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	ssize_t result = file_readv(file, fd, &iov, 1, -1);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_write(int fd, const void *buf, size_t bytes)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return write(fd, buf, bytes);
+
+	const struct iovec iov = { .iov_base = (void *)(uintptr_t)buf, .iov_len = bytes };
+	ssize_t result = file_writev(file, fd, &iov, 1, -1);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_pread(int fd, void *buf, size_t bytes, off_t offset)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return pread(fd, buf, bytes, offset);
+
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	const struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	ssize_t result = file_readv(file, fd, &iov, 1, offset);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_pwrite(int fd, const void *buf, size_t bytes, off_t offset)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return pwrite(fd, buf, bytes, offset);
+
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	const struct iovec iov = { .iov_base = (void *)(uintptr_t)buf, .iov_len = bytes };
+	ssize_t result = file_writev(file, fd, &iov, 1, offset);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return readv(fd, iov, iovcnt);
+
+	ssize_t result = file_readv(file, fd, iov, iovcnt, -1);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return writev(fd, iov, iovcnt);
+
+	ssize_t result = file_writev(file, fd, iov, iovcnt, -1);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return preadv(fd, iov, iovcnt, offset);
+
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t result = file_readv(file, fd, iov, iovcnt, offset);
+	file_release(file);
+	return result;
+}
+
+ssize_t compress_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return pwritev(fd, iov, iovcnt, offset);
+
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t result = file_writev(file, fd, iov, iovcnt, offset);
+	file_release(file);
+	return result;
+}
+
+off_t compress_lseek(int fd, off_t offset, int whence)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return lseek(fd, offset, whence);
+
+	pthread_mutex_lock(&file->lock);
+	off_t result = file_seek(file, fd, offset, whence);
+	pthread_mutex_unlock(&file->lock);
+	file_release(file);
+	return result;
+}
+
+int compress_ftruncate(int fd, off_t length)
+{
+	struct compressmap_s *file = fdmap_acquire(fd, FDMAP_COMPRESS);
+	if (!file) return ftruncate(fd, length);
+
+	int result = 0;
+	pthread_mutex_lock(&file->lock);
+	if (length < 0) {
+		errno = EINVAL;
+		result = -1;
+	} else if (length == 0 && file->state != READ) {
+		// layers above discard what they wrote, start over with an empty view
+		result = ftruncate(fd, 0);
+		if (file->inflating) inflateEnd(&file->inflater);
+		file->inflating = false;
+		file->state = file->state == UNDECIDED ? UNDECIDED : WRITE;
+		file->position = 0;
+		file->content_written = 0;
+		file->output_filled = 0;
+	} else if (file->state == READ || (size_t)length < file->position) {
+		// the compressed view can neither be edited nor cut short
+		errno = EINVAL;
+		result = -1;
+	}
+	// truncating to the final length of a view still being written is left to the view itself
+	pthread_mutex_unlock(&file->lock);
+	file_release(file);
+	return result;
+}
+
+#ifndef __APPLE__
+static const struct fdmap_io_s copy_io = {
+	.read = compress_read, .pread = compress_pread, .write = compress_write, .pwrite = compress_pwrite
+};
+
+ssize_t compress_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+	if (!fdmap_get(fd_in, FDMAP_COMPRESS) && !fdmap_get(fd_out, FDMAP_COMPRESS))
+		return copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+
+	// the kernel cannot copy content we transform
+	return fdmap_copy(&copy_io, fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+ssize_t compress_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	if (!fdmap_get(in_fd, FDMAP_COMPRESS) && !fdmap_get(out_fd, FDMAP_COMPRESS))
+		return sendfile(out_fd, in_fd, offset, count);
+
+	// the kernel cannot copy content we transform
+	return fdmap_copy(&copy_io, in_fd, offset, out_fd, NULL, count, 0);
+}
+#endif
+
+int compress_stat(const char * restrict path, struct stat * restrict buf)
+{
+	int result = stat(path, buf);
+
+	enum compress_method method;
+	if (result == 0 && S_ISREG(buf->st_mode) && compress_search(path, &method)) {
+		// we will compress on read, so report the size of the compressed view
+		path_size(AT_FDCWD, path, 0, buf, method, &buf->st_size);
+	}
+
+	return result;
+}
+
+int compress_lstat(const char * restrict path, struct stat * restrict buf)
+{
+	int result = lstat(path, buf);
+
+	enum compress_method method;
+	if (result == 0 && S_ISREG(buf->st_mode) && compress_search(path, &method)) {
+		// we will compress on read, so report the size of the compressed view
+		path_size(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, buf, method, &buf->st_size);
+	}
+
+	return result;
+}
+
+int compress_fstat(int fd, struct stat *buf)
+{
+	int result = fstat(fd, buf);
+
+	struct compressmap_s *file = result == 0 ? fdmap_acquire(fd, FDMAP_COMPRESS) : NULL;
+	if (file) {
+		pthread_mutex_lock(&file->lock);
+		if (file->state == WRITE || file->state == WRITE_COMPLETE || file->state == FAILED) {
+			// writers have received this much of the view
+			buf->st_size = (off_t)file->position;
+		} else {
+			uint64_t size;
+			if (view_size(file, fd, &size)) buf->st_size = (off_t)size;
+			else result = -1;
+		}
+		pthread_mutex_unlock(&file->lock);
+		file_release(file);
+	}
+
+	return result;
+}
+
+int compress_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags)
+{
+	int result = fstatat(dirfd, path, buf, flags);
+
+	if (result == 0 && S_ISREG(buf->st_mode)) {
+		char *resolved = fdmap_path(dirfd, path, flags);
+		enum compress_method method;
+		if (compress_search(resolved ? resolved : path, &method)) {
+			// we will compress on read, so report the size of the compressed view
+			path_size(dirfd, path, flags, buf, method, &buf->st_size);
+		}
+		free(resolved);
+	}
+
+	return result;
+}
+
+#ifndef __APPLE__
+int compress_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf)
+{
+	int result = statx(dirfd, path, flags, mask, buf);
+
+	if (result == 0 && (buf->stx_mask & STATX_TYPE) && (buf->stx_mask & STATX_SIZE) && S_ISREG(buf->stx_mode)) {
+		char *resolved = fdmap_path(dirfd, path, flags);
+		enum compress_method method;
+		if (compress_search(resolved ? resolved : path, &method)) {
+			// we will compress on read, so report the size of the compressed view
+			struct stat stat_buf;
+			statx_convert(buf, &stat_buf);
+			path_size(dirfd, path, flags, &stat_buf, method, &stat_buf.st_size);
+			buf->stx_size = (uint64_t)stat_buf.st_size;
+		}
+		free(resolved);
+	}
+
+	return result;
+}
+#endif
+
+
+/* MARK: - Helper Functions */
+
+static bool compress_search(const char *path, enum compress_method *method_out)
+{
+	// resource forks are left alone, their sizes are reported separately
+	if (strstr(path, "/..namedfork/")) return false;
+
+	// never compress Unison’s internal files
+	if (fnmatch(INTERNAL_PATTERN1, path, 0) == 0 || fnmatch(INTERNAL_PATTERN2, path, 0) == 0) {
+		sync_started = true;
+		return false;
+	}
+	if (!sync_started) return false;
+
+	pthread_mutex_lock(&config.lock);
+	const struct compress_s *compress = config_compress_rule(path);
+	if (compress) *method_out = compress->method;
+	pthread_mutex_unlock(&config.lock);
+
+	return compress != NULL;
+}
+
+static void file_attach(int fd, const char *path, int flags)
+{
+	enum compress_method method;
+	struct compressmap_s *file = NULL;
+	struct stat stat_buf;
+	// only regular files have content to compress
+	if (fd >= 0 && compress_search(path, &method) && fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+		file = calloc(1, sizeof(struct compressmap_s));
+		assert(file);
+		atomic_init(&file->reference.count, 1);
+		pthread_mutex_init(&file->lock, NULL);
+		file->state = UNDECIDED;
+		file->method = method;
+		// read-write descriptors take the direction of their first transfer
+		switch (flags & (O_RDONLY | O_WRONLY | O_RDWR)) {
+		case O_RDONLY:
+			file_direction(file, false);
+			break;
+		case O_WRONLY:
+			file_direction(file, true);
+			break;
+		}
+	}
+	// a reused file descriptor may carry stale state
+	if (fd >= 0) file_release(fdmap_set(fd, FDMAP_COMPRESS, file));
+}
+
+static void file_release(void *state)
+{
+	struct compressmap_s *file = state;
+	// calls still using the file free it when they finish, without disturbing their errno
+	if (!file || !fdmap_put(file)) return;
+	const int saved_errno = errno;
+	pthread_mutex_destroy(&file->lock);
+	deflater_end(&file->deflater);
+	if (file->inflating) inflateEnd(&file->inflater);
+	iobuf_put(file->output, file->output_size);
+	free(file);
+	errno = saved_errno;
+}
+
+/* the first transfer decides whether the view is read or written, false for transfers the other way */
+static bool file_direction(struct compressmap_s *file, bool writing)
+{
+	if (file->state == UNDECIDED) file->state = writing ? WRITE : READ;
+	return (file->state != READ) == writing;
+}
+
+static ssize_t file_readv(struct compressmap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t result = 0;
+	pthread_mutex_lock(&file->lock);
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		result = -1;
+	} else if (!file_direction(file, false)) {
+		errno = EBADF;
+		result = -1;
+	} else if (!view_prepare(file, fd)) {
+		result = -1;
+	} else {
+		// positional reads leave the file position alone
+		size_t position = offset >= 0 ? (size_t)offset : file->position;
+		for (int i = 0; i < iovcnt; i++) {
+			ssize_t read_result = view_read(file, fd, iov[i].iov_base, iov[i].iov_len, position);
+			if (read_result < 0 && result == 0) result = -1;
+			if (read_result <= 0) break;
+			result += read_result;
+			position += (size_t)read_result;
+			if ((size_t)read_result < iov[i].iov_len) break;
+		}
+		if (offset < 0 && result > 0) file->position = position;
+	}
+
+	pthread_mutex_unlock(&file->lock);
+	return result;
+}
+
+static ssize_t file_writev(struct compressmap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t result = 0;
+	pthread_mutex_lock(&file->lock);
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		result = -1;
+	} else if (file->state == UNDECIDED && file->position != 0) {
+		// writers must start with the header
+		errno = EINVAL;
+		result = -1;
+	} else if (!file_direction(file, true)) {
+		errno = EBADF;
+		result = -1;
+	} else if (offset >= 0 && (size_t)offset != file->position) {
+		// the compressed view can only be consumed sequentially
+		errno = EINVAL;
+		result = -1;
+	} else {
+		for (int i = 0; i < iovcnt; i++) {
+			ssize_t write_result = view_write(file, fd, iov[i].iov_base, iov[i].iov_len);
+			if (write_result < 0) {
+				result = -1;
+				break;
+			}
+			result += write_result;
+		}
+	}
+
+	pthread_mutex_unlock(&file->lock);
+	return result;
+}
+
+static off_t file_seek(struct compressmap_s *file, int fd, off_t offset, int whence)
+{
+	const bool writing = file->state != UNDECIDED && file->state != READ;
+	off_t base;
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = (off_t)file->position;
+		break;
+	case SEEK_END:
+		if (writing) {
+			// writers only know the size of the view once it is complete
+			if (file->state != WRITE_COMPLETE) {
+				errno = EINVAL;
+				return -1;
+			}
+			base = (off_t)file->position;
+		} else {
+			uint64_t size;
+			if (!view_size(file, fd, &size)) return -1;
+			base = (off_t)size;
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	off_t target;
+	if (__builtin_add_overflow(base, offset, &target)) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (target < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (writing && (size_t)target != file->position) {
+		// the received view is strictly sequential
+		errno = ESPIPE;
+		return -1;
+	}
+
+	file->position = (size_t)target;
+	return target;
+}
+
+/* decide how the content of a file being read is presented */
+static bool view_prepare(struct compressmap_s *file, int fd)
+{
+	if (file->prepared) return true;
+
+	struct stat stat_buf;
+	if (fstat(fd, &stat_buf) != 0) return false;
+	const uint64_t length = (uint64_t)stat_buf.st_size;
+
+	enum view_body body;
+	if (size_lookup(&stat_buf, file->method, &body, &file->view_size)) {
+		file->size_known = true;
+	} else {
+		body = sample_compressible(fd, length) ? BODY_ZLIB : BODY_STORED;
+		if (body == BODY_STORED) {
+			file->view_size = VIEW_HEADER + length;
+			file->size_known = true;
+			size_store(fd, &stat_buf, file->method, body, file->view_size);
+		}
+	}
+
+	memcpy(file->header.magic, VIEW_MAGIC, sizeof(file->header.magic));
+	file->header.body = body;
+	file->header.content_length = length;
+	if (body == BODY_ZLIB) {
+		deflater_start(&file->deflater, length);
+		file->output = iobuf_get(OUTPUT_SIZE, IOBUF_MIN, &file->output_size);
+		file->output_start = 0;
+		file->output_filled = 0;
+	}
+
+	file->prepared = true;
+	return true;
+}
+
+/* size of the view of a file being read, compressing it once if necessary */
+static bool view_size(struct compressmap_s *file, int fd, uint64_t *size_out)
+{
+	if (!view_prepare(file, fd)) return false;
+	if (!file->size_known) {
+		struct stat stat_buf;
+		if (fstat(fd, &stat_buf) != 0) return false;
+		if (!view_measure(fd, &stat_buf, file->method, NULL, &file->view_size)) return false;
+		file->size_known = true;
+	}
+	*size_out = file->view_size;
+	return true;
+}
+
+static ssize_t view_read(struct compressmap_s *file, int fd, unsigned char *buffer, size_t bytes, size_t position)
+{
+	size_t done = 0;
+	while (done < bytes) {
+		const size_t current = position + done;
+		if (current < VIEW_HEADER) {
+			const size_t length = VIEW_HEADER - current < bytes - done ? VIEW_HEADER - current : bytes - done;
+			memcpy(buffer + done, (const unsigned char *)&file->header + current, length);
+			done += length;
+			continue;
+		}
+
+		const uint64_t body = current - VIEW_HEADER;
+		if (file->header.body == BODY_STORED) {
+			// content as is, up to the length announced in the header
+			if (body >= file->header.content_length) break;
+			const uint64_t remaining = file->header.content_length - body;
+			const size_t length = remaining < bytes - done ? (size_t)remaining : bytes - done;
+			ssize_t read_result = pread(fd, buffer + done, length, (off_t)body);
+			if (read_result < 0 && errno == EINTR) continue;
+			if (read_result == 0) errno = EIO;  // the file was truncated under the reader
+			if (read_result <= 0) return done ? (ssize_t)done : -1;
+			done += (size_t)read_result;
+			continue;
+		}
+
+		if (body < file->output_start) {
+			// reading backwards starts the compressor over
+			deflater_restart(&file->deflater);
+			file->output_start = 0;
+			file->output_filled = 0;
+		}
+		if (body >= file->output_start + file->output_filled) {
+			if (file->deflater.finished) break;
+			file->output_start += file->output_filled;
+			file->output_filled = 0;
+			ssize_t run_result = deflater_run(&file->deflater, fd, file->output, file->output_size);
+			if (run_result < 0) return done ? (ssize_t)done : -1;
+			file->output_filled = (size_t)run_result;
+			if (file->deflater.finished && !file->size_known) {
+				// having compressed all of it, the size is known for later stat calls
+				file->view_size = VIEW_HEADER + file->output_start + file->output_filled;
+				file->size_known = true;
+				struct stat stat_buf;
+				if (fstat(fd, &stat_buf) == 0 && (uint64_t)stat_buf.st_size == file->header.content_length)
+					size_store(fd, &stat_buf, file->method, BODY_ZLIB, file->view_size);
+			}
+			continue;
+		}
+
+		const size_t available = (size_t)(file->output_start + file->output_filled - body);
+		const size_t length = available < bytes - done ? available : bytes - done;
+		memcpy(buffer + done, file->output + (body - file->output_start), length);
+		done += length;
+	}
+	return (ssize_t)done;
+}
+
+static ssize_t view_write(struct compressmap_s *file, int fd, const unsigned char *buffer, size_t bytes)
+{
+	if (file->state == FAILED) {
+		errno = EIO;
+		return -1;
+	}
+
+	size_t done = 0;
+	while (done < bytes) {
+		if (file->position < VIEW_HEADER) {
+			const size_t length = VIEW_HEADER - file->position < bytes - done ? VIEW_HEADER - file->position : bytes - done;
+			memcpy((unsigned char *)&file->header + file->position, buffer + done, length);
+			file->position += length;
+			done += length;
+			if (file->position == VIEW_HEADER && !view_accept(file)) return view_fail(file, fd, EIO);
+		} else if (file->state == WRITE_COMPLETE) {
+			// data beyond the end of the view
+			return view_fail(file, fd, EIO);
+		} else if (file->header.body == BODY_STORED) {
+			const uint64_t remaining = file->header.content_length - file->content_written;
+			const size_t length = remaining < bytes - done ? (size_t)remaining : bytes - done;
+			if (fdmap_write(fd, buffer + done, length, (off_t)file->content_written) < 0) return view_fail(file, fd, errno);
+			file->content_written += length;
+			file->position += length;
+			done += length;
+		} else {
+			file->inflater.next_in = (unsigned char *)(uintptr_t)(buffer + done);
+			file->inflater.avail_in = (uInt)(bytes - done < UINT_MAX ? bytes - done : UINT_MAX);
+			const size_t offered = file->inflater.avail_in;
+			bool finished = false;
+			while (file->inflater.avail_in > 0 && !finished) {
+				file->inflater.next_out = file->output + file->output_filled;
+				file->inflater.avail_out = (uInt)(file->output_size - file->output_filled);
+				int zlib_result = inflate(&file->inflater, Z_NO_FLUSH);
+				file->output_filled = file->output_size - file->inflater.avail_out;
+				if (zlib_result == Z_STREAM_END) finished = true;
+				else if (zlib_result != Z_OK) return view_fail(file, fd, EIO);
+				if ((file->output_filled == file->output_size || finished) && !view_flush(file, fd)) return view_fail(file, fd, errno);
+			}
+			const size_t consumed = offered - file->inflater.avail_in;
+			file->position += consumed;
+			done += consumed;
+			if (finished && file->content_written != file->header.content_length) return view_fail(file, fd, EIO);
+			if (finished) {
+				inflateEnd(&file->inflater);
+				file->inflating = false;
+			}
+		}
+
+		const bool complete = file->position >= VIEW_HEADER && file->content_written == file->header.content_length &&
+		                      (file->header.body == BODY_STORED || !file->inflating);
+		if (complete && file->state == WRITE) {
+			// all content arrived, drop content left from before
+			if (ftruncate(fd, (off_t)file->content_written) != 0) return view_fail(file, fd, errno);
+			file->state = WRITE_COMPLETE;
+		}
+	}
+	return (ssize_t)done;
+}
+
+/* check a received header and get ready for the body */
+static bool view_accept(struct compressmap_s *file)
+{
+	if (memcmp(file->header.magic, VIEW_MAGIC, sizeof(file->header.magic)) != 0) return false;
+	file->content_written = 0;
+	switch (file->header.body) {
+	case BODY_STORED:
+		return true;
+	case BODY_ZLIB:
+		memset(&file->inflater, 0, sizeof(file->inflater));
+		if (inflateInit(&file->inflater) != Z_OK) return false;
+		file->inflating = true;
+		if (!file->output) file->output = iobuf_get(OUTPUT_SIZE, IOBUF_MIN, &file->output_size);
+		file->output_filled = 0;
+		return true;
+	}
+	return false;
+}
+
+/* write out decompressed content, which must not exceed the announced length */
+static bool view_flush(struct compressmap_s *file, int fd)
+{
+	if (file->output_filled > file->header.content_length - file->content_written) {
+		errno = EIO;
+		return false;
+	}
+	if (fdmap_write(fd, file->output, file->output_filled, (off_t)file->content_written) < 0) return false;
+	file->content_written += file->output_filled;
+	file->output_filled = 0;
+	return true;
+}
+
+/* a failed write leaves an empty file behind */
+static ssize_t view_fail(struct compressmap_s *file, int fd, int error)
+{
+	(void)ftruncate(fd, 0);
+	file->state = FAILED;
+	errno = error;
+	return -1;
+}
+
+/* how the content of an open file is presented and the size of its view */
+static bool view_measure(int fd, const struct stat *buf, enum compress_method method, enum view_body *body_out, uint64_t *size_out)
+{
+	enum view_body body;
+	if (size_lookup(buf, method, &body, size_out)) {
+		if (body_out) *body_out = body;
+		return true;
+	}
+
+	const uint64_t length = (uint64_t)buf->st_size;
+	body = sample_compressible(fd, length) ? BODY_ZLIB : BODY_STORED;
+	uint64_t size = VIEW_HEADER + length;
+	if (body == BODY_ZLIB) {
+		// the compressed size is only known after compressing all of it
+		struct deflater_s deflater = { 0 };
+		deflater_start(&deflater, length);
+		size_t output_size;
+		unsigned char *output = iobuf_get(OUTPUT_SIZE, IOBUF_MIN, &output_size);
+		size = VIEW_HEADER;
+		ssize_t run_result;
+		while ((run_result = deflater_run(&deflater, fd, output, output_size)) > 0) size += (uint64_t)run_result;
+		const bool finished = deflater.finished;
+		iobuf_put(output, output_size);
+		deflater_end(&deflater);
+		if (run_result < 0 || !finished) return false;
+	}
+
+	size_store(fd, buf, method, body, size);
+	if (body_out) *body_out = body;
+	*size_out = size;
+	return true;
+}
+
+/* view size of a file found by path, the stat buffer describes the file
+ * an unreadable file keeps the size from the stat buffer, opening it reports the error */
+static void path_size(int dirfd, const char *path, int flags, const struct stat *buf, enum compress_method method, off_t *size_out)
+{
+	uint64_t size;
+	enum view_body body;
+	if (size_lookup(buf, method, &body, &size)) {
+		*size_out = (off_t)size;
+		return;
+	}
+
+	const int error = errno;
+	int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC | ((flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0));
+	if (fd >= 0) {
+		struct stat stat_buf;
+		if (fstat(fd, &stat_buf) == 0 && view_measure(fd, &stat_buf, method, NULL, &size)) *size_out = (off_t)size;
+		close(fd);
+	}
+	errno = error;
+}
+
+/* whether compressing pieces of the content quickly saves enough to compress all of it */
+static bool sample_compressible(int fd, uint64_t length)
+{
+	if (length == 0) return false;
+
+	unsigned char *sample = malloc(SAMPLE_PIECES * SAMPLE_PIECE);
+	assert(sample);
+	size_t sampled = 0;
+	if (length <= SAMPLE_PIECES * SAMPLE_PIECE) {
+		// small files are sampled entirely
+		while (sampled < length) {
+			ssize_t read_result = pread(fd, sample + sampled, (size_t)length - sampled, (off_t)sampled);
+			if (read_result < 0 && errno == EINTR) continue;
+			if (read_result <= 0) break;
+			sampled += (size_t)read_result;
+		}
+	} else {
+		for (size_t piece = 0; piece < SAMPLE_PIECES; piece++) {
+			const uint64_t offset = (length - SAMPLE_PIECE) / (SAMPLE_PIECES - 1) * piece;
+			size_t filled = 0;
+			while (filled < SAMPLE_PIECE) {
+				ssize_t read_result = pread(fd, sample + sampled + filled, SAMPLE_PIECE - filled, (off_t)(offset + filled));
+				if (read_result < 0 && errno == EINTR) continue;
+				if (read_result <= 0) break;
+				filled += (size_t)read_result;
+			}
+			sampled += filled;
+		}
+	}
+
+	bool result = false;
+	uLongf compressed_size = compressBound((uLong)sampled);
+	unsigned char *compressed = malloc(compressed_size);
+	assert(compressed);
+	if (sampled > 0 && compress2(compressed, &compressed_size, sample, (uLong)sampled, SAMPLE_LEVEL) == Z_OK)
+		result = compressed_size * 100 < (uLongf)sampled * (100 - SAMPLE_SAVING);
+	free(compressed);
+	free(sample);
+	return result;
+}
+
+static void deflater_start(struct deflater_s *deflater, uint64_t content_length)
+{
+	memset(&deflater->stream, 0, sizeof(deflater->stream));
+	int zlib_result = deflateInit(&deflater->stream, Z_DEFAULT_COMPRESSION);
+	assert(zlib_result == Z_OK);
+	deflater->active = true;
+	deflater->finished = false;
+	deflater->content_offset = 0;
+	deflater->content_length = content_length;
+	deflater->input = iobuf_get(INPUT_STEP, INPUT_STEP, &deflater->input_size);
+}
+
+static void deflater_restart(struct deflater_s *deflater)
+{
+	int zlib_result = deflateReset(&deflater->stream);
+	assert(zlib_result == Z_OK);
+	deflater->stream.avail_in = 0;
+	deflater->finished = false;
+	deflater->content_offset = 0;
+}
+
+/* compress content into the buffer until it is full, bytes produced or -1 */
+static ssize_t deflater_run(struct deflater_s *deflater, int fd, unsigned char *output, size_t size)
+{
+	deflater->stream.next_out = output;
+	deflater->stream.avail_out = (uInt)size;
+	while (deflater->stream.avail_out > 0 && !deflater->finished) {
+		if (deflater->stream.avail_in == 0 && deflater->content_offset < deflater->content_length) {
+			const uint64_t remaining = deflater->content_length - deflater->content_offset;
+			const size_t length = remaining < INPUT_STEP ? (size_t)remaining : INPUT_STEP;
+			size_t filled = 0;
+			while (filled < length) {
+				[[clang::suppress]]  // unix.BlockInCriticalSection
+				ssize_t read_result = pread(fd, deflater->input + filled, length - filled, (off_t)(deflater->content_offset + filled));
+				if (read_result < 0 && errno == EINTR) continue;
+				if (read_result == 0) errno = EIO;  // the file was truncated under the reader
+				if (read_result <= 0) return -1;
+				filled += (size_t)read_result;
+			}
+			deflater->stream.next_in = deflater->input;
+			deflater->stream.avail_in = (uInt)length;
+			deflater->content_offset += length;
+		}
+		const int flush = deflater->content_offset == deflater->content_length ? Z_FINISH : Z_NO_FLUSH;
+		int zlib_result = deflate(&deflater->stream, flush);
+		if (zlib_result == Z_STREAM_END) deflater->finished = true;
+		else assert(zlib_result == Z_OK || zlib_result == Z_BUF_ERROR);
+	}
+	return (ssize_t)(size - deflater->stream.avail_out);
+}
+
+static void deflater_end(struct deflater_s *deflater)
+{
+	if (!deflater->active) return;
+	deflateEnd(&deflater->stream);
+	iobuf_put(deflater->input, deflater->input_size);
+	deflater->active = false;
+}
+
+static bool size_lookup(const struct stat *buf, enum compress_method method, enum view_body *body_out, uint64_t *size_out)
+{
+	unsigned char key[256 / CHAR_BIT], entry[256 / CHAR_BIT];
+	size_key(method, key);
+	if (!ivcache_lookup(buf, key, entry)) return false;
+	uint64_t size;
+	uint32_t body;
+	memcpy(&size, entry, sizeof(size));
+	memcpy(&body, entry + sizeof(size), sizeof(body));
+	if (body != BODY_STORED && body != BODY_ZLIB) return false;
+	*body_out = body;
+	*size_out = size;
+	return true;
+}
+
+static void size_store(int fd, const struct stat *buf, enum compress_method method, enum view_body body, uint64_t size)
+{
+	unsigned char key[256 / CHAR_BIT], entry[256 / CHAR_BIT] = { 0 };
+	size_key(method, key);
+	const uint32_t stored_body = body;
+	memcpy(entry, &size, sizeof(size));
+	memcpy(entry + sizeof(size), &stored_body, sizeof(stored_body));
+	ivcache_store(fd, buf, key, entry);
+}
+
+static void size_key(enum compress_method method, unsigned char key_out[256 / CHAR_BIT])
+{
+	static const char *const method_name[] = { [COMPRESS_ZLIB] = "zlib" };
+	memset(key_out, 0, 256 / CHAR_BIT);
+	snprintf((char *)key_out, 256 / CHAR_BIT, SIZE_KEY " %s", method_name[method]);
+}
+
+#ifndef __APPLE__
+/* the fields of a statx buffer that identify the file in the size cache */
+static void statx_convert(const struct statx *source, struct stat *target)
+{
+	memset(target, 0, sizeof(*target));
+	target->st_dev = makedev(source->stx_dev_major, source->stx_dev_minor);
+	target->st_ino = (ino_t)source->stx_ino;
+	target->st_mode = source->stx_mode;
+	target->st_size = (off_t)source->stx_size;
+	target->st_mtim.tv_sec = source->stx_mtime.tv_sec;
+	target->st_mtim.tv_nsec = source->stx_mtime.tv_nsec;
+	target->st_ctim.tv_sec = source->stx_ctime.tv_sec;
+	target->st_ctim.tv_nsec = source->stx_ctime.tv_nsec;
+}
+#endif
+
+void compress_reset(void)
+{
+	fdmap_reset(FDMAP_COMPRESS, file_release);
+
+	sync_started = false;
+}
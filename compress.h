@@ -0,0 +1,40 @@
+/* intercept layer that presents unison with compressed file content
+ *
+ * Files matching a compress rule are read as a short header followed by their
+ * content as a zlib stream, what Unison writes to them is decompressed again.
+ * The layer sits below the encrypt layer, so content is compressed before it
+ * is encrypted. A sample of each file decides whether compression pays off,
+ * incompressible content follows the header unchanged. Reported sizes are the
+ * sizes of the compressed view, which takes one pass over the content and is
+ * remembered in the IV cache. */
+
+struct stat;
+struct iovec;
+
+[[nodiscard]] int compress_open(const char *path, int flags, ...);
+[[nodiscard]] int compress_openat(int dirfd, const char *path, int flags, ...);
+[[nodiscard]] int compress_close(int fd);
+[[nodiscard]] ssize_t compress_read(int fd, void *buf, size_t bytes);
+[[nodiscard]] ssize_t compress_write(int fd, const void *buf, size_t bytes);
+[[nodiscard]] ssize_t compress_pread(int fd, void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t compress_pwrite(int fd, const void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t compress_readv(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t compress_writev(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t compress_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+[[nodiscard]] ssize_t compress_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+[[nodiscard]] off_t compress_lseek(int fd, off_t offset, int whence);
+[[nodiscard]] int compress_ftruncate(int fd, off_t length);
+#ifndef __APPLE__
+[[nodiscard]] ssize_t compress_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+[[nodiscard]] ssize_t compress_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+#endif
+[[nodiscard]] int compress_stat(const char * restrict path, struct stat * restrict buf);
+[[nodiscard]] int compress_lstat(const char * restrict path, struct stat * restrict buf);
+[[nodiscard]] int compress_fstat(int fd, struct stat *buf);
+[[nodiscard]] int compress_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags);
+#ifndef __APPLE__
+struct statx;
+[[nodiscard]] int compress_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf);
+#endif
+
+void compress_reset(void);
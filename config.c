@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -10,12 +11,16 @@
 #include <paths.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
 
 #ifndef __APPLE__
+#include <sys/sendfile.h>
 #define strlcpy strncpy
 #endif
 
 #include "config.h"
+#include "fdmap.h"
 #include "mbedtls/sha256.h"
 
 #define UNISON_DIR1 ".unison"
@@ -25,38 +30,45 @@ enum entry_type {
 	ENTRY_ROOT,
 	ENTRY_PRE_CMD, ENTRY_POST_CMD, ENTRY_POST_PATH,
 	ENTRY_SYMLINK,
-	ENTRY_ENCRYPT
+	ENTRY_ENCRYPT,
+	ENTRY_COMPRESS,
+	ENTRY_IO_PRESSURE,
+	ENTRY_IO_LIMIT
 };
 
 
 static bool config_expected = true;
 static char *config_pattern;
-static int current_config_fd = -1;
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 static struct parse_s {
 	const enum entry_type type;
 	const char * const pattern;
-	size_t seen;
 } parse[] = {
-	/* uses a minimal regexp syntax:
-	 *  ^ - beginning of line
-	 *  * - previous symbol repeats
-	 *  . - matches anything, stores in argument buffer
+	/* uses a minimal regexp syntax, matched against whole lines:
+	 *  ^ - beginning of line, the keyword up to the first space selects the pattern
+	 *  * - previous symbol repeats, it must appear at least once
+	 *  . - matches anything, stores in argument buffer, only as .* at the end
 	 *    - space also matches tab */
 	{ .type = ENTRY_ROOT, .pattern = "^root *= *.*" },
 	{ .type = ENTRY_PRE_CMD, .pattern = "^#precmd *= *.*" },
 	{ .type = ENTRY_POST_CMD, .pattern = "^#postcmd *= *.*" },
 	{ .type = ENTRY_POST_PATH, .pattern = "^#post *= *Path *.*" },
 	{ .type = ENTRY_SYMLINK, .pattern = "^#symlink *= *Path *.*" },
-	{ .type = ENTRY_ENCRYPT, .pattern = "^#encrypt *= *Path *.*" }
+	{ .type = ENTRY_ENCRYPT, .pattern = "^#encrypt *= *Path *.*" },
+	{ .type = ENTRY_COMPRESS, .pattern = "^#compress *= *Path *.*" },
+	{ .type = ENTRY_IO_PRESSURE, .pattern = "^#iopressure *= *.*" },
+	{ .type = ENTRY_IO_LIMIT, .pattern = "^#iolimit *= *.*" }
 };
 #pragma clang diagnostic pop
 static struct buffer_s argument = { .buffer = NULL, .size = 0 };
+static struct buffer_s line = { .buffer = NULL, .size = 0 };
+static size_t line_length;  // partial line left over from the previous read
 
 struct config_s config = {
 	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.directory = NULL,
 	.search_path = NULL,
 	.root = { { .string = NULL, .length = 0 }, { .string = NULL, .length = 0 } },
 	.pre_command = NULL,
@@ -64,11 +76,24 @@ struct config_s config = {
 	.post = NULL,
 	.symlink = NULL,
 	.encrypt = NULL,
+	.encrypt_index = NULL,
+	.compress = NULL,
+	.pressure = { .io = 0, .memory = 0 },
+	.iolimit = { .read = 0, .write = 0 },
+	.generation = 0,
 	.scratchpad = { .buffer = NULL, .size = 0 }
 };
 
-static void config_parse(struct parse_s * restrict parser, char character);
+static void config_detect(int fd, const char *path, int flags);
+static void config_feed(int fd, const struct iovec *iov, int iovcnt, ssize_t result);
+static void config_scan(const char *data, size_t length);
+static void config_parse(const char *text, size_t length);
+static const char *config_match(const char *pattern, const char *text, const char *end);
 static void process_entry(enum entry_type type);
+static void temporary_patterns(char *pattern, struct string_s *prefixed_out, struct string_s *suffixed_out);
+static struct encrypt_index_s *index_build(void);
+static void index_free(struct encrypt_index_s *index);
+static int index_compare(const void *a, const void *b);
 
 
 static void __attribute__((constructor)) initialize(void)
@@ -99,6 +124,9 @@ static void __attribute__((constructor)) initialize(void)
 		}
 	}
 
+	config.directory = strdup(config_prefix);
+	if (!config.directory) abort();
+
 	// amend PATH with Unison’s bin directory
 	alloc_size = 2 * strlen(config_prefix) + sizeof(":/bin:" _PATH_DEFPATH);
 	config.search_path = malloc(alloc_size);
@@ -116,11 +144,13 @@ static void __attribute__((constructor)) initialize(void)
 static void __attribute__((destructor)) finalize(void)
 {
 	config_reset();
+	free(config.directory);
 	free(config.search_path);
 	free(config.scratchpad.buffer);
 
 	free(config_pattern);
 	free(argument.buffer);
+	free(line.buffer);
 }
 
 
@@ -137,25 +167,28 @@ int config_open(const char *path, int flags, ...)
 		result = open(path, flags, mode);
 	} else {
 		result = open(path, flags);
+		config_detect(result, path, flags);
+	}
 
-		if (result >= 0 && (flags & O_ACCMODE) == O_RDONLY && config_expected &&
-			fnmatch(config_pattern, path, FNM_PATHNAME) == 0) {
+	va_end(arg);
+	return result;
+}
 
-			if (strlen(strrchr(path, '/') + 1) == 2 + 32) {
-				// unison internal file, sync has started, inhibit parsing of upcoming files
-				config_expected = false;
-			} else {
-				assert(current_config_fd == -1);  // config files must be read sequentially
-				current_config_fd = result;
-
-				// reset config parser
-				for (size_t i = 0; i < sizeof(parse) / sizeof(parse[0]); i++) {
-					parse[i].seen = 0;
-					config_parse(&parse[i], '\n');
-				}
-				buffer_alloc(&argument, 1);
-				argument.buffer[0] = '\0';
-			}
+int config_openat(int dirfd, const char *path, int flags, ...)
+{
+	int result;
+	va_list arg;
+	va_start(arg, flags);
+
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		result = openat(dirfd, path, flags, mode);
+	} else {
+		result = openat(dirfd, path, flags);
+		if (result >= 0 && config_expected) {
+			char *resolved = fdmap_path(dirfd, path, 0);
+			config_detect(result, resolved ? resolved : path, flags);
+			free(resolved);
 		}
 	}
 
@@ -165,85 +198,170 @@ int config_open(const char *path, int flags, ...)
 
 int config_close(int fd)
 {
-	if (fd == current_config_fd)
-		current_config_fd = -1;
+	(void)fdmap_set(fd, FDMAP_CONFIG, NULL);
 	return close(fd);
 }
 
 ssize_t config_read(int fd, void *buf, size_t bytes)
 {
 	ssize_t result = read(fd, buf, bytes);
+	const struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	config_feed(fd, &iov, 1, result);
+	return result;
+}
 
-	if (result > 0 && fd == current_config_fd)
-		for (ssize_t pos = 0; pos < result; pos++)
-			for (size_t i = 0; i < sizeof(parse) / sizeof(parse[0]); i++)
-				config_parse(&parse[i], ((char *)buf)[pos]);
-	if (result == 0 && bytes > 0 && fd == current_config_fd)
-		// finalize parsing when last line has no trailing newline
-		for (size_t i = 0; i < sizeof(parse) / sizeof(parse[0]); i++)
-			config_parse(&parse[i], '\n');
+ssize_t config_pread(int fd, void *buf, size_t bytes, off_t offset)
+{
+	ssize_t result = pread(fd, buf, bytes, offset);
+	const struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	config_feed(fd, &iov, 1, result);
+	return result;
+}
 
+ssize_t config_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t result = readv(fd, iov, iovcnt);
+	config_feed(fd, iov, iovcnt, result);
 	return result;
 }
 
+ssize_t config_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t result = preadv(fd, iov, iovcnt, offset);
+	config_feed(fd, iov, iovcnt, result);
+	return result;
+}
+
+#ifndef __APPLE__
+// the output is not a config file and goes straight to the next layer
+static const struct fdmap_io_s copy_io = {
+	.read = config_read, .pread = config_pread, .write = write, .pwrite = pwrite
+};
+
+ssize_t config_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+	if (!fdmap_get(fd_in, FDMAP_CONFIG))
+		return copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+
+	// config files must pass through the parser
+	return fdmap_copy(&copy_io, fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+ssize_t config_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	if (!fdmap_get(in_fd, FDMAP_CONFIG))
+		return sendfile(out_fd, in_fd, offset, count);
+
+	// config files must pass through the parser
+	return fdmap_copy(&copy_io, in_fd, offset, out_fd, NULL, count, 0);
+}
+#endif
+
 
 /* MARK: - Helper Functions */
 
-static void config_parse(struct parse_s * restrict parser, char character)
+static void config_detect(int fd, const char *path, int flags)
 {
-	switch (parser->pattern[parser->seen]) {
-	case '^':
-		if (character == '\n') {
-			parser->seen++;
-		} else if (parser->seen) {
-			parser->seen = 0;
-			config_parse(parser, character);
-		}
-		break;
-	case ' ':
-		if (character == ' ' || character == '\t') {
-			parser->seen++;
-		} else if (parser->seen) {
-			parser->seen = 0;
-			config_parse(parser, character);
+	if (fd >= 0 && (flags & O_ACCMODE) == O_RDONLY && config_expected && config_pattern &&
+		fnmatch(config_pattern, path, FNM_PATHNAME) == 0) {
+
+		if (strlen(strrchr(path, '/') + 1) == 2 + 32) {
+			// unison internal file, sync has started, inhibit parsing of upcoming files
+			config_expected = false;
+		} else {
+			// the parser table serves as marker, config files are read sequentially
+			(void)fdmap_set(fd, FDMAP_CONFIG, parse);
+
+			// reset config parser
+			line_length = 0;
+			buffer_alloc(&argument, 1);
+			argument.buffer[0] = '\0';
 		}
-		break;
-	case '.':
-		if (character != '\n') {
-			size_t length = strlen(argument.buffer);
-			buffer_alloc(&argument, length + 1);
-			argument.buffer[length + 0] = character;
-			argument.buffer[length + 1] = '\0';
-			parser->seen++;
-		} else if (parser->seen) {
-			parser->seen = 0;
-			config_parse(parser, character);
+	}
+}
+
+static void config_feed(int fd, const struct iovec *iov, int iovcnt, ssize_t result)
+{
+	if (fdmap_get(fd, FDMAP_CONFIG) == NULL) return;
+
+	size_t requested = 0;
+	size_t remaining = result > 0 ? (size_t)result : 0;
+	for (int index = 0; index < iovcnt; index++) {
+		const char *buf = iov[index].iov_base;
+		size_t length = iov[index].iov_len;
+		requested += length;
+		if (length > remaining) length = remaining;
+		config_scan(buf, length);
+		remaining -= length;
+	}
+	if (result == 0 && requested > 0)
+		// finalize parsing when last line has no trailing newline
+		config_scan("\n", 1);
+}
+
+static void config_scan(const char *data, size_t length)
+{
+	while (length > 0) {
+		// memchr is vectorized by libc, lines are parsed without copying unless split by reads
+		const char *newline = memchr(data, '\n', length);
+		const size_t part = newline ? (size_t)(newline - data) : length;
+		if (!newline || line_length) {
+			buffer_alloc(&line, line_length + part);
+			memcpy(line.buffer + line_length, data, part);
+			line_length += part;
 		}
-		break;
-	case '*': {
-		size_t saved_state = parser->seen;
-		parser->seen--;
-		config_parse(parser, character);
-		if (parser->seen != saved_state) {
-			parser->seen = saved_state + 1;
-			config_parse(parser, character);
+		if (!newline) break;
+
+		if (line_length) {
+			config_parse(line.buffer, line_length);
+			line_length = 0;
+		} else {
+			config_parse(data, part);
 		}
-		break;
+		data += part + 1;
+		length -= part + 1;
 	}
-	case '\0':
-		process_entry(parser->type);
-		parser->seen = 0;
-		config_parse(parser, character);
-		break;
-	default:
-		if (character == parser->pattern[parser->seen]) {
-			parser->seen++;
-		} else if (parser->seen) {
-			parser->seen = 0;
-			config_parse(parser, character);
-		}
-		break;
+}
+
+static void config_parse(const char *text, size_t length)
+{
+	// keywords are distinct, so at most one pattern applies to a line
+	size_t keyword = 0;
+	while (keyword < length && text[keyword] != ' ' && text[keyword] != '\t') keyword++;
+	if (keyword == 0 || keyword == length) return;
+
+	for (size_t i = 0; i < sizeof(parse) / sizeof(parse[0]); i++) {
+		const char *pattern = parse[i].pattern + 1;  // skip the ^
+		// the keyword may be longer than the pattern, as with other Unison options
+		if (strlen(pattern) <= keyword || pattern[keyword] != ' ' || memcmp(pattern, text, keyword) != 0) continue;
+
+		const char *matched = config_match(pattern + keyword, text + keyword, text + length);
+		if (!matched) return;
+
+		// NUL characters do not become part of the argument
+		buffer_alloc(&argument, (size_t)(text + length - matched) + 1);
+		char *copy = argument.buffer;
+		for (; matched < text + length; matched++)
+			if (*matched != '\0') *copy++ = *matched;
+		*copy = '\0';
+		process_entry(parse[i].type);
+		return;
+	}
+}
+
+static const char *config_match(const char *pattern, const char *text, const char *end)
+{
+	// returns the start of the argument, repetitions are greedy without backtracking
+	while (pattern[0] != '.') {
+		const bool repeat = pattern[1] == '*';
+		const char *start = text;
+		while (text < end && (repeat || text == start) &&
+			(*text == pattern[0] || (pattern[0] == ' ' && *text == '\t'))) text++;
+		if (text == start) return NULL;
+		pattern += repeat ? 2 : 1;
 	}
+	assert(pattern[1] == '*' && pattern[2] == '\0');
+	return text < end ? text : NULL;
 }
 
 static void process_entry(enum entry_type type)
@@ -334,42 +452,25 @@ static void process_entry(enum entry_type type)
 
 	case ENTRY_ENCRYPT:
 		if (!attribute) break;
-		if (strncmp(attribute, "aes-256-gcm:", sizeof("aes-256-gcm:") - sizeof((char)'\0')) != 0) break;
-		attribute += sizeof("aes-256-gcm:") - sizeof((char)'\0');
+		enum encrypt_format format;
+		if (strncmp(attribute, "aes-256-gcm:", sizeof("aes-256-gcm:") - sizeof((char)'\0')) == 0) {
+			attribute += sizeof("aes-256-gcm:") - sizeof((char)'\0');
+			format = ENCRYPT_STREAM;
+		} else if (strncmp(attribute, "aes-256-gcm-v2:", sizeof("aes-256-gcm-v2:") - sizeof((char)'\0')) == 0) {
+			attribute += sizeof("aes-256-gcm-v2:") - sizeof((char)'\0');
+			format = ENCRYPT_SEGMENTED;
+		} else if (strncmp(attribute, "aes-256-gcm-cdc:", sizeof("aes-256-gcm-cdc:") - sizeof((char)'\0')) == 0) {
+			attribute += sizeof("aes-256-gcm-cdc:") - sizeof((char)'\0');
+			format = ENCRYPT_CHUNKED;
+		} else {
+			break;
+		}
 		struct encrypt_s *new_encrypt = malloc(sizeof(struct encrypt_s));
 		if (!new_encrypt) break;
+		new_encrypt->format = format;
 		new_encrypt->path.string = strdup(argument.buffer);
 		new_encrypt->path.length = strlen(argument.buffer);
-		// find the last slash to separate path and filename
-		char *path, *name;
-		name = strrchr(argument.buffer, '/');
-		if (name) {
-			name[0] = '\0';
-			name++;
-			path = argument.buffer;
-		} else {
-			name = argument.buffer;
-			path = NULL;
-		}
-		// generate prefixed and suffixed versions of the filename
-		size_t alloc_size = sizeof(".unison.") - sizeof((char)'\0') + new_encrypt->path.length + sizeof(".*");
-		new_encrypt->prefixed_path.length = alloc_size - sizeof((char)'\0');
-		new_encrypt->prefixed_path.string = malloc(alloc_size);
-		assert(new_encrypt->prefixed_path.string);
-		if (path) {
-			snprintf(new_encrypt->prefixed_path.string, alloc_size, "%s/.unison.%s.*", path, name);
-		} else {
-			snprintf(new_encrypt->prefixed_path.string, alloc_size, ".unison.%s.*", name);
-		}
-		alloc_size = new_encrypt->path.length + sizeof(".unison.*");
-		new_encrypt->suffixed_path.length = alloc_size - sizeof((char)'\0');
-		new_encrypt->suffixed_path.string = malloc(alloc_size);
-		assert(new_encrypt->suffixed_path.string);
-		if (path) {
-			snprintf(new_encrypt->suffixed_path.string, alloc_size, "%s/%s.unison.*", path, name);
-		} else {
-			snprintf(new_encrypt->suffixed_path.string, alloc_size, "%s.unison.*", name);
-		}
+		temporary_patterns(argument.buffer, &new_encrypt->prefixed_path, &new_encrypt->suffixed_path);
 		// process the key material with SHA-256 to obtain an AES-256 key
 		mbedtls_sha256((unsigned char *)attribute, strlen(attribute), new_encrypt->key, 0);
 		new_encrypt->next = NULL;
@@ -382,13 +483,100 @@ static void process_entry(enum entry_type type)
 		}
 		new_encrypt->next = *cur_encrypt;
 		*cur_encrypt = new_encrypt;
+		index_free(config.encrypt_index);
+		config.encrypt_index = NULL;
 		pthread_mutex_unlock(&config.lock);
 		break;
+
+	case ENTRY_COMPRESS:
+		if (!attribute) break;
+		enum compress_method method;
+		if (strcmp(attribute, "zlib") == 0) {
+			method = COMPRESS_ZLIB;
+		} else {
+			break;
+		}
+		struct compress_s *new_compress = malloc(sizeof(struct compress_s));
+		if (!new_compress) break;
+		new_compress->method = method;
+		new_compress->path.string = strdup(argument.buffer);
+		new_compress->path.length = strlen(argument.buffer);
+		temporary_patterns(argument.buffer, &new_compress->prefixed_path, &new_compress->suffixed_path);
+		new_compress->next = NULL;
+		pthread_mutex_lock(&config.lock);
+		// ordering by descending overall path length ensures first match is most specific
+		struct compress_s **cur_compress;
+		for (cur_compress = &config.compress; *cur_compress; cur_compress = &(*cur_compress)->next) {
+			if ((*cur_compress)->path.length < new_compress->path.length) break;
+		}
+		new_compress->next = *cur_compress;
+		*cur_compress = new_compress;
+		pthread_mutex_unlock(&config.lock);
+		break;
+
+	case ENTRY_IO_PRESSURE:
+		// stall percentages for I/O and optionally memory
+		char *pressure_end;
+		const double io = strtod(argument.buffer, &pressure_end);
+		const double memory = strtod(pressure_end, &pressure_end);
+		if (*pressure_end != '\0' || !(io >= 0 && io <= 100) || !(memory >= 0 && memory <= 100)) break;
+		atomic_store_explicit(&config.pressure.io, (uint32_t)(io * 100), memory_order_relaxed);
+		atomic_store_explicit(&config.pressure.memory, (uint32_t)(memory * 100), memory_order_relaxed);
+		break;
+
+	case ENTRY_IO_LIMIT:
+		// MiB per second for reading and writing, 0 for no limit
+		char *limit_end;
+		const double read_limit = strtod(argument.buffer, &limit_end);
+		const double write_limit = strtod(limit_end, &limit_end);
+		if (*limit_end != '\0' || !(read_limit >= 0 && read_limit < 1e9) || !(write_limit >= 0 && write_limit < 1e9)) break;
+		atomic_store_explicit(&config.iolimit.read, (uint64_t)(read_limit * 1024 * 1024), memory_order_relaxed);
+		atomic_store_explicit(&config.iolimit.write, (uint64_t)(write_limit * 1024 * 1024), memory_order_relaxed);
+		break;
 	}
 
+	// results derived from the previous entries are outdated
+	atomic_fetch_add_explicit(&config.generation, 1, memory_order_release);
 	argument.buffer[0] = '\0';
 }
 
+/* patterns for the temporary files Unison writes while transferring matching
+ * paths, the pattern is split at its last slash in place */
+static void temporary_patterns(char *pattern, struct string_s *prefixed_out, struct string_s *suffixed_out)
+{
+	const size_t length = strlen(pattern);
+	// find the last slash to separate path and filename
+	char *path, *name;
+	name = strrchr(pattern, '/');
+	if (name) {
+		name[0] = '\0';
+		name++;
+		path = pattern;
+	} else {
+		name = pattern;
+		path = NULL;
+	}
+	// generate prefixed and suffixed versions of the filename
+	size_t alloc_size = sizeof(".unison.") - sizeof((char)'\0') + length + sizeof(".*");
+	prefixed_out->length = alloc_size - sizeof((char)'\0');
+	prefixed_out->string = malloc(alloc_size);
+	assert(prefixed_out->string);
+	if (path) {
+		snprintf(prefixed_out->string, alloc_size, "%s/.unison.%s.*", path, name);
+	} else {
+		snprintf(prefixed_out->string, alloc_size, ".unison.%s.*", name);
+	}
+	alloc_size = length + sizeof(".unison.*");
+	suffixed_out->length = alloc_size - sizeof((char)'\0');
+	suffixed_out->string = malloc(alloc_size);
+	assert(suffixed_out->string);
+	if (path) {
+		snprintf(suffixed_out->string, alloc_size, "%s/%s.unison.*", path, name);
+	} else {
+		snprintf(suffixed_out->string, alloc_size, "%s.unison.*", name);
+	}
+}
+
 void config_reset(void)
 {
 	pthread_mutex_lock(&config.lock);
@@ -431,8 +619,184 @@ void config_reset(void)
 		free(save_encrypt);
 	}
 	config.encrypt = NULL;
+	index_free(config.encrypt_index);
+	config.encrypt_index = NULL;
+
+	for (struct compress_s *compress = config.compress; compress;) {
+		free(compress->path.string);
+		free(compress->prefixed_path.string);
+		free(compress->suffixed_path.string);
+		struct compress_s *save_compress = compress;
+		compress = compress->next;
+		free(save_compress);
+	}
+	config.compress = NULL;
+	atomic_store_explicit(&config.pressure.io, 0, memory_order_relaxed);
+	atomic_store_explicit(&config.pressure.memory, 0, memory_order_relaxed);
+	atomic_store_explicit(&config.iolimit.read, 0, memory_order_relaxed);
+	atomic_store_explicit(&config.iolimit.write, 0, memory_order_relaxed);
+	atomic_fetch_add_explicit(&config.generation, 1, memory_order_release);
 
 	config_expected = true;
 
 	pthread_mutex_unlock(&config.lock);
 }
+
+
+/* MARK: - Rule Index */
+
+/* Every encrypt rule contributes three patterns, which are matched against
+ * absolute paths after prepending the first root. The index sorts the patterns
+ * by their literal leading part, which any matching path must start with. The
+ * entries whose literal part is a prefix of the path are found by a binary
+ * search followed by a walk along parent links, each leading to the entry with
+ * the longest literal part that is a prefix of the current one. Only these
+ * candidates are matched with fnmatch(). */
+
+struct encrypt_index_s {
+	char *root;       // the first root when the index was built
+	size_t count;
+	struct encrypt_index_entry_s {
+		char *pattern;
+		size_t literal;   // length of the leading part without wildcards
+		size_t parent;    // SIZE_MAX at the top
+		size_t order;     // position of the rule in the list, lower is more specific
+		const struct encrypt_s *rule;
+	} entry[];
+};
+
+const struct encrypt_s *config_encrypt_rule(const char *path)
+{
+	struct encrypt_index_s *index = config.encrypt_index;
+	if (index && (!index->root != !config.root[0].string ||
+	              (index->root && strcmp(index->root, config.root[0].string) != 0))) {
+		// the root was changed after the rules were parsed
+		index_free(index);
+		index = config.encrypt_index = NULL;
+	}
+	if (!index) {
+		if (!config.encrypt) return NULL;
+		index = config.encrypt_index = index_build();
+	}
+
+	// find the last entry whose literal part sorts before or is a prefix of the path
+	size_t low = 0, high = index->count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const struct encrypt_index_entry_s *entry = &index->entry[middle];
+		if (strncmp(entry->pattern, path, entry->literal) <= 0) low = middle + 1;
+		else high = middle;
+	}
+
+	const struct encrypt_index_entry_s *found = NULL;
+	for (size_t current = low ? low - 1 : SIZE_MAX; current != SIZE_MAX; current = index->entry[current].parent) {
+		const struct encrypt_index_entry_s *entry = &index->entry[current];
+		if (found && found->order <= entry->order) continue;
+		if (strncmp(entry->pattern, path, entry->literal) != 0) continue;
+		if (fnmatch(entry->pattern, path, FNM_PATHNAME | FNM_LEADING_DIR) == 0) found = entry;
+	}
+
+	return found ? found->rule : NULL;
+}
+
+static struct encrypt_index_s *index_build(void)
+{
+	size_t rules = 0;
+	for (struct encrypt_s *encrypt = config.encrypt; encrypt; encrypt = encrypt->next) rules++;
+
+	struct encrypt_index_s *index = malloc(sizeof(struct encrypt_index_s) + 3 * rules * sizeof(struct encrypt_index_entry_s));
+	assert(index);
+	index->root = config.root[0].string ? strdup(config.root[0].string) : NULL;
+	index->count = 0;
+
+	size_t order = 0;
+	for (struct encrypt_s *encrypt = config.encrypt; encrypt; encrypt = encrypt->next, order++) {
+		const struct string_s paths[3] = { encrypt->path, encrypt->prefixed_path, encrypt->suffixed_path };
+		for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+			struct encrypt_index_entry_s *entry = &index->entry[index->count++];
+			if (paths[i].string[0] != '/' && config.root[0].string) {
+				size_t size = config.root[0].length + sizeof("/") + paths[i].length;
+				entry->pattern = malloc(size);
+				assert(entry->pattern);
+				snprintf(entry->pattern, size, "%s/%s", config.root[0].string, paths[i].string);
+			} else if (paths[i].string[0] == '/' && paths[i].length == 1) {
+				// special case for just "/": FNM_LEADING_DIR will not work otherwise
+				entry->pattern = strdup("");
+			} else {
+				// do not prepend root when an absolute path is given
+				entry->pattern = strdup(paths[i].string);
+			}
+			assert(entry->pattern);
+			entry->literal = strcspn(entry->pattern, "*?[\\");
+			entry->order = order;
+			entry->rule = encrypt;
+		}
+	}
+
+	qsort(index->entry, index->count, sizeof(struct encrypt_index_entry_s), index_compare);
+
+	// in sorted order, the entries whose literal part is a prefix of the current one form a stack
+	size_t *stack = malloc((index->count + 1) * sizeof(size_t));
+	assert(stack);
+	size_t depth = 0;
+	for (size_t i = 0; i < index->count; i++) {
+		struct encrypt_index_entry_s *entry = &index->entry[i];
+		while (depth > 0) {
+			const struct encrypt_index_entry_s *top = &index->entry[stack[depth - 1]];
+			if (top->literal <= entry->literal && strncmp(top->pattern, entry->pattern, top->literal) == 0) break;
+			depth--;
+		}
+		entry->parent = depth > 0 ? stack[depth - 1] : SIZE_MAX;
+		stack[depth++] = i;
+	}
+	free(stack);
+
+	return index;
+}
+
+static void index_free(struct encrypt_index_s *index)
+{
+	if (!index) return;
+	for (size_t i = 0; i < index->count; i++) free(index->entry[i].pattern);
+	free(index->root);
+	free(index);
+}
+
+/* order by literal part, then by specificity */
+static int index_compare(const void *a, const void *b)
+{
+	const struct encrypt_index_entry_s *entry_a = a, *entry_b = b;
+	size_t common = entry_a->literal < entry_b->literal ? entry_a->literal : entry_b->literal;
+	int result = memcmp(entry_a->pattern, entry_b->pattern, common);
+	if (result == 0) result = (entry_a->literal > entry_b->literal) - (entry_a->literal < entry_b->literal);
+	if (result == 0) result = (entry_a->order > entry_b->order) - (entry_a->order < entry_b->order);
+	return result;
+}
+
+
+/* MARK: - Compress Rules */
+
+const struct compress_s *config_compress_rule(const char *path)
+{
+	// compress rules are few, so they are matched in order of specificity without an index
+	for (const struct compress_s *compress = config.compress; compress; compress = compress->next) {
+		const struct string_s paths[3] = { compress->path, compress->prefixed_path, compress->suffixed_path };
+		for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+			const char *pattern;
+			if (paths[i].string[0] != '/' && config.root[0].string) {
+				size_t size = config.root[0].length + sizeof("/") + paths[i].length;
+				buffer_alloc(&config.scratchpad, size);
+				snprintf(config.scratchpad.buffer, config.scratchpad.size, "%s/%s", config.root[0].string, paths[i].string);
+				pattern = config.scratchpad.buffer;
+			} else if (paths[i].string[0] == '/' && paths[i].length == 1) {
+				// special case for just "/": FNM_LEADING_DIR will not work otherwise
+				pattern = "";
+			} else {
+				// do not prepend root when an absolute path is given
+				pattern = paths[i].string;
+			}
+			if (fnmatch(pattern, path, FNM_PATHNAME | FNM_LEADING_DIR) == 0) return compress;
+		}
+	}
+	return NULL;
+}
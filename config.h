@@ -1,11 +1,20 @@
 /* intercept layer that parses config files as they are read by Unison */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <limits.h>
 #include <pthread.h>
 #include <sys/types.h>
 
+struct iovec;
+
+// Unison’s archive and fingerprint cache files, which no layer transforms
+#define INTERNAL_PATTERN "??[0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f]*"
+#define INTERNAL_PATTERN1 "*/.unison/" INTERNAL_PATTERN
+#define INTERNAL_PATTERN2 "*/Library/Application Support/Unison/" INTERNAL_PATTERN
+
 struct string_s {
 	char *string;
 	size_t length;
@@ -13,6 +22,7 @@ struct string_s {
 
 extern struct config_s {
 	pthread_mutex_t lock;
+	char *directory;
 	char *search_path;
 	struct string_s root[2];
 	char *pre_command;
@@ -31,10 +41,36 @@ extern struct config_s {
 		struct string_s path;
 		struct string_s prefixed_path;
 		struct string_s suffixed_path;
+		enum encrypt_format {
+			ENCRYPT_STREAM,     // aes-256-gcm: one GCM stream with a final tag
+			ENCRYPT_SEGMENTED,  // aes-256-gcm-v2: segments with a tag each
+			ENCRYPT_CHUNKED     // aes-256-gcm-cdc: content-defined chunks, encrypted deterministically
+		} format;
 		_Static_assert(256 / CHAR_BIT == 32, "AES-256 key must be 32 bytes");
 		unsigned char key[256 / CHAR_BIT];
 		struct encrypt_s *next;
 	} *encrypt;
+	struct encrypt_index_s *encrypt_index;  // rules compiled for lookup, built on demand
+	struct compress_s {
+		struct string_s path;
+		struct string_s prefixed_path;
+		struct string_s suffixed_path;
+		enum compress_method {
+			COMPRESS_ZLIB  // zlib: deflate at the default level
+		} method;
+		struct compress_s *next;
+	} *compress;
+	struct pressure_s {
+		// stall thresholds in hundredths of a percent, 0 when not throttling
+		_Atomic uint32_t io;
+		_Atomic uint32_t memory;
+	} pressure;
+	struct iolimit_s {
+		// bytes per second, 0 when unlimited
+		_Atomic uint64_t read;
+		_Atomic uint64_t write;
+	} iolimit;
+	_Atomic uint32_t generation;            // bumped whenever parsed entries change
 	struct buffer_s {
 		char *buffer;
 		size_t size;
@@ -53,7 +89,20 @@ static inline void buffer_alloc(struct buffer_s * restrict buffer, size_t size)
 
 
 [[nodiscard]] int config_open(const char *path, int flags, ...);
+[[nodiscard]] int config_openat(int dirfd, const char *path, int flags, ...);
 [[nodiscard]] int config_close(int fd);
 [[nodiscard]] ssize_t config_read(int fd, void *buf, size_t bytes);
+[[nodiscard]] ssize_t config_pread(int fd, void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t config_readv(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t config_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+#ifndef __APPLE__
+[[nodiscard]] ssize_t config_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+[[nodiscard]] ssize_t config_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+#endif
 
 void config_reset(void);
+
+/* most specific encrypt rule matching the path, the caller holds the config lock */
+[[nodiscard]] const struct encrypt_s *config_encrypt_rule(const char *path);
+/* most specific compress rule matching the path, the caller holds the config lock */
+[[nodiscard]] const struct compress_s *config_compress_rule(const char *path);
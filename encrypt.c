@@ -2,21 +2,34 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
 #include <fnmatch.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <limits.h>
 #include <assert.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
 
 #ifdef __APPLE__
 #include <sys/attr.h>
+#else
+#include <sys/sendfile.h>
 #endif
 
 #include "config.h"
+#include "fdmap.h"
+#include "ivcache.h"
+#include "gcm.h"
+#include "workers.h"
+#include "iobuf.h"
 #include "encrypt.h"
 
 #pragma clang diagnostic push
@@ -28,16 +41,38 @@
 
 // never encrypt Unison’s internal files
 static bool sync_started = false;
-#define INTERNAL_PATTERN "??[0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f]*"
-#define INTERNAL_PATTERN1 "*/.unison/" INTERNAL_PATTERN
-#define INTERNAL_PATTERN2 "*/Library/Application Support/Unison/" INTERNAL_PATTERN
+
+// verdicts of recent rule lookups, each path maps to one slot
+#define VERDICT_SLOTS 1024
+#define VERDICT_PATH 216  // longer paths are looked up every time
+
+static struct verdict_s {
+	_Atomic uint32_t sequence;  // odd while the slot is being replaced
+	uint32_t generation;        // of the configuration the verdict was derived from
+	bool found;
+	enum encrypt_format format;
+	unsigned char key[256 / CHAR_BIT];
+	char path[VERDICT_PATH];
+} verdict[VERDICT_SLOTS];
+
+// keyed crypto contexts of closed files, reused by later files with the same key
+#define CONTEXT_POOL 32
+
+static struct {
+	pthread_mutex_t lock;
+	size_t next;  // slot replaced when all are taken
+	struct {
+		unsigned char key[256 / CHAR_BIT];
+		struct gcm_s *gcm;
+	} slot[CONTEXT_POOL];
+} context_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 // we add this to the beginning of files
 struct file_header_s {
 	unsigned char iv[256 / CHAR_BIT];
 	_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
 	               "storing a size_t in the encrypted file format assumes little endian processors");
-	size_t trailer_start;
+	size_t trailer_start;  // zero in the segmented format, whose header continues below
 };
 
 // we add this to the end of files
@@ -45,22 +80,179 @@ struct file_trailer_s {
 	unsigned char auth_tag[128 / CHAR_BIT];
 };
 
-static pthread_mutex_t filemap_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct filemap_s {
-	int fd;
-	enum { READ, READ_AUTHENTICATED, WRITE, WRITE_AUTHENTICATED } state;
+// the segmented format splits the content into segments, each followed by its tag
+struct segment_header_s {
+	uint32_t version;
+	uint32_t segment_size;    // content bytes per segment, the last segment may be shorter
+	uint64_t content_length;
+};
+
+// each segment is encrypted under its own nonce, the last one is marked to detect truncation
+struct segment_nonce_s {
+	unsigned char iv[256 / CHAR_BIT];
+	uint64_t index;
+	uint64_t last;
+};
+
+#define SEGMENT_VERSION 2
+#define SEGMENT_SIZE (64 * 1024)
+#define SEGMENT_SIZE_MAX (16 * 1024 * 1024)
+#define SEGMENT_HEADER (sizeof(struct file_header_s) + sizeof(struct segment_header_s))
+#define SEGMENT_TAG (128 / CHAR_BIT)
+
+// the chunked format cuts the content where a rolling hash matches, so edits only change nearby chunks
+struct chunk_header_s {
+	unsigned char iv[128 / CHAR_BIT];  // HMAC of the chunk content, identical chunks encrypt identically
+	uint64_t length;
+};
+
+// where the chunks of a file being read start, found before the first byte is emitted
+struct chunk_entry_s {
+	uint64_t start;
+	unsigned char iv[128 / CHAR_BIT];
+};
+
+#define CHUNK_VERSION 3
+#define CHUNK_MIN (16 * 1024)   // announced as segment size, bounds the number of chunks
+#define CHUNK_MAX (256 * 1024)
+#define CHUNK_BITS 16           // a boundary is found 64 KiB beyond the minimum on average
+#define CHUNK_OVERHEAD (sizeof(struct chunk_header_s) + SEGMENT_TAG)
+
+struct filemap_s {
+	struct fdmap_reference_s reference;  // held by the fd table and calls in progress
+	pthread_mutex_t lock;  // serializes operations on this file only
+	enum { UNDECIDED, READ, READ_AUTHENTICATED, WRITE, WRITE_AUTHENTICATED, FAILED } state;
+	enum encrypt_format format;  // emitted when reading, announced by the header when writing
 	size_t position;
 	unsigned char key[256 / CHAR_BIT];
-	mbedtls_gcm_context gcm;
+	struct gcm_s *gcm;             // keyed context, from the pool
 	struct file_header_s header;
-	struct buffer_s content_buffer;
+	struct segment_header_s segment_header;
+	size_t segments;                 // in the segmented format, zero until the header is known
+	size_t segment_current;          // index plus one of the segment held in the segment buffer
+	size_t segment_filled;           // bytes of the current segment received by the writer
+	size_t segments_authenticated;
+	struct buffer_s segment;         // one segment with its tag
+	struct buffer_s authenticated;   // bitmap of segments written and authenticated
+	struct buffer_s vector;
+	size_t chunks;                   // in the chunked format, of the file read or received so far
+	size_t chunk_limit;              // chunks the encrypted size has room for, unused room is zero padding
+	size_t chunk_offset;             // content offset of the next chunk received by the writer
+	size_t chunks_sealed;            // leading chunks added to the trailer
+	struct buffer_s chunk_table;     // of a file being read
+	mbedtls_md_context_t seal;       // HMAC over the header and all chunk headers and tags, forms the trailer
+	bool sealed;
+	const unsigned char *mapping;  // content of a regular file being read, MAP_FAILED after a fault
+	size_t mapping_size;
+	size_t mapping_dropped;        // leading bytes of the mapping already released
+	struct pipeline_s *pipeline;   // encrypts ahead of the reader on worker threads
+	unsigned char *write_back;     // decrypted content not yet written to the file
+	size_t write_back_size;        // smaller than WRITE_BACK when memory is tight
+	size_t write_back_filled;
+	size_t write_back_start;       // content offset of the first buffered byte
+	bool write_back_positional;
 	struct file_trailer_s trailer;
-	struct filemap_s *next;
-} *filemap = NULL;
+};
 
-static bool encrypt_search_key(const char *path, unsigned char key_out[256 / CHAR_BIT]);
-static struct filemap_s *file_from_fd(int fd);
+// smaller files are read through the file descriptor, mapping them costs more than it saves
+#define MAPPING_THRESHOLD (256 * 1024)
+
+// release mapped pages behind the reader in steps of this size
+#define DROP_BEHIND (1024 * 1024)
+
+// decrypted content is gathered into writes of this size
+#define WRITE_BACK IOBUF_MAX
+
+// large mapped files are encrypted ahead of the reader in chunks, on several threads
+#define PIPELINE_THRESHOLD (32 * 1024 * 1024)
+#define PIPELINE_CHUNK IOBUF_MAX
+#define PIPELINE_DEPTH 2  // chunks in flight per worker thread
+
+struct pipeline_s {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pid_t owner;              // workers do not survive fork()
+	struct filemap_s *file;
+	size_t chunks;            // whole chunks in the mapping, the tail is encrypted by the reader
+	size_t joined;            // chunks added to the authentication tag
+	size_t pending;           // jobs submitted and not yet finished
+	bool cancelled;
+	size_t slots;
+	struct pipeline_slot_s {
+		struct pipeline_s *pipeline;
+		size_t index;         // chunk held by this slot
+		enum { BUSY, READY, FAULT } state;
+		unsigned char hash[16];
+		unsigned char *buffer;
+	} slot[];
+};
+
+// a mapped file that shrinks under the reader raises SIGBUS, which is caught while a mapping is accessed
+static _Thread_local sigjmp_buf *mapping_guard = NULL;
+static struct sigaction mapping_previous;
+static pthread_once_t mapping_once = PTHREAD_ONCE_INIT;
+
+static bool encrypt_search_key(const char *path, unsigned char key_out[256 / CHAR_BIT], enum encrypt_format *format_out);
+static struct verdict_s *verdict_slot(const char *path, size_t length);
+static off_t encrypted_size(enum encrypt_format format, off_t length);
+static void file_attach(int fd, const char *path, int flags);
+static void file_release(void *state);
+static bool file_direction(struct filemap_s *file, bool writing);
+static bool file_incomplete(const struct filemap_s *file);
+static ssize_t file_readv(struct filemap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+static ssize_t file_writev(struct filemap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+static off_t file_seek(struct filemap_s *file, int fd, off_t offset, int whence);
+static bool file_iv(struct filemap_s *file, int fd, const struct stat *buf);
+static ssize_t stream_read(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, bool positional);
+static ssize_t stream_write(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, bool positional);
+static ssize_t segment_read(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, size_t position);
+static ssize_t segment_write(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, size_t position);
+static bool segment_start(struct filemap_s *file);
+static size_t segment_count(uint64_t length, size_t segment_size);
+static size_t segment_length(const struct filemap_s *file, size_t index);
+static void segment_nonce(const struct filemap_s *file, size_t index, struct segment_nonce_s *nonce_out);
+static bool segment_encrypt(struct filemap_s *file, int fd, size_t index);
+static int segment_decrypt(struct filemap_s *file, int fd, size_t index);
+static bool content_encrypt(struct filemap_s *file, int fd, size_t start, size_t length, unsigned char *buffer);
+static ssize_t chunk_read(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, size_t position);
+static ssize_t chunk_write(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt);
+static bool chunk_layout(struct filemap_s *file, int fd, const struct stat *buf);
+static bool chunk_scan(struct filemap_s *file, int fd, size_t length, const uint64_t gear[256], mbedtls_md_context_t *digest, unsigned char *window);
+static size_t chunk_boundary(const unsigned char *data, size_t available, const uint64_t gear[256]);
+static void chunk_gear(const unsigned char key[256 / CHAR_BIT], uint64_t gear_out[256]);
+static bool chunk_start(struct filemap_s *file);
+static size_t chunk_capacity(uint64_t length, size_t minimum);
+static size_t chunk_find(const struct filemap_s *file, size_t position);
+static size_t chunk_length(const struct filemap_s *file, size_t index);
+static bool chunk_encrypt(struct filemap_s *file, int fd, size_t index);
+static int chunk_decrypt(struct filemap_s *file, int fd);
+static void chunk_seal_start(struct filemap_s *file);
+static void chunk_seal(struct filemap_s *file, const struct chunk_header_s *header, const unsigned char tag[SEGMENT_TAG]);
+static void chunk_seal_finish(struct filemap_s *file, unsigned char tag_out[SEGMENT_TAG]);
+static size_t iov_length(const struct iovec *iov, int iovcnt);
+static void iov_put(struct iovec **iov, int *iovcnt, const void *source, size_t bytes);
+static void iov_get(struct iovec **iov, int *iovcnt, void *target, size_t bytes);
+static size_t iov_crypt(struct gcm_s *gcm, struct iovec **iov, int *iovcnt, size_t bytes, unsigned char *target);
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t bytes);
+static ssize_t iov_read(int fd, struct iovec *iov, int iovcnt, size_t bytes, off_t offset);
+static bool write_back_flush(struct filemap_s *file, int fd);
 static ssize_t generate_iv_from_hmac(int fd, size_t length, unsigned char key[256 / CHAR_BIT], unsigned char iv_out[256 / CHAR_BIT]);
+static struct gcm_s *context_get(const unsigned char key[256 / CHAR_BIT]);
+static void context_put(struct gcm_s *gcm, const unsigned char key[256 / CHAR_BIT]);
+static void mapping_setup(struct filemap_s *file, int fd, const struct stat *buf);
+static bool mapping_hmac(struct filemap_s *file, unsigned char iv_out[256 / CHAR_BIT]);
+static bool mapping_crypt(struct filemap_s *file, struct iovec **iov, int *iovcnt, size_t bytes);
+static void mapping_drop(struct filemap_s *file, size_t end);
+static void mapping_release(struct filemap_s *file);
+static void mapping_enter(sigjmp_buf *guard);
+static void mapping_leave(void);
+static void mapping_install(void);
+static void mapping_fault(int signal, siginfo_t *info, void *context);
+static void pipeline_start(struct filemap_s *file);
+static void pipeline_submit(struct pipeline_s *pipeline, struct pipeline_slot_s *slot, size_t index);
+static void pipeline_work(void *argument);
+static struct pipeline_slot_s *pipeline_wait(struct pipeline_s *pipeline, size_t index);
+static void pipeline_stop(struct filemap_s *file);
 
 
 static void __attribute__((constructor)) initialize(void)
@@ -85,36 +277,29 @@ int encrypt_open(const char *path, int flags, ...)
 		result = open(path, flags);
 	}
 
-	unsigned char key[256 / CHAR_BIT];
-	if (encrypt_search_key(path, key)) {
-		pthread_mutex_lock(&filemap_lock);
+	file_attach(result, path, flags);
 
-		struct filemap_s *file = malloc(sizeof(struct filemap_s));
-		assert(file);
-		switch (flags & (O_RDONLY | O_WRONLY | O_RDWR)) {
-		case O_RDONLY:
-			file->state = READ;
-			break;
-		case O_WRONLY:
-			file->state = WRITE;
-			break;
-		default:
-			abort();
-		}
-		file->fd = result;
-		file->position = 0;
+	va_end(arg);
+	return result;
+}
 
-		memcpy(file->key, key, sizeof(key));
-		mbedtls_gcm_init(&file->gcm);
-		int gcm_result = mbedtls_gcm_setkey(&file->gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
-		assert(gcm_result == 0);
+int encrypt_openat(int dirfd, const char *path, int flags, ...)
+{
+	int result;
+	va_list arg;
+	va_start(arg, flags);
 
-		file->content_buffer.size = 0;
-		file->content_buffer.buffer = NULL;
-		file->next = filemap;
-		filemap = file;
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		result = openat(dirfd, path, flags, mode);
+	} else {
+		result = openat(dirfd, path, flags);
+	}
 
-		pthread_mutex_unlock(&filemap_lock);
+	if (result >= 0) {
+		char *resolved = fdmap_path(dirfd, path, 0);
+		file_attach(result, resolved ? resolved : path, flags);
+		free(resolved);
 	}
 
 	va_end(arg);
@@ -123,23 +308,19 @@ int encrypt_open(const char *path, int flags, ...)
 
 int encrypt_close(int fd)
 {
-	pthread_mutex_lock(&filemap_lock);
-	struct filemap_s *file, **prev = &filemap;
-	for (file = filemap; file; file = file->next) {
-		if (file->fd == fd) break;
-		prev = &file->next;
-	}
-	if (file) *prev = file->next;
-	pthread_mutex_unlock(&filemap_lock);
+	struct filemap_s *file = fdmap_set(fd, FDMAP_ENCRYPT, NULL);
 
 	if (file) {
-		if (file->position == 0 || file->state == READ_AUTHENTICATED || file->state == WRITE_AUTHENTICATED) {
-			mbedtls_gcm_free(&file->gcm);
-			free(file->content_buffer.buffer);
-			free(file);
+		// wait for concurrent operations on the file to finish
+		pthread_mutex_lock(&file->lock);
+		pthread_mutex_unlock(&file->lock);
+
+		if (!file_incomplete(file)) {
+			file_release(file);
 		} else {
 			// authentication failure, file was manipulated or not read completely
 			if (file->state == WRITE) (void)ftruncate(fd, 0);
+			file_release(file);
 			close(fd);
 			errno = EIO;
 			return -1;
@@ -151,240 +332,152 @@ int encrypt_close(int fd)
 
 ssize_t encrypt_read(int fd, void *buf, size_t bytes)
 {
-	ssize_t result = 0;
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return read(fd, buf, bytes);
 
-	pthread_mutex_lock(&filemap_lock);
-	struct filemap_s *file = file_from_fd(fd);
-
-	if (file) {
-		assert(file->state == READ || file->state == READ_AUTHENTICATED);
-		unsigned char *target = buf;
-
-		if (bytes > 0 && file->position == 0) {
-			// initialize the file header
-			struct stat stat_buf;
-			int stat_result = fstat(file->fd, &stat_buf);
-			assert(stat_result == 0);
-			size_t file_length = (size_t)stat_buf.st_size;
-			ssize_t iv_result = generate_iv_from_hmac(fd, file_length, file->key, file->header.iv);
-			assert(iv_result == 0);
-			file->header.trailer_start = sizeof(struct file_header_s) + file_length;
-		}
-
-		if (bytes > 0 && file->position < sizeof(struct file_header_s)) {
-			// first emit the header to the caller
-			size_t to_emit = sizeof(struct file_header_s) - file->position;
-			if (to_emit > bytes) to_emit = bytes;
-			const char *source = (const char *)&file->header + file->position;
-			memcpy(target, source, to_emit);
-			target += to_emit;
-			result += to_emit;
-			bytes -= to_emit;
-			file->position += to_emit;
-		}
+	const struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	ssize_t result = file_readv(file, fd, &iov, 1, -1);
+	file_release(file);
+	return result;
+}
 
-		if (bytes > 0 && file->position == sizeof(struct file_header_s)) {
-			// start the crypto context
-			int gcm_result = mbedtls_gcm_starts(&file->gcm, MBEDTLS_GCM_ENCRYPT, file->header.iv, sizeof(file->header.iv));
-			assert(gcm_result == 0);
-		}
-
-		if (bytes > 0 && file->position < file->header.trailer_start) {
-			// emit encrypted file content to the caller
-			size_t to_emit = file->header.trailer_start - file->position;
-			if (to_emit > bytes) to_emit = bytes;
-			buffer_alloc(&file->content_buffer, to_emit);
-
-			// read file data
-			size_t to_read = to_emit;
-			char *buffer = file->content_buffer.buffer;
-			while (to_read > 0) {
-				[[clang::suppress]]  // unix.BlockInCriticalSection
-				ssize_t read_result = read(fd, buffer, to_read);
-				if (read_result < 0 && errno == EINTR) continue;
-				if (read_result < 0) return read_result;
-				if (read_result == 0) break;
-				buffer += read_result;
-				to_read -= (size_t)read_result;
-			}
-			to_emit -= to_read;
+ssize_t encrypt_write(int fd, const void *buf, size_t bytes)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return write(fd, buf, bytes);
 
-			// perform encryption
-			const unsigned char *source = (const unsigned char *)file->content_buffer.buffer;
-			size_t gcm_size;
-			int gcm_result = mbedtls_gcm_update(&file->gcm, source, to_emit, target, bytes, &gcm_size);
-			assert(gcm_result == 0);
+	const struct iovec iov = { .iov_base = (void *)(uintptr_t)buf, .iov_len = bytes };
+	ssize_t result = file_writev(file, fd, &iov, 1, -1);
+	file_release(file);
+	return result;
+}
 
-			target += gcm_size;
-			result += gcm_size;
-			bytes -= gcm_size;
-			file->position += to_emit;
-		}
+ssize_t encrypt_pread(int fd, void *buf, size_t bytes, off_t offset)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return pread(fd, buf, bytes, offset);
 
-		if (bytes > 0 && file->position == file->header.trailer_start) {
-			// generate authentication tag
-			size_t gcm_size;
-			int gcm_result = mbedtls_gcm_finish(&file->gcm, target, bytes, &gcm_size, file->trailer.auth_tag, sizeof(file->trailer.auth_tag));
-			assert(gcm_result == 0);
-			target += gcm_size;
-			result += gcm_size;
-			bytes -= gcm_size;
-		}
-
-		if (bytes > 0 && file->position >= file->header.trailer_start &&
-		    file->position < file->header.trailer_start + sizeof(struct file_trailer_s)) {
-			// lastly emit the file trailer to the caller
-			size_t to_emit = sizeof(struct file_trailer_s);
-			to_emit -= file->position - file->header.trailer_start;
-			if (to_emit > bytes) to_emit = bytes;
-			const char *source = (const char *)&file->trailer;
-			source += file->position - file->header.trailer_start;
-			memcpy(target, source, to_emit);
-			result += to_emit;
-			file->position += to_emit;
-		}
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	const struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	ssize_t result = file_readv(file, fd, &iov, 1, offset);
+	file_release(file);
+	return result;
+}
 
-		if (file->position == file->header.trailer_start + sizeof(struct file_trailer_s)) {
-			// complete file emitted to the caller
-			file->state = READ_AUTHENTICATED;
-		}
+ssize_t encrypt_pwrite(int fd, const void *buf, size_t bytes, off_t offset)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return pwrite(fd, buf, bytes, offset);
 
-	} else {
-		[[clang::suppress]]  // unix.BlockInCriticalSection
-		result = read(fd, buf, bytes);
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
 	}
+	const struct iovec iov = { .iov_base = (void *)(uintptr_t)buf, .iov_len = bytes };
+	ssize_t result = file_writev(file, fd, &iov, 1, offset);
+	file_release(file);
+	return result;
+}
+
+ssize_t encrypt_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return readv(fd, iov, iovcnt);
 
-	pthread_mutex_unlock(&filemap_lock);
+	ssize_t result = file_readv(file, fd, iov, iovcnt, -1);
+	file_release(file);
 	return result;
 }
 
-ssize_t encrypt_write(int fd, const void *buf, size_t bytes)
+ssize_t encrypt_writev(int fd, const struct iovec *iov, int iovcnt)
 {
-	ssize_t result = 0;
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return writev(fd, iov, iovcnt);
 
-	pthread_mutex_lock(&filemap_lock);
-	struct filemap_s *file = file_from_fd(fd);
+	ssize_t result = file_writev(file, fd, iov, iovcnt, -1);
+	file_release(file);
+	return result;
+}
 
-	if (file) {
-		assert(file->state == WRITE);
-		const unsigned char *source = buf;
+ssize_t encrypt_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return preadv(fd, iov, iovcnt, offset);
 
-		if (bytes > 0 && file->position < sizeof(struct file_header_s)) {
-			// first consume the header from the caller
-			size_t to_consume = sizeof(struct file_header_s) - file->position;
-			if (to_consume > bytes) to_consume = bytes;
-			char *target = (char *)&file->header + file->position;
-			memcpy(target, source, to_consume);
-			source += to_consume;
-			result += to_consume;
-			bytes -= to_consume;
-			file->position += to_consume;
-		}
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t result = file_readv(file, fd, iov, iovcnt, offset);
+	file_release(file);
+	return result;
+}
 
-		if (bytes > 0 && file->position == sizeof(struct file_header_s)) {
-			// start the crypto context
-			int gcm_result = mbedtls_gcm_starts(&file->gcm, MBEDTLS_GCM_DECRYPT, file->header.iv, sizeof(file->header.iv));
-			assert(gcm_result == 0);
-		}
+ssize_t encrypt_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return pwritev(fd, iov, iovcnt, offset);
 
-		if (bytes > 0 && file->position < file->header.trailer_start) {
-			// consume and decrypt file content from the caller
-			size_t to_consume = file->header.trailer_start - file->position;
-			if (to_consume > bytes) to_consume = bytes;
-			size_t enlarged = to_consume + 15;  // mbedtls needs a rounded-up output buffer
-			buffer_alloc(&file->content_buffer, enlarged);
-
-			// perform decryption
-			unsigned char *target = (unsigned char *)file->content_buffer.buffer;
-			size_t gcm_size;
-			int gcm_result = mbedtls_gcm_update(&file->gcm, source, to_consume, target, enlarged, &gcm_size);
-			assert(gcm_result == 0);
-
-			// write file data
-			size_t to_write = gcm_size;
-			const char *buffer = file->content_buffer.buffer;
-			while (to_write > 0) {
-				ssize_t write_result = write(fd, buffer, to_write);
-				if (write_result < 0 && errno == EINTR) continue;
-				if (write_result < 0) return write_result;
-				buffer += write_result;
-				to_write -= (size_t)write_result;
-			}
+	if (offset < 0) {
+		file_release(file);
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t result = file_writev(file, fd, iov, iovcnt, offset);
+	file_release(file);
+	return result;
+}
 
-			source += to_consume;
-			result += to_consume;
-			bytes -= to_consume;
-			file->position += to_consume;
-		}
+off_t encrypt_lseek(int fd, off_t offset, int whence)
+{
+	struct filemap_s *file = fdmap_acquire(fd, FDMAP_ENCRYPT);
+	if (!file) return lseek(fd, offset, whence);
 
-		if (bytes > 0 && file->position >= file->header.trailer_start &&
-		    file->position < file->header.trailer_start + sizeof(struct file_trailer_s)) {
-			// lastly consume the file trailer from the caller
-			size_t to_consume = sizeof(struct file_trailer_s);
-			to_consume -= file->position - file->header.trailer_start;
-			if (to_consume > bytes) to_consume = bytes;
-			char *target = (char *)&file->trailer;
-			target += file->position - file->header.trailer_start;
-			memcpy(target, source, to_consume);
-			result += to_consume;
-			bytes -= to_consume;
-			file->position += to_consume;
-		}
+	pthread_mutex_lock(&file->lock);
+	off_t result = file_seek(file, fd, offset, whence);
+	pthread_mutex_unlock(&file->lock);
+	file_release(file);
+	return result;
+}
 
-		if (file->position == file->header.trailer_start + sizeof(struct file_trailer_s)) {
-			// verify authentication tag
-			buffer_alloc(&file->content_buffer, 15);
-			unsigned char *target = (unsigned char *)file->content_buffer.buffer;
-			unsigned char generated[128 / CHAR_BIT];
-			size_t gcm_size;
-			int gcm_result = mbedtls_gcm_finish(&file->gcm, target, bytes, &gcm_size, generated, sizeof(generated));
-			assert(gcm_result == 0);
-
-			if (gcm_size > 0) {
-				// write file data
-				size_t to_write = gcm_size;
-				const char *buffer = file->content_buffer.buffer;
-				while (to_write > 0) {
-					ssize_t write_result = write(fd, buffer, to_write);
-					if (write_result < 0 && errno == EINTR) continue;
-					if (write_result < 0) return write_result;
-					buffer += write_result;
-					to_write -= (size_t)write_result;
-				}
-			}
+#ifndef __APPLE__
+static const struct fdmap_io_s copy_io = {
+	.read = encrypt_read, .pread = encrypt_pread, .write = encrypt_write, .pwrite = encrypt_pwrite
+};
 
-			int diff = memcmp(file->trailer.auth_tag, generated, sizeof(struct file_trailer_s));
-			if (diff == 0) {
-				file->state = WRITE_AUTHENTICATED;
-			} else {
-				// authentication failure, file was manipulated
-				(void)ftruncate(fd, 0);
-				errno = EIO;
-				result = -1;
-			}
-		}
+ssize_t encrypt_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+	if (!fdmap_get(fd_in, FDMAP_ENCRYPT) && !fdmap_get(fd_out, FDMAP_ENCRYPT))
+		return copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
 
-		if (bytes > 0) {
-			// caller tried to write unexpected extra file data
-			errno = EIO;
-			result = -1;
-		}
+	// the kernel cannot copy content we transform
+	return fdmap_copy(&copy_io, fd_in, off_in, fd_out, off_out, len, flags);
+}
 
-	} else {
-		result = write(fd, buf, bytes);
-	}
+ssize_t encrypt_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	if (!fdmap_get(in_fd, FDMAP_ENCRYPT) && !fdmap_get(out_fd, FDMAP_ENCRYPT))
+		return sendfile(out_fd, in_fd, offset, count);
 
-	pthread_mutex_unlock(&filemap_lock);
-	return result;
+	// the kernel cannot copy content we transform
+	return fdmap_copy(&copy_io, in_fd, offset, out_fd, NULL, count, 0);
 }
+#endif
 
 int encrypt_stat(const char * restrict path, struct stat * restrict buf)
 {
 	int result = stat(path, buf);
 
-	if ((buf->st_mode & S_IFREG) && encrypt_search_key(path, NULL)) {
+	enum encrypt_format format;
+	if ((buf->st_mode & S_IFREG) && encrypt_search_key(path, NULL, &format)) {
 		// we will encrypt on read, so increase reported size by encryption header and trailer
-		buf->st_size += sizeof(struct file_header_s) + sizeof(struct file_trailer_s);
+		buf->st_size = encrypted_size(format, buf->st_size);
 	}
 
 	return result;
@@ -394,13 +487,66 @@ int encrypt_lstat(const char * restrict path, struct stat * restrict buf)
 {
 	int result = lstat(path, buf);
 
-	if ((buf->st_mode & S_IFREG) && encrypt_search_key(path, NULL)) {
+	enum encrypt_format format;
+	if ((buf->st_mode & S_IFREG) && encrypt_search_key(path, NULL, &format)) {
+		// we will encrypt on read, so increase reported size by encryption header and trailer
+		buf->st_size = encrypted_size(format, buf->st_size);
+	}
+
+	return result;
+}
+
+int encrypt_fstat(int fd, struct stat *buf)
+{
+	int result = fstat(fd, buf);
+
+	struct filemap_s *file = result == 0 && S_ISREG(buf->st_mode) ? fdmap_acquire(fd, FDMAP_ENCRYPT) : NULL;
+	if (file) {
 		// we will encrypt on read, so increase reported size by encryption header and trailer
-		buf->st_size += sizeof(struct file_header_s) + sizeof(struct file_trailer_s);
+		pthread_mutex_lock(&file->lock);
+		buf->st_size = encrypted_size(file->format, buf->st_size);
+		pthread_mutex_unlock(&file->lock);
+		file_release(file);
+	}
+
+	return result;
+}
+
+int encrypt_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags)
+{
+	int result = fstatat(dirfd, path, buf, flags);
+
+	if (result == 0 && (buf->st_mode & S_IFREG)) {
+		char *resolved = fdmap_path(dirfd, path, flags);
+		enum encrypt_format format;
+		if (encrypt_search_key(resolved ? resolved : path, NULL, &format)) {
+			// we will encrypt on read, so increase reported size by encryption header and trailer
+			buf->st_size = encrypted_size(format, buf->st_size);
+		}
+		free(resolved);
+	}
+
+	return result;
+}
+
+#ifndef __APPLE__
+int encrypt_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf)
+{
+	int result = statx(dirfd, path, flags, mask, buf);
+
+	if (result == 0 && (buf->stx_mask & STATX_TYPE) && (buf->stx_mask & STATX_SIZE) && S_ISREG(buf->stx_mode)) {
+		char *resolved = fdmap_path(dirfd, path, flags);
+		enum encrypt_format format;
+		if (encrypt_search_key(resolved ? resolved : path, NULL, &format)) {
+			// we will encrypt on read, so increase reported size by encryption header and trailer
+			buf->stx_size = (uint64_t)encrypted_size(format, (off_t)buf->stx_size);
+		}
+		free(resolved);
 	}
 
 	return result;
 }
+#endif
 
 #ifdef __APPLE__
 int encrypt_getattrlist(const char *path, void *attrs, void *buf, size_t buf_size, unsigned int options)
@@ -414,7 +560,8 @@ int encrypt_getattrlist(const char *path, void *attrs, void *buf, size_t buf_siz
 	assert(attr_list->fileattr == 0 || attr_list->fileattr == ATTR_FILE_RSRCLENGTH);
 	assert(attr_list->forkattr == 0);
 
-	if (attr_list->fileattr == ATTR_FILE_RSRCLENGTH && encrypt_search_key(path, NULL)) {
+	enum encrypt_format format;
+	if (attr_list->fileattr == ATTR_FILE_RSRCLENGTH && encrypt_search_key(path, NULL, &format)) {
 		struct attr_values {
 			uint32_t size;
 			uint8_t finder_info[32];
@@ -423,7 +570,7 @@ int encrypt_getattrlist(const char *path, void *attrs, void *buf, size_t buf_siz
 		assert(attr_values->size == sizeof(struct attr_values));
 		if (attr_values->rsrc_length > 0) {
 			// we will encrypt existing resource forks, so increase reported size
-			attr_values->rsrc_length += sizeof(struct file_header_s) + sizeof(struct file_trailer_s);
+			attr_values->rsrc_length = encrypted_size(format, attr_values->rsrc_length);
 		}
 	}
 
@@ -434,8 +581,31 @@ int encrypt_getattrlist(const char *path, void *attrs, void *buf, size_t buf_siz
 
 /* MARK: - Helper Functions */
 
-static bool encrypt_search_key(const char *path, unsigned char key_out[256 / CHAR_BIT])
+static bool encrypt_search_key(const char *path, unsigned char key_out[256 / CHAR_BIT], enum encrypt_format *format_out)
 {
+	const size_t length = strlen(path);
+	const uint32_t generation = atomic_load_explicit(&config.generation, memory_order_acquire);
+	struct verdict_s *slot = length < VERDICT_PATH ? verdict_slot(path, length) : NULL;
+
+	if (slot && sync_started) {
+		// only paths outside Unison’s internal files are remembered
+		const uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		if (!(sequence & 1) && slot->generation == generation) {
+			// copy first, then check that no writer interfered
+			const bool match = memcmp(slot->path, path, length + 1) == 0;
+			const bool found = slot->found;
+			const enum encrypt_format format = slot->format;
+			unsigned char key[256 / CHAR_BIT];
+			memcpy(key, slot->key, sizeof(key));
+			atomic_thread_fence(memory_order_acquire);
+			if (match && atomic_load_explicit(&slot->sequence, memory_order_relaxed) == sequence) {
+				if (found && key_out) memcpy(key_out, key, sizeof(key));
+				if (found && format_out) *format_out = format;
+				return found;
+			}
+		}
+	}
+
 	// never encrypt Unison’s internal files
 	if (fnmatch(INTERNAL_PATTERN1, path, 0) == 0 || fnmatch(INTERNAL_PATTERN2, path, 0) == 0) {
 		sync_started = true;
@@ -444,98 +614,1705 @@ static bool encrypt_search_key(const char *path, unsigned char key_out[256 / CHA
 	if (!sync_started) return false;
 
 	bool found = false;
+	enum encrypt_format format = ENCRYPT_STREAM;
+	unsigned char key[256 / CHAR_BIT] = { 0 };
 
 	pthread_mutex_lock(&config.lock);
-	for (struct encrypt_s *encrypt = config.encrypt; encrypt; encrypt = encrypt->next) {
-		const struct string_s paths[3] = { encrypt->path, encrypt->prefixed_path, encrypt->suffixed_path };
-		for (size_t index = 0; index < sizeof(paths) / sizeof(paths[0]); index++) {
-			if (paths[index].string[0] != '/' && config.root[0].string) {
-				size_t size = config.root[0].length + sizeof("/") + paths[index].length;
-				buffer_alloc(&config.scratchpad, size);
-				snprintf(config.scratchpad.buffer, config.scratchpad.size, "%s/%s", config.root[0].string, paths[index].string);
-			} else {
-				// do not prepend root when an absolute path is given
-				buffer_alloc(&config.scratchpad, paths[index].length + sizeof((char)'\0'));
-				snprintf(config.scratchpad.buffer, config.scratchpad.size, "%s", paths[index].string);
-				if (paths[index].string[0] == '/' && paths[index].length == 1) {
-					// special case for just "/": FNM_LEADING_DIR will not work otherwise
-					config.scratchpad.buffer[0] = '\0';
-				}
-			}
-			if (fnmatch(config.scratchpad.buffer, path, FNM_PATHNAME | FNM_LEADING_DIR) == 0) {
-				if (key_out) memcpy(key_out, encrypt->key, sizeof(encrypt->key));
-				found = true;
-				break;
-			}
-		}
-		if (found) break;
+	const struct encrypt_s *encrypt = config_encrypt_rule(path);
+	if (encrypt) {
+		found = true;
+		format = encrypt->format;
+		memcpy(key, encrypt->key, sizeof(key));
 	}
 	pthread_mutex_unlock(&config.lock);
 
+	if (slot) {
+		// remember the verdict, unless a concurrent writer owns the slot
+		uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+		if (!(sequence & 1) && atomic_compare_exchange_strong_explicit(&slot->sequence, &sequence, sequence + 1,
+		                                                               memory_order_acquire, memory_order_relaxed)) {
+			atomic_thread_fence(memory_order_release);
+			slot->generation = generation;
+			slot->found = found;
+			slot->format = format;
+			memcpy(slot->key, key, sizeof(key));
+			memcpy(slot->path, path, length + 1);
+			atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+		}
+	}
+
+	if (found && key_out) memcpy(key_out, key, sizeof(key));
+	if (found && format_out) *format_out = format;
 	return found;
 }
 
-static struct filemap_s *file_from_fd(int fd)
+static struct verdict_s *verdict_slot(const char *path, size_t length)
 {
-	struct filemap_s *file;
-	for (file = filemap; file; file = file->next) {
-		if (file->fd == fd) break;
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3;
+	return &verdict[hash % VERDICT_SLOTS];
+}
+
+/* size of the encrypted view of content with the given length */
+static off_t encrypted_size(enum encrypt_format format, off_t length)
+{
+	switch (format) {
+	case ENCRYPT_STREAM:
+		return length + (off_t)(sizeof(struct file_header_s) + sizeof(struct file_trailer_s));
+	case ENCRYPT_SEGMENTED:
+		return length + (off_t)(SEGMENT_HEADER + segment_count((uint64_t)length, SEGMENT_SIZE) * SEGMENT_TAG);
+	case ENCRYPT_CHUNKED:
+		// room for as many chunks as the content could be cut into, so the size does not depend on the content
+		return length + (off_t)(SEGMENT_HEADER + chunk_capacity((uint64_t)length, CHUNK_MIN) * CHUNK_OVERHEAD + sizeof(struct file_trailer_s));
 	}
-	return file;
+	abort();
 }
 
-static ssize_t generate_iv_from_hmac(int fd, size_t length, unsigned char key[256 / CHAR_BIT], unsigned char iv_out[256 / CHAR_BIT])
+static void file_attach(int fd, const char *path, int flags)
 {
-	mbedtls_md_context_t digest;
-	mbedtls_md_init(&digest);
+	unsigned char key[256 / CHAR_BIT];
+	enum encrypt_format format;
+	struct filemap_s *file = NULL;
+	if (fd >= 0 && encrypt_search_key(path, key, &format)) {
+		file = malloc(sizeof(struct filemap_s));
+		assert(file);
+		atomic_init(&file->reference.count, 1);
+		pthread_mutex_init(&file->lock, NULL);
+		file->state = UNDECIDED;
+		file->format = format;
+		file->position = 0;
+		// read-write descriptors take the direction of their first transfer
+		switch (flags & (O_RDONLY | O_WRONLY | O_RDWR)) {
+		case O_RDONLY:
+			file_direction(file, false);
+			break;
+		case O_WRONLY:
+			file_direction(file, true);
+			break;
+		}
 
-	// set up HMAC context
-	const mbedtls_md_info_t *info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-	assert(mbedtls_md_get_size(info) == 32);
-	int md_result = mbedtls_md_setup(&digest, info, 1);
-	assert(md_result == 0);
-	md_result = mbedtls_md_hmac_starts(&digest, key, 256 / CHAR_BIT);
-	assert(md_result == 0);
+		memcpy(file->key, key, sizeof(key));
+		file->gcm = context_get(key);
+
+		file->segments = 0;
+		file->segment_current = 0;
+		file->segment_filled = 0;
+		file->segments_authenticated = 0;
+		file->segment.size = 0;
+		file->segment.buffer = NULL;
+		file->authenticated.size = 0;
+		file->authenticated.buffer = NULL;
+		file->vector.size = 0;
+		file->vector.buffer = NULL;
+		file->chunks = 0;
+		file->chunk_limit = 0;
+		file->chunk_offset = 0;
+		file->chunks_sealed = 0;
+		file->chunk_table.size = 0;
+		file->chunk_table.buffer = NULL;
+		mbedtls_md_init(&file->seal);
+		file->sealed = false;
+		file->mapping = NULL;
+		file->mapping_size = 0;
+		file->mapping_dropped = 0;
+		file->pipeline = NULL;
+		file->write_back = NULL;
+		file->write_back_filled = 0;
+	}
+	// a reused file descriptor may carry stale state
+	if (fd >= 0) file_release(fdmap_set(fd, FDMAP_ENCRYPT, file));
+}
 
-	// read file and update HMAC
-	struct buffer_s buffer = { .buffer = NULL, .size = 0 };
-	buffer_alloc(&buffer, 1024 * 1024);
-	while (length > 0) {
-		[[clang::suppress]]  // unix.BlockInCriticalSection
-		ssize_t read_result = read(fd, buffer.buffer, length < buffer.size ? length : buffer.size);
-		if (read_result < 0 && errno == EINTR) continue;
-		if (read_result < 0) return read_result;
-		md_result = mbedtls_md_hmac_update(&digest, (unsigned char *)buffer.buffer, (size_t)read_result);
-		assert(md_result == 0);
-		length -= (size_t)read_result;
+static void file_release(void *state)
+{
+	struct filemap_s *file = state;
+	// calls still using the file free it when they finish, without disturbing their errno
+	if (!file || !fdmap_put(file)) return;
+	const int saved_errno = errno;
+	pthread_mutex_destroy(&file->lock);
+	// pending pipeline jobs still use the crypto context
+	mapping_release(file);
+	context_put(file->gcm, file->key);
+	free(file->segment.buffer);
+	free(file->authenticated.buffer);
+	free(file->vector.buffer);
+	free(file->chunk_table.buffer);
+	mbedtls_md_free(&file->seal);
+	iobuf_put(file->write_back, file->write_back_size);
+	free(file);
+	errno = saved_errno;
+}
+
+/* fix the direction of transfers, false if the descriptor is used in the opposite one */
+static bool file_direction(struct filemap_s *file, bool writing)
+{
+	if (file->state == UNDECIDED) {
+		file->state = writing ? WRITE : READ;
+		// the header tells writers which format they receive
+		if (writing) file->format = ENCRYPT_STREAM;
 	}
-	free(buffer.buffer);
+	const bool written = file->state == WRITE || file->state == WRITE_AUTHENTICATED || file->state == FAILED;
+	return written == writing;
+}
 
-	// finalize HMAC into IV
-	md_result = mbedtls_md_hmac_finish(&digest, iv_out);
-	assert(md_result == 0);
+/* whether closing the file now loses or leaves behind unauthenticated content */
+static bool file_incomplete(const struct filemap_s *file)
+{
+	switch (file->state) {
+	case UNDECIDED:
+	case READ_AUTHENTICATED:
+	case WRITE_AUTHENTICATED:
+		return false;
+	case READ:
+		// segments can be read in any order and need not all be read
+		return file->format == ENCRYPT_STREAM && file->position > 0;
+	case WRITE:
+		return file->position > 0;
+	case FAILED:
+		return true;
+	}
+	return true;
+}
 
-	// rewind the file read position
-	off_t seek_result = lseek(fd, 0, SEEK_SET);
-	assert(seek_result == 0);
+static ssize_t file_readv(struct filemap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t result;
+	pthread_mutex_lock(&file->lock);
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		result = -1;
+	} else if (!file_direction(file, false)) {
+		errno = EBADF;
+		result = -1;
+	} else if (file->format == ENCRYPT_STREAM && offset >= 0 && (size_t)offset != file->position) {
+		// the encrypted stream can only be produced sequentially
+		errno = EINVAL;
+		result = -1;
+	} else {
+		// work on a private copy of the vector, the helpers advance it
+		buffer_alloc(&file->vector, (size_t)iovcnt * sizeof(struct iovec));
+		struct iovec *vector = (struct iovec *)(void *)file->vector.buffer;
+		if (iovcnt) memcpy(vector, iov, (size_t)iovcnt * sizeof(struct iovec));
+		if (file->format == ENCRYPT_STREAM) {
+			result = stream_read(file, fd, vector, iovcnt, offset >= 0);
+		} else {
+			// positional reads of segments and chunks leave the file position alone
+			const size_t start = offset >= 0 ? (size_t)offset : file->position;
+			if (file->format == ENCRYPT_SEGMENTED)
+				result = segment_read(file, fd, vector, iovcnt, start);
+			else
+				result = chunk_read(file, fd, vector, iovcnt, start);
+			if (offset < 0 && result > 0) file->position += (size_t)result;
+		}
+	}
 
-	mbedtls_md_free(&digest);
-	return 0;
+	pthread_mutex_unlock(&file->lock);
+	return result;
 }
 
-void encrypt_reset(void)
+static ssize_t file_writev(struct filemap_s *file, int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t result;
+	pthread_mutex_lock(&file->lock);
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		result = -1;
+	} else if (file->state == UNDECIDED && file->position != 0) {
+		// writers must start with the header
+		errno = EINVAL;
+		result = -1;
+	} else if (!file_direction(file, true)) {
+		errno = EBADF;
+		result = -1;
+	} else if (file->format != ENCRYPT_SEGMENTED && offset >= 0 && (size_t)offset != file->position) {
+		// the encrypted stream and chunks can only be consumed sequentially
+		errno = EINVAL;
+		result = -1;
+	} else {
+		// work on a private copy of the vector, the helpers advance it
+		buffer_alloc(&file->vector, (size_t)iovcnt * sizeof(struct iovec));
+		struct iovec *vector = (struct iovec *)(void *)file->vector.buffer;
+		if (iovcnt) memcpy(vector, iov, (size_t)iovcnt * sizeof(struct iovec));
+		if (file->format == ENCRYPT_STREAM) {
+			result = stream_write(file, fd, vector, iovcnt, offset >= 0);
+		} else if (file->format == ENCRYPT_CHUNKED) {
+			result = chunk_write(file, fd, vector, iovcnt);
+		} else {
+			// segments can be written in any order, the position follows the last write
+			const size_t start = offset >= 0 ? (size_t)offset : file->position;
+			result = segment_write(file, fd, vector, iovcnt, start);
+			if (result > 0) file->position = start + (size_t)result;
+		}
+	}
+
+	pthread_mutex_unlock(&file->lock);
+	return result;
+}
+
+static off_t file_seek(struct filemap_s *file, int fd, off_t offset, int whence)
+{
+	const bool writing = file->state == WRITE || file->state == WRITE_AUTHENTICATED || file->state == FAILED;
+	off_t base;
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = (off_t)file->position;
+		break;
+	case SEEK_END:
+		if (writing) {
+			// writers know the size once the header is complete
+			if (file->format == ENCRYPT_CHUNKED) {
+				base = (off_t)(SEGMENT_HEADER + file->segment_header.content_length + file->chunk_limit * CHUNK_OVERHEAD + sizeof(struct file_trailer_s));
+			} else if (file->format == ENCRYPT_SEGMENTED && file->segments) {
+				base = (off_t)(SEGMENT_HEADER + file->segment_header.content_length + file->segments * SEGMENT_TAG);
+			} else {
+				errno = EINVAL;
+				return -1;
+			}
+		} else {
+			struct stat stat_buf;
+			if (fstat(fd, &stat_buf) != 0) return -1;
+			base = encrypted_size(file->format, stat_buf.st_size);
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	off_t target;
+	if (__builtin_add_overflow(base, offset, &target)) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (target < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((file->format == ENCRYPT_STREAM || (file->format == ENCRYPT_CHUNKED && writing)) && (size_t)target != file->position) {
+		// the encrypted stream and received chunks are strictly sequential
+		errno = ESPIPE;
+		return -1;
+	}
+
+	file->position = (size_t)target;
+	return target;
+}
+
+/* derive the IV from the file content, unless it is cached */
+static bool file_iv(struct filemap_s *file, int fd, const struct stat *buf)
+{
+	mapping_setup(file, fd, buf);
+	if (ivcache_lookup(buf, file->key, file->header.iv)) return true;
+
+	if (file->mapping) {
+		if (!mapping_hmac(file, file->header.iv)) return false;
+	} else {
+		ssize_t iv_result = generate_iv_from_hmac(fd, (size_t)buf->st_size, file->key, file->header.iv);
+		assert(iv_result == 0);
+	}
+	ivcache_store(fd, buf, file->key, file->header.iv);
+	return true;
+}
+
+static ssize_t stream_read(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, bool positional)
 {
-	pthread_mutex_lock(&filemap_lock);
+	ssize_t result = 0;
+	assert(file->state == READ || file->state == READ_AUTHENTICATED);
+	size_t bytes = iov_length(iov, iovcnt);
 
-	struct filemap_s *next;
-	for (struct filemap_s *file = filemap; file; file = next) {
-		next = file->next;
-		free(file->content_buffer.buffer);
-		free(file);
+	if (file->mapping == MAP_FAILED) {
+		// the file shrank while it was mapped
+		errno = EIO;
+		return -1;
 	}
-	filemap = NULL;
 
-	pthread_mutex_unlock(&filemap_lock);
+	if (bytes > 0 && file->position == 0) {
+		// initialize the file header
+		struct stat stat_buf;
+		int stat_result = fstat(fd, &stat_buf);
+		assert(stat_result == 0);
+		size_t file_length = (size_t)stat_buf.st_size;
+		if (!file_iv(file, fd, &stat_buf)) {
+			errno = EIO;
+			return -1;
+		}
+		file->header.trailer_start = sizeof(struct file_header_s) + file_length;
+	}
+
+	if (bytes > 0 && file->position < sizeof(struct file_header_s)) {
+		// first emit the header to the caller
+		size_t to_emit = sizeof(struct file_header_s) - file->position;
+		if (to_emit > bytes) to_emit = bytes;
+		const char *source = (const char *)&file->header + file->position;
+		iov_put(&iov, &iovcnt, source, to_emit);
+		result += to_emit;
+		bytes -= to_emit;
+		file->position += to_emit;
+	}
+
+	if (bytes > 0 && file->position == sizeof(struct file_header_s)) {
+		// start the crypto context
+		int gcm_result = gcm_starts(file->gcm, MBEDTLS_GCM_ENCRYPT, file->header.iv, sizeof(file->header.iv));
+		assert(gcm_result == 0);
+		if (file->mapping && file->mapping_size >= PIPELINE_THRESHOLD) pipeline_start(file);
+	}
+
+	if (bytes > 0 && file->position < file->header.trailer_start) {
+		// emit encrypted file content to the caller
+		size_t to_emit = file->header.trailer_start - file->position;
+		if (to_emit > bytes) to_emit = bytes;
+
+		if (file->mapping && to_emit > 0) {
+			// encrypt straight from the mapping into the caller’s buffers
+			if (!mapping_crypt(file, &iov, &iovcnt, to_emit)) {
+				errno = EIO;
+				return -1;
+			}
+			result += to_emit;
+			bytes -= to_emit;
+			file->position += to_emit;
+			to_emit = 0;
+		}
+
+		// read file data directly into the caller’s buffers and encrypt in place
+		while (to_emit > 0) {
+			off_t offset = positional ? (off_t)(file->position - sizeof(struct file_header_s)) : -1;
+			[[clang::suppress]]  // unix.BlockInCriticalSection
+			ssize_t read_result = iov_read(fd, iov, iovcnt, to_emit, offset);
+			if (read_result < 0 && errno == EINTR) continue;
+			if (read_result < 0) return read_result;
+			if (read_result == 0) break;
+			iov_crypt(file->gcm, &iov, &iovcnt, (size_t)read_result, NULL);
+			result += read_result;
+			bytes -= (size_t)read_result;
+			to_emit -= (size_t)read_result;
+			file->position += (size_t)read_result;
+		}
+	}
+
+	if (bytes > 0 && file->position == file->header.trailer_start) {
+		// generate authentication tag
+		unsigned char rest[15];
+		size_t gcm_size;
+		int gcm_result = gcm_finish(file->gcm, rest, sizeof(rest), &gcm_size, file->trailer.auth_tag, sizeof(file->trailer.auth_tag));
+		assert(gcm_result == 0 && gcm_size <= bytes);
+		iov_put(&iov, &iovcnt, rest, gcm_size);
+		result += gcm_size;
+		bytes -= gcm_size;
+	}
+
+	if (bytes > 0 && file->position >= file->header.trailer_start &&
+	    file->position < file->header.trailer_start + sizeof(struct file_trailer_s)) {
+		// lastly emit the file trailer to the caller
+		size_t to_emit = sizeof(struct file_trailer_s);
+		to_emit -= file->position - file->header.trailer_start;
+		if (to_emit > bytes) to_emit = bytes;
+		const char *source = (const char *)&file->trailer;
+		source += file->position - file->header.trailer_start;
+		iov_put(&iov, &iovcnt, source, to_emit);
+		result += to_emit;
+		file->position += to_emit;
+	}
+
+	if (file->position == file->header.trailer_start + sizeof(struct file_trailer_s)) {
+		// complete file emitted to the caller
+		file->state = READ_AUTHENTICATED;
+	}
+
+	return result;
+}
+
+static ssize_t stream_write(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, bool positional)
+{
+	ssize_t result = 0;
+	size_t bytes = iov_length(iov, iovcnt);
+
+	if (file->state == FAILED) {
+		// writing buffered content already failed
+		errno = EIO;
+		return -1;
+	}
+	assert(file->state == WRITE);
+
+	if (bytes > 0 && file->position < sizeof(struct file_header_s)) {
+		// first consume the header from the caller
+		size_t to_consume = sizeof(struct file_header_s) - file->position;
+		if (to_consume > bytes) to_consume = bytes;
+		char *target = (char *)&file->header + file->position;
+		iov_get(&iov, &iovcnt, target, to_consume);
+		result += to_consume;
+		bytes -= to_consume;
+		file->position += to_consume;
+	}
+
+	if (file->position >= sizeof(struct file_header_s) && file->header.trailer_start == 0) {
+		// the header announces the segmented or chunked format, the version tells them apart
+		if (bytes > 0 && file->position < SEGMENT_HEADER) {
+			size_t to_consume = SEGMENT_HEADER - file->position;
+			if (to_consume > bytes) to_consume = bytes;
+			char *target = (char *)&file->segment_header + (file->position - sizeof(struct file_header_s));
+			iov_get(&iov, &iovcnt, target, to_consume);
+			result += to_consume;
+			bytes -= to_consume;
+			file->position += to_consume;
+		}
+		if (file->position < SEGMENT_HEADER) return result;
+
+		const bool chunked = file->segment_header.version == CHUNK_VERSION;
+		if (chunked ? !chunk_start(file) : !segment_start(file)) {
+			// unsupported or manipulated header
+			(void)ftruncate(fd, 0);
+			file->state = FAILED;
+			errno = EIO;
+			return -1;
+		}
+		file->format = chunked ? ENCRYPT_CHUNKED : ENCRYPT_SEGMENTED;
+		if (bytes == 0) return result;
+		if (chunked) {
+			ssize_t chunk_result = chunk_write(file, fd, iov, iovcnt);
+			return chunk_result < 0 ? chunk_result : result + chunk_result;
+		}
+		ssize_t segment_result = segment_write(file, fd, iov, iovcnt, file->position);
+		if (segment_result < 0) return segment_result;
+		file->position += (size_t)segment_result;
+		return result + segment_result;
+	}
+
+	if (bytes > 0 && file->position == sizeof(struct file_header_s)) {
+		// start the crypto context
+		int gcm_result = gcm_starts(file->gcm, MBEDTLS_GCM_DECRYPT, file->header.iv, sizeof(file->header.iv));
+		assert(gcm_result == 0);
+	}
+
+	if (bytes > 0 && file->position < file->header.trailer_start) {
+		// consume and decrypt file content from the caller
+		size_t to_consume = file->header.trailer_start - file->position;
+		if (to_consume > bytes) to_consume = bytes;
+
+		if (!file->write_back) {
+			// small files need no more than their content
+			const size_t content = file->header.trailer_start - sizeof(struct file_header_s);
+			file->write_back = iobuf_get(content < WRITE_BACK ? content : WRITE_BACK, IOBUF_MIN, &file->write_back_size);
+		}
+		if (file->write_back_filled > 0 && file->write_back_positional != positional) {
+			// buffered content goes where the caller expected it
+			if (!write_back_flush(file, fd)) return -1;
+		}
+
+		// perform decryption into the write-back buffer, gathering small writes into large ones
+		while (to_consume > 0) {
+			if (file->write_back_filled == 0) {
+				file->write_back_start = file->position - sizeof(struct file_header_s);
+				file->write_back_positional = positional;
+			}
+			size_t chunk = file->write_back_size - file->write_back_filled;
+			if (chunk > to_consume) chunk = to_consume;
+			iov_crypt(file->gcm, &iov, &iovcnt, chunk, file->write_back + file->write_back_filled);
+			file->write_back_filled += chunk;
+			result += chunk;
+			bytes -= chunk;
+			to_consume -= chunk;
+			file->position += chunk;
+			if (file->write_back_filled == file->write_back_size && !write_back_flush(file, fd)) return -1;
+		}
+	}
+
+	if (bytes > 0 && file->position >= file->header.trailer_start &&
+	    file->position < file->header.trailer_start + sizeof(struct file_trailer_s)) {
+		// lastly consume the file trailer from the caller
+		size_t to_consume = sizeof(struct file_trailer_s);
+		to_consume -= file->position - file->header.trailer_start;
+		if (to_consume > bytes) to_consume = bytes;
+		char *target = (char *)&file->trailer;
+		target += file->position - file->header.trailer_start;
+		iov_get(&iov, &iovcnt, target, to_consume);
+		result += to_consume;
+		bytes -= to_consume;
+		file->position += to_consume;
+	}
+
+	if (file->position == file->header.trailer_start + sizeof(struct file_trailer_s)) {
+		// verify authentication tag
+		unsigned char rest[15];
+		unsigned char generated[128 / CHAR_BIT];
+		size_t gcm_size;
+		int gcm_result = gcm_finish(file->gcm, rest, sizeof(rest), &gcm_size, generated, sizeof(generated));
+		assert(gcm_result == 0);
+
+		if (gcm_size > 0) {
+			// append the remaining file data to the buffered content
+			if (file->write_back_filled + gcm_size > file->write_back_size && !write_back_flush(file, fd)) return -1;
+			if (file->write_back_filled == 0) {
+				file->write_back_start = file->header.trailer_start - sizeof(struct file_header_s);
+				file->write_back_positional = positional;
+			}
+			memcpy(file->write_back + file->write_back_filled, rest, gcm_size);
+			file->write_back_filled += gcm_size;
+		}
+		// all file data is written before the outcome is known
+		if (!write_back_flush(file, fd)) return -1;
+		iobuf_put(file->write_back, file->write_back_size);
+		file->write_back = NULL;
+
+		int diff = memcmp(file->trailer.auth_tag, generated, sizeof(struct file_trailer_s));
+		if (diff == 0) {
+			file->state = WRITE_AUTHENTICATED;
+		} else {
+			// authentication failure, file was manipulated
+			(void)ftruncate(fd, 0);
+			errno = EIO;
+			result = -1;
+		}
+	}
+
+	if (bytes > 0) {
+		// caller tried to write unexpected extra file data
+		errno = EIO;
+		result = -1;
+	}
+
+	return result;
+}
+
+static ssize_t segment_read(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, size_t position)
+{
+	ssize_t result = 0;
+	assert(file->state == READ || file->state == READ_AUTHENTICATED);
+	size_t bytes = iov_length(iov, iovcnt);
+
+	if (file->mapping == MAP_FAILED) {
+		// the file shrank while it was mapped
+		errno = EIO;
+		return -1;
+	}
+
+	if (bytes > 0 && !file->segments) {
+		// initialize the file header
+		struct stat stat_buf;
+		int stat_result = fstat(fd, &stat_buf);
+		assert(stat_result == 0);
+		if (!file_iv(file, fd, &stat_buf)) {
+			errno = EIO;
+			return -1;
+		}
+		file->header.trailer_start = 0;
+		file->segment_header.version = SEGMENT_VERSION;
+		file->segment_header.segment_size = SEGMENT_SIZE;
+		file->segment_header.content_length = (uint64_t)stat_buf.st_size;
+		if (!segment_start(file)) return -1;
+	}
+
+	const size_t stride = file->segment_header.segment_size + SEGMENT_TAG;
+	const size_t end = SEGMENT_HEADER + (size_t)file->segment_header.content_length + file->segments * SEGMENT_TAG;
+	while (bytes > 0 && position < end) {
+		size_t chunk;
+		if (position < SEGMENT_HEADER) {
+			// emit the header to the caller
+			unsigned char header[SEGMENT_HEADER];
+			memcpy(header, &file->header, sizeof(file->header));
+			memcpy(header + sizeof(file->header), &file->segment_header, sizeof(file->segment_header));
+			chunk = SEGMENT_HEADER - position < bytes ? SEGMENT_HEADER - position : bytes;
+			iov_put(&iov, &iovcnt, header + position, chunk);
+		} else {
+			// emit an encrypted segment and its tag, consecutive reads mostly hit the same segment
+			const size_t index = (position - SEGMENT_HEADER) / stride;
+			const size_t within = (position - SEGMENT_HEADER) % stride;
+			if (file->segment_current != index + 1 && !segment_encrypt(file, fd, index))
+				return result > 0 ? result : -1;
+			const size_t available = segment_length(file, index) + SEGMENT_TAG - within;
+			chunk = available < bytes ? available : bytes;
+			iov_put(&iov, &iovcnt, file->segment.buffer + within, chunk);
+		}
+		result += chunk;
+		bytes -= chunk;
+		position += chunk;
+	}
+
+	if (position == end) {
+		// complete file emitted to the caller
+		file->state = READ_AUTHENTICATED;
+	}
+
+	return result;
+}
+
+static ssize_t segment_write(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, size_t position)
+{
+	ssize_t result = 0;
+	size_t bytes = iov_length(iov, iovcnt);
+
+	if (file->state == FAILED) {
+		// authentication already failed
+		errno = EIO;
+		return -1;
+	}
+
+	if (bytes > 0 && (position < SEGMENT_HEADER || !file->segments)) {
+		// the header is consumed before the format is known and cannot be rewritten
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (bytes > 0) {
+		const size_t stride = file->segment_header.segment_size + SEGMENT_TAG;
+		const size_t index = (position - SEGMENT_HEADER) / stride;
+		const size_t within = (position - SEGMENT_HEADER) % stride;
+		if (index >= file->segments) {
+			// caller tried to write unexpected extra file data
+			errno = EIO;
+			return -1;
+		}
+		if (within == 0) {
+			file->segment_current = index + 1;
+			file->segment_filled = 0;
+		} else if (file->segment_current != index + 1 || within != file->segment_filled) {
+			// segments must be written from their start and without gaps
+			errno = EINVAL;
+			return -1;
+		}
+
+		// collect the segment and its tag, then authenticate and write it as a whole
+		const size_t expected = segment_length(file, index) + SEGMENT_TAG;
+		const size_t chunk = expected - within < bytes ? expected - within : bytes;
+		iov_get(&iov, &iovcnt, file->segment.buffer + within, chunk);
+		file->segment_filled += chunk;
+		if (file->segment_filled == expected && segment_decrypt(file, fd, index) < 0) return -1;
+		result += chunk;
+		bytes -= chunk;
+		position += chunk;
+	}
+
+	return result;
+}
+
+/* validate the segmented header and prepare buffers */
+static bool segment_start(struct filemap_s *file)
+{
+	const struct segment_header_s *header = &file->segment_header;
+	if (header->version != SEGMENT_VERSION || header->segment_size == 0 || header->segment_size > SEGMENT_SIZE_MAX ||
+	    header->content_length > (uint64_t)SIZE_MAX / 2) {
+		errno = EIO;
+		return false;
+	}
+
+	const size_t segments = segment_count(header->content_length, header->segment_size);
+	file->authenticated.buffer = calloc(segments / CHAR_BIT + 1, 1);
+	if (!file->authenticated.buffer) return false;  // errno is ENOMEM
+	file->authenticated.size = segments / CHAR_BIT + 1;
+	buffer_alloc(&file->segment, header->segment_size + SEGMENT_TAG);
+
+	file->segments = segments;
+	file->segment_current = 0;
+	file->segment_filled = 0;
+	file->segments_authenticated = 0;
+	return true;
+}
+
+/* an empty file still consists of one segment, so its tag marks the end */
+static size_t segment_count(uint64_t length, size_t segment_size)
+{
+	return length == 0 ? 1 : (size_t)((length + segment_size - 1) / segment_size);
+}
+
+static size_t segment_length(const struct filemap_s *file, size_t index)
+{
+	const size_t start = index * file->segment_header.segment_size;
+	const size_t rest = (size_t)file->segment_header.content_length - start;
+	return rest < file->segment_header.segment_size ? rest : file->segment_header.segment_size;
+}
+
+static void segment_nonce(const struct filemap_s *file, size_t index, struct segment_nonce_s *nonce_out)
+{
+	memcpy(nonce_out->iv, file->header.iv, sizeof(nonce_out->iv));
+	nonce_out->index = index;
+	nonce_out->last = index + 1 == file->segments;
+}
+
+/* encrypt one segment of the file into the segment buffer and append its tag */
+static bool segment_encrypt(struct filemap_s *file, int fd, size_t index)
+{
+	const size_t start = index * file->segment_header.segment_size;
+	const size_t length = segment_length(file, index);
+	unsigned char *buffer = (unsigned char *)file->segment.buffer;
+	file->segment_current = 0;
+
+	struct segment_nonce_s nonce;
+	segment_nonce(file, index, &nonce);
+	int gcm_result = gcm_starts(file->gcm, MBEDTLS_GCM_ENCRYPT, (const unsigned char *)&nonce, sizeof(nonce));
+	assert(gcm_result == 0);
+	if (!content_encrypt(file, fd, start, length, buffer)) return false;
+
+	size_t gcm_size;
+	gcm_result = gcm_finish(file->gcm, NULL, 0, &gcm_size, buffer + length, SEGMENT_TAG);
+	assert(gcm_result == 0 && gcm_size == 0);
+	file->segment_current = index + 1;
+	return true;
+}
+
+/* authenticate and decrypt the received segment, then write its content */
+static int segment_decrypt(struct filemap_s *file, int fd, size_t index)
+{
+	const size_t length = segment_length(file, index);
+	unsigned char *buffer = (unsigned char *)file->segment.buffer;
+	file->segment_current = 0;
+
+	struct segment_nonce_s nonce;
+	segment_nonce(file, index, &nonce);
+	int gcm_result = gcm_starts(file->gcm, MBEDTLS_GCM_DECRYPT, (const unsigned char *)&nonce, sizeof(nonce));
+	assert(gcm_result == 0);
+	size_t gcm_size;
+	gcm_result = gcm_update(file->gcm, buffer, length, buffer, length, &gcm_size);
+	assert(gcm_result == 0 && gcm_size == length);
+	unsigned char generated[SEGMENT_TAG];
+	gcm_result = gcm_finish(file->gcm, NULL, 0, &gcm_size, generated, sizeof(generated));
+	assert(gcm_result == 0 && gcm_size == 0);
+
+	if (memcmp(buffer + length, generated, sizeof(generated)) != 0) {
+		// authentication failure, segment was manipulated
+		(void)ftruncate(fd, 0);
+		file->state = FAILED;
+		errno = EIO;
+		return -1;
+	}
+
+	// write file data
+	off_t offset = (off_t)(index * file->segment_header.segment_size);
+	ssize_t write_result = fdmap_write(fd, buffer, length, offset);
+	if (write_result < 0) return -1;
+
+	unsigned char *bitmap = (unsigned char *)file->authenticated.buffer;
+	if (!(bitmap[index / CHAR_BIT] & 1U << index % CHAR_BIT)) {
+		bitmap[index / CHAR_BIT] |= (unsigned char)(1U << index % CHAR_BIT);
+		file->segments_authenticated++;
+	}
+	if (file->segments_authenticated == file->segments && file->state == WRITE) {
+		// all segments arrived, drop content left from before
+		if (ftruncate(fd, (off_t)file->segment_header.content_length) != 0) return -1;
+		file->state = WRITE_AUTHENTICATED;
+	}
+
+	return 0;
+}
+
+/* run the started cipher over a range of file content into the buffer */
+static bool content_encrypt(struct filemap_s *file, int fd, size_t start, size_t length, unsigned char *buffer)
+{
+	int gcm_result;
+	size_t gcm_size;
+	if (file->mapping) {
+		if (start + length > file->mapping_size) {
+			errno = EIO;
+			return false;
+		}
+		sigjmp_buf guard;
+		if (sigsetjmp(guard, 0) != 0) {
+			mapping_leave();
+			mapping_release(file);
+			file->mapping = MAP_FAILED;
+			errno = EIO;
+			return false;
+		}
+		mapping_enter(&guard);
+		gcm_result = gcm_update(file->gcm, file->mapping + start, length, buffer, length, &gcm_size);
+		mapping_leave();
+		mapping_drop(file, start + length);
+	} else {
+		for (size_t done = 0; done < length;) {
+			[[clang::suppress]]  // unix.BlockInCriticalSection
+			ssize_t read_result = pread(fd, buffer + done, length - done, (off_t)(start + done));
+			if (read_result < 0 && errno == EINTR) continue;
+			if (read_result < 0) return false;
+			if (read_result == 0) {
+				// the file shrank since its IV was derived
+				errno = EIO;
+				return false;
+			}
+			done += (size_t)read_result;
+		}
+		gcm_result = gcm_update(file->gcm, buffer, length, buffer, length, &gcm_size);
+	}
+	assert(gcm_result == 0 && gcm_size == length);
+	return true;
+}
+
+static ssize_t chunk_read(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt, size_t position)
+{
+	ssize_t result = 0;
+	assert(file->state == READ || file->state == READ_AUTHENTICATED);
+	size_t bytes = iov_length(iov, iovcnt);
+
+	if (file->mapping == MAP_FAILED) {
+		// the file shrank while it was mapped
+		errno = EIO;
+		return -1;
+	}
+
+	if (bytes > 0 && !file->chunk_table.buffer) {
+		// find the chunks before the header announces the size
+		struct stat stat_buf;
+		int stat_result = fstat(fd, &stat_buf);
+		assert(stat_result == 0);
+		if (!chunk_layout(file, fd, &stat_buf)) {
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	const size_t content = (size_t)file->segment_header.content_length;
+	const size_t padding = SEGMENT_HEADER + content + file->chunks * CHUNK_OVERHEAD;
+	const size_t trailer = SEGMENT_HEADER + content + file->chunk_limit * CHUNK_OVERHEAD;
+	const size_t end = trailer + sizeof(struct file_trailer_s);
+	while (bytes > 0 && position < end) {
+		size_t chunk;
+		if (position < SEGMENT_HEADER) {
+			// emit the header to the caller
+			unsigned char header[SEGMENT_HEADER];
+			memcpy(header, &file->header, sizeof(file->header));
+			memcpy(header + sizeof(file->header), &file->segment_header, sizeof(file->segment_header));
+			chunk = SEGMENT_HEADER - position < bytes ? SEGMENT_HEADER - position : bytes;
+			iov_put(&iov, &iovcnt, header + position, chunk);
+		} else if (position < padding) {
+			// emit an encrypted chunk between its header and tag, consecutive reads mostly hit the same chunk
+			const size_t index = chunk_find(file, position);
+			const struct chunk_entry_s *entry = &((const struct chunk_entry_s *)(const void *)file->chunk_table.buffer)[index];
+			const size_t within = position - (SEGMENT_HEADER + (size_t)entry->start + index * CHUNK_OVERHEAD);
+			if (file->segment_current != index + 1 && !chunk_encrypt(file, fd, index))
+				return result > 0 ? result : -1;
+			const size_t available = chunk_length(file, index) + CHUNK_OVERHEAD - within;
+			chunk = available < bytes ? available : bytes;
+			iov_put(&iov, &iovcnt, file->segment.buffer + within, chunk);
+		} else if (position < trailer) {
+			// room for chunks the content was not cut into
+			static const unsigned char zero[4096];
+			chunk = trailer - position < bytes ? trailer - position : bytes;
+			if (chunk > sizeof(zero)) chunk = sizeof(zero);
+			iov_put(&iov, &iovcnt, zero, chunk);
+		} else {
+			// the trailer covers all chunks in order, including those the caller skipped
+			while (file->chunks_sealed < file->chunks) {
+				if (!chunk_encrypt(file, fd, file->chunks_sealed)) return result > 0 ? result : -1;
+			}
+			if (!file->sealed) chunk_seal_finish(file, file->trailer.auth_tag);
+			chunk = end - position < bytes ? end - position : bytes;
+			iov_put(&iov, &iovcnt, (const unsigned char *)&file->trailer + (position - trailer), chunk);
+		}
+		result += chunk;
+		bytes -= chunk;
+		position += chunk;
+	}
+
+	if (position == end) {
+		// complete file emitted to the caller
+		file->state = READ_AUTHENTICATED;
+	}
+
+	return result;
+}
+
+static ssize_t chunk_write(struct filemap_s *file, int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t result = 0;
+	size_t bytes = iov_length(iov, iovcnt);
+
+	if (file->state == FAILED) {
+		// authentication already failed
+		errno = EIO;
+		return -1;
+	}
+
+	const size_t content = (size_t)file->segment_header.content_length;
+	const size_t trailer = SEGMENT_HEADER + content + file->chunk_limit * CHUNK_OVERHEAD;
+	const size_t end = trailer + sizeof(struct file_trailer_s);
+	while (bytes > 0) {
+		size_t chunk;
+		if (file->position >= end) {
+			// caller tried to write unexpected extra file data
+			errno = EIO;
+			return -1;
+		} else if (file->chunk_offset < content) {
+			// collect the next chunk with its header and tag, then authenticate and write it as a whole
+			struct chunk_header_s header;
+			size_t expected = sizeof(header);
+			if (file->segment_filled >= sizeof(header)) {
+				memcpy(&header, file->segment.buffer, sizeof(header));
+				expected += (size_t)header.length + SEGMENT_TAG;
+			}
+			chunk = expected - file->segment_filled < bytes ? expected - file->segment_filled : bytes;
+			iov_get(&iov, &iovcnt, file->segment.buffer + file->segment_filled, chunk);
+			file->segment_filled += chunk;
+			if (file->segment_filled == sizeof(header)) {
+				memcpy(&header, file->segment.buffer, sizeof(header));
+				if (header.length == 0 || header.length > SEGMENT_SIZE_MAX || header.length > content - file->chunk_offset ||
+				    file->chunks == file->chunk_limit) {
+					// the chunk does not fit the announced content, header was manipulated
+					(void)ftruncate(fd, 0);
+					file->state = FAILED;
+					errno = EIO;
+					return -1;
+				}
+				buffer_alloc(&file->segment, (size_t)header.length + CHUNK_OVERHEAD);
+			} else if (file->segment_filled == expected && chunk_decrypt(file, fd) < 0) {
+				return -1;
+			}
+		} else if (file->position < trailer) {
+			// room for chunks the content was not cut into must be empty
+			chunk = trailer - file->position < bytes ? trailer - file->position : bytes;
+			if (chunk > file->segment.size) chunk = file->segment.size;
+			iov_get(&iov, &iovcnt, file->segment.buffer, chunk);
+			for (size_t i = 0; i < chunk; i++) {
+				if (file->segment.buffer[i] == 0) continue;
+				(void)ftruncate(fd, 0);
+				file->state = FAILED;
+				errno = EIO;
+				return -1;
+			}
+		} else {
+			// lastly consume the trailer, which authenticates the sequence of chunks
+			chunk = end - file->position < bytes ? end - file->position : bytes;
+			char *target = (char *)&file->trailer + (file->position - trailer);
+			iov_get(&iov, &iovcnt, target, chunk);
+			if (file->position + chunk == end) {
+				unsigned char generated[SEGMENT_TAG];
+				chunk_seal_finish(file, generated);
+				if (memcmp(file->trailer.auth_tag, generated, sizeof(generated)) != 0) {
+					// authentication failure, chunks were removed, reordered, or replaced
+					(void)ftruncate(fd, 0);
+					file->state = FAILED;
+					errno = EIO;
+					return -1;
+				}
+				// all chunks arrived, drop content left from before
+				if (ftruncate(fd, (off_t)content) != 0) return -1;
+				file->state = WRITE_AUTHENTICATED;
+			}
+		}
+		result += chunk;
+		bytes -= chunk;
+		file->position += chunk;
+	}
+
+	return result;
+}
+
+/* cut a file about to be read into chunks and derive their IVs */
+static bool chunk_layout(struct filemap_s *file, int fd, const struct stat *buf)
+{
+	const size_t length = (size_t)buf->st_size;
+	const size_t capacity = chunk_capacity(length, CHUNK_MIN);
+	buffer_alloc(&file->chunk_table, (capacity + 1) * sizeof(struct chunk_entry_s));
+	buffer_alloc(&file->segment, CHUNK_MAX + CHUNK_OVERHEAD);
+
+	uint64_t gear[256];
+	chunk_gear(file->key, gear);
+	mbedtls_md_context_t digest;
+	mbedtls_md_init(&digest);
+	int md_result = mbedtls_md_setup(&digest, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+	assert(md_result == 0);
+	md_result = mbedtls_md_hmac_starts(&digest, file->key, sizeof(file->key));
+	assert(md_result == 0);
+
+	// without a mapping, the content passes through a window holding the largest chunk
+	mapping_setup(file, fd, buf);
+	size_t window_size = 0;
+	unsigned char *window = file->mapping ? NULL : iobuf_get(CHUNK_MAX, CHUNK_MAX, &window_size);
+
+	volatile bool success = false;
+	sigjmp_buf guard;
+	if (sigsetjmp(guard, 0) == 0) {
+		mapping_enter(&guard);
+		success = chunk_scan(file, fd, length, gear, &digest, window);
+		mapping_leave();
+	} else {
+		mapping_leave();
+		mapping_release(file);
+		file->mapping = MAP_FAILED;
+	}
+	iobuf_put(window, window_size);
+	mbedtls_md_free(&digest);
+	if (!success) return false;
+
+	// only chunks are encrypted, the header carries no IV
+	memset(&file->header, 0, sizeof(file->header));
+	file->segment_header.version = CHUNK_VERSION;
+	file->segment_header.segment_size = CHUNK_MIN;
+	file->segment_header.content_length = (uint64_t)length;
+	file->chunk_limit = capacity;
+	file->segment_current = 0;
+	chunk_seal_start(file);
+	return true;
+}
+
+static bool chunk_scan(struct filemap_s *file, int fd, size_t length, const uint64_t gear[256], mbedtls_md_context_t *digest, unsigned char *window)
+{
+	struct chunk_entry_s *table = (struct chunk_entry_s *)(void *)file->chunk_table.buffer;
+	size_t filled = 0;
+	file->chunks = 0;
+
+	for (size_t start = 0; start < length;) {
+		const size_t available = length - start < CHUNK_MAX ? length - start : CHUNK_MAX;
+		while (!file->mapping && filled < available) {
+			// keep the rest of the window beyond the previous chunk and fill it up
+			[[clang::suppress]]  // unix.BlockInCriticalSection
+			ssize_t read_result = pread(fd, window + filled, available - filled, (off_t)(start + filled));
+			if (read_result < 0 && errno == EINTR) continue;
+			if (read_result <= 0) return false;
+			filled += (size_t)read_result;
+		}
+		const unsigned char *data = file->mapping ? file->mapping + start : window;
+		const size_t size = chunk_boundary(data, available, gear);
+
+		unsigned char iv[256 / CHAR_BIT];
+		int md_result = mbedtls_md_hmac_reset(digest);
+		assert(md_result == 0);
+		md_result = mbedtls_md_hmac_update(digest, data, size);
+		assert(md_result == 0);
+		md_result = mbedtls_md_hmac_finish(digest, iv);
+		assert(md_result == 0);
+		table[file->chunks].start = start;
+		memcpy(table[file->chunks].iv, iv, sizeof(table->iv));
+		file->chunks++;
+
+		if (!file->mapping) {
+			memmove(window, window + size, filled - size);
+			filled -= size;
+		}
+		start += size;
+	}
+	return true;
+}
+
+/* length of the chunk at the start of the data, the whole data if no boundary is found */
+static size_t chunk_boundary(const unsigned char *data, size_t available, const uint64_t gear[256])
+{
+	if (available <= CHUNK_MIN) return available;
+	// the gear hash depends on the last 64 bytes only, so it is complete when the minimum is reached
+	uint64_t hash = 0;
+	for (size_t i = CHUNK_MIN - 64; i < CHUNK_MIN; i++) hash = (hash << 1) + gear[data[i]];
+	for (size_t i = CHUNK_MIN; i < available; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash >> (64 - CHUNK_BITS))) return i + 1;
+	}
+	return available;
+}
+
+/* the boundaries depend on the key, so their positions cannot be matched against guessed content */
+static void chunk_gear(const unsigned char key[256 / CHAR_BIT], uint64_t gear_out[256])
+{
+	unsigned char input[256 / CHAR_BIT + sizeof("chunk boundaries")];
+	memcpy(input, key, 256 / CHAR_BIT);
+	memcpy(input + 256 / CHAR_BIT, "chunk boundaries", sizeof("chunk boundaries"));
+	unsigned char seed[256 / CHAR_BIT];
+	int md_result = mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), input, sizeof(input), seed);
+	assert(md_result == 0);
+
+	// SplitMix64
+	uint64_t state;
+	memcpy(&state, seed, sizeof(state));
+	for (size_t i = 0; i < 256; i++) {
+		uint64_t value = state += 0x9e3779b97f4a7c15;
+		value = (value ^ value >> 30) * 0xbf58476d1ce4e5b9;
+		value = (value ^ value >> 27) * 0x94d049bb133111eb;
+		gear_out[i] = value ^ value >> 31;
+	}
+}
+
+/* validate the chunked header and prepare the trailer */
+static bool chunk_start(struct filemap_s *file)
+{
+	const struct segment_header_s *header = &file->segment_header;
+	if (header->version != CHUNK_VERSION || header->segment_size < CHUNK_OVERHEAD || header->segment_size > SEGMENT_SIZE_MAX)
+		return false;
+	if (header->content_length > (uint64_t)SIZE_MAX / 2) return false;
+
+	buffer_alloc(&file->segment, CHUNK_MIN + CHUNK_OVERHEAD);
+	file->chunks = 0;
+	file->chunk_limit = chunk_capacity(header->content_length, header->segment_size);
+	file->chunk_offset = 0;
+	file->segment_filled = 0;
+	chunk_seal_start(file);
+	return true;
+}
+
+/* all chunks but the last have at least the minimum length */
+static size_t chunk_capacity(uint64_t length, size_t minimum)
+{
+	return (size_t)((length + minimum - 1) / minimum);
+}
+
+/* index of the chunk whose header, content, or tag is at the position */
+static size_t chunk_find(const struct filemap_s *file, size_t position)
+{
+	const struct chunk_entry_s *table = (const struct chunk_entry_s *)(const void *)file->chunk_table.buffer;
+	const size_t offset = position - SEGMENT_HEADER;
+	size_t low = 0, high = file->chunks;
+	while (high - low > 1) {
+		const size_t middle = low + (high - low) / 2;
+		if ((size_t)table[middle].start + middle * CHUNK_OVERHEAD <= offset)
+			low = middle;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static size_t chunk_length(const struct filemap_s *file, size_t index)
+{
+	const struct chunk_entry_s *table = (const struct chunk_entry_s *)(const void *)file->chunk_table.buffer;
+	const uint64_t end = index + 1 < file->chunks ? table[index + 1].start : file->segment_header.content_length;
+	return (size_t)(end - table[index].start);
+}
+
+/* encrypt one chunk of the file into the segment buffer, between its header and tag */
+static bool chunk_encrypt(struct filemap_s *file, int fd, size_t index)
+{
+	const struct chunk_entry_s *entry = &((const struct chunk_entry_s *)(const void *)file->chunk_table.buffer)[index];
+	const size_t length = chunk_length(file, index);
+	unsigned char *buffer = (unsigned char *)file->segment.buffer;
+	file->segment_current = 0;
+
+	struct chunk_header_s header = { .length = length };
+	memcpy(header.iv, entry->iv, sizeof(header.iv));
+	memcpy(buffer, &header, sizeof(header));
+	int gcm_result = gcm_starts(file->gcm, MBEDTLS_GCM_ENCRYPT, header.iv, sizeof(header.iv));
+	assert(gcm_result == 0);
+	if (!content_encrypt(file, fd, (size_t)entry->start, length, buffer + sizeof(header))) return false;
+
+	size_t gcm_size;
+	unsigned char *tag = buffer + sizeof(header) + length;
+	gcm_result = gcm_finish(file->gcm, NULL, 0, &gcm_size, tag, SEGMENT_TAG);
+	assert(gcm_result == 0 && gcm_size == 0);
+
+	if (index == file->chunks_sealed) chunk_seal(file, &header, tag);
+	file->segment_current = index + 1;
+	return true;
+}
+
+/* authenticate and decrypt the received chunk, then write its content */
+static int chunk_decrypt(struct filemap_s *file, int fd)
+{
+	unsigned char *buffer = (unsigned char *)file->segment.buffer;
+	struct chunk_header_s header;
+	memcpy(&header, buffer, sizeof(header));
+	const size_t length = (size_t)header.length;
+	unsigned char *content = buffer + sizeof(header);
+	file->segment_filled = 0;
+
+	int gcm_result = gcm_starts(file->gcm, MBEDTLS_GCM_DECRYPT, header.iv, sizeof(header.iv));
+	assert(gcm_result == 0);
+	size_t gcm_size;
+	gcm_result = gcm_update(file->gcm, content, length, content, length, &gcm_size);
+	assert(gcm_result == 0 && gcm_size == length);
+	unsigned char generated[SEGMENT_TAG];
+	gcm_result = gcm_finish(file->gcm, NULL, 0, &gcm_size, generated, sizeof(generated));
+	assert(gcm_result == 0 && gcm_size == 0);
+
+	if (memcmp(content + length, generated, sizeof(generated)) != 0) {
+		// authentication failure, chunk was manipulated
+		(void)ftruncate(fd, 0);
+		file->state = FAILED;
+		errno = EIO;
+		return -1;
+	}
+	chunk_seal(file, &header, generated);
+
+	// write file data
+	ssize_t write_result = fdmap_write(fd, content, length, (off_t)file->chunk_offset);
+	if (write_result < 0) return -1;
+	file->chunk_offset += length;
+	file->chunks++;
+	return 0;
+}
+
+/* the trailer is an HMAC over the header and the header and tag of every chunk */
+static void chunk_seal_start(struct filemap_s *file)
+{
+	int md_result = mbedtls_md_setup(&file->seal, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+	assert(md_result == 0);
+	md_result = mbedtls_md_hmac_starts(&file->seal, file->key, sizeof(file->key));
+	assert(md_result == 0);
+	md_result = mbedtls_md_hmac_update(&file->seal, (const unsigned char *)&file->segment_header, sizeof(file->segment_header));
+	assert(md_result == 0);
+	file->chunks_sealed = 0;
+	file->sealed = false;
+}
+
+static void chunk_seal(struct filemap_s *file, const struct chunk_header_s *header, const unsigned char tag[SEGMENT_TAG])
+{
+	int md_result = mbedtls_md_hmac_update(&file->seal, (const unsigned char *)header, sizeof(*header));
+	assert(md_result == 0);
+	md_result = mbedtls_md_hmac_update(&file->seal, tag, SEGMENT_TAG);
+	assert(md_result == 0);
+	file->chunks_sealed++;
+}
+
+static void chunk_seal_finish(struct filemap_s *file, unsigned char tag_out[SEGMENT_TAG])
+{
+	unsigned char digest[256 / CHAR_BIT];
+	int md_result = mbedtls_md_hmac_finish(&file->seal, digest);
+	assert(md_result == 0);
+	memcpy(tag_out, digest, SEGMENT_TAG);
+	file->sealed = true;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++) length += iov[i].iov_len;
+	return length;
+}
+
+static void iov_put(struct iovec **iov, int *iovcnt, const void *source, size_t bytes)
+{
+	while (bytes > 0) {
+		assert(*iovcnt > 0);
+		size_t chunk = (*iov)->iov_len < bytes ? (*iov)->iov_len : bytes;
+		memcpy((*iov)->iov_base, source, chunk);
+		source = (const char *)source + chunk;
+		bytes -= chunk;
+		iov_advance(iov, iovcnt, chunk);
+	}
+}
+
+static void iov_get(struct iovec **iov, int *iovcnt, void *target, size_t bytes)
+{
+	while (bytes > 0) {
+		assert(*iovcnt > 0);
+		size_t chunk = (*iov)->iov_len < bytes ? (*iov)->iov_len : bytes;
+		memcpy(target, (*iov)->iov_base, chunk);
+		target = (char *)target + chunk;
+		bytes -= chunk;
+		iov_advance(iov, iovcnt, chunk);
+	}
+}
+
+/* run the cipher over the next bytes of the vector, in place when no target is given */
+static size_t iov_crypt(struct gcm_s *gcm, struct iovec **iov, int *iovcnt, size_t bytes, unsigned char *target)
+{
+	size_t result = 0;
+	while (bytes > 0) {
+		assert(*iovcnt > 0);
+		size_t chunk = (*iov)->iov_len < bytes ? (*iov)->iov_len : bytes;
+		const unsigned char *source = (*iov)->iov_base;
+		unsigned char *output = target ? target + result : (*iov)->iov_base;
+		size_t gcm_size;
+		int gcm_result = gcm_update(gcm, source, chunk, output, chunk, &gcm_size);
+		assert(gcm_result == 0 && gcm_size == chunk);
+		result += gcm_size;
+		bytes -= chunk;
+		iov_advance(iov, iovcnt, chunk);
+	}
+	return result;
+}
+
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t bytes)
+{
+	(*iov)->iov_base = (char *)(*iov)->iov_base + bytes;
+	(*iov)->iov_len -= bytes;
+	while (*iovcnt > 0 && (*iov)->iov_len == 0) {
+		(*iov)++;
+		(*iovcnt)--;
+	}
+}
+
+/* readv() or preadv() of at most the given number of bytes into the vector */
+static ssize_t iov_read(int fd, struct iovec *iov, int iovcnt, size_t bytes, off_t offset)
+{
+	// temporarily shorten the vector to the requested length
+	int count = 0;
+	size_t covered = 0;
+	while (covered + iov[count].iov_len < bytes) covered += iov[count++].iov_len;
+	assert(count < iovcnt);
+	size_t saved = iov[count].iov_len;
+	iov[count].iov_len = bytes - covered;
+
+	ssize_t result;
+	if (offset < 0)
+		result = readv(fd, iov, count + 1);
+	else
+		result = preadv(fd, iov, count + 1, offset);
+
+	iov[count].iov_len = saved;
+	return result;
+}
+
+/* write out buffered content, a failed write leaves an empty file behind */
+static bool write_back_flush(struct filemap_s *file, int fd)
+{
+	if (file->write_back_filled == 0) return true;
+	off_t offset = file->write_back_positional ? (off_t)file->write_back_start : -1;
+	ssize_t write_result = fdmap_write(fd, file->write_back, file->write_back_filled, offset);
+	file->write_back_filled = 0;
+	if (write_result < 0) {
+		int error = errno;
+		(void)ftruncate(fd, 0);
+		file->state = FAILED;
+		errno = error;
+		return false;
+	}
+	return true;
+}
+
+static ssize_t generate_iv_from_hmac(int fd, size_t length, unsigned char key[256 / CHAR_BIT], unsigned char iv_out[256 / CHAR_BIT])
+{
+	mbedtls_md_context_t digest;
+	mbedtls_md_init(&digest);
+
+	// set up HMAC context
+	const mbedtls_md_info_t *info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+	assert(mbedtls_md_get_size(info) == 32);
+	int md_result = mbedtls_md_setup(&digest, info, 1);
+	assert(md_result == 0);
+	md_result = mbedtls_md_hmac_starts(&digest, key, 256 / CHAR_BIT);
+	assert(md_result == 0);
+
+	// read file and update HMAC, leaving the file read position untouched
+	struct buffer_s buffer;
+	buffer.buffer = iobuf_get(length, IOBUF_MIN, &buffer.size);
+	off_t offset = 0;
+	while (length > 0) {
+		[[clang::suppress]]  // unix.BlockInCriticalSection
+		ssize_t read_result = pread(fd, buffer.buffer, length < buffer.size ? length : buffer.size, offset);
+		if (read_result < 0 && errno == EINTR) continue;
+		if (read_result < 0) {
+			iobuf_put(buffer.buffer, buffer.size);
+			mbedtls_md_free(&digest);
+			return read_result;
+		}
+		if (read_result == 0) break;
+		md_result = mbedtls_md_hmac_update(&digest, (unsigned char *)buffer.buffer, (size_t)read_result);
+		assert(md_result == 0);
+		length -= (size_t)read_result;
+		offset += read_result;
+	}
+	iobuf_put(buffer.buffer, buffer.size);
+
+	// finalize HMAC into IV
+	md_result = mbedtls_md_hmac_finish(&digest, iv_out);
+	assert(md_result == 0);
+
+	mbedtls_md_free(&digest);
+	return 0;
+}
+
+/* a context keyed for the given key, reused from a closed file if possible */
+static struct gcm_s *context_get(const unsigned char key[256 / CHAR_BIT])
+{
+	struct gcm_s *gcm = NULL;
+	pthread_mutex_lock(&context_pool.lock);
+	for (size_t i = 0; i < CONTEXT_POOL; i++) {
+		if (context_pool.slot[i].gcm && memcmp(context_pool.slot[i].key, key, sizeof(context_pool.slot[i].key)) == 0) {
+			gcm = context_pool.slot[i].gcm;
+			context_pool.slot[i].gcm = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&context_pool.lock);
+	if (gcm) return gcm;
+
+	// key expansion and hash tables are computed once per pooled context
+	gcm = malloc(sizeof(struct gcm_s));
+	assert(gcm);
+	gcm_init(gcm);
+	int gcm_result = gcm_setkey(gcm, key);
+	assert(gcm_result == 0);
+	return gcm;
+}
+
+/* return a context to the pool, replacing the oldest one when it is full */
+static void context_put(struct gcm_s *gcm, const unsigned char key[256 / CHAR_BIT])
+{
+	pthread_mutex_lock(&context_pool.lock);
+	size_t index = context_pool.next;
+	for (size_t i = 0; i < CONTEXT_POOL; i++) {
+		if (!context_pool.slot[i].gcm) {
+			index = i;
+			break;
+		}
+	}
+	if (index == context_pool.next) context_pool.next = (context_pool.next + 1) % CONTEXT_POOL;
+	struct gcm_s *replaced = context_pool.slot[index].gcm;
+	memcpy(context_pool.slot[index].key, key, sizeof(context_pool.slot[index].key));
+	context_pool.slot[index].gcm = gcm;
+	pthread_mutex_unlock(&context_pool.lock);
+
+	if (replaced) {
+		gcm_free(replaced);
+		free(replaced);
+	}
+}
+
+static void mapping_setup(struct filemap_s *file, int fd, const struct stat *buf)
+{
+	// special and small files are read through the file descriptor
+	if (!S_ISREG(buf->st_mode) || buf->st_size < MAPPING_THRESHOLD) return;
+	// so is content the compress layer transforms on its way up
+	if (fdmap_interest(fd) & 1U << FDMAP_COMPRESS) return;
+	void *mapping = mmap(NULL, (size_t)buf->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) return;
+	madvise(mapping, (size_t)buf->st_size, MADV_SEQUENTIAL);
+
+	file->mapping = mapping;
+	file->mapping_size = (size_t)buf->st_size;
+	file->mapping_dropped = 0;
+}
+
+static bool mapping_hmac(struct filemap_s *file, unsigned char iv_out[256 / CHAR_BIT])
+{
+	mbedtls_md_context_t digest;
+	mbedtls_md_init(&digest);
+	const mbedtls_md_info_t *info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+	int md_result = mbedtls_md_setup(&digest, info, 1);
+	assert(md_result == 0);
+	md_result = mbedtls_md_hmac_starts(&digest, file->key, sizeof(file->key));
+	assert(md_result == 0);
+
+	volatile bool success = false;
+	sigjmp_buf guard;
+	if (sigsetjmp(guard, 0) == 0) {
+		mapping_enter(&guard);
+		md_result = mbedtls_md_hmac_update(&digest, file->mapping, file->mapping_size);
+		assert(md_result == 0);
+		mapping_leave();
+		md_result = mbedtls_md_hmac_finish(&digest, iv_out);
+		assert(md_result == 0);
+		success = true;
+	} else {
+		mapping_leave();
+		mapping_release(file);
+		file->mapping = MAP_FAILED;
+	}
+
+	mbedtls_md_free(&digest);
+	return success;
+}
+
+static bool mapping_crypt(struct filemap_s *file, struct iovec **iov, int *iovcnt, size_t bytes)
+{
+	const size_t start = file->position - sizeof(struct file_header_s);
+	assert(start + bytes <= file->mapping_size);
+
+	sigjmp_buf guard;
+	if (sigsetjmp(guard, 0) != 0) {
+		mapping_leave();
+		mapping_release(file);
+		file->mapping = MAP_FAILED;
+		return false;
+	}
+	mapping_enter(&guard);
+	for (size_t done = 0; done < bytes;) {
+		assert(*iovcnt > 0);
+		struct pipeline_s *pipeline = file->pipeline;
+		const size_t index = (start + done) / PIPELINE_CHUNK;
+
+		if (pipeline && index < pipeline->chunks) {
+			// take the chunk encrypted by a worker
+			struct pipeline_slot_s *slot = pipeline_wait(pipeline, index);
+			if (!slot) {
+				mapping_leave();
+				mapping_release(file);
+				file->mapping = MAP_FAILED;
+				return false;
+			}
+			if (pipeline->joined == index) {
+				gcm_join(file->gcm, slot->hash, PIPELINE_CHUNK);
+				pipeline->joined++;
+			}
+			const size_t within = start + done - index * PIPELINE_CHUNK;
+			size_t chunk = PIPELINE_CHUNK - within;
+			if (chunk > bytes - done) chunk = bytes - done;
+			iov_put(iov, iovcnt, slot->buffer + within, chunk);
+			done += chunk;
+			if (within + chunk == PIPELINE_CHUNK && index + pipeline->slots < pipeline->chunks)
+				pipeline_submit(pipeline, slot, index + pipeline->slots);
+			continue;
+		}
+
+		size_t chunk = (*iov)->iov_len < bytes - done ? (*iov)->iov_len : bytes - done;
+		size_t gcm_size;
+		int gcm_result = gcm_update(file->gcm, file->mapping + start + done, chunk, (*iov)->iov_base, chunk, &gcm_size);
+		assert(gcm_result == 0 && gcm_size == chunk);
+		done += chunk;
+		iov_advance(iov, iovcnt, chunk);
+	}
+	mapping_leave();
+
+	mapping_drop(file, start + bytes);
+	return true;
+}
+
+/* release pages behind the reader, they are not needed again */
+static void mapping_drop(struct filemap_s *file, size_t end)
+{
+	if (end < file->mapping_dropped) return;
+	if (end == file->mapping_size || end - file->mapping_dropped >= DROP_BEHIND) {
+		const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		const size_t until = end == file->mapping_size ? end : end / page * page;
+		if (until > file->mapping_dropped) {
+			madvise((void *)(uintptr_t)(file->mapping + file->mapping_dropped), until - file->mapping_dropped, MADV_DONTNEED);
+			file->mapping_dropped = until;
+		}
+	}
+}
+
+static void mapping_release(struct filemap_s *file)
+{
+	pipeline_stop(file);
+	if (file->mapping && file->mapping != MAP_FAILED)
+		munmap((void *)(uintptr_t)file->mapping, file->mapping_size);
+	file->mapping = NULL;
+}
+
+/* catch SIGBUS while the calling thread accesses a mapping */
+static void mapping_enter(sigjmp_buf *guard)
+{
+	pthread_once(&mapping_once, mapping_install);
+	mapping_guard = guard;
+}
+
+static void mapping_leave(void)
+{
+	mapping_guard = NULL;
+}
+
+static void mapping_install(void)
+{
+	// the handler stays installed, faults outside a mapping go to the previous handler
+	// SIGBUS is not blocked while handling, so the jump out needs no signal mask restore
+	struct sigaction action = { .sa_sigaction = mapping_fault, .sa_flags = SA_SIGINFO | SA_NODEFER };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGBUS, &action, &mapping_previous);
+}
+
+static void mapping_fault(int signal, siginfo_t *info, void *context)
+{
+	if (mapping_guard) siglongjmp(*mapping_guard, 1);
+	// not caused by a mapping: chain to the previous handler
+	if (mapping_previous.sa_flags & SA_SIGINFO) {
+		mapping_previous.sa_sigaction(signal, info, context);
+	} else if (mapping_previous.sa_handler != SIG_DFL && mapping_previous.sa_handler != SIG_IGN) {
+		mapping_previous.sa_handler(signal);
+	} else {
+		// reinstate the default action, the fault repeats on return
+		sigaction(SIGBUS, &mapping_previous, NULL);
+	}
+}
+
+/* encrypt the chunks of the mapping ahead of the reader on worker threads */
+static void pipeline_start(struct filemap_s *file)
+{
+	const unsigned workers = workers_limit();
+	if (workers <= 1 || !gcm_parallel(file->gcm)) return;
+
+	// content past the GCM length limit is left to gcm_update, which refuses it
+	const size_t chunks = (file->mapping_size < GCM_LENGTH_MAX ? file->mapping_size : GCM_LENGTH_MAX) / PIPELINE_CHUNK;
+	size_t slots = (size_t)workers * PIPELINE_DEPTH;
+	if (slots > chunks) slots = chunks;
+
+	struct pipeline_s *pipeline = malloc(sizeof(struct pipeline_s) + slots * sizeof(struct pipeline_slot_s));
+	if (!pipeline) return;
+
+	// when memory is tight, fewer chunks are encrypted ahead
+	size_t available = 0;
+	while (available < slots && (pipeline->slot[available].buffer = iobuf_try(PIPELINE_CHUNK))) available++;
+	if (available < PIPELINE_DEPTH) {
+		for (size_t i = 0; i < available; i++) iobuf_put(pipeline->slot[i].buffer, PIPELINE_CHUNK);
+		free(pipeline);
+		return;
+	}
+	slots = available;
+
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->changed, NULL);
+	pipeline->owner = getpid();
+	pipeline->file = file;
+	pipeline->chunks = chunks;
+	pipeline->joined = 0;
+	pipeline->pending = 0;
+	pipeline->cancelled = false;
+	pipeline->slots = slots;
+	file->pipeline = pipeline;
+
+	for (size_t i = 0; i < slots; i++) {
+		pipeline->slot[i].pipeline = pipeline;
+		pipeline_submit(pipeline, &pipeline->slot[i], i);
+	}
+}
+
+static void pipeline_submit(struct pipeline_s *pipeline, struct pipeline_slot_s *slot, size_t index)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	slot->index = index;
+	slot->state = BUSY;
+	pipeline->pending++;
+	pthread_mutex_unlock(&pipeline->lock);
+	workers_submit(pipeline_work, slot);
+}
+
+static void pipeline_work(void *argument)
+{
+	struct pipeline_slot_s *slot = argument;
+	struct pipeline_s *pipeline = slot->pipeline;
+	const struct filemap_s *file = pipeline->file;
+
+	volatile bool success = true;
+	if (!__atomic_load_n(&pipeline->cancelled, __ATOMIC_RELAXED)) {
+		sigjmp_buf guard;
+		if (sigsetjmp(guard, 0) == 0) {
+			mapping_enter(&guard);
+			const size_t offset = slot->index * PIPELINE_CHUNK;
+			gcm_piece(file->gcm, offset, file->mapping + offset, PIPELINE_CHUNK, slot->buffer, slot->hash);
+		} else {
+			success = false;
+		}
+		mapping_leave();
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	slot->state = success ? READY : FAULT;
+	pipeline->pending--;
+	pthread_cond_broadcast(&pipeline->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* the slot holding the encrypted chunk, NULL if the file shrank */
+static struct pipeline_slot_s *pipeline_wait(struct pipeline_s *pipeline, size_t index)
+{
+	struct pipeline_slot_s *slot = &pipeline->slot[index % pipeline->slots];
+	assert(slot->index == index);
+	pthread_mutex_lock(&pipeline->lock);
+	while (slot->state == BUSY) pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+	pthread_mutex_unlock(&pipeline->lock);
+	return slot->state == READY ? slot : NULL;
+}
+
+static void pipeline_stop(struct filemap_s *file)
+{
+	struct pipeline_s *pipeline = file->pipeline;
+	if (!pipeline) return;
+	file->pipeline = NULL;
+
+	// wait for running jobs, those in a forked child never finish
+	if (pipeline->owner != getpid()) return;
+	pthread_mutex_lock(&pipeline->lock);
+	__atomic_store_n(&pipeline->cancelled, true, __ATOMIC_RELAXED);
+	while (pipeline->pending > 0) pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->changed);
+	for (size_t i = 0; i < pipeline->slots; i++) iobuf_put(pipeline->slot[i].buffer, PIPELINE_CHUNK);
+	free(pipeline);
+}
+
+void encrypt_reset(void)
+{
+	fdmap_reset(FDMAP_ENCRYPT, file_release);
 
 	sync_started = false;
 }
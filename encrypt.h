@@ -1,13 +1,32 @@
 /* intercept layer that presents unison with encrypted file content */
 
 struct stat;
+struct iovec;
 
 [[nodiscard]] int encrypt_open(const char *path, int flags, ...);
+[[nodiscard]] int encrypt_openat(int dirfd, const char *path, int flags, ...);
 [[nodiscard]] int encrypt_close(int fd);
 [[nodiscard]] ssize_t encrypt_read(int fd, void *buf, size_t bytes);
 [[nodiscard]] ssize_t encrypt_write(int fd, const void *buf, size_t bytes);
+[[nodiscard]] ssize_t encrypt_pread(int fd, void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t encrypt_pwrite(int fd, const void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t encrypt_readv(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t encrypt_writev(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t encrypt_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+[[nodiscard]] ssize_t encrypt_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+[[nodiscard]] off_t encrypt_lseek(int fd, off_t offset, int whence);
+#ifndef __APPLE__
+[[nodiscard]] ssize_t encrypt_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+[[nodiscard]] ssize_t encrypt_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+#endif
 [[nodiscard]] int encrypt_stat(const char * restrict path, struct stat * restrict buf);
 [[nodiscard]] int encrypt_lstat(const char * restrict path, struct stat * restrict buf);
+[[nodiscard]] int encrypt_fstat(int fd, struct stat *buf);
+[[nodiscard]] int encrypt_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags);
+#ifndef __APPLE__
+struct statx;
+[[nodiscard]] int encrypt_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf);
+#endif
 #ifdef __APPLE__
 [[nodiscard]] int encrypt_getattrlist(const char *path, void *attrs, void *buf, size_t buf_size, unsigned int options);
 #endif
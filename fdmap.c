@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <assert.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "fdmap.h"
+#include "iobuf.h"
+
+
+struct fdmap_s fdmap = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.chunk = { NULL }
+};
+
+
+void *fdmap_acquire(int fd, enum fdmap_slot slot)
+{
+	if (!(fdmap_interest(fd) & (1U << slot))) return NULL;
+
+	pthread_mutex_lock(&fdmap.lock);
+	// the state cannot be replaced and released while we hold the lock
+	struct fdmap_reference_s *reference = fdmap_get(fd, slot);
+	if (reference) atomic_fetch_add_explicit(&reference->count, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&fdmap.lock);
+
+	return reference;
+}
+
+void *fdmap_set(int fd, enum fdmap_slot slot, void *state)
+{
+	assert(fd >= 0);
+	if (fd >= FDMAP_CHUNK_SIZE * FDMAP_CHUNKS) abort();
+	if (!state && !(fdmap_interest(fd) & (1U << slot))) return NULL;
+
+	pthread_mutex_lock(&fdmap.lock);
+
+	struct fdmap_chunk_s *chunk = atomic_load_explicit(&fdmap.chunk[fd / FDMAP_CHUNK_SIZE], memory_order_relaxed);
+	if (!chunk && state) {
+		chunk = calloc(1, sizeof(struct fdmap_chunk_s));
+		if (!chunk) abort();
+		atomic_store_explicit(&fdmap.chunk[fd / FDMAP_CHUNK_SIZE], chunk, memory_order_release);
+	}
+
+	void *previous = NULL;
+	if (chunk) {
+		const size_t index = fd % FDMAP_CHUNK_SIZE;
+		const unsigned char interest = atomic_load_explicit(&chunk->interest[index], memory_order_relaxed);
+		if (interest & (1U << slot)) previous = chunk->state[index][slot];
+		chunk->state[index][slot] = state;
+		// publish the state before announcing it in the bitmap
+		if (state)
+			atomic_store_explicit(&chunk->interest[index], interest | (1U << slot), memory_order_release);
+		else
+			atomic_store_explicit(&chunk->interest[index], interest & ~(1U << slot), memory_order_release);
+	}
+
+	pthread_mutex_unlock(&fdmap.lock);
+
+	return previous;
+}
+
+void fdmap_reset(enum fdmap_slot slot, void (*release)(void *state))
+{
+	pthread_mutex_lock(&fdmap.lock);
+
+	for (size_t i = 0; i < FDMAP_CHUNKS; i++) {
+		struct fdmap_chunk_s *chunk = atomic_load_explicit(&fdmap.chunk[i], memory_order_relaxed);
+		if (!chunk) continue;
+		for (size_t index = 0; index < FDMAP_CHUNK_SIZE; index++) {
+			const unsigned char interest = atomic_load_explicit(&chunk->interest[index], memory_order_relaxed);
+			if (!(interest & (1U << slot))) continue;
+			atomic_store_explicit(&chunk->interest[index], interest & ~(1U << slot), memory_order_release);
+			release(chunk->state[index][slot]);
+			chunk->state[index][slot] = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&fdmap.lock);
+}
+
+char *fdmap_path(int dirfd, const char *path, int flags)
+{
+#ifdef AT_EMPTY_PATH
+	const bool empty = path[0] == '\0' && (flags & AT_EMPTY_PATH);
+#else
+	(void)flags;
+	const bool empty = false;
+#endif
+	if (!empty && (path[0] == '/' || dirfd == AT_FDCWD)) return NULL;
+
+	// ask the kernel for the current path of the directory
+	char directory[PATH_MAX];
+#ifdef __APPLE__
+	if (fcntl(dirfd, F_GETPATH, directory) == -1) return NULL;
+#else
+	char link[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+	ssize_t length = readlink(link, directory, sizeof(directory) - 1);
+	if (length < 0) return NULL;
+	directory[length] = '\0';
+#endif
+
+	if (empty) return strdup(directory);
+
+	size_t size = strlen(directory) + sizeof((char)'/') + strlen(path) + sizeof((char)'\0');
+	char *result = malloc(size);
+	if (!result) abort();
+	snprintf(result, size, "%s/%s", directory, path);
+	return result;
+}
+
+ssize_t fdmap_write(int fd, const void *buffer, size_t bytes, off_t offset)
+{
+	const char *source = buffer;
+	while (bytes > 0) {
+		ssize_t write_result;
+		if (offset < 0) {
+			write_result = write(fd, source, bytes);
+		} else {
+			write_result = pwrite(fd, source, bytes, offset);
+			if (write_result > 0) offset += write_result;
+		}
+		if (write_result < 0 && errno == EINTR) continue;
+		if (write_result < 0) return write_result;
+		source += write_result;
+		bytes -= (size_t)write_result;
+	}
+	return 0;
+}
+
+#ifndef __APPLE__
+ssize_t fdmap_copy(const struct fdmap_io_s *io, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+	// no flags are defined, the kernel rejects any
+	if (flags != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ssize_t result = 0;
+	size_t size;
+	char *buffer = iobuf_get(len, IOBUF_MIN, &size);
+
+	while (len > 0) {
+		size_t chunk = len < size ? len : size;
+		ssize_t read_result;
+		if (off_in)
+			read_result = io->pread(fd_in, buffer, chunk, *off_in);
+		else
+			read_result = io->read(fd_in, buffer, chunk);
+		if (read_result < 0 && errno == EINTR) continue;
+		if (read_result < 0 && result == 0) result = -1;
+		if (read_result <= 0) break;
+
+		// data already consumed from the input must reach the output
+		const char *source = buffer;
+		size_t to_write = (size_t)read_result;
+		while (to_write > 0) {
+			ssize_t write_result;
+			if (off_out)
+				write_result = io->pwrite(fd_out, source, to_write, *off_out);
+			else
+				write_result = io->write(fd_out, source, to_write);
+			if (write_result < 0 && errno == EINTR) continue;
+			if (write_result <= 0) break;
+			if (off_in) *off_in += write_result;
+			if (off_out) *off_out += write_result;
+			source += write_result;
+			to_write -= (size_t)write_result;
+			result += write_result;
+			len -= (size_t)write_result;
+		}
+		if (to_write > 0) {
+			if (result == 0) result = -1;
+			break;
+		}
+	}
+
+	iobuf_put(buffer, size);
+	return result;
+}
+#endif
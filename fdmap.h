@@ -0,0 +1,95 @@
+/* per file descriptor state of the intercept layers
+ *
+ * Every layer that tracks open files owns one slot per file descriptor. The
+ * table is indexed by file descriptor and allocated in chunks on demand. A
+ * bitmap tells which layers are interested in a file descriptor and can be
+ * read without locking, so calls on file descriptors no layer cares about can
+ * bypass the intercept layers entirely. */
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+enum fdmap_slot {
+	FDMAP_NOCACHE,  // cache use of a written or read file
+	FDMAP_CONFIG,   // config file currently being parsed
+	FDMAP_ENCRYPT,  // encryption state of a file
+	FDMAP_COMPRESS, // compression state of a file
+	FDMAP_SYMLINK,  // path of a directory stream
+	FDMAP_SLOTS
+};
+
+#define FDMAP_CHUNK_SIZE 1024
+#define FDMAP_CHUNKS 65536
+
+extern struct fdmap_s {
+	pthread_mutex_t lock;
+	struct fdmap_chunk_s {
+		_Atomic unsigned char interest[FDMAP_CHUNK_SIZE];
+		void *state[FDMAP_CHUNK_SIZE][FDMAP_SLOTS];
+	} * _Atomic chunk[FDMAP_CHUNKS];
+} fdmap;
+
+/* bitmap of the slots holding state for the file descriptor */
+static inline unsigned fdmap_interest(int fd)
+{
+	if (fd < 0 || fd >= FDMAP_CHUNK_SIZE * FDMAP_CHUNKS) return 0;
+	struct fdmap_chunk_s *chunk = atomic_load_explicit(&fdmap.chunk[fd / FDMAP_CHUNK_SIZE], memory_order_acquire);
+	if (!chunk) return 0;
+	return atomic_load_explicit(&chunk->interest[fd % FDMAP_CHUNK_SIZE], memory_order_acquire);
+}
+
+/* state stored by a layer, NULL if none */
+static inline void *fdmap_get(int fd, enum fdmap_slot slot)
+{
+	if (!(fdmap_interest(fd) & (1U << slot))) return NULL;
+	struct fdmap_chunk_s *chunk = atomic_load_explicit(&fdmap.chunk[fd / FDMAP_CHUNK_SIZE], memory_order_relaxed);
+	return chunk->state[fd % FDMAP_CHUNK_SIZE][slot];
+}
+
+/* Layer state used by concurrent calls starts with a reference count. The
+ * table owns one reference, which fdmap_set() hands back with the previous
+ * state, and fdmap_acquire() takes one for the caller under the table lock,
+ * so a concurrent close cannot free the state while a call still uses it. */
+struct fdmap_reference_s {
+	_Atomic unsigned count;
+};
+
+/* state stored by a layer with a reference taken for the caller, NULL if none */
+void *fdmap_acquire(int fd, enum fdmap_slot slot);
+
+/* drop a reference, true if it was the last one and the caller must free the state */
+static inline bool fdmap_put(void *state)
+{
+	struct fdmap_reference_s *reference = state;
+	return atomic_fetch_sub_explicit(&reference->count, 1, memory_order_acq_rel) == 1;
+}
+
+/* store new state and return the previous one, NULL state clears the slot */
+void *fdmap_set(int fd, enum fdmap_slot slot, void *state);
+/* clear the slot for all file descriptors, passing the state to release */
+void fdmap_reset(enum fdmap_slot slot, void (*release)(void *state));
+
+/* absolute form of a path relative to a directory file descriptor
+ * Returns NULL when the path can be used as is, otherwise a string to free(). */
+[[nodiscard]] char *fdmap_path(int dirfd, const char *path, int flags);
+
+/* write() or pwrite() the whole buffer, a negative offset writes at the file position
+ * Returns 0, or a negative result with errno set when a write fails. */
+[[nodiscard]] ssize_t fdmap_write(int fd, const void *buffer, size_t bytes, off_t offset);
+
+#ifndef __APPLE__
+/* the functions of a layer a copy through userspace runs through */
+struct fdmap_io_s {
+	ssize_t (*read)(int fd, void *buf, size_t bytes);
+	ssize_t (*pread)(int fd, void *buf, size_t bytes, off_t offset);
+	ssize_t (*write)(int fd, const void *buf, size_t bytes);
+	ssize_t (*pwrite)(int fd, const void *buf, size_t bytes, off_t offset);
+};
+
+/* copy_file_range() through userspace, for content the kernel cannot copy
+ * A NULL offset uses and advances the file position, like sendfile() does for
+ * its output. Returns the bytes copied, or -1 with errno set if none were. */
+[[nodiscard]] ssize_t fdmap_copy(const struct fdmap_io_s *io, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+#endif
@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "gcm.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TARGET_AESNI __attribute__((target("aes,pclmul,sse4.1,ssse3")))
+#define TARGET_VAES __attribute__((target("aes,pclmul,sse4.1,ssse3,avx,avx2,vaes,vpclmulqdq")))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define UNROLL _Pragma("GCC unroll 16")
+#endif
+
+
+static enum gcm_backend selected = GCM_MBEDTLS;
+static pthread_once_t selected_once = PTHREAD_ONCE_INIT;
+
+static const char *backend_names[GCM_BACKENDS] = {
+	[GCM_MBEDTLS] = "mbedtls", [GCM_AESNI] = "aesni", [GCM_VAES] = "vaes"
+};
+
+static void backend_select(void);
+static bool backend_usable(enum gcm_backend backend);
+static void zeroize(void *buffer, size_t size);
+#if defined(__x86_64__)
+static void native_setkey(struct gcm_native_s *native, const unsigned char key[256 / CHAR_BIT]);
+static void native_starts(struct gcm_native_s *native, bool decrypt, const unsigned char *iv, size_t iv_length);
+static void native_update(struct gcm_native_s *native, const unsigned char *input, size_t length, unsigned char *output, bool wide);
+static void native_finish(struct gcm_native_s *native, unsigned char tag[16]);
+static size_t native_wide(struct gcm_native_s *native, const unsigned char *input, size_t length, unsigned char *output);
+static void native_piece(const struct gcm_native_s *native, uint64_t offset, const unsigned char *input, size_t length, unsigned char *output, unsigned char hash_out[16], bool wide);
+static void native_join(struct gcm_native_s *native, const unsigned char hash[16], size_t length);
+#endif
+
+
+void gcm_init(struct gcm_s *gcm)
+{
+	pthread_once(&selected_once, backend_select);
+	memset(gcm, 0, sizeof(*gcm));
+	gcm->backend = selected;
+	mbedtls_gcm_init(&gcm->mbedtls);
+}
+
+int gcm_setkey(struct gcm_s *gcm, const unsigned char key[256 / CHAR_BIT])
+{
+#if defined(__x86_64__)
+	if (gcm->backend != GCM_MBEDTLS) {
+		native_setkey(&gcm->native, key);
+		return 0;
+	}
+#endif
+	return mbedtls_gcm_setkey(&gcm->mbedtls, MBEDTLS_CIPHER_ID_AES, key, 256);
+}
+
+int gcm_starts(struct gcm_s *gcm, int mode, const unsigned char *iv, size_t iv_length)
+{
+#if defined(__x86_64__)
+	if (gcm->backend != GCM_MBEDTLS) {
+		native_starts(&gcm->native, mode == MBEDTLS_GCM_DECRYPT, iv, iv_length);
+		return 0;
+	}
+#endif
+	return mbedtls_gcm_starts(&gcm->mbedtls, mode, iv, iv_length);
+}
+
+int gcm_update(struct gcm_s *gcm, const unsigned char *input, size_t length, unsigned char *output, size_t output_size, size_t *output_length)
+{
+#if defined(__x86_64__)
+	if (gcm->backend != GCM_MBEDTLS) {
+		// like mbedtls, refuse text beyond the counter range of one IV
+		if (length > GCM_LENGTH_MAX || gcm->native.length > GCM_LENGTH_MAX - length) return MBEDTLS_ERR_GCM_BAD_INPUT;
+		assert(output_size >= length);
+		native_update(&gcm->native, input, length, output, gcm->backend == GCM_VAES);
+		*output_length = length;
+		return 0;
+	}
+#endif
+	return mbedtls_gcm_update(&gcm->mbedtls, input, length, output, output_size, output_length);
+}
+
+int gcm_finish(struct gcm_s *gcm, unsigned char *output, size_t output_size, size_t *output_length, unsigned char *tag, size_t tag_length)
+{
+#if defined(__x86_64__)
+	if (gcm->backend != GCM_MBEDTLS) {
+		// all data has been passed through already, only the tag remains
+		unsigned char full_tag[16];
+		assert(tag_length <= sizeof(full_tag));
+		native_finish(&gcm->native, full_tag);
+		memcpy(tag, full_tag, tag_length);
+		*output_length = 0;
+		return 0;
+	}
+#endif
+	return mbedtls_gcm_finish(&gcm->mbedtls, output, output_size, output_length, tag, tag_length);
+}
+
+void gcm_free(struct gcm_s *gcm)
+{
+	mbedtls_gcm_free(&gcm->mbedtls);
+	zeroize(&gcm->native, sizeof(gcm->native));
+}
+
+bool gcm_parallel(const struct gcm_s *gcm)
+{
+	// mbedtls keeps its hash state private
+	return gcm->backend != GCM_MBEDTLS;
+}
+
+void gcm_piece(const struct gcm_s *gcm, uint64_t offset, const unsigned char *input, size_t length, unsigned char *output, unsigned char hash_out[16])
+{
+	assert(gcm_parallel(gcm) && offset % 16 == 0 && length % 16 == 0);
+	assert(offset <= GCM_LENGTH_MAX && length <= GCM_LENGTH_MAX - offset);
+#if defined(__x86_64__)
+	native_piece(&gcm->native, offset, input, length, output, hash_out, gcm->backend == GCM_VAES);
+#else
+	(void)input;
+	(void)output;
+	(void)hash_out;
+#endif
+}
+
+void gcm_join(struct gcm_s *gcm, const unsigned char hash[16], size_t length)
+{
+	assert(gcm_parallel(gcm) && length % 16 == 0);
+	assert(length <= GCM_LENGTH_MAX - gcm->native.length);
+#if defined(__x86_64__)
+	native_join(&gcm->native, hash, length);
+#else
+	(void)hash;
+#endif
+}
+
+enum gcm_backend gcm_backend(void)
+{
+	pthread_once(&selected_once, backend_select);
+	return selected;
+}
+
+const char *gcm_backend_name(enum gcm_backend backend)
+{
+	return backend < GCM_BACKENDS ? backend_names[backend] : "unknown";
+}
+
+
+/* MARK: - Helper Functions */
+
+static void backend_select(void)
+{
+	const char *requested = getenv("UNISON_INTERCEPT_GCM");
+	if (requested) {
+		for (enum gcm_backend backend = GCM_MBEDTLS; backend < GCM_BACKENDS; backend++) {
+			if (strcmp(requested, backend_names[backend]) == 0 && backend_usable(backend)) {
+				selected = backend;
+				return;
+			}
+		}
+	}
+
+	// prefer the widest implementation
+	for (enum gcm_backend backend = GCM_BACKENDS - 1; backend > GCM_MBEDTLS; backend--) {
+		if (backend_usable(backend)) {
+			selected = backend;
+			return;
+		}
+	}
+	selected = GCM_MBEDTLS;
+}
+
+/* whether the processor supports an implementation and it agrees with mbedtls */
+static bool backend_usable(enum gcm_backend backend)
+{
+	if (backend == GCM_MBEDTLS) return true;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	bool supported = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+	                 __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+	if (backend == GCM_VAES)
+		supported = supported && __builtin_cpu_supports("avx2") &&
+		            __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq");
+	if (!supported) return false;
+
+	// encrypt and decrypt in pieces that exercise all code paths
+	unsigned char key[256 / CHAR_BIT], iv[256 / CHAR_BIT], plain[1500];
+	unsigned char expected[sizeof(plain)], actual[sizeof(plain)];
+	unsigned char expected_tag[16], actual_tag[16];
+	for (size_t i = 0; i < sizeof(key); i++) key[i] = (unsigned char)(i * 13 + 7);
+	for (size_t i = 0; i < sizeof(iv); i++) iv[i] = (unsigned char)(i * 29 + 3);
+	for (size_t i = 0; i < sizeof(plain); i++) plain[i] = (unsigned char)(i * 7 + i / 251);
+	const size_t pieces[] = { 1, 15, 300, 17, 600, 16, 128, 3, sizeof(plain) - 1080 };
+
+	struct gcm_s reference, candidate;
+	size_t size;
+	bool agree = true;
+	mbedtls_gcm_init(&reference.mbedtls);
+	agree = agree && mbedtls_gcm_setkey(&reference.mbedtls, MBEDTLS_CIPHER_ID_AES, key, 256) == 0;
+	agree = agree && mbedtls_gcm_starts(&reference.mbedtls, MBEDTLS_GCM_ENCRYPT, iv, sizeof(iv)) == 0;
+	agree = agree && mbedtls_gcm_update(&reference.mbedtls, plain, sizeof(plain), expected, sizeof(expected), &size) == 0;
+	agree = agree && mbedtls_gcm_finish(&reference.mbedtls, NULL, 0, &size, expected_tag, sizeof(expected_tag)) == 0;
+	mbedtls_gcm_free(&reference.mbedtls);
+	if (!agree) return false;
+
+	for (int mode = 0; mode < 2; mode++) {
+		candidate.backend = backend;
+		native_setkey(&candidate.native, key);
+		native_starts(&candidate.native, mode == 1, iv, sizeof(iv));
+		size_t offset = 0;
+		for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+			// decrypt in place to cover aliased buffers
+			if (mode == 0) {
+				native_update(&candidate.native, plain + offset, pieces[i], actual + offset, backend == GCM_VAES);
+			} else {
+				memcpy(actual + offset, expected + offset, pieces[i]);
+				native_update(&candidate.native, actual + offset, pieces[i], actual + offset, backend == GCM_VAES);
+			}
+			offset += pieces[i];
+		}
+		native_finish(&candidate.native, actual_tag);
+		assert(offset == sizeof(plain));
+		agree = agree && memcmp(actual, mode == 0 ? expected : plain, sizeof(plain)) == 0;
+		agree = agree && memcmp(actual_tag, expected_tag, sizeof(expected_tag)) == 0;
+	}
+
+	// encrypt whole blocks in pieces processed out of order, join them, and continue with the rest
+	const size_t blocks[] = { 16, 512, 400, 96 };
+	unsigned char hash[sizeof(blocks) / sizeof(blocks[0])][16];
+	candidate.backend = backend;
+	native_setkey(&candidate.native, key);
+	native_starts(&candidate.native, false, iv, sizeof(iv));
+	for (size_t i = sizeof(blocks) / sizeof(blocks[0]); i-- > 0;) {
+		size_t offset = 0;
+		for (size_t j = 0; j < i; j++) offset += blocks[j];
+		native_piece(&candidate.native, offset, plain + offset, blocks[i], actual + offset, hash[i], backend == GCM_VAES);
+	}
+	size_t offset = 0;
+	for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+		native_join(&candidate.native, hash[i], blocks[i]);
+		offset += blocks[i];
+	}
+	native_update(&candidate.native, plain + offset, sizeof(plain) - offset, actual + offset, backend == GCM_VAES);
+	native_finish(&candidate.native, actual_tag);
+	agree = agree && memcmp(actual, expected, sizeof(plain)) == 0;
+	agree = agree && memcmp(actual_tag, expected_tag, sizeof(expected_tag)) == 0;
+	zeroize(&candidate.native, sizeof(candidate.native));
+	return agree;
+#else
+	return false;
+#endif
+}
+
+static void zeroize(void *buffer, size_t size)
+{
+	volatile unsigned char *bytes = buffer;
+	while (size--) *bytes++ = 0;
+}
+
+
+/* MARK: - Native Implementation */
+
+#if defined(__x86_64__)
+
+/* GHASH operates on byte-reversed blocks, so carry-less products need only one extra shift */
+TARGET_AESNI static ALWAYS_INLINE __m128i byte_reverse(__m128i block)
+{
+	return _mm_shuffle_epi8(block, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+TARGET_AESNI static ALWAYS_INLINE __m128i counter_block(__m128i base, uint32_t counter)
+{
+	return _mm_insert_epi32(base, (int)__builtin_bswap32(counter), 3);
+}
+
+TARGET_AESNI static ALWAYS_INLINE __m128i aes_encrypt(const __m128i round_key[15], __m128i block)
+{
+	block = _mm_xor_si128(block, round_key[0]);
+	UNROLL
+	for (int round = 1; round < 14; round++) block = _mm_aesenc_si128(block, round_key[round]);
+	return _mm_aesenclast_si128(block, round_key[14]);
+}
+
+TARGET_AESNI static ALWAYS_INLINE __m128i expand_step(__m128i key, __m128i generated)
+{
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, generated);
+}
+
+/* 256 bit product of two field elements, before reduction */
+TARGET_AESNI static ALWAYS_INLINE void clmul_wide(__m128i a, __m128i b, __m128i *low, __m128i *high)
+{
+	__m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+	*low = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(middle, 8));
+	*high = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(middle, 8));
+}
+
+/* shift the product left by one bit and reduce it modulo x^128 + x^7 + x^2 + x + 1 */
+TARGET_AESNI static ALWAYS_INLINE __m128i reduce(__m128i low, __m128i high)
+{
+	__m128i carry_low = _mm_srli_epi32(low, 31);
+	__m128i carry_high = _mm_srli_epi32(high, 31);
+	low = _mm_slli_epi32(low, 1);
+	high = _mm_slli_epi32(high, 1);
+	__m128i carry_across = _mm_srli_si128(carry_low, 12);
+	carry_high = _mm_slli_si128(carry_high, 4);
+	carry_low = _mm_slli_si128(carry_low, 4);
+	low = _mm_or_si128(low, carry_low);
+	high = _mm_or_si128(_mm_or_si128(high, carry_high), carry_across);
+
+	__m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)), _mm_slli_epi32(low, 25));
+	__m128i b = _mm_srli_si128(a, 4);
+	low = _mm_xor_si128(low, _mm_slli_si128(a, 12));
+	__m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)), _mm_srli_epi32(low, 7));
+	low = _mm_xor_si128(low, _mm_xor_si128(c, b));
+	return _mm_xor_si128(high, low);
+}
+
+TARGET_AESNI static ALWAYS_INLINE __m128i ghash_multiply(__m128i a, __m128i b)
+{
+	__m128i low, high;
+	clmul_wide(a, b, &low, &high);
+	return reduce(low, high);
+}
+
+TARGET_AESNI static void native_setkey(struct gcm_native_s *native, const unsigned char key[256 / CHAR_BIT])
+{
+	__m128i round_key[15];
+	round_key[0] = _mm_loadu_si128((const __m128i *)(const void *)key);
+	round_key[1] = _mm_loadu_si128((const __m128i *)(const void *)(key + 16));
+#define EXPAND_EVEN(i, rcon) round_key[i] = expand_step(round_key[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(round_key[i - 1], rcon), 0xff))
+#define EXPAND_ODD(i) round_key[i] = expand_step(round_key[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(round_key[i - 1], 0x00), 0xaa))
+	EXPAND_EVEN(2, 0x01); EXPAND_ODD(3);
+	EXPAND_EVEN(4, 0x02); EXPAND_ODD(5);
+	EXPAND_EVEN(6, 0x04); EXPAND_ODD(7);
+	EXPAND_EVEN(8, 0x08); EXPAND_ODD(9);
+	EXPAND_EVEN(10, 0x10); EXPAND_ODD(11);
+	EXPAND_EVEN(12, 0x20); EXPAND_ODD(13);
+	EXPAND_EVEN(14, 0x40);
+#undef EXPAND_EVEN
+#undef EXPAND_ODD
+	for (int round = 0; round < 15; round++)
+		_mm_storeu_si128((__m128i *)(void *)native->round_key[round], round_key[round]);
+
+	// powers of the hash key H for aggregated reduction
+	__m128i hash_key = byte_reverse(aes_encrypt(round_key, _mm_setzero_si128()));
+	__m128i power = hash_key;
+	for (int i = 0; i < GCM_HASH_POWERS; i++) {
+		_mm_storeu_si128((__m128i *)(void *)native->hash_key[i], power);
+		power = ghash_multiply(power, hash_key);
+	}
+	zeroize(round_key, sizeof(round_key));
+}
+
+TARGET_AESNI static void native_starts(struct gcm_native_s *native, bool decrypt, const unsigned char *iv, size_t iv_length)
+{
+	__m128i j0;
+	if (iv_length == 12) {
+		unsigned char block[16] = { 0 };
+		memcpy(block, iv, 12);
+		block[15] = 1;
+		j0 = _mm_loadu_si128((const __m128i *)(const void *)block);
+	} else {
+		// hash the IV, padded to full blocks and followed by its length in bits
+		const __m128i hash_key = _mm_loadu_si128((const __m128i *)(const void *)native->hash_key[0]);
+		__m128i hash = _mm_setzero_si128();
+		for (size_t offset = 0; offset < iv_length; offset += 16) {
+			unsigned char block[16] = { 0 };
+			memcpy(block, iv + offset, iv_length - offset < 16 ? iv_length - offset : 16);
+			hash = ghash_multiply(_mm_xor_si128(hash, byte_reverse(_mm_loadu_si128((const __m128i *)(const void *)block))), hash_key);
+		}
+		hash = ghash_multiply(_mm_xor_si128(hash, _mm_set_epi64x(0, (long long)((uint64_t)iv_length * 8))), hash_key);
+		j0 = byte_reverse(hash);
+	}
+
+	_mm_storeu_si128((__m128i *)(void *)native->counter_block, j0);
+	native->counter = __builtin_bswap32((uint32_t)_mm_extract_epi32(j0, 3)) + 1;
+	native->decrypt = decrypt;
+	memset(native->hash, 0, sizeof(native->hash));
+	native->partial = 0;
+	native->length = 0;
+}
+
+TARGET_AESNI static void native_blocks8(const __m128i round_key[15], const __m128i power[GCM_HASH_POWERS], __m128i base, uint32_t *counter,
+                                        __m128i *hash, bool decrypt, const unsigned char *input, unsigned char *output)
+{
+	__m128i block[8], text[8];
+	UNROLL
+	for (int i = 0; i < 8; i++) block[i] = _mm_xor_si128(counter_block(base, *counter + (uint32_t)i), round_key[0]);
+	*counter += 8;
+	UNROLL
+	for (int round = 1; round < 14; round++)
+		UNROLL
+		for (int i = 0; i < 8; i++) block[i] = _mm_aesenc_si128(block[i], round_key[round]);
+	UNROLL
+	for (int i = 0; i < 8; i++) block[i] = _mm_aesenclast_si128(block[i], round_key[14]);
+
+	// load all input before storing, input and output may be the same buffer
+	UNROLL
+	for (int i = 0; i < 8; i++) text[i] = _mm_loadu_si128((const __m128i *)(const void *)(input + 16 * i));
+	UNROLL
+	for (int i = 0; i < 8; i++) {
+		block[i] = _mm_xor_si128(block[i], text[i]);
+		_mm_storeu_si128((__m128i *)(void *)(output + 16 * i), block[i]);
+		text[i] = byte_reverse(decrypt ? text[i] : block[i]);
+	}
+
+	// Y = (Y + X0) * H^8 + X1 * H^7 + ... + X7 * H, reduced once
+	__m128i low, high, part_low, part_high;
+	clmul_wide(_mm_xor_si128(*hash, text[0]), power[7], &low, &high);
+	UNROLL
+	for (int i = 1; i < 8; i++) {
+		clmul_wide(text[i], power[7 - i], &part_low, &part_high);
+		low = _mm_xor_si128(low, part_low);
+		high = _mm_xor_si128(high, part_high);
+	}
+	*hash = reduce(low, high);
+}
+
+TARGET_AESNI static void native_update(struct gcm_native_s *native, const unsigned char *input, size_t length, unsigned char *output, bool wide)
+{
+	native->length += length;
+
+	// complete a block left over from the previous call
+	if (native->partial) {
+		while (native->partial < 16 && length > 0) {
+			unsigned char byte = *input ^ native->key_stream[native->partial];
+			native->text[native->partial++] = native->decrypt ? *input : byte;
+			*output++ = byte;
+			input++;
+			length--;
+		}
+		if (native->partial < 16) return;
+		__m128i hash = _mm_loadu_si128((const __m128i *)(void *)native->hash);
+		__m128i text = byte_reverse(_mm_loadu_si128((const __m128i *)(void *)native->text));
+		hash = ghash_multiply(_mm_xor_si128(hash, text), _mm_loadu_si128((const __m128i *)(void *)native->hash_key[0]));
+		_mm_storeu_si128((__m128i *)(void *)native->hash, hash);
+		native->partial = 0;
+	}
+
+	if (wide && length >= 16 * 16) {
+		size_t done = native_wide(native, input, length, output);
+		input += done;
+		output += done;
+		length -= done;
+	}
+
+	__m128i round_key[15], power[GCM_HASH_POWERS];
+	for (int round = 0; round < 15; round++) round_key[round] = _mm_loadu_si128((const __m128i *)(void *)native->round_key[round]);
+	for (int i = 0; i < 8; i++) power[i] = _mm_loadu_si128((const __m128i *)(void *)native->hash_key[i]);
+	const __m128i base = _mm_loadu_si128((const __m128i *)(void *)native->counter_block);
+	__m128i hash = _mm_loadu_si128((const __m128i *)(void *)native->hash);
+	uint32_t counter = native->counter;
+
+	for (; length >= 16 * 8; length -= 16 * 8, input += 16 * 8, output += 16 * 8)
+		native_blocks8(round_key, power, base, &counter, &hash, native->decrypt, input, output);
+
+	for (; length >= 16; length -= 16, input += 16, output += 16) {
+		__m128i text = _mm_loadu_si128((const __m128i *)(const void *)input);
+		__m128i block = _mm_xor_si128(aes_encrypt(round_key, counter_block(base, counter++)), text);
+		_mm_storeu_si128((__m128i *)(void *)output, block);
+		hash = ghash_multiply(_mm_xor_si128(hash, byte_reverse(native->decrypt ? text : block)), power[0]);
+	}
+
+	if (length > 0) {
+		// keep the key stream of a trailing partial block for the next call
+		_mm_storeu_si128((__m128i *)(void *)native->key_stream, aes_encrypt(round_key, counter_block(base, counter++)));
+		for (size_t i = 0; i < length; i++) {
+			unsigned char byte = input[i] ^ native->key_stream[i];
+			native->text[i] = native->decrypt ? input[i] : byte;
+			output[i] = byte;
+		}
+		native->partial = length;
+	}
+
+	_mm_storeu_si128((__m128i *)(void *)native->hash, hash);
+	native->counter = counter;
+	zeroize(round_key, sizeof(round_key));
+}
+
+TARGET_AESNI static void native_finish(struct gcm_native_s *native, unsigned char tag[16])
+{
+	const __m128i hash_key = _mm_loadu_si128((const __m128i *)(void *)native->hash_key[0]);
+	__m128i hash = _mm_loadu_si128((const __m128i *)(void *)native->hash);
+
+	if (native->partial) {
+		memset(native->text + native->partial, 0, 16 - native->partial);
+		hash = ghash_multiply(_mm_xor_si128(hash, byte_reverse(_mm_loadu_si128((const __m128i *)(void *)native->text))), hash_key);
+		native->partial = 0;
+	}
+	// lengths of additional data, which is not used, and of the text in bits
+	hash = ghash_multiply(_mm_xor_si128(hash, _mm_set_epi64x(0, (long long)(native->length * 8))), hash_key);
+
+	__m128i round_key[15];
+	for (int round = 0; round < 15; round++) round_key[round] = _mm_loadu_si128((const __m128i *)(void *)native->round_key[round]);
+	__m128i j0 = _mm_loadu_si128((const __m128i *)(void *)native->counter_block);
+	_mm_storeu_si128((__m128i *)(void *)tag, _mm_xor_si128(aes_encrypt(round_key, j0), byte_reverse(hash)));
+	zeroize(round_key, sizeof(round_key));
+}
+
+TARGET_AESNI static void native_piece(const struct gcm_native_s *native, uint64_t offset, const unsigned char *input, size_t length, unsigned char *output, unsigned char hash_out[16], bool wide)
+{
+	// a private state that starts hashing afresh at the counter of the offset
+	struct gcm_native_s piece;
+	memcpy(piece.round_key, native->round_key, sizeof(piece.round_key));
+	memcpy(piece.hash_key, native->hash_key, sizeof(piece.hash_key));
+	memcpy(piece.counter_block, native->counter_block, sizeof(piece.counter_block));
+	const __m128i j0 = _mm_loadu_si128((const __m128i *)(const void *)piece.counter_block);
+	piece.counter = __builtin_bswap32((uint32_t)_mm_extract_epi32(j0, 3)) + 1 + (uint32_t)(offset / 16);
+	piece.decrypt = native->decrypt;
+	memset(piece.hash, 0, sizeof(piece.hash));
+	piece.partial = 0;
+	piece.length = 0;
+
+	native_update(&piece, input, length, output, wide);
+	memcpy(hash_out, piece.hash, sizeof(piece.hash));
+	zeroize(&piece, sizeof(piece));
+}
+
+/* Y = Y * H^n + hash of the piece, where n is the number of blocks in the piece */
+TARGET_AESNI static void native_join(struct gcm_native_s *native, const unsigned char hash[16], size_t length)
+{
+	assert(native->partial == 0);
+	size_t blocks = length / 16;
+	if (blocks == 0) return;
+
+	// H^n by square and multiply
+	__m128i square = _mm_loadu_si128((const __m128i *)(void *)native->hash_key[0]);
+	__m128i power = _mm_setzero_si128();
+	bool first = true;
+	for (;;) {
+		if (blocks & 1) {
+			power = first ? square : ghash_multiply(power, square);
+			first = false;
+		}
+		blocks >>= 1;
+		if (!blocks) break;
+		square = ghash_multiply(square, square);
+	}
+
+	__m128i running = _mm_loadu_si128((const __m128i *)(void *)native->hash);
+	running = _mm_xor_si128(ghash_multiply(running, power), _mm_loadu_si128((const __m128i *)(const void *)hash));
+	_mm_storeu_si128((__m128i *)(void *)native->hash, running);
+	native->counter += (uint32_t)(length / 16);
+	native->length += length;
+}
+
+/* process as many groups of sixteen blocks as possible, two blocks per vector */
+TARGET_VAES static size_t native_wide(struct gcm_native_s *native, const unsigned char *input, size_t length, unsigned char *output)
+{
+	const __m128i reverse128 = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m256i reverse = _mm256_broadcastsi128_si256(reverse128);
+	__m256i round_key[15], power[8];
+	UNROLL
+	for (int round = 0; round < 15; round++)
+		round_key[round] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(void *)native->round_key[round]));
+	// block 2i is multiplied by H^(16-2i), block 2i+1 by H^(15-2i)
+	UNROLL
+	for (int i = 0; i < 8; i++)
+		power[i] = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)(void *)native->hash_key[14 - 2 * i]),
+		                            _mm_loadu_si128((const __m128i *)(void *)native->hash_key[15 - 2 * i]));
+	const __m128i base = _mm_loadu_si128((const __m128i *)(void *)native->counter_block);
+	__m128i hash = _mm_loadu_si128((const __m128i *)(void *)native->hash);
+	uint32_t counter = native->counter;
+	size_t done = 0;
+
+	for (; length - done >= 16 * 16; done += 16 * 16) {
+		__m256i block[8], text[8];
+		UNROLL
+		for (int i = 0; i < 8; i++) {
+			block[i] = _mm256_set_m128i(counter_block(base, counter + 2 * (uint32_t)i + 1), counter_block(base, counter + 2 * (uint32_t)i));
+			block[i] = _mm256_xor_si256(block[i], round_key[0]);
+		}
+		counter += 16;
+		UNROLL
+		for (int round = 1; round < 14; round++)
+			UNROLL
+			for (int i = 0; i < 8; i++) block[i] = _mm256_aesenc_epi128(block[i], round_key[round]);
+		UNROLL
+		for (int i = 0; i < 8; i++) block[i] = _mm256_aesenclast_epi128(block[i], round_key[14]);
+
+		UNROLL
+		for (int i = 0; i < 8; i++) text[i] = _mm256_loadu_si256((const __m256i *)(const void *)(input + done + 32 * i));
+		UNROLL
+		for (int i = 0; i < 8; i++) {
+			block[i] = _mm256_xor_si256(block[i], text[i]);
+			_mm256_storeu_si256((__m256i *)(void *)(output + done + 32 * i), block[i]);
+			text[i] = _mm256_shuffle_epi8(native->decrypt ? text[i] : block[i], reverse);
+		}
+
+		text[0] = _mm256_xor_si256(text[0], _mm256_set_m128i(_mm_setzero_si128(), hash));
+		__m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+		UNROLL
+		for (int i = 0; i < 8; i++) {
+			__m256i middle = _mm256_xor_si256(_mm256_clmulepi64_epi128(text[i], power[i], 0x10), _mm256_clmulepi64_epi128(text[i], power[i], 0x01));
+			low = _mm256_xor_si256(low, _mm256_xor_si256(_mm256_clmulepi64_epi128(text[i], power[i], 0x00), _mm256_bslli_epi128(middle, 8)));
+			high = _mm256_xor_si256(high, _mm256_xor_si256(_mm256_clmulepi64_epi128(text[i], power[i], 0x11), _mm256_bsrli_epi128(middle, 8)));
+		}
+		// fold both halves before the single reduction
+		hash = reduce(_mm_xor_si128(_mm256_castsi256_si128(low), _mm256_extracti128_si256(low, 1)),
+		              _mm_xor_si128(_mm256_castsi256_si128(high), _mm256_extracti128_si256(high, 1)));
+	}
+
+	_mm_storeu_si128((__m128i *)(void *)native->hash, hash);
+	native->counter = counter;
+	zeroize(round_key, sizeof(round_key));
+	return done;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/* AES-256-GCM with implementations selected at runtime
+ *
+ * The portable implementation is provided by mbedtls. On x86-64 processors
+ * with AES-NI and PCLMULQDQ, a native implementation encrypts and authenticates
+ * eight blocks at a time. Processors that also support VAES and VPCLMULQDQ
+ * handle sixteen blocks at a time, two per instruction. The implementation is
+ * chosen once from CPUID, after checking it against mbedtls, and can be
+ * overridden by setting UNISON_INTERCEPT_GCM to mbedtls, aesni, or vaes. All
+ * implementations produce identical output. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#include "mbedtls/gcm.h"
+#pragma clang diagnostic pop
+
+enum gcm_backend {
+	GCM_MBEDTLS,  // portable
+	GCM_AESNI,    // AES-NI and PCLMULQDQ
+	GCM_VAES,     // VAES and VPCLMULQDQ on 256 bit vectors
+	GCM_BACKENDS
+};
+
+#define GCM_HASH_POWERS 16
+#define GCM_LENGTH_MAX 0xFFFFFFFE0ULL  // 2^36 - 32 bytes per IV, the 32 bit counter must not wrap
+
+struct gcm_s {
+	enum gcm_backend backend;
+	mbedtls_gcm_context mbedtls;
+	struct gcm_native_s {
+		unsigned char round_key[15][16];
+		unsigned char hash_key[GCM_HASH_POWERS][16];  // powers of H, byte-reversed
+		unsigned char counter_block[16];               // J0
+		uint32_t counter;                              // low word of the next counter block
+		bool decrypt;
+		unsigned char hash[16];                        // running GHASH, byte-reversed
+		unsigned char key_stream[16];                  // of the partially used block
+		unsigned char text[16];                        // ciphertext of the partially used block
+		size_t partial;                                // bytes used of the current block
+		uint64_t length;
+	} native;
+};
+
+void gcm_init(struct gcm_s *gcm);
+[[nodiscard]] int gcm_setkey(struct gcm_s *gcm, const unsigned char key[256 / CHAR_BIT]);
+[[nodiscard]] int gcm_starts(struct gcm_s *gcm, int mode, const unsigned char *iv, size_t iv_length);
+[[nodiscard]] int gcm_update(struct gcm_s *gcm, const unsigned char *input, size_t length, unsigned char *output, size_t output_size, size_t *output_length);
+[[nodiscard]] int gcm_finish(struct gcm_s *gcm, unsigned char *output, size_t output_size, size_t *output_length, unsigned char *tag, size_t tag_length);
+void gcm_free(struct gcm_s *gcm);
+
+/* Long streams can be processed in pieces on several threads. A piece covers
+ * whole blocks at a given offset since gcm_starts() and leaves the context
+ * untouched, so any number of pieces may be processed concurrently. Joining
+ * the pieces in stream order yields the same state as gcm_update() would.
+ * Pieces must end within GCM_LENGTH_MAX, which gcm_update() enforces. */
+bool gcm_parallel(const struct gcm_s *gcm);
+void gcm_piece(const struct gcm_s *gcm, uint64_t offset, const unsigned char *input, size_t length, unsigned char *output, unsigned char hash_out[16]);
+void gcm_join(struct gcm_s *gcm, const unsigned char hash[16], size_t length);
+
+/* implementation used by new contexts */
+enum gcm_backend gcm_backend(void);
+/* name of an implementation as used by UNISON_INTERCEPT_GCM */
+const char *gcm_backend_name(enum gcm_backend backend);
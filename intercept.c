@@ -9,11 +9,16 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
 
-#ifdef __APPLE__
 #include <string.h>
+
+#ifdef __APPLE__
 #include <CoreFoundation/CFBase.h>
 #include <CoreFoundation/CFString.h>
 #include <SystemConfiguration/SCDynamicStoreCopySpecific.h>
@@ -21,22 +26,85 @@
 #include <objc/runtime.h>
 #endif
 
+#include "fdmap.h"
+#include "trace.h"
 #include "nocache.h"
 #include "config.h"
 #include "prepost.h"
 #include "symlink.h"
 #include "umask.h"
 #include "encrypt.h"
+#include "compress.h"
+#include "ivcache.h"
+#include "iobuf.h"
 
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#ifndef __APPLE__
+#include <sys/sendfile.h>
+#endif
+
+/* Pointers to the original libSystem/libc functions.
+ * They are resolved once by the constructor, so the intercepts themselves
+ * merely perform an indirect call through this table. Constructors of
+ * libraries loaded before this one may call intercepts earlier, so a missing
+ * pointer resolves the table on first use. */
+static struct original_s {
+	int (*open)(const char *path, int flags, ...);
+	int (*close)(int fd);
+	ssize_t (*read)(int fd, void *buf, size_t bytes);
+	ssize_t (*write)(int fd, const void *buf, size_t bytes);
+	ssize_t (*pread)(int fd, void *buf, size_t bytes, off_t offset);
+	ssize_t (*pwrite)(int fd, const void *buf, size_t bytes, off_t offset);
+	ssize_t (*readv)(int fd, const struct iovec *iov, int iovcnt);
+	ssize_t (*writev)(int fd, const struct iovec *iov, int iovcnt);
+	ssize_t (*preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+	ssize_t (*pwritev)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+	off_t (*lseek)(int fd, off_t offset, int whence);
+	int (*fstat)(int fd, struct stat *buf);
+	int (*ftruncate)(int fd, off_t length);
+#ifndef __APPLE__
+	ssize_t (*copy_file_range)(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+	ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
+#endif
+	int (*stat)(const char * restrict path, struct stat * restrict buf);
+	int (*lstat)(const char * restrict path, struct stat * restrict buf);
+#ifdef __APPLE__
+	int (*getattrlist)(const char *path, void *attrs, void *buf, size_t buf_size, unsigned int options);
+#endif
+	int (*rename)(const char *old, const char *new);
+	int (*symlink)(const char *target, const char *path);
+	int (*unlink)(const char *path);
+	DIR *(*opendir)(const char *path);
+	int (*closedir)(DIR *dir);
+	int (*mkdir)(const char *path, mode_t mode);
+	int (*rmdir)(const char *path);
+	int (*openat)(int dirfd, const char *path, int flags, ...);
+	int (*fstatat)(int dirfd, const char * restrict path, struct stat * restrict buf, int flags);
+#ifndef __APPLE__
+	int (*statx)(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf);
+#endif
+	int (*renameat)(int olddirfd, const char *old, int newdirfd, const char *new);
+#ifndef __APPLE__
+	int (*renameat2)(int olddirfd, const char *old, int newdirfd, const char *new, unsigned int flags);
+#endif
+	int (*unlinkat)(int dirfd, const char *path, int flags);
+	int (*mkdirat)(int dirfd, const char *path, mode_t mode);
+} original;
+static pthread_once_t original_once = PTHREAD_ONCE_INIT;
+
+#define ORIGINAL_FUNCTION(symbol) \
+	(__builtin_expect(original.symbol != NULL, 1) ? original.symbol : original_resolve()->symbol)
 
-#define ORIGINAL_SYMBOL(symbol, arguments) \
-	static int (*original_##symbol)arguments; \
-	local: if (!original_##symbol) { \
+#define ORIGINAL_SYMBOL(symbol) \
+	local: { \
 		Dl_info info; \
 		/* retrieve internal symbol name of current function
 		 * We cannot use the symbol argument directly, because it may be altered
@@ -47,24 +115,101 @@
 		 * label, which is a GNU extension, but apparently the only portable way. */ \
 		int result = dladdr(&&local, &info); \
 		assert(result && info.dli_sname); \
-		original_##symbol = (int (*)arguments)dlsym(RTLD_NEXT, info.dli_sname); \
-		assert(original_##symbol); \
+		original.symbol = (typeof(original.symbol))dlsym(RTLD_NEXT, info.dli_sname); \
+		assert(original.symbol); \
 	}
 
 /* The intercept layers in use.
  * Thread-local storage remembers which one has been called. */
 enum intercept_id {
+	RESOLVE,   // constructor looks up the original symbols
 	NONE,
 	NOCACHE,   // disable caching of file writes
 	CONFIG,    // process our own entries in Unison config files
 	ENCRYPT,   // presents encrypted file content
+	COMPRESS,  // presents compressed file content
 	PREPOST,   // execute post scripts when files change
 	SYMLINK,   // create symlinks before traversing directories
 	UMASK,     // restricts umask in home directory
 	ORIGINAL
 };
 
-static _Thread_local enum intercept_id context = NONE;
+#ifdef __APPLE__
+#define TLS_MODEL
+#else
+/* The library is loaded at startup, so its thread-local storage can live in
+ * the static TLS block and be accessed without calling __tls_get_addr(). */
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+#endif
+
+static _Thread_local enum intercept_id context TLS_MODEL = NONE;
+
+/* Optional call statistics, enabled by the UNISON_INTERCEPT_STATS environment
+ * variable. Every thread counts calls, latency and bytes per intercepted
+ * function and per layer entered. Times are inclusive of all layers below, so
+ * the cost of a layer is the difference to the next layer down. The report is
+ * written to stderr at exit, or appended to the file named by the variable. */
+#define STATS_BUCKETS 32  // log2 of nanoseconds, the last bucket collects everything slower
+
+static struct stats_s {
+	struct stats_s *next;
+	struct {
+		uint64_t calls;
+		uint64_t nanoseconds;
+		uint64_t bytes;
+		uint64_t buckets[STATS_BUCKETS];
+	} call[INTERCEPT_FUNCTION_COUNT][ORIGINAL + 1];
+} *stats_threads;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stats_enabled = false;
+static _Thread_local struct stats_s *stats_thread TLS_MODEL = NULL;
+
+static void stats_initialize(void);
+static void stats_record(enum intercept_function function, enum intercept_id level, uint64_t start, ssize_t bytes);
+
+static inline uint64_t clock_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static inline uint64_t stats_begin(void)
+{
+	return stats_enabled ? clock_now() : 0;
+}
+
+static inline void stats_end(enum intercept_function function, enum intercept_id level, uint64_t start, ssize_t bytes)
+{
+	if (start) stats_record(function, level, start, bytes);
+}
+
+/* Optional recording of the calls Unison makes, enabled by setting the
+ * UNISON_INTERCEPT_TRACE environment variable to the file receiving the trace.
+ * Only calls entering the top of the stack are recorded, see trace.h for the
+ * format. The bench/replay program runs a recorded trace on a synthetic tree. */
+static struct {
+	int fd;
+	pthread_mutex_t lock;
+	uint64_t start;
+	uint32_t threads;
+	size_t used;
+	unsigned char buffer[64 * 1024];
+} trace = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+static _Thread_local uint32_t trace_thread TLS_MODEL = 0;
+
+static void trace_initialize(void);
+static void trace_record(enum intercept_function function, const char *path1, const char *path2, struct trace_record_s record);
+static uint64_t trace_iov_size(const struct iovec *iov, int iovcnt);
+
+#define TRACE(function, path1, path2, ...) \
+	do { \
+		if (trace.fd >= 0 && saved_context == NONE) \
+			trace_record(function, path1, path2, (struct trace_record_s){ __VA_ARGS__ }); \
+	} while (0)
+
+static void resolve_originals(void);
+static struct original_s *original_resolve(void);
 
 
 #ifdef __APPLE__
@@ -76,6 +221,11 @@ static void profile_intercept(id self, SEL command, void *arg);
 
 static void __attribute__((constructor)) initialize(void)
 {
+	// this object is linked first, so this runs before other constructors
+	pthread_once(&original_once, resolve_originals);
+	stats_initialize();
+	trace_initialize();
+
 	// set UNISONLOCALHOSTNAME to the local hostname
 	CFStringRef nameString = SCDynamicStoreCopyLocalHostName(NULL);
 	if (nameString) {
@@ -107,6 +257,7 @@ static void profile_intercept(id self, SEL command, void *arg)
 	// the user changed to a different Unison profile, call reset functions
 	config_reset();
 	encrypt_reset();
+	compress_reset();
 	prepost_reset();
 	symlink_reset();
 	previous_implementation(self, command, arg);
@@ -114,51 +265,129 @@ static void profile_intercept(id self, SEL command, void *arg)
 
 #else
 
-static void __attribute__((constructor)) initialize(void)
+/* run before the constructors of the other layers, which already use libc */
+static void __attribute__((constructor(101))) initialize(void)
 {
+	pthread_once(&original_once, resolve_originals);
+	stats_initialize();
+	trace_initialize();
+
 	// prevent LD_PRELOAD from propagating to sub-processes
 	unsetenv("LD_PRELOAD");
 }
 
 #endif
 
+static struct original_s *original_resolve(void)
+{
+	pthread_once(&original_once, resolve_originals);
+	return &original;
+}
+
+static void resolve_originals(void)
+{
+	// in RESOLVE context, every intercept only looks up its original symbol
+	char path[] = "";
+	char buf[1];
+	enum intercept_id saved_context = context;
+	context = RESOLVE;
+	(void)open(path, 0);
+	(void)close(-1);
+	(void)read(-1, buf, 0);
+	(void)write(-1, buf, 0);
+	struct iovec iov = { .iov_base = buf, .iov_len = 0 };
+	(void)pread(-1, buf, 0, 0);
+	(void)pwrite(-1, buf, 0, 0);
+	(void)readv(-1, &iov, 0);
+	(void)writev(-1, &iov, 0);
+	(void)preadv(-1, &iov, 0, 0);
+	(void)pwritev(-1, &iov, 0, 0);
+	(void)lseek(-1, 0, SEEK_CUR);
+	(void)fstat(-1, (void *)buf);
+	(void)ftruncate(-1, 0);
+#ifndef __APPLE__
+	(void)copy_file_range(-1, NULL, -1, NULL, 0, 0);
+	(void)sendfile(-1, -1, NULL, 0);
+#endif
+	(void)stat(path, (void *)buf);
+	(void)lstat(path, (void *)buf);
+#ifdef __APPLE__
+	(void)getattrlist(path, buf, buf, 0, 0);
+#endif
+	(void)rename(path, path);
+	(void)symlink(path, path);
+	(void)unlink(path);
+	(void)opendir(path);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfree-nonheap-object"
+	(void)closedir((void *)buf);
+#pragma GCC diagnostic pop
+	(void)mkdir(path, 0);
+	(void)rmdir(path);
+	(void)openat(-1, path, 0);
+	(void)fstatat(-1, path, (void *)buf, 0);
+#ifndef __APPLE__
+	(void)statx(-1, path, 0, 0, (void *)buf);
+#endif
+	(void)renameat(-1, path, -1, path);
+#ifndef __APPLE__
+	(void)renameat2(-1, path, -1, path, 0);
+#endif
+	(void)unlinkat(-1, path, 0);
+	(void)mkdirat(-1, path, 0);
+	context = saved_context;
+}
+
 
 /* MARK: - Intercepted Functions */
 
 int open(const char *path, int flags, ...)
 {
-	ORIGINAL_SYMBOL(open, (const char *path, int flags, ...))
 	int result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
 
 	va_list arg;
 	va_start(arg, flags);
-	switch (context) {
+	const unsigned mode = (flags & O_CREAT) ? va_arg(arg, unsigned) : 0;
+	va_end(arg);
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(open)
+		break;
 	case NONE:
 		context = NOCACHE;
 		if (flags & O_CREAT)
-			result = nocache_open(path, flags, va_arg(arg, unsigned));
+			result = nocache_open(path, flags, mode);
 		else
 			result = nocache_open(path, flags);
 		break;
 	case NOCACHE:
 		context = CONFIG;
 		if (flags & O_CREAT)
-			result = config_open(path, flags, va_arg(arg, unsigned));
+			result = config_open(path, flags, mode);
 		else
 			result = config_open(path, flags);
 		break;
 	case CONFIG:
 		context = ENCRYPT;
 		if (flags & O_CREAT)
-			result = encrypt_open(path, flags, va_arg(arg, unsigned));
+			result = encrypt_open(path, flags, mode);
 		else
 			result = encrypt_open(path, flags);
 		break;
 	case ENCRYPT:
+		context = COMPRESS;
+		if (flags & O_CREAT)
+			result = compress_open(path, flags, mode);
+		else
+			result = compress_open(path, flags);
+		break;
+	case COMPRESS:
 		context = PREPOST;
 		if (flags & O_CREAT)
-			result = prepost_open(path, flags, va_arg(arg, unsigned));
+			result = prepost_open(path, flags, mode);
 		else
 			result = prepost_open(path, flags);
 		break;
@@ -166,7 +395,7 @@ int open(const char *path, int flags, ...)
 	case SYMLINK:
 		context = UMASK;
 		if (flags & O_CREAT)
-			result = umask_open(path, flags, va_arg(arg, unsigned));
+			result = umask_open(path, flags, mode);
 		else
 			result = umask_open(path, flags);
 		break;
@@ -175,25 +404,40 @@ int open(const char *path, int flags, ...)
 		[[fallthrough]];
 	case ORIGINAL:
 		if (flags & O_CREAT)
-			result = original_open(path, flags, va_arg(arg, unsigned));
+			result = ORIGINAL_FUNCTION(open)(path, flags, mode);
 		else
-			result = original_open(path, flags);
+			result = ORIGINAL_FUNCTION(open)(path, flags);
 		break;
 	}
-	va_end(arg);
 
+	TRACE(INTERCEPT_open, path, NULL, .fd = { -1, -1 }, .flags = flags, .mode = mode, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_open, context, stats_start, 0);
 	context = saved_context;
 	return result;
 }
 
 int close(int fd)
 {
-	ORIGINAL_SYMBOL(close, (int fd))
 	int result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(close)(fd);
+		TRACE(INTERCEPT_close, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .result = result);
+		stats_end(INTERCEPT_close, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(close)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_close(fd);
+		break;
 	case NOCACHE:
 		context = CONFIG;
 		result = config_close(fd);
@@ -203,28 +447,48 @@ int close(int fd)
 		result = encrypt_close(fd);
 		break;
 	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_close(fd);
+		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_close(fd);
+		result = ORIGINAL_FUNCTION(close)(fd);
 		break;
 	}
 
+	TRACE(INTERCEPT_close, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_close, context, stats_start, 0);
 	context = saved_context;
 	return result;
 }
 
 ssize_t read(int fd, void *buf, size_t bytes)
 {
-	ORIGINAL_SYMBOL(read, (int fd, void *buf, size_t bytes))
 	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(read)(fd, buf, bytes);
+		TRACE(INTERCEPT_read, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .size = bytes, .result = result);
+		stats_end(INTERCEPT_read, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(read)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_read(fd, buf, bytes);
+		break;
 	case NOCACHE:
 		context = CONFIG;
 		result = config_read(fd, buf, bytes);
@@ -234,345 +498,1482 @@ ssize_t read(int fd, void *buf, size_t bytes)
 		result = encrypt_read(fd, buf, bytes);
 		break;
 	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_read(fd, buf, bytes);
+		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_read(fd, buf, bytes);
+		result = ORIGINAL_FUNCTION(read)(fd, buf, bytes);
 		break;
 	}
 
+	TRACE(INTERCEPT_read, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .size = bytes, .result = result);
+	stats_end(INTERCEPT_read, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
 ssize_t write(int fd, const void *buf, size_t bytes)
 {
-	ORIGINAL_SYMBOL(write, (int fd, const void *buf, size_t bytes))
 	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(write)(fd, buf, bytes);
+		TRACE(INTERCEPT_write, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .size = bytes, .result = result);
+		stats_end(INTERCEPT_write, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(write)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_write(fd, buf, bytes);
+		break;
 	case NOCACHE:
 	case CONFIG:
 		context = ENCRYPT;
 		result = encrypt_write(fd, buf, bytes);
 		break;
 	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_write(fd, buf, bytes);
+		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_write(fd, buf, bytes);
+		result = ORIGINAL_FUNCTION(write)(fd, buf, bytes);
 		break;
 	}
 
+	TRACE(INTERCEPT_write, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .size = bytes, .result = result);
+	stats_end(INTERCEPT_write, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-int stat(const char * restrict path, struct stat * restrict buf)
+ssize_t pread(int fd, void *buf, size_t bytes, off_t offset)
 {
-	ORIGINAL_SYMBOL(stat, (const char * restrict path, struct stat * restrict buf))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(pread)(fd, buf, bytes, offset);
+		TRACE(INTERCEPT_pread, NULL, NULL, .fd = { fd, -1 }, .offset = { offset, -1 }, .size = bytes, .result = result);
+		stats_end(INTERCEPT_pread, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(pread)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_pread(fd, buf, bytes, offset);
+		break;
 	case NOCACHE:
+		context = CONFIG;
+		result = config_pread(fd, buf, bytes, offset);
+		break;
 	case CONFIG:
 		context = ENCRYPT;
-		result = encrypt_stat(path, buf);
+		result = encrypt_pread(fd, buf, bytes, offset);
 		break;
 	case ENCRYPT:
-		context = PREPOST;
-		result = prepost_stat(path, buf);
+		context = COMPRESS;
+		result = compress_pread(fd, buf, bytes, offset);
 		break;
+	case COMPRESS:
 	case PREPOST:
-		context = SYMLINK;
-		result = symlink_stat(path, buf);
-		break;
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_stat(path, buf);
+		result = ORIGINAL_FUNCTION(pread)(fd, buf, bytes, offset);
 		break;
 	}
 
+	TRACE(INTERCEPT_pread, NULL, NULL, .fd = { fd, -1 }, .offset = { offset, -1 }, .size = bytes, .result = result);
+	stats_end(INTERCEPT_pread, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-int lstat(const char * restrict path, struct stat * restrict buf)
+ssize_t pwrite(int fd, const void *buf, size_t bytes, off_t offset)
 {
-	ORIGINAL_SYMBOL(lstat, (const char * restrict path, struct stat * restrict buf))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(pwrite)(fd, buf, bytes, offset);
+		TRACE(INTERCEPT_pwrite, NULL, NULL, .fd = { fd, -1 }, .offset = { offset, -1 }, .size = bytes, .result = result);
+		stats_end(INTERCEPT_pwrite, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(pwrite)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_pwrite(fd, buf, bytes, offset);
+		break;
 	case NOCACHE:
 	case CONFIG:
 		context = ENCRYPT;
-		result = encrypt_lstat(path, buf);
+		result = encrypt_pwrite(fd, buf, bytes, offset);
 		break;
 	case ENCRYPT:
-		context = PREPOST;
-		result = prepost_lstat(path, buf);
+		context = COMPRESS;
+		result = compress_pwrite(fd, buf, bytes, offset);
 		break;
+	case COMPRESS:
 	case PREPOST:
-		context = SYMLINK;
-		result = symlink_lstat(path, buf);
-		break;
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_lstat(path, buf);
+		result = ORIGINAL_FUNCTION(pwrite)(fd, buf, bytes, offset);
 		break;
 	}
 
+	TRACE(INTERCEPT_pwrite, NULL, NULL, .fd = { fd, -1 }, .offset = { offset, -1 }, .size = bytes, .result = result);
+	stats_end(INTERCEPT_pwrite, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-#ifdef __APPLE__
-int getattrlist(const char *path, void *attrs, void *buf, size_t buf_size, unsigned int options)
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
 {
-	ORIGINAL_SYMBOL(getattrlist, (const char *path, void *attrList, void *attrBuf, size_t attrBufSize, unsigned int options))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(readv)(fd, iov, iovcnt);
+		TRACE(INTERCEPT_readv, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { -1, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+		stats_end(INTERCEPT_readv, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(readv)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_readv(fd, iov, iovcnt);
+		break;
 	case NOCACHE:
+		context = CONFIG;
+		result = config_readv(fd, iov, iovcnt);
+		break;
 	case CONFIG:
 		context = ENCRYPT;
-		result = encrypt_getattrlist(path, attrs, buf, buf_size, options);
+		result = encrypt_readv(fd, iov, iovcnt);
 		break;
 	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_readv(fd, iov, iovcnt);
+		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_getattrlist(path, attrs, buf, buf_size, options);
+		result = ORIGINAL_FUNCTION(readv)(fd, iov, iovcnt);
 		break;
 	}
 
+	TRACE(INTERCEPT_readv, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { -1, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+	stats_end(INTERCEPT_readv, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
-#endif
 
-int rename(const char *old, const char *new)
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
 {
-	ORIGINAL_SYMBOL(rename, (const char *old, const char *new))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(writev)(fd, iov, iovcnt);
+		TRACE(INTERCEPT_writev, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { -1, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+		stats_end(INTERCEPT_writev, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(writev)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_writev(fd, iov, iovcnt);
+		break;
 	case NOCACHE:
 	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_writev(fd, iov, iovcnt);
+		break;
 	case ENCRYPT:
-		context = PREPOST;
-		result = prepost_rename(old, new);
+		context = COMPRESS;
+		result = compress_writev(fd, iov, iovcnt);
 		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_rename(old, new);
+		result = ORIGINAL_FUNCTION(writev)(fd, iov, iovcnt);
 		break;
 	}
 
+	TRACE(INTERCEPT_writev, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { -1, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+	stats_end(INTERCEPT_writev, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-int symlink(const char *target, const char *path)
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-	ORIGINAL_SYMBOL(symlink, (const char *target, const char *path))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(preadv)(fd, iov, iovcnt, offset);
+		TRACE(INTERCEPT_preadv, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { offset, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+		stats_end(INTERCEPT_preadv, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(preadv)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_preadv(fd, iov, iovcnt, offset);
+		break;
 	case NOCACHE:
+		context = CONFIG;
+		result = config_preadv(fd, iov, iovcnt, offset);
+		break;
 	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_preadv(fd, iov, iovcnt, offset);
+		break;
 	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_preadv(fd, iov, iovcnt, offset);
+		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
-		context = UMASK;
-		result = umask_symlink(target, path);
-		break;
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_symlink(target, path);
+		result = ORIGINAL_FUNCTION(preadv)(fd, iov, iovcnt, offset);
 		break;
 	}
 
+	TRACE(INTERCEPT_preadv, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { offset, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+	stats_end(INTERCEPT_preadv, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-int unlink(const char *path)
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-	ORIGINAL_SYMBOL(unlink, (const char *path))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(pwritev)(fd, iov, iovcnt, offset);
+		TRACE(INTERCEPT_pwritev, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { offset, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+		stats_end(INTERCEPT_pwritev, ORIGINAL, stats_start, result);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(pwritev)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_pwritev(fd, iov, iovcnt, offset);
+		break;
 	case NOCACHE:
 	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_pwritev(fd, iov, iovcnt, offset);
+		break;
 	case ENCRYPT:
-		context = PREPOST;
-		result = prepost_unlink(path);
+		context = COMPRESS;
+		result = compress_pwritev(fd, iov, iovcnt, offset);
 		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_unlink(path);
+		result = ORIGINAL_FUNCTION(pwritev)(fd, iov, iovcnt, offset);
 		break;
 	}
 
+	TRACE(INTERCEPT_pwritev, NULL, NULL, .fd = { fd, -1 }, .flags = iovcnt, .offset = { offset, -1 }, .size = trace_iov_size(iov, iovcnt), .result = result);
+	stats_end(INTERCEPT_pwritev, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-DIR *opendir(const char *path)
+off_t lseek(int fd, off_t offset, int whence)
 {
-	ORIGINAL_SYMBOL(opendir, (const char *path))
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wincompatible-function-pointer-types-strict"
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
-	DIR *(*typecorrect_original_opendir)(const char *path) = original_opendir;
-#pragma clang diagnostic pop
-#pragma GCC diagnostic pop
-	DIR *result = NULL;
+	off_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(lseek)(fd, offset, whence);
+		TRACE(INTERCEPT_lseek, NULL, NULL, .fd = { fd, -1 }, .flags = whence, .offset = { offset, -1 }, .result = result);
+		stats_end(INTERCEPT_lseek, ORIGINAL, stats_start, 0);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(lseek)
+		break;
 	case NONE:
+		context = NOCACHE;
+		result = nocache_lseek(fd, offset, whence);
+		break;
 	case NOCACHE:
 	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_lseek(fd, offset, whence);
+		break;
 	case ENCRYPT:
-	case PREPOST:
-		context = SYMLINK;
-		result = symlink_opendir(path);
+		context = COMPRESS;
+		result = compress_lseek(fd, offset, whence);
 		break;
+	case COMPRESS:
+	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = typecorrect_original_opendir(path);
+		result = ORIGINAL_FUNCTION(lseek)(fd, offset, whence);
 		break;
 	}
 
+	TRACE(INTERCEPT_lseek, NULL, NULL, .fd = { fd, -1 }, .flags = whence, .offset = { offset, -1 }, .result = result);
+	stats_end(INTERCEPT_lseek, context, stats_start, 0);
 	context = saved_context;
 	return result;
 }
 
-int closedir(DIR *dir)
+int fstat(int fd, struct stat *buf)
 {
-	ORIGINAL_SYMBOL(closedir, (DIR *dir))
 	int result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(fstat)(fd, buf);
+		TRACE(INTERCEPT_fstat, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .mode = result == 0 ? (uint32_t)buf->st_mode : 0, .size = result == 0 ? (uint64_t)buf->st_size : 0, .result = result);
+		stats_end(INTERCEPT_fstat, ORIGINAL, stats_start, 0);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(fstat)
+		break;
 	case NONE:
 	case NOCACHE:
 	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_fstat(fd, buf);
+		break;
 	case ENCRYPT:
-	case PREPOST:
-		context = SYMLINK;
-		result = symlink_closedir(dir);
+		context = COMPRESS;
+		result = compress_fstat(fd, buf);
 		break;
+	case COMPRESS:
+	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_closedir(dir);
+		result = ORIGINAL_FUNCTION(fstat)(fd, buf);
 		break;
 	}
 
+	TRACE(INTERCEPT_fstat, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .mode = result == 0 ? (uint32_t)buf->st_mode : 0, .size = result == 0 ? (uint64_t)buf->st_size : 0, .result = result);
+	stats_end(INTERCEPT_fstat, context, stats_start, 0);
 	context = saved_context;
 	return result;
 }
 
-int mkdir(const char *path, mode_t mode)
+int ftruncate(int fd, off_t length)
 {
-	ORIGINAL_SYMBOL(mkdir, (const char *path, mode_t mode))
 	int result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer tracks state for this file descriptor
+	if (saved_context == NONE && !fdmap_interest(fd)) {
+		result = ORIGINAL_FUNCTION(ftruncate)(fd, length);
+		TRACE(INTERCEPT_ftruncate, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .size = (uint64_t)length, .result = result);
+		stats_end(INTERCEPT_ftruncate, ORIGINAL, stats_start, 0);
+		return result;
+	}
 
-	switch (context) {
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(ftruncate)
+		break;
 	case NONE:
 	case NOCACHE:
 	case CONFIG:
 	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_ftruncate(fd, length);
+		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
-		context = UMASK;
-		result = umask_mkdir(path, mode);
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(ftruncate)(fd, length);
+		break;
+	}
+
+	TRACE(INTERCEPT_ftruncate, NULL, NULL, .fd = { fd, -1 }, .offset = { -1, -1 }, .size = (uint64_t)length, .result = result);
+	stats_end(INTERCEPT_ftruncate, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+#ifndef __APPLE__
+ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+	ssize_t result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	// no layer transforms either file, let the kernel copy
+	if (saved_context == NONE && !fdmap_interest(fd_in) && !fdmap_interest(fd_out)) {
+		result = ORIGINAL_FUNCTION(copy_file_range)(fd_in, off_in, fd_out, off_out, len, flags);
+		TRACE(INTERCEPT_copy_file_range, NULL, NULL, .fd = { fd_in, fd_out }, .flags = (int32_t)flags, .offset = { off_in ? *off_in - (result > 0 ? result : 0) : -1, off_out ? *off_out - (result > 0 ? result : 0) : -1 }, .size = len, .result = result);
+		stats_end(INTERCEPT_copy_file_range, ORIGINAL, stats_start, result);
+		return result;
+	}
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(copy_file_range)
+		break;
+	case NONE:
+	case NOCACHE:
+		context = CONFIG;
+		result = config_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+		break;
+	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+		break;
+	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
 		break;
+	case COMPRESS:
+	case PREPOST:
+	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_mkdir(path, mode);
+		result = ORIGINAL_FUNCTION(copy_file_range)(fd_in, off_in, fd_out, off_out, len, flags);
 		break;
 	}
 
+	TRACE(INTERCEPT_copy_file_range, NULL, NULL, .fd = { fd_in, fd_out }, .flags = (int32_t)flags, .offset = { off_in ? *off_in - (result > 0 ? result : 0) : -1, off_out ? *off_out - (result > 0 ? result : 0) : -1 }, .size = len, .result = result);
+	stats_end(INTERCEPT_copy_file_range, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
 
-int rmdir(const char *path)
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	ORIGINAL_SYMBOL(rmdir, (const char *path))
-	int result = 0;
+	ssize_t result = 0;
 	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
 
-	switch (context) {
+	// no layer transforms either file, let the kernel copy
+	if (saved_context == NONE && !fdmap_interest(in_fd) && !fdmap_interest(out_fd)) {
+		result = ORIGINAL_FUNCTION(sendfile)(out_fd, in_fd, offset, count);
+		TRACE(INTERCEPT_sendfile, NULL, NULL, .fd = { out_fd, in_fd }, .offset = { -1, offset ? *offset - (result > 0 ? result : 0) : -1 }, .size = count, .result = result);
+		stats_end(INTERCEPT_sendfile, ORIGINAL, stats_start, result);
+		return result;
+	}
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(sendfile)
+		break;
 	case NONE:
 	case NOCACHE:
+		context = CONFIG;
+		result = config_sendfile(out_fd, in_fd, offset, count);
+		break;
 	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_sendfile(out_fd, in_fd, offset, count);
+		break;
 	case ENCRYPT:
-		context = PREPOST;
-		result = prepost_rmdir(path);
+		context = COMPRESS;
+		result = compress_sendfile(out_fd, in_fd, offset, count);
 		break;
+	case COMPRESS:
 	case PREPOST:
 	case SYMLINK:
 	case UMASK:
 		context = ORIGINAL;
 		[[fallthrough]];
 	case ORIGINAL:
-		result = original_rmdir(path);
+		result = ORIGINAL_FUNCTION(sendfile)(out_fd, in_fd, offset, count);
 		break;
 	}
 
+	TRACE(INTERCEPT_sendfile, NULL, NULL, .fd = { out_fd, in_fd }, .offset = { -1, offset ? *offset - (result > 0 ? result : 0) : -1 }, .size = count, .result = result);
+	stats_end(INTERCEPT_sendfile, context, stats_start, result);
 	context = saved_context;
 	return result;
 }
+#endif
+
+int stat(const char * restrict path, struct stat * restrict buf)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(stat)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_stat(path, buf);
+		break;
+	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_stat(path, buf);
+		break;
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_stat(path, buf);
+		break;
+	case PREPOST:
+		context = SYMLINK;
+		result = symlink_stat(path, buf);
+		break;
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(stat)(path, buf);
+		break;
+	}
+
+	TRACE(INTERCEPT_stat, path, NULL, .fd = { -1, -1 }, .offset = { -1, -1 }, .mode = result == 0 ? (uint32_t)buf->st_mode : 0, .size = result == 0 ? (uint64_t)buf->st_size : 0, .result = result);
+	stats_end(INTERCEPT_stat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int lstat(const char * restrict path, struct stat * restrict buf)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(lstat)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_lstat(path, buf);
+		break;
+	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_lstat(path, buf);
+		break;
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_lstat(path, buf);
+		break;
+	case PREPOST:
+		context = SYMLINK;
+		result = symlink_lstat(path, buf);
+		break;
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(lstat)(path, buf);
+		break;
+	}
+
+	TRACE(INTERCEPT_lstat, path, NULL, .fd = { -1, -1 }, .offset = { -1, -1 }, .mode = result == 0 ? (uint32_t)buf->st_mode : 0, .size = result == 0 ? (uint64_t)buf->st_size : 0, .result = result);
+	stats_end(INTERCEPT_lstat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+#ifdef __APPLE__
+int getattrlist(const char *path, void *attrs, void *buf, size_t buf_size, unsigned int options)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(getattrlist)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_getattrlist(path, attrs, buf, buf_size, options);
+		break;
+	case ENCRYPT:
+	case COMPRESS:
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(getattrlist)(path, attrs, buf, buf_size, options);
+		break;
+	}
+
+	TRACE(INTERCEPT_getattrlist, path, NULL, .fd = { -1, -1 }, .flags = (int32_t)options, .offset = { -1, -1 }, .size = buf_size, .result = result);
+	stats_end(INTERCEPT_getattrlist, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+#endif
+
+int rename(const char *old, const char *new)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(rename)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_rename(old, new);
+		break;
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(rename)(old, new);
+		break;
+	}
+
+	TRACE(INTERCEPT_rename, old, new, .fd = { -1, -1 }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_rename, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int symlink(const char *target, const char *path)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(symlink)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+	case PREPOST:
+	case SYMLINK:
+		context = UMASK;
+		result = umask_symlink(target, path);
+		break;
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(symlink)(target, path);
+		break;
+	}
+
+	TRACE(INTERCEPT_symlink, target, path, .fd = { -1, -1 }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_symlink, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int unlink(const char *path)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(unlink)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_unlink(path);
+		break;
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(unlink)(path);
+		break;
+	}
+
+	TRACE(INTERCEPT_unlink, path, NULL, .fd = { -1, -1 }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_unlink, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+DIR *opendir(const char *path)
+{
+	DIR *result = NULL;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(opendir)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+	case PREPOST:
+		context = SYMLINK;
+		result = symlink_opendir(path);
+		break;
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(opendir)(path);
+		break;
+	}
+
+	TRACE(INTERCEPT_opendir, path, NULL, .fd = { -1, -1 }, .offset = { -1, -1 }, .result = result ? dirfd(result) : -1);
+	stats_end(INTERCEPT_opendir, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int closedir(DIR *dir)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+	const int dir_fd = trace.fd >= 0 && saved_context == NONE ? dirfd(dir) : -1;
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(closedir)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+	case PREPOST:
+		context = SYMLINK;
+		result = symlink_closedir(dir);
+		break;
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(closedir)(dir);
+		break;
+	}
+
+	TRACE(INTERCEPT_closedir, NULL, NULL, .fd = { dir_fd, -1 }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_closedir, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(mkdir)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+	case PREPOST:
+	case SYMLINK:
+		context = UMASK;
+		result = umask_mkdir(path, mode);
+		break;
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(mkdir)(path, mode);
+		break;
+	}
+
+	TRACE(INTERCEPT_mkdir, path, NULL, .fd = { -1, -1 }, .mode = mode, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_mkdir, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int rmdir(const char *path)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(rmdir)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_rmdir(path);
+		break;
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(rmdir)(path);
+		break;
+	}
+
+	TRACE(INTERCEPT_rmdir, path, NULL, .fd = { -1, -1 }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_rmdir, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	va_list arg;
+	va_start(arg, flags);
+	const unsigned mode = (flags & O_CREAT) ? va_arg(arg, unsigned) : 0;
+	va_end(arg);
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(openat)
+		break;
+	case NONE:
+		context = NOCACHE;
+		if (flags & O_CREAT)
+			result = nocache_openat(dirfd, path, flags, mode);
+		else
+			result = nocache_openat(dirfd, path, flags);
+		break;
+	case NOCACHE:
+		context = CONFIG;
+		if (flags & O_CREAT)
+			result = config_openat(dirfd, path, flags, mode);
+		else
+			result = config_openat(dirfd, path, flags);
+		break;
+	case CONFIG:
+		context = ENCRYPT;
+		if (flags & O_CREAT)
+			result = encrypt_openat(dirfd, path, flags, mode);
+		else
+			result = encrypt_openat(dirfd, path, flags);
+		break;
+	case ENCRYPT:
+		context = COMPRESS;
+		if (flags & O_CREAT)
+			result = compress_openat(dirfd, path, flags, mode);
+		else
+			result = compress_openat(dirfd, path, flags);
+		break;
+	case COMPRESS:
+		context = PREPOST;
+		if (flags & O_CREAT)
+			result = prepost_openat(dirfd, path, flags, mode);
+		else
+			result = prepost_openat(dirfd, path, flags);
+		break;
+	case PREPOST:
+	case SYMLINK:
+		context = UMASK;
+		if (flags & O_CREAT)
+			result = umask_openat(dirfd, path, flags, mode);
+		else
+			result = umask_openat(dirfd, path, flags);
+		break;
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		if (flags & O_CREAT)
+			result = ORIGINAL_FUNCTION(openat)(dirfd, path, flags, mode);
+		else
+			result = ORIGINAL_FUNCTION(openat)(dirfd, path, flags);
+		break;
+	}
+
+	TRACE(INTERCEPT_openat, path, NULL, .fd = { dirfd, -1 }, .flags = flags, .mode = mode, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_openat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(fstatat)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_fstatat(dirfd, path, buf, flags);
+		break;
+	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_fstatat(dirfd, path, buf, flags);
+		break;
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_fstatat(dirfd, path, buf, flags);
+		break;
+	case PREPOST:
+		context = SYMLINK;
+		result = symlink_fstatat(dirfd, path, buf, flags);
+		break;
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(fstatat)(dirfd, path, buf, flags);
+		break;
+	}
+
+	TRACE(INTERCEPT_fstatat, path, NULL, .fd = { dirfd, -1 }, .flags = flags, .offset = { -1, -1 }, .mode = result == 0 ? (uint32_t)buf->st_mode : 0, .size = result == 0 ? (uint64_t)buf->st_size : 0, .result = result);
+	stats_end(INTERCEPT_fstatat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+#ifndef __APPLE__
+int statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(statx)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+		context = ENCRYPT;
+		result = encrypt_statx(dirfd, path, flags, mask, buf);
+		break;
+	case ENCRYPT:
+		context = COMPRESS;
+		result = compress_statx(dirfd, path, flags, mask, buf);
+		break;
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_statx(dirfd, path, flags, mask, buf);
+		break;
+	case PREPOST:
+		context = SYMLINK;
+		result = symlink_statx(dirfd, path, flags, mask, buf);
+		break;
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(statx)(dirfd, path, flags, mask, buf);
+		break;
+	}
+
+	TRACE(INTERCEPT_statx, path, NULL, .fd = { dirfd, -1 }, .flags = flags, .offset = { -1, -1 }, .mode = result == 0 ? buf->stx_mode : 0, .size = result == 0 ? buf->stx_size : 0, .result = result);
+	stats_end(INTERCEPT_statx, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+#endif
+
+int renameat(int olddirfd, const char *old, int newdirfd, const char *new)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(renameat)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_renameat(olddirfd, old, newdirfd, new);
+		break;
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(renameat)(olddirfd, old, newdirfd, new);
+		break;
+	}
+
+	TRACE(INTERCEPT_renameat, old, new, .fd = { olddirfd, newdirfd }, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_renameat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+#ifndef __APPLE__
+int renameat2(int olddirfd, const char *old, int newdirfd, const char *new, unsigned int flags)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(renameat2)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_renameat2(olddirfd, old, newdirfd, new, flags);
+		break;
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(renameat2)(olddirfd, old, newdirfd, new, flags);
+		break;
+	}
+
+	TRACE(INTERCEPT_renameat2, old, new, .fd = { olddirfd, newdirfd }, .flags = (int32_t)flags, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_renameat2, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+#endif
+
+int unlinkat(int dirfd, const char *path, int flags)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(unlinkat)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+		context = PREPOST;
+		result = prepost_unlinkat(dirfd, path, flags);
+		break;
+	case PREPOST:
+	case SYMLINK:
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(unlinkat)(dirfd, path, flags);
+		break;
+	}
+
+	TRACE(INTERCEPT_unlinkat, path, NULL, .fd = { dirfd, -1 }, .flags = flags, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_unlinkat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode)
+{
+	int result = 0;
+	enum intercept_id saved_context = context;
+	const uint64_t stats_start = stats_begin();
+
+	switch (saved_context) {
+	case RESOLVE:
+		ORIGINAL_SYMBOL(mkdirat)
+		break;
+	case NONE:
+	case NOCACHE:
+	case CONFIG:
+	case ENCRYPT:
+	case COMPRESS:
+	case PREPOST:
+	case SYMLINK:
+		context = UMASK;
+		result = umask_mkdirat(dirfd, path, mode);
+		break;
+	case UMASK:
+		context = ORIGINAL;
+		[[fallthrough]];
+	case ORIGINAL:
+		result = ORIGINAL_FUNCTION(mkdirat)(dirfd, path, mode);
+		break;
+	}
+
+	TRACE(INTERCEPT_mkdirat, path, NULL, .fd = { dirfd, -1 }, .mode = mode, .offset = { -1, -1 }, .result = result);
+	stats_end(INTERCEPT_mkdirat, context, stats_start, 0);
+	context = saved_context;
+	return result;
+}
+
+
+/* MARK: - Statistics */
+
+static void stats_initialize(void)
+{
+	stats_enabled = getenv("UNISON_INTERCEPT_STATS") != NULL;
+}
+
+static void stats_record(enum intercept_function function, enum intercept_id level, uint64_t start, ssize_t bytes)
+{
+	const uint64_t elapsed = clock_now() - start;
+
+	struct stats_s *stats = stats_thread;
+	if (!stats) {
+		// blocks are never freed, so the report includes threads that have exited
+		stats = calloc(1, sizeof(struct stats_s));
+		if (!stats) abort();
+		pthread_mutex_lock(&stats_lock);
+		stats->next = stats_threads;
+		stats_threads = stats;
+		pthread_mutex_unlock(&stats_lock);
+		stats_thread = stats;
+	}
+
+	unsigned bucket = elapsed ? (unsigned)(64 - __builtin_clzll(elapsed)) : 0;
+	if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+	stats->call[function][level].calls++;
+	stats->call[function][level].nanoseconds += elapsed;
+	stats->call[function][level].buckets[bucket]++;
+	if (bytes > 0) stats->call[function][level].bytes += (uint64_t)bytes;
+}
+
+/* upper bound of the bucket holding the given quantile */
+static uint64_t stats_quantile(const uint64_t buckets[STATS_BUCKETS], uint64_t calls, double quantile)
+{
+	uint64_t seen = 0;
+	for (unsigned bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		seen += buckets[bucket];
+		if ((double)seen >= quantile * (double)calls) return (uint64_t)1 << bucket;
+	}
+	return (uint64_t)1 << (STATS_BUCKETS - 1);
+}
+
+static void __attribute__((destructor)) stats_report(void)
+{
+	if (!stats_enabled) return;
+	stats_enabled = false;
+
+	// the report itself should neither pass through the layers nor be counted
+	const enum intercept_id saved_context = context;
+	context = ORIGINAL;
+
+	static const char *const function_name[] = {
+#define STATS_NAME(function) #function,
+		INTERCEPT_FUNCTIONS(STATS_NAME)
+#undef STATS_NAME
+	};
+	static const char *const layer_name[] = {
+		[RESOLVE] = "resolve", [NONE] = "none", [NOCACHE] = "nocache", [CONFIG] = "config",
+		[ENCRYPT] = "encrypt", [COMPRESS] = "compress", [PREPOST] = "prepost", [SYMLINK] = "symlink", [UMASK] = "umask",
+		[ORIGINAL] = "original"
+	};
+
+	const char *target = getenv("UNISON_INTERCEPT_STATS");
+	FILE *output = NULL;
+	if (target && target[0] == '/') output = fopen(target, "a");
+	if (!output) output = stderr;
+
+	fprintf(output, "%-16s %-9s %10s %12s %10s %10s %10s %14s\n",
+	        "function", "layer", "calls", "total ms", "mean ns", "p50 ns", "p99 ns", "bytes");
+
+	pthread_mutex_lock(&stats_lock);
+	for (size_t function = 0; function < INTERCEPT_FUNCTION_COUNT; function++) {
+		for (size_t level = 0; level <= ORIGINAL; level++) {
+			// sum up all threads
+			uint64_t calls = 0, nanoseconds = 0, bytes = 0, buckets[STATS_BUCKETS] = { 0 };
+			for (struct stats_s *stats = stats_threads; stats; stats = stats->next) {
+				calls += stats->call[function][level].calls;
+				nanoseconds += stats->call[function][level].nanoseconds;
+				bytes += stats->call[function][level].bytes;
+				for (unsigned bucket = 0; bucket < STATS_BUCKETS; bucket++)
+					buckets[bucket] += stats->call[function][level].buckets[bucket];
+			}
+			if (!calls) continue;
+
+			fprintf(output, "%-16s %-9s %10llu %12.3f %10llu %10llu %10llu %14llu\n",
+			        function_name[function], layer_name[level], (unsigned long long)calls,
+			        (double)nanoseconds / 1000000, (unsigned long long)(nanoseconds / calls),
+			        (unsigned long long)stats_quantile(buckets, calls, 0.5),
+			        (unsigned long long)stats_quantile(buckets, calls, 0.99),
+			        (unsigned long long)bytes);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	uint64_t hits, misses;
+	ivcache_statistics(&hits, &misses);
+	if (hits || misses)
+		fprintf(output, "%-16s %-9s %10llu hits %10llu misses\n", "iv cache", "encrypt",
+		        (unsigned long long)hits, (unsigned long long)misses);
+
+	struct iobuf_statistics_s buffers;
+	iobuf_statistics(&buffers);
+	if (buffers.allocations)
+		fprintf(output, "%-16s %-9s %10llu allocated %10llu reused %10llu reduced %8.1f MiB peak\n", "buffers", "encrypt",
+		        (unsigned long long)buffers.allocations, (unsigned long long)buffers.reuses,
+		        (unsigned long long)buffers.reductions, (double)buffers.peak / (1024 * 1024));
+
+	struct nocache_statistics_s throttling;
+	nocache_statistics(&throttling);
+	if (throttling.pressure_calls)
+		fprintf(output, "%-16s %-9s %10llu calls %12.3f ms throttled\n", "io pressure", "nocache",
+		        (unsigned long long)throttling.pressure_calls, (double)throttling.pressure_nanoseconds / 1000000);
+	if (throttling.read_calls)
+		fprintf(output, "%-16s %-9s %10llu calls %12.3f ms delayed\n", "read limit", "nocache",
+		        (unsigned long long)throttling.read_calls, (double)throttling.read_nanoseconds / 1000000);
+	if (throttling.write_calls)
+		fprintf(output, "%-16s %-9s %10llu calls %12.3f ms delayed\n", "write limit", "nocache",
+		        (unsigned long long)throttling.write_calls, (double)throttling.write_nanoseconds / 1000000);
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+		const double resident = (double)usage.ru_maxrss / (1024 * 1024);  // bytes
+#else
+		const double resident = (double)usage.ru_maxrss / 1024;  // KiB
+#endif
+		fprintf(output, "%-16s %-9s %10.1f MiB peak resident\n", "process", "", resident);
+	}
+
+	if (output != stderr) fclose(output);
+	context = saved_context;
+}
+
+
+/* MARK: - Trace */
+
+static void trace_initialize(void)
+{
+	const char *target = getenv("UNISON_INTERCEPT_TRACE");
+	if (!target || target[0] != '/') return;
+
+	trace.fd = ORIGINAL_FUNCTION(open)(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (trace.fd < 0) return;
+	trace.start = clock_now();
+
+	const char *home = getenv("HOME");
+	if (!home) home = "";
+	char cwd[4096];
+	if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+
+	struct trace_header_s header = {
+		.magic = TRACE_MAGIC, .version = TRACE_VERSION,
+		.home_length = (uint32_t)strlen(home), .cwd_length = (uint32_t)strlen(cwd)
+	};
+	if (ORIGINAL_FUNCTION(write)(trace.fd, &header, sizeof(header)) != sizeof(header) ||
+	    ORIGINAL_FUNCTION(write)(trace.fd, home, header.home_length) != header.home_length ||
+	    ORIGINAL_FUNCTION(write)(trace.fd, cwd, header.cwd_length) != header.cwd_length) {
+		ORIGINAL_FUNCTION(close)(trace.fd);
+		trace.fd = -1;
+	}
+}
+
+static void trace_append(const void *data, size_t size)
+{
+	if (trace.used + size > sizeof(trace.buffer)) {
+		// a failing trace file only loses records, the intercepted call is unaffected
+		(void)!ORIGINAL_FUNCTION(write)(trace.fd, trace.buffer, trace.used);
+		trace.used = 0;
+	}
+	memcpy(trace.buffer + trace.used, data, size);
+	trace.used += size;
+}
+
+static void trace_record(enum intercept_function function, const char *path1, const char *path2, struct trace_record_s record)
+{
+	const int saved_errno = errno;
+
+	record.function = (uint16_t)function;
+	if (record.result < 0) record.error = saved_errno;
+	size_t length[2] = { path1 ? strlen(path1) : 0, path2 ? strlen(path2) : 0 };
+	for (unsigned i = 0; i < 2; i++) {
+		if (length[i] > UINT16_MAX) length[i] = UINT16_MAX;
+		record.path_length[i] = (uint16_t)length[i];
+	}
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fd >= 0) {
+		if (!trace_thread) trace_thread = ++trace.threads;
+		record.thread = trace_thread;
+		record.time = clock_now() - trace.start;
+		trace_append(&record, sizeof(record));
+		if (length[0]) trace_append(path1, length[0]);
+		if (length[1]) trace_append(path2, length[1]);
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	errno = saved_errno;
+}
+
+static uint64_t trace_iov_size(const struct iovec *iov, int iovcnt)
+{
+	uint64_t size = 0;
+	for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+	return size;
+}
+
+static void __attribute__((destructor)) trace_finish(void)
+{
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fd >= 0) {
+		(void)!ORIGINAL_FUNCTION(write)(trace.fd, trace.buffer, trace.used);
+		ORIGINAL_FUNCTION(close)(trace.fd);
+		trace.fd = -1;
+		trace.used = 0;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "iobuf.h"
+
+
+#define IOBUF_CLASSES 5      // 64 KiB to 1 MiB
+#define IOBUF_IDLE 4         // pooled buffers kept per size
+#define IOBUF_LIMIT (256 * 1024 * 1024)
+
+_Static_assert(IOBUF_MIN << (IOBUF_CLASSES - 1) == IOBUF_MAX, "size classes must cover the buffer sizes");
+
+static struct {
+	pthread_mutex_t lock;
+	size_t limit;
+	struct iobuf_statistics_s statistics;
+	struct idle_s {
+		struct idle_s *next;  // stored within the pooled buffer
+	} *idle[IOBUF_CLASSES];
+	size_t idle_count[IOBUF_CLASSES];
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_initialize(void);
+static unsigned pool_class(size_t size);
+static void *pool_take(unsigned class, bool beyond_limit);
+static bool pool_trim(size_t needed);
+
+
+void *iobuf_get(size_t wanted, size_t minimum, size_t *size_out)
+{
+	pthread_once(&pool_once, pool_initialize);
+	const unsigned lowest = pool_class(minimum);
+	unsigned class = pool_class(wanted);
+	if (class < lowest) class = lowest;
+
+	pthread_mutex_lock(&pool.lock);
+	void *buffer = NULL;
+	unsigned taken = class + 1;
+	while (!buffer && taken > lowest) buffer = pool_take(--taken, false);
+	if (!buffer) {
+		// backpressure cannot shrink further, the smallest size exceeds the cap
+		buffer = pool_take(lowest, true);
+		assert(buffer);
+	}
+	if (taken < class) pool.statistics.reductions++;
+	pthread_mutex_unlock(&pool.lock);
+
+	*size_out = (size_t)IOBUF_MIN << taken;
+	return buffer;
+}
+
+void *iobuf_try(size_t size)
+{
+	pthread_once(&pool_once, pool_initialize);
+	const unsigned class = pool_class(size);
+	assert(size == (size_t)IOBUF_MIN << class);
+
+	pthread_mutex_lock(&pool.lock);
+	void *buffer = pool_take(class, false);
+	if (!buffer) pool.statistics.reductions++;
+	pthread_mutex_unlock(&pool.lock);
+	return buffer;
+}
+
+void iobuf_put(void *buffer, size_t size)
+{
+	if (!buffer) return;
+	const unsigned class = pool_class(size);
+	assert(size == (size_t)IOBUF_MIN << class);
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.idle_count[class] < IOBUF_IDLE && pool.statistics.current <= pool.limit) {
+		struct idle_s *idle = buffer;
+		idle->next = pool.idle[class];
+		pool.idle[class] = idle;
+		pool.idle_count[class]++;
+		buffer = NULL;
+	} else {
+		pool.statistics.current -= size;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	free(buffer);
+}
+
+void iobuf_statistics(struct iobuf_statistics_s *statistics)
+{
+	pthread_mutex_lock(&pool.lock);
+	*statistics = pool.statistics;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+/* MARK: - Helper Functions */
+
+static void pool_initialize(void)
+{
+	pool.limit = IOBUF_LIMIT;
+	const char *requested = getenv("UNISON_INTERCEPT_MEMORY");
+	if (requested && *requested) pool.limit = (size_t)strtoul(requested, NULL, 10) * 1024 * 1024;
+}
+
+/* smallest size class holding the given size, sizes beyond the largest class are capped */
+static unsigned pool_class(size_t size)
+{
+	unsigned class = 0;
+	while (class + 1 < IOBUF_CLASSES && ((size_t)IOBUF_MIN << class) < size) class++;
+	return class;
+}
+
+/* a pooled or newly allocated buffer of the class, called with the lock held */
+static void *pool_take(unsigned class, bool beyond_limit)
+{
+	const size_t size = (size_t)IOBUF_MIN << class;
+
+	if (pool.idle[class]) {
+		struct idle_s *idle = pool.idle[class];
+		pool.idle[class] = idle->next;
+		pool.idle_count[class]--;
+		pool.statistics.reuses++;
+		return idle;
+	}
+
+	if (!pool_trim(size) && !beyond_limit) return NULL;
+
+	void *buffer = NULL;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	if (posix_memalign(&buffer, page, size) != 0) return NULL;
+	pool.statistics.allocations++;
+	pool.statistics.current += size;
+	if (pool.statistics.current > pool.statistics.peak) pool.statistics.peak = pool.statistics.current;
+	return buffer;
+}
+
+/* release pooled buffers of other sizes until the needed bytes fit under the cap */
+static bool pool_trim(size_t needed)
+{
+	for (unsigned class = IOBUF_CLASSES; pool.statistics.current + needed > pool.limit && class-- > 0;) {
+		while (pool.idle[class] && pool.statistics.current + needed > pool.limit) {
+			struct idle_s *idle = pool.idle[class];
+			pool.idle[class] = idle->next;
+			pool.idle_count[class]--;
+			pool.statistics.current -= (size_t)IOBUF_MIN << class;
+			free(idle);
+		}
+	}
+	return pool.statistics.current + needed <= pool.limit;
+}
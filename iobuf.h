@@ -0,0 +1,29 @@
+/* pool of aligned I/O buffers under a process-wide memory cap
+ *
+ * Layers that stage file content take their buffers from the pool, sized in
+ * powers of two from 64 KiB to 1 MiB. Returned buffers are kept for reuse.
+ * All buffers together stay within UNISON_INTERCEPT_MEMORY MiB, by default
+ * 256: when the cap is reached, callers receive smaller buffers and transfer
+ * in smaller chunks, only the smallest size is handed out beyond the cap. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IOBUF_MIN (64 * 1024)
+#define IOBUF_MAX (1024 * 1024)
+
+struct iobuf_statistics_s {
+	uint64_t allocations;  // buffers allocated from the system
+	uint64_t reuses;       // buffers handed out again from the pool
+	uint64_t reductions;   // requests served smaller than wanted or refused
+	size_t current;        // bytes allocated, in use or pooled
+	size_t peak;
+};
+
+/* a buffer of at most the wanted and at least the minimum size, its actual size is returned */
+[[nodiscard]] void *iobuf_get(size_t wanted, size_t minimum, size_t *size_out);
+/* a buffer of exactly the given size, NULL if the cap does not permit it */
+[[nodiscard]] void *iobuf_try(size_t size);
+/* return a buffer to the pool */
+void iobuf_put(void *buffer, size_t size);
+void iobuf_statistics(struct iobuf_statistics_s *statistics);
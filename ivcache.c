@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "ivcache.h"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#include "mbedtls/md.h"
+#pragma clang diagnostic pop
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+
+#define IVCACHE_FILE "ivcache"
+#define IVCACHE_MAGIC "UNIVCACH"
+#define IVCACHE_VERSION 1
+#define IVCACHE_SLOTS 8192
+#define IVCACHE_WAYS 4  // slots a file can occupy, the first one is chosen by its inode
+#define IVCACHE_RACY 2  // seconds, covers the coarsest timestamp granularity in use (FAT)
+
+struct ivcache_key_s {
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t modification[2];
+	int64_t change[2];
+	unsigned char key_id[128 / CHAR_BIT];  // derived from the encryption key, which is never stored
+};
+
+struct ivcache_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+};
+
+static struct ivcache_s {
+	struct ivcache_header_s header;
+	struct ivcache_entry_s {
+		_Atomic uint32_t sequence;  // odd while the entry is being replaced
+		uint32_t reserved;
+		struct ivcache_key_s key;
+		unsigned char iv[256 / CHAR_BIT];
+	} entry[IVCACHE_SLOTS];
+} *cache = NULL;
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static _Atomic uint64_t cache_hits = 0;
+static _Atomic uint64_t cache_misses = 0;
+
+static void cache_open(void);
+static bool cache_map(const char *path);
+static void cache_create(const char *path);
+static bool cache_racy(const struct stat *buf);
+static void cache_key(struct ivcache_key_s *key_out, const struct stat *buf, const unsigned char key[256 / CHAR_BIT]);
+static struct ivcache_entry_s *cache_set(const struct ivcache_key_s *key);
+
+
+bool ivcache_lookup(const struct stat *buf, const unsigned char key[256 / CHAR_BIT], unsigned char iv_out[256 / CHAR_BIT])
+{
+	pthread_once(&cache_once, cache_open);
+	if (!cache) {
+		atomic_fetch_add_explicit(&cache_misses, 1, memory_order_relaxed);
+		return false;
+	}
+
+	struct ivcache_key_s wanted;
+	cache_key(&wanted, buf, key);
+	struct ivcache_entry_s *set = cache_set(&wanted);
+
+	for (size_t way = 0; way < IVCACHE_WAYS; way++) {
+		struct ivcache_entry_s *entry = &set[way];
+		const uint32_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+		if (sequence & 1) continue;
+
+		// copy first, then check that no writer interfered
+		const bool match = memcmp(&entry->key, &wanted, sizeof(wanted)) == 0;
+		unsigned char iv[256 / CHAR_BIT];
+		memcpy(iv, entry->iv, sizeof(iv));
+		atomic_thread_fence(memory_order_acquire);
+		if (match && atomic_load_explicit(&entry->sequence, memory_order_relaxed) == sequence) {
+			memcpy(iv_out, iv, sizeof(iv));
+			atomic_fetch_add_explicit(&cache_hits, 1, memory_order_relaxed);
+			return true;
+		}
+	}
+
+	atomic_fetch_add_explicit(&cache_misses, 1, memory_order_relaxed);
+	return false;
+}
+
+void ivcache_store(int fd, const struct stat *buf, const unsigned char key[256 / CHAR_BIT], const unsigned char iv[256 / CHAR_BIT])
+{
+	pthread_once(&cache_once, cache_open);
+	if (!cache) return;
+
+	// a file modified while its IV was derived must not be cached
+	struct ivcache_key_s wanted, current;
+	struct stat current_buf;
+	if (fstat(fd, &current_buf) != 0) return;
+	cache_key(&wanted, buf, key);
+	cache_key(&current, &current_buf, key);
+	if (memcmp(&wanted, &current, sizeof(wanted)) != 0) return;
+	// a file changed within the current timestamp tick can change again without changing its key
+	if (cache_racy(&current_buf)) return;
+	struct ivcache_entry_s *set = cache_set(&wanted);
+
+	// replace an older entry of the same file and key, else an unused slot, else any
+	struct ivcache_entry_s *entry = &set[iv[0] % IVCACHE_WAYS];
+	for (size_t way = 0; way < IVCACHE_WAYS; way++) {
+		if (set[way].key.device == wanted.device && set[way].key.inode == wanted.inode &&
+		    memcmp(set[way].key.key_id, wanted.key_id, sizeof(wanted.key_id)) == 0) {
+			entry = &set[way];
+			break;
+		}
+		if (atomic_load_explicit(&set[way].sequence, memory_order_relaxed) == 0) entry = &set[way];
+	}
+
+	uint32_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+	// a concurrent writer owns the slot, its entry is as good as ours
+	if (sequence & 1) return;
+	if (!atomic_compare_exchange_strong_explicit(&entry->sequence, &sequence, sequence + 1,
+	                                             memory_order_acquire, memory_order_relaxed)) return;
+	atomic_thread_fence(memory_order_release);
+	memcpy(&entry->key, &wanted, sizeof(wanted));
+	memcpy(entry->iv, iv, sizeof(entry->iv));
+	atomic_store_explicit(&entry->sequence, sequence + 2, memory_order_release);
+}
+
+void ivcache_statistics(uint64_t *hits, uint64_t *misses)
+{
+	*hits = atomic_load_explicit(&cache_hits, memory_order_relaxed);
+	*misses = atomic_load_explicit(&cache_misses, memory_order_relaxed);
+}
+
+
+/* MARK: - Helper Functions */
+
+static void cache_open(void)
+{
+	if (!config.directory) return;
+	size_t size = strlen(config.directory) + sizeof("/" IVCACHE_FILE);
+	char *path = malloc(size);
+	if (!path) abort();
+	snprintf(path, size, "%s/" IVCACHE_FILE, config.directory);
+
+	// a missing or incompatible cache is replaced by an empty one
+	if (!cache_map(path)) {
+		cache_create(path);
+		cache_map(path);
+	}
+
+	free(path);
+}
+
+static bool cache_map(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	struct stat buf;
+	struct ivcache_s *mapping = MAP_FAILED;
+	if (fstat(fd, &buf) == 0 && (size_t)buf.st_size == sizeof(struct ivcache_s))
+		mapping = mmap(NULL, sizeof(struct ivcache_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+
+	if (memcmp(mapping->header.magic, IVCACHE_MAGIC, sizeof(mapping->header.magic)) != 0 ||
+	    mapping->header.version != IVCACHE_VERSION || mapping->header.slots != IVCACHE_SLOTS) {
+		munmap(mapping, sizeof(struct ivcache_s));
+		return false;
+	}
+
+	cache = mapping;
+	return true;
+}
+
+static void cache_create(const char *path)
+{
+	size_t size = strlen(path) + sizeof(".XXXXXX");
+	char *temporary = malloc(size);
+	if (!temporary) abort();
+	snprintf(temporary, size, "%s.XXXXXX", path);
+
+	// prepare the new cache aside, so other processes only ever see a complete file
+	int fd = mkstemp(temporary);
+	if (fd >= 0) {
+		const struct ivcache_header_s header = { .magic = IVCACHE_MAGIC, .version = IVCACHE_VERSION, .slots = IVCACHE_SLOTS };
+		bool success = ftruncate(fd, sizeof(struct ivcache_s)) == 0 &&
+		               pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+		close(fd);
+		if (!success || rename(temporary, path) != 0) unlink(temporary);
+	}
+
+	free(temporary);
+}
+
+static bool cache_racy(const struct stat *buf)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now) != 0) return true;
+	return buf->st_mtim.tv_sec > now.tv_sec - IVCACHE_RACY || buf->st_ctim.tv_sec > now.tv_sec - IVCACHE_RACY;
+}
+
+static void cache_key(struct ivcache_key_s *key_out, const struct stat *buf, const unsigned char key[256 / CHAR_BIT])
+{
+	memset(key_out, 0, sizeof(*key_out));
+	key_out->device = (uint64_t)buf->st_dev;
+	key_out->inode = (uint64_t)buf->st_ino;
+	key_out->size = (uint64_t)buf->st_size;
+	key_out->modification[0] = (int64_t)buf->st_mtim.tv_sec;
+	key_out->modification[1] = (int64_t)buf->st_mtim.tv_nsec;
+	key_out->change[0] = (int64_t)buf->st_ctim.tv_sec;
+	key_out->change[1] = (int64_t)buf->st_ctim.tv_nsec;
+
+	unsigned char digest[256 / CHAR_BIT];
+	const unsigned char label[] = "ivcache";
+	int md_result = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, 256 / CHAR_BIT,
+	                                label, sizeof(label) - 1, digest);
+	assert(md_result == 0);
+	memcpy(key_out->key_id, digest, sizeof(key_out->key_id));
+}
+
+static struct ivcache_entry_s *cache_set(const struct ivcache_key_s *key)
+{
+	uint64_t hash = (key->inode ^ (key->device << 32 | key->device >> 32)) * 0x9e3779b97f4a7c15U;
+	return &cache->entry[(hash >> 32) % IVCACHE_SLOTS & ~(size_t)(IVCACHE_WAYS - 1)];
+}
@@ -0,0 +1,22 @@
+/* persistent cache of the IVs derived for encrypted files
+ *
+ * Deriving the IV of an encrypted file requires reading the entire file before
+ * the first encrypted byte can be produced. The cache remembers derived IVs in
+ * a memory-mapped file within Unison’s directory, keyed by the identity and
+ * change times of the file and by the encryption key. Slots are replaced under
+ * a per-slot sequence number, so concurrent Unison processes and threads never
+ * observe a partially written entry. The compress layer keeps the sizes of
+ * compressed views here as well, under keys of its own. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* look up the IV for the file described by the stat buffer */
+[[nodiscard]] bool ivcache_lookup(const struct stat *buf, const unsigned char key[256 / CHAR_BIT], unsigned char iv_out[256 / CHAR_BIT]);
+/* remember the IV derived from an open file, unless it changed since the stat buffer was filled or too
+ * recently for its timestamps to tell a further change apart */
+void ivcache_store(int fd, const struct stat *buf, const unsigned char key[256 / CHAR_BIT], const unsigned char iv[256 / CHAR_BIT]);
+/* lookups answered and missed by this process */
+void ivcache_statistics(uint64_t *hits, uint64_t *misses);
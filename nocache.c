@@ -1,16 +1,117 @@
+#include <stdlib.h>
+#include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifndef __APPLE__
+#include <sys/syscall.h>
+#endif
 
 #include "nocache.h"
+#include "config.h"
+#include "fdmap.h"
+
+
+struct nocache_s {
+	struct fdmap_reference_s reference;  // held by the fd table and calls in progress
+	bool writable;
+	off_t dropped;   // data before this offset is no longer cached
+	// writing
+	off_t end;       // end of the data written so far
+	off_t started;   // writeback is running for data before this offset
+	size_t pending;  // bytes written since writeback was last started
+	// reading
+	off_t position;  // file offset of the next read()
+	off_t next;      // offset where a sequential read continues
+	size_t streak;   // bytes read sequentially up to there
+};
+
+// longest a single call waits for the bandwidth limit, larger requests are split
+#define LIMIT_SLICE (50 * 1000 * 1000)
+// unused bandwidth saved up for later calls, as time at the limit
+#define LIMIT_BURST (100 * 1000 * 1000)
+
+enum limit_direction { LIMIT_READ, LIMIT_WRITE };
+
+static struct limit_s {
+	pthread_mutex_t lock;
+	uint64_t refilled;  // monotonic time tokens were last added
+	double tokens;      // bytes that may pass without waiting, negative when taken ahead
+	_Atomic uint64_t calls, nanoseconds;
+} limit[] = {
+	[LIMIT_READ] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+	[LIMIT_WRITE] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+#ifndef __APPLE__
+// data written or read before cached data is dropped
+#define DROP_WINDOW (8 * 1024 * 1024)
+// reads shorter than this in a row are left alone
+#define SEQUENTIAL_MIN (1024 * 1024)
+
+// from linux/ioprio.h, which not all systems ship
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+// how often stall information is sampled, the kernel updates it every two seconds
+#define PRESSURE_INTERVAL (1000 * 1000 * 1000)
+// longest delay of a call while pressure is between one and two times the threshold
+#define SLOWDOWN_MAX (50 * 1000 * 1000)
+// samples a call waits for pressure to fall below twice the threshold
+#define PAUSE_MAX 30
+
+static struct {
+	pthread_mutex_t lock;              // held while sampling
+	_Atomic uint64_t sampled;          // monotonic time of the last sample
+	_Atomic uint32_t io, memory;       // stalled time in hundredths of a percent
+	_Atomic uint64_t calls, nanoseconds;
+} pressure = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+#endif
+
+static void nocache_setup(int fd, int flags);
+static void nocache_release(void *state);
+static void nocache_written(int fd, ssize_t bytes, off_t offset);
+static void nocache_consumed(int fd, ssize_t bytes, off_t offset);
+static void nocache_throttle(int fd);
+#ifndef __APPLE__
+static void written_window(struct nocache_s *state, int fd, ssize_t bytes, off_t offset);
+static void consumed_window(struct nocache_s *state, int fd, ssize_t bytes, off_t offset);
+#endif
+static ssize_t limit_transfer(int fd, enum limit_direction direction, void *buf, size_t bytes, off_t offset);
+static size_t limit_vectored(int fd, enum limit_direction direction, const struct iovec *iov, int iovcnt, uint64_t *rate_out);
+static size_t limit_slice(int fd, enum limit_direction direction, uint64_t *rate_out);
+static void limit_take(enum limit_direction direction, size_t bytes, uint64_t rate);
+static void limit_settle(enum limit_direction direction, size_t taken, ssize_t result, uint64_t rate);
+static uint64_t monotonic_now(void);
+#ifndef __APPLE__
+static void pressure_sample(uint64_t now);
+static uint32_t pressure_read(const char *path);
+#endif
 
 
 static void __attribute__((constructor)) initialize(void)
 {
 	// lower Unison's priority to avoid disk hogging
 	setpriority(PRIO_PROCESS, 0, 10);
+#ifdef __APPLE__
+	setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE);
+#else
+	// threads inherit the class, disk access only happens when nobody else needs the disk
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
 }
 
 
@@ -29,11 +130,458 @@ int nocache_open(const char *path, int flags, ...)
 		result = open(path, flags);
 	}
 
-#ifdef __APPLE__
-	bool writable = (flags & O_ACCMODE) == O_WRONLY || (flags & O_ACCMODE) == O_RDWR;
-	if (result > 0 && writable) fcntl(result, F_NOCACHE, 1);
-#endif
+	nocache_setup(result, flags);
 
 	va_end(arg);
 	return result;
 }
+
+int nocache_openat(int dirfd, const char *path, int flags, ...)
+{
+	int result;
+	va_list arg;
+	va_start(arg, flags);
+
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		result = openat(dirfd, path, flags, mode);
+	} else {
+		result = openat(dirfd, path, flags);
+	}
+
+	nocache_setup(result, flags);
+
+	va_end(arg);
+	return result;
+}
+
+int nocache_close(int fd)
+{
+	struct nocache_s *state = fdmap_set(fd, FDMAP_NOCACHE, NULL);
+#ifndef __APPLE__
+	if (state && state->writable) {
+		// start writeback for the rest, but do not wait for it like fsync would
+		sync_file_range(fd, state->started, 0, SYNC_FILE_RANGE_WRITE);
+		posix_fadvise(fd, state->dropped, 0, POSIX_FADV_DONTNEED);
+	}
+	if (state && !state->writable && state->streak >= SEQUENTIAL_MIN) {
+		// includes what layers below read beyond the last read
+		posix_fadvise(fd, state->dropped, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+	nocache_release(state);
+	return close(fd);
+}
+
+ssize_t nocache_read(int fd, void *buf, size_t bytes)
+{
+	nocache_throttle(fd);
+	ssize_t result = limit_transfer(fd, LIMIT_READ, buf, bytes, -1);
+	nocache_consumed(fd, result, -1);
+	return result;
+}
+
+ssize_t nocache_write(int fd, const void *buf, size_t bytes)
+{
+	nocache_throttle(fd);
+	ssize_t result = limit_transfer(fd, LIMIT_WRITE, (void *)buf, bytes, -1);
+	nocache_written(fd, result, -1);
+	return result;
+}
+
+ssize_t nocache_pread(int fd, void *buf, size_t bytes, off_t offset)
+{
+	nocache_throttle(fd);
+	ssize_t result = limit_transfer(fd, LIMIT_READ, buf, bytes, offset);
+	nocache_consumed(fd, result, offset);
+	return result;
+}
+
+ssize_t nocache_pwrite(int fd, const void *buf, size_t bytes, off_t offset)
+{
+	nocache_throttle(fd);
+	ssize_t result = limit_transfer(fd, LIMIT_WRITE, (void *)buf, bytes, offset);
+	nocache_written(fd, result, offset);
+	return result;
+}
+
+ssize_t nocache_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	nocache_throttle(fd);
+	uint64_t rate;
+	const size_t taken = limit_vectored(fd, LIMIT_READ, iov, iovcnt, &rate);
+	ssize_t result = readv(fd, iov, iovcnt);
+	limit_settle(LIMIT_READ, taken, result, rate);
+	nocache_consumed(fd, result, -1);
+	return result;
+}
+
+ssize_t nocache_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	nocache_throttle(fd);
+	uint64_t rate;
+	const size_t taken = limit_vectored(fd, LIMIT_WRITE, iov, iovcnt, &rate);
+	ssize_t result = writev(fd, iov, iovcnt);
+	limit_settle(LIMIT_WRITE, taken, result, rate);
+	nocache_written(fd, result, -1);
+	return result;
+}
+
+ssize_t nocache_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	nocache_throttle(fd);
+	uint64_t rate;
+	const size_t taken = limit_vectored(fd, LIMIT_READ, iov, iovcnt, &rate);
+	ssize_t result = preadv(fd, iov, iovcnt, offset);
+	limit_settle(LIMIT_READ, taken, result, rate);
+	nocache_consumed(fd, result, offset);
+	return result;
+}
+
+ssize_t nocache_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	nocache_throttle(fd);
+	uint64_t rate;
+	const size_t taken = limit_vectored(fd, LIMIT_WRITE, iov, iovcnt, &rate);
+	ssize_t result = pwritev(fd, iov, iovcnt, offset);
+	limit_settle(LIMIT_WRITE, taken, result, rate);
+	nocache_written(fd, result, offset);
+	return result;
+}
+
+off_t nocache_lseek(int fd, off_t offset, int whence)
+{
+	off_t result = lseek(fd, offset, whence);
+#ifndef __APPLE__
+	struct nocache_s *state = fdmap_acquire(fd, FDMAP_NOCACHE);
+	if (state && result >= 0) state->position = result;
+	nocache_release(state);
+#endif
+	return result;
+}
+
+void nocache_statistics(struct nocache_statistics_s *statistics)
+{
+#ifndef __APPLE__
+	statistics->pressure_calls = atomic_load_explicit(&pressure.calls, memory_order_relaxed);
+	statistics->pressure_nanoseconds = atomic_load_explicit(&pressure.nanoseconds, memory_order_relaxed);
+#else
+	statistics->pressure_calls = 0;
+	statistics->pressure_nanoseconds = 0;
+#endif
+	statistics->read_calls = atomic_load_explicit(&limit[LIMIT_READ].calls, memory_order_relaxed);
+	statistics->read_nanoseconds = atomic_load_explicit(&limit[LIMIT_READ].nanoseconds, memory_order_relaxed);
+	statistics->write_calls = atomic_load_explicit(&limit[LIMIT_WRITE].calls, memory_order_relaxed);
+	statistics->write_nanoseconds = atomic_load_explicit(&limit[LIMIT_WRITE].nanoseconds, memory_order_relaxed);
+}
+
+
+/* MARK: - Helper Functions */
+
+static void nocache_setup(int fd, int flags)
+{
+	if (fd < 0) return;
+	const bool writable = (flags & O_ACCMODE) == O_WRONLY || (flags & O_ACCMODE) == O_RDWR;
+#ifdef __APPLE__
+	if (writable) fcntl(fd, F_NOCACHE, 1);
+	// only bandwidth limits need to see the calls on this file
+	const bool tracked = atomic_load_explicit(&config.iolimit.read, memory_order_relaxed) ||
+		atomic_load_explicit(&config.iolimit.write, memory_order_relaxed);
+#else
+	bool tracked = writable ||
+		atomic_load_explicit(&config.iolimit.read, memory_order_relaxed) ||
+		atomic_load_explicit(&config.iolimit.write, memory_order_relaxed) ||
+		atomic_load_explicit(&config.pressure.io, memory_order_relaxed) ||
+		atomic_load_explicit(&config.pressure.memory, memory_order_relaxed);
+	// files transformed by other layers lose the fast path anyway, and their size is costly to obtain
+	if (!tracked && fdmap_interest(fd) & ~(1U << FDMAP_NOCACHE)) tracked = true;
+	if (!tracked) {
+		// reads of smaller files never form a stream, they keep the fast path of untracked files
+		struct stat buf;
+		tracked = fstat(fd, &buf) == 0 && S_ISREG(buf.st_mode) && buf.st_size >= SEQUENTIAL_MIN;
+	}
+#endif
+	// a recycled file descriptor must not inherit state of a missed close
+	struct nocache_s *state = NULL;
+	if (tracked) {
+		state = calloc(1, sizeof(struct nocache_s));
+		if (!state) abort();
+		atomic_init(&state->reference.count, 1);
+		state->writable = writable;
+	}
+	nocache_release(fdmap_set(fd, FDMAP_NOCACHE, state));
+}
+
+static void nocache_release(void *state)
+{
+	if (state && fdmap_put(state)) free(state);
+}
+
+static void nocache_written(int fd, ssize_t bytes, off_t offset)
+{
+#ifndef __APPLE__
+	if (bytes <= 0) return;
+	struct nocache_s *state = fdmap_acquire(fd, FDMAP_NOCACHE);
+	if (!state) return;
+	if (state->writable) written_window(state, fd, bytes, offset);
+	nocache_release(state);
+#else
+	(void)fd;
+	(void)bytes;
+	(void)offset;
+#endif
+}
+
+#ifndef __APPLE__
+static void written_window(struct nocache_s *state, int fd, ssize_t bytes, off_t offset)
+{
+	state->pending += (size_t)bytes;
+	if (offset >= 0 && offset + bytes > state->end) state->end = offset + bytes;
+	if (state->pending < DROP_WINDOW) return;
+	state->pending = 0;
+
+	if (offset < 0) {
+		// sequential writes only tell where they end when asked
+		const off_t position = lseek(fd, 0, SEEK_CUR);
+		if (position > state->end) state->end = position;
+	}
+	if (state->end <= state->started) return;
+
+	/* Offsets are those Unison sees, layers below may write the file elsewhere.
+	 * Writeback therefore always extends to the end of the file, and whatever
+	 * a window misses is dropped when the file is closed. */
+	if (sync_file_range(fd, state->started, 0, SYNC_FILE_RANGE_WRITE) != 0) {
+		// not a regular file
+		nocache_release(fdmap_set(fd, FDMAP_NOCACHE, NULL));
+		return;
+	}
+	// the previous window has had a full window of time to reach storage
+	if (state->started > state->dropped) {
+		sync_file_range(fd, state->dropped, state->started - state->dropped,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, state->dropped, state->started - state->dropped, POSIX_FADV_DONTNEED);
+		state->dropped = state->started;
+	}
+	state->started = state->end;
+}
+#endif
+
+static void nocache_consumed(int fd, ssize_t bytes, off_t offset)
+{
+#ifndef __APPLE__
+	if (bytes <= 0) return;
+	struct nocache_s *state = fdmap_acquire(fd, FDMAP_NOCACHE);
+	if (!state) return;
+	if (!state->writable) consumed_window(state, fd, bytes, offset);
+	nocache_release(state);
+#else
+	(void)fd;
+	(void)bytes;
+	(void)offset;
+#endif
+}
+
+#ifndef __APPLE__
+static void consumed_window(struct nocache_s *state, int fd, ssize_t bytes, off_t offset)
+{
+	if (offset < 0) {
+		offset = state->position;
+		state->position += bytes;
+	}
+	if (offset != state->next) {
+		// random access ends a stream and leaves the cache to the kernel again
+		if (state->streak >= SEQUENTIAL_MIN) posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+		state->streak = 0;
+		state->dropped = offset;
+	}
+	state->next = offset + bytes;
+	state->streak += (size_t)bytes;
+	if (state->streak < SEQUENTIAL_MIN) return;
+
+	if (state->streak - (size_t)bytes < SEQUENTIAL_MIN) {
+		// a stream: read ahead further and drop behind the reader from now on
+		if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
+			// not a regular file
+			nocache_release(fdmap_set(fd, FDMAP_NOCACHE, NULL));
+			return;
+		}
+	}
+	if (state->next - state->dropped >= DROP_WINDOW) {
+		posix_fadvise(fd, state->dropped, state->next - state->dropped, POSIX_FADV_DONTNEED);
+		state->dropped = state->next;
+	}
+}
+#endif
+
+/* delay the call while the system stalls on I/O or memory beyond the configured thresholds */
+static void nocache_throttle(int fd)
+{
+#ifndef __APPLE__
+	const uint32_t io_threshold = atomic_load_explicit(&config.pressure.io, memory_order_relaxed);
+	const uint32_t memory_threshold = atomic_load_explicit(&config.pressure.memory, memory_order_relaxed);
+	if (!io_threshold && !memory_threshold) return;
+	// only files, not pipes or sockets
+	if (!fdmap_get(fd, FDMAP_NOCACHE)) return;
+
+	const uint64_t start = monotonic_now();
+	uint64_t now = start;
+	for (unsigned paused = 0;; paused++) {
+		pressure_sample(now);
+		// how far pressure exceeds the threshold, 1.0 at twice the threshold
+		double excess = 0.0;
+		if (io_threshold)
+			excess = (double)atomic_load_explicit(&pressure.io, memory_order_relaxed) / io_threshold - 1.0;
+		if (memory_threshold) {
+			const double memory = (double)atomic_load_explicit(&pressure.memory, memory_order_relaxed) / memory_threshold - 1.0;
+			if (memory > excess) excess = memory;
+		}
+		if (excess <= 0.0) break;
+
+		if (excess < 1.0 || paused == PAUSE_MAX) {
+			// slow down in proportion to the excess
+			const long delay = (long)(SLOWDOWN_MAX * (excess < 1.0 ? excess : 1.0));
+			nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = delay }, NULL);
+			now = monotonic_now();
+			break;
+		}
+		// pause while pressure stays this high
+		nanosleep(&(struct timespec){ .tv_sec = PRESSURE_INTERVAL / 1000000000, .tv_nsec = PRESSURE_INTERVAL % 1000000000 }, NULL);
+		now = monotonic_now();
+	}
+
+	if (now != start) {
+		atomic_fetch_add_explicit(&pressure.calls, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&pressure.nanoseconds, now - start, memory_order_relaxed);
+	}
+#else
+	// stall information is specific to Linux
+	(void)fd;
+#endif
+}
+
+/* read or write in slices, each waiting for its share of the bandwidth limit */
+static ssize_t limit_transfer(int fd, enum limit_direction direction, void *buf, size_t bytes, off_t offset)
+{
+	uint64_t rate;
+	const size_t slice = limit_slice(fd, direction, &rate);
+	size_t done = 0;
+	do {
+		const size_t step = bytes - done < slice ? bytes - done : slice;
+		if (rate) limit_take(direction, step, rate);
+		ssize_t result;
+		if (direction == LIMIT_READ)
+			result = offset < 0 ? read(fd, (char *)buf + done, step) : pread(fd, (char *)buf + done, step, offset + (off_t)done);
+		else
+			result = offset < 0 ? write(fd, (char *)buf + done, step) : pwrite(fd, (char *)buf + done, step, offset + (off_t)done);
+		limit_settle(direction, step, result, rate);
+		// report what was transferred before an error, like a short transfer
+		if (result < 0) return done ? (ssize_t)done : result;
+		done += (size_t)result;
+		if ((size_t)result < step) break;
+	} while (done < bytes);
+	return (ssize_t)done;
+}
+
+/* vectored calls transfer at once after waiting for the first slice, the rest
+ * is settled by limit_settle once the transferred size is known */
+static size_t limit_vectored(int fd, enum limit_direction direction, const struct iovec *iov, int iovcnt, uint64_t *rate_out)
+{
+	const size_t slice = limit_slice(fd, direction, rate_out);
+	if (!*rate_out) return 0;
+	size_t bytes = 0;
+	for (int i = 0; i < iovcnt; i++) bytes += iov[i].iov_len;
+	const size_t taken = bytes < slice ? bytes : slice;
+	limit_take(direction, taken, *rate_out);
+	return taken;
+}
+
+/* bytes passing the limit in one step, unlimited when the rate is 0 */
+static size_t limit_slice(int fd, enum limit_direction direction, uint64_t *rate_out)
+{
+	uint64_t rate = atomic_load_explicit(direction == LIMIT_READ ? &config.iolimit.read : &config.iolimit.write, memory_order_relaxed);
+	// only files, not pipes or sockets
+	if (rate && !fdmap_get(fd, FDMAP_NOCACHE)) rate = 0;
+	*rate_out = rate;
+	if (!rate) return SIZE_MAX;
+	// in floating point, the product overflows for huge limits meant as unlimited
+	const double slice = (double)rate * LIMIT_SLICE / 1000000000;
+	if (slice >= (double)SIZE_MAX) return SIZE_MAX;
+	return slice > 4096 ? (size_t)slice : 4096;
+}
+
+/* token bucket shared by all threads, a call takes its tokens and sleeps off any debt */
+static void limit_take(enum limit_direction direction, size_t bytes, uint64_t rate)
+{
+	struct limit_s *bucket = &limit[direction];
+	const double burst = (double)rate * LIMIT_BURST / 1000000000;
+
+	pthread_mutex_lock(&bucket->lock);
+	const uint64_t now = monotonic_now();
+	if (bucket->refilled)
+		bucket->tokens += (double)(now - bucket->refilled) * (double)rate / 1000000000;
+	else
+		bucket->tokens = burst;
+	if (bucket->tokens > burst) bucket->tokens = burst;
+	bucket->refilled = now;
+	bucket->tokens -= (double)bytes;
+	const double debt = -bucket->tokens;
+	pthread_mutex_unlock(&bucket->lock);
+
+	if (debt <= 0) return;
+	const uint64_t delay = (uint64_t)(debt * 1000000000 / (double)rate);
+	nanosleep(&(struct timespec){ .tv_sec = (time_t)(delay / 1000000000), .tv_nsec = (long)(delay % 1000000000) }, NULL);
+	atomic_fetch_add_explicit(&bucket->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bucket->nanoseconds, delay, memory_order_relaxed);
+}
+
+/* charge the bytes actually transferred: return the tokens of a short or failed
+ * transfer, or take the remainder of a larger one in slices of the first */
+static void limit_settle(enum limit_direction direction, size_t taken, ssize_t result, uint64_t rate)
+{
+	if (!rate) return;
+	const size_t moved = result > 0 ? (size_t)result : 0;
+	for (size_t done = taken; done < moved; done += taken)
+		limit_take(direction, moved - done < taken ? moved - done : taken, rate);
+	if (taken <= moved) return;
+	struct limit_s *bucket = &limit[direction];
+	pthread_mutex_lock(&bucket->lock);
+	bucket->tokens += (double)(taken - moved);
+	pthread_mutex_unlock(&bucket->lock);
+}
+
+static uint64_t monotonic_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+#ifndef __APPLE__
+/* refresh the stall information when it is due, one thread samples for all */
+static void pressure_sample(uint64_t now)
+{
+	const uint64_t sampled = atomic_load_explicit(&pressure.sampled, memory_order_relaxed);
+	if (sampled && now - sampled < PRESSURE_INTERVAL) return;
+	if (pthread_mutex_trylock(&pressure.lock) != 0) return;
+	atomic_store_explicit(&pressure.io, pressure_read("/proc/pressure/io"), memory_order_relaxed);
+	atomic_store_explicit(&pressure.memory, pressure_read("/proc/pressure/memory"), memory_order_relaxed);
+	atomic_store_explicit(&pressure.sampled, now, memory_order_relaxed);
+	pthread_mutex_unlock(&pressure.lock);
+}
+
+/* share of the last ten seconds in which some task stalled, 0 without PSI support */
+static uint32_t pressure_read(const char *path)
+{
+	char buffer[256];
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	const ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (length <= 0) return 0;
+	buffer[length] = '\0';
+
+	unsigned whole, hundredths;
+	if (sscanf(buffer, "some avg10=%u.%2u", &whole, &hundredths) != 2) return 0;
+	return whole * 100 + hundredths;
+}
+#endif
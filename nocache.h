@@ -2,6 +2,38 @@
  *
  * This should improve data safety, because the Unison read check after copying
  * will read back from the physical storage medium, not from the buffer cache.
- * Also, this intercept lowers Unison's scheduler priority to reduce IO impact. */
+ * On Linux, written data is pushed to storage in a sliding window and dropped
+ * from the cache once it is on disk, and large sequential reads drop the data
+ * behind them. Also, this intercept lowers Unison's scheduler and I/O priority
+ * to reduce IO impact, and on Linux delays reads and writes while the system
+ * stalls on I/O or memory beyond the configured thresholds. Configured
+ * bandwidth limits apply to reads and writes of files on all systems and are
+ * charged for the bytes actually transferred. In-kernel copies through
+ * copy_file_range and sendfile bypass this layer and are not limited. */
+
+#include <stdint.h>
+
+struct iovec;
 
 [[nodiscard]] int nocache_open(const char *path, int flags, ...);
+[[nodiscard]] int nocache_openat(int dirfd, const char *path, int flags, ...);
+[[nodiscard]] int nocache_close(int fd);
+[[nodiscard]] ssize_t nocache_read(int fd, void *buf, size_t bytes);
+[[nodiscard]] ssize_t nocache_write(int fd, const void *buf, size_t bytes);
+[[nodiscard]] ssize_t nocache_pread(int fd, void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t nocache_pwrite(int fd, const void *buf, size_t bytes, off_t offset);
+[[nodiscard]] ssize_t nocache_readv(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t nocache_writev(int fd, const struct iovec *iov, int iovcnt);
+[[nodiscard]] ssize_t nocache_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+[[nodiscard]] ssize_t nocache_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+[[nodiscard]] off_t nocache_lseek(int fd, off_t offset, int whence);
+struct nocache_statistics_s {
+	uint64_t pressure_calls;        // delayed for I/O or memory pressure
+	uint64_t pressure_nanoseconds;
+	uint64_t read_calls;            // delayed by the read bandwidth limit
+	uint64_t read_nanoseconds;
+	uint64_t write_calls;           // delayed by the write bandwidth limit
+	uint64_t write_nanoseconds;
+};
+
+void nocache_statistics(struct nocache_statistics_s *statistics);
@@ -13,6 +13,7 @@
 #include <assert.h>
 
 #include "config.h"
+#include "fdmap.h"
 #include "prepost.h"
 
 #define ARCHIVE_PATTERN "*/ar[0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f]"
@@ -20,6 +21,7 @@
 
 static char *current_archive = NULL;
 
+static void prepostcmd_initialize_at(int dirfd, const char *path, int flags);
 static void prepostcmd_initialize(const char *path);
 static void prepostcmd_finalize(const char *path);
 static void post_recurse(const char *path);
@@ -86,9 +88,89 @@ int prepost_rmdir(const char *path)
 	return result;
 }
 
+int prepost_openat(int dirfd, const char *path, int flags, ...)
+{
+	prepostcmd_initialize_at(dirfd, path, 0);
+
+	int result;
+	va_list arg;
+	va_start(arg, flags);
+
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		result = openat(dirfd, path, flags, mode);
+	} else {
+		result = openat(dirfd, path, flags);
+	}
+
+	va_end(arg);
+	return result;
+}
+
+int prepost_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags)
+{
+	prepostcmd_initialize_at(dirfd, path, flags);
+	return fstatat(dirfd, path, buf, flags);
+}
+
+int prepost_renameat(int olddirfd, const char *old, int newdirfd, const char *new)
+{
+	char *resolved = fdmap_path(newdirfd, new, 0);
+	const char *new_path = resolved ? resolved : new;
+	int result = renameat(olddirfd, old, newdirfd, new);
+	if (result == 0)
+		post_recurse(new_path);
+	prepostcmd_finalize(new_path);
+	free(resolved);
+	return result;
+}
+
+int prepost_unlinkat(int dirfd, const char *path, int flags)
+{
+	char *resolved = fdmap_path(dirfd, path, 0);
+	const char *full_path = resolved ? resolved : path;
+	int result = unlinkat(dirfd, path, flags);
+	if (result == 0)
+		post_check(full_path);
+	// like rmdir(), removing a directory does not finalize the archive
+	if (!(flags & AT_REMOVEDIR))
+		prepostcmd_finalize(full_path);
+	free(resolved);
+	return result;
+}
+
+#ifndef __APPLE__
+int prepost_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf)
+{
+	prepostcmd_initialize_at(dirfd, path, flags);
+	return statx(dirfd, path, flags, mask, buf);
+}
+
+int prepost_renameat2(int olddirfd, const char *old, int newdirfd, const char *new, unsigned int flags)
+{
+	char *resolved = fdmap_path(newdirfd, new, 0);
+	const char *new_path = resolved ? resolved : new;
+	int result = renameat2(olddirfd, old, newdirfd, new, flags);
+	if (result == 0)
+		post_recurse(new_path);
+	prepostcmd_finalize(new_path);
+	free(resolved);
+	return result;
+}
+#endif
+
 
 /* MARK: - Helper Functions */
 
+static void prepostcmd_initialize_at(int dirfd, const char *path, int flags)
+{
+	// the archive file is only interesting until the pre command has run
+	if (current_archive) return;
+	char *resolved = fdmap_path(dirfd, path, flags);
+	prepostcmd_initialize(resolved ? resolved : path);
+	free(resolved);
+}
+
 static void prepostcmd_initialize(const char *path)
 {
 	if (!current_archive && fnmatch(ARCHIVE_PATTERN, path, 0) == 0) {
@@ -8,5 +8,14 @@ struct stat;
 [[nodiscard]] int prepost_rename(const char *old, const char *new);
 [[nodiscard]] int prepost_unlink(const char *path);
 [[nodiscard]] int prepost_rmdir(const char *path);
+[[nodiscard]] int prepost_openat(int dirfd, const char *path, int flags, ...);
+[[nodiscard]] int prepost_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags);
+[[nodiscard]] int prepost_renameat(int olddirfd, const char *old, int newdirfd, const char *new);
+[[nodiscard]] int prepost_unlinkat(int dirfd, const char *path, int flags);
+#ifndef __APPLE__
+struct statx;
+[[nodiscard]] int prepost_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf);
+[[nodiscard]] int prepost_renameat2(int olddirfd, const char *old, int newdirfd, const char *new, unsigned int flags);
+#endif
 
 void prepost_reset(void);
@@ -5,21 +5,16 @@
 #include <string.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <assert.h>
 
 #include "config.h"
+#include "fdmap.h"
 #include "symlink.h"
 
 
-static pthread_mutex_t dirmap_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct dirmap_s {
-	const DIR *dir;
-	char *path;
-	struct dirmap_s *next;
-} *dirmap = NULL;
-
 static void symlink_iterate(const char *path, void (*)(const struct string_s path, const struct string_s link, const char *target));
 static void symlink_prepare(const struct string_s path, const struct string_s link, const char *target);
 static void symlink_cleanup(const struct string_s path, const struct string_s link, const char *target);
@@ -51,36 +46,49 @@ DIR *symlink_opendir(const char *path)
 	DIR *dir = opendir(path);
 
 	// remember mapping from dir to path for cleanup
-	pthread_mutex_lock(&dirmap_lock);
-	struct dirmap_s *entry = malloc(sizeof(struct dirmap_s));
-	assert(entry);
-	entry->dir = dir;
-	entry->path = strdup(path);
-	entry->next = dirmap;
-	dirmap = entry;
-	pthread_mutex_unlock(&dirmap_lock);
+	if (dir) {
+		char *dir_path = strdup(path);
+		assert(dir_path);
+		free(fdmap_set(dirfd(dir), FDMAP_SYMLINK, dir_path));
+	}
 
 	return dir;
 }
 
+int symlink_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags)
+{
+	char *resolved = fdmap_path(dirfd, path, flags);
+	const char *full_path = resolved ? resolved : path;
+	symlink_iterate(full_path, symlink_prepare);
+	int result = fstatat(dirfd, path, buf, flags);
+	symlink_iterate(full_path, symlink_cleanup);
+	free(resolved);
+	return result;
+}
+
+#ifndef __APPLE__
+int symlink_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf)
+{
+	char *resolved = fdmap_path(dirfd, path, flags);
+	const char *full_path = resolved ? resolved : path;
+	symlink_iterate(full_path, symlink_prepare);
+	int result = statx(dirfd, path, flags, mask, buf);
+	symlink_iterate(full_path, symlink_cleanup);
+	free(resolved);
+	return result;
+}
+#endif
+
 int symlink_closedir(DIR *dir)
 {
+	// pull path information from the file descriptor of the dir
+	char *path = fdmap_set(dirfd(dir), FDMAP_SYMLINK, NULL);
 	int result = closedir(dir);
 
-	// pull path information from dirmap
-	pthread_mutex_lock(&dirmap_lock);
-	struct dirmap_s *entry, **prev = &dirmap;
-	for (entry = dirmap; entry; entry = entry->next) {
-		if (entry->dir == dir) break;
-		prev = &entry->next;
+	if (path) {
+		symlink_iterate(path, symlink_cleanup_children);
+		free(path);
 	}
-	assert(entry);
-	*prev = entry->next;
-	pthread_mutex_unlock(&dirmap_lock);
-
-	symlink_iterate(entry->path, symlink_cleanup_children);
-	free(entry->path);
-	free(entry);
 
 	return result;
 }
@@ -204,15 +212,5 @@ static void symlink_cleanup_children(const struct string_s path, const struct st
 
 void symlink_reset(void)
 {
-	pthread_mutex_lock(&dirmap_lock);
-
-	struct dirmap_s *next;
-	for (struct dirmap_s *entry = dirmap; entry; entry = next) {
-		next = entry->next;
-		free(entry->path);
-		free(entry);
-	}
-	dirmap = NULL;
-
-	pthread_mutex_unlock(&dirmap_lock);
+	fdmap_reset(FDMAP_SYMLINK, free);
 }
@@ -8,5 +8,10 @@ struct stat;
 [[nodiscard]] int symlink_lstat(const char * restrict path, struct stat * restrict buf);
 [[nodiscard]] DIR *symlink_opendir(const char *path);
 [[nodiscard]] int symlink_closedir(DIR *dir);
+[[nodiscard]] int symlink_fstatat(int dirfd, const char * restrict path, struct stat * restrict buf, int flags);
+#ifndef __APPLE__
+struct statx;
+[[nodiscard]] int symlink_statx(int dirfd, const char * restrict path, int flags, unsigned int mask, struct statx * restrict buf);
+#endif
 
 void symlink_reset(void);
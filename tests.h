@@ -1,9 +1,14 @@
 #include <fcntl.h>
 #include "config.h"
+#include "gcm.h"
+#include "workers.h"
 
 /* Explain to Swift concurrency checking that this shared state is OK. */
 extern struct config_s config __attribute__((swift_attr("nonisolated(unsafe)")));
 
+/* Swift cannot load C atomics, so the throttling settings are read here. */
+uint64_t config_throttling(unsigned index) __attribute__((swift_name("configThrottling(_:)")));
+
 /* Because open() is variadic in C, it is imported differently into Swift,
  * causing the intercept to not function properly. Instead, we provide non-
  * variadic wrappers for open. */
@@ -19,3 +24,13 @@ int open3(const char *path, int flags, mode_t mode)
 {
 	return open(path, flags, mode);
 }
+
+uint64_t config_throttling(unsigned index)
+{
+	switch (index) {
+	case 0: return config.pressure.io;
+	case 1: return config.pressure.memory;
+	case 2: return config.iolimit.read;
+	default: return config.iolimit.write;
+	}
+}
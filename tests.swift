@@ -8,6 +8,17 @@ import XCTest
 
 nonisolated(unsafe) let files = FileManager.default
 
+// reproducible pseudo-random numbers for randomized tests
+struct Generator: RandomNumberGenerator {
+	var state: UInt64
+	mutating func next() -> UInt64 {
+		state ^= state << 13
+		state ^= state >> 7
+		state ^= state << 17
+		return state
+	}
+}
+
 
 class Tests: XCTestCase {
 
@@ -45,6 +56,45 @@ class Tests: XCTestCase {
 		}
 	}
 
+	private func dumpConfig() -> [String] {
+		// one line per parsed entry, keys abbreviated to their first bytes
+		var dump: [String] = []
+		for root in [config.root.0, config.root.1] where root.string != nil {
+			dump.append("root \(String(cString: root.string))")
+		}
+		if let command = config.pre_command { dump.append("precmd \(String(cString: command))") }
+		if let command = config.post_command { dump.append("postcmd \(String(cString: command))") }
+		var post = config.post
+		while let current = post {
+			dump.append("post \(String(cString: current.pointee.pattern.string)) -> \(String(cString: current.pointee.command))")
+			post = current.pointee.next
+		}
+		var symlink = config.symlink
+		while let current = symlink {
+			dump.append("symlink \(String(cString: current.pointee.path.string)) -> \(String(cString: current.pointee.target))")
+			symlink = current.pointee.next
+		}
+		var encrypt = config.encrypt
+		while let current = encrypt {
+			let key = current.pointee.key
+			let prefix = String(format: "%02x%02x%02x%02x", key.0, key.1, key.2, key.3)
+			dump.append("encrypt \(String(cString: current.pointee.path.string)) \(current.pointee.format.rawValue) \(prefix)")
+			encrypt = current.pointee.next
+		}
+		var compress = config.compress
+		while let current = compress {
+			dump.append("compress \(String(cString: current.pointee.path.string)) \(current.pointee.method.rawValue)")
+			compress = current.pointee.next
+		}
+		if configThrottling(0) != 0 || configThrottling(1) != 0 {
+			dump.append("iopressure \(configThrottling(0)) \(configThrottling(1))")
+		}
+		if configThrottling(2) != 0 || configThrottling(3) != 0 {
+			dump.append("iolimit \(configThrottling(2)) \(configThrottling(3))")
+		}
+		return dump
+	}
+
 	private func traverse(_ path: URL) {
 		path.withUnsafeFileSystemRepresentation {
 			_ = closedir(opendir($0))
@@ -120,6 +170,193 @@ extension Tests {
 		XCTAssertEqual(config.encrypt.pointee.next.pointee.key.0, 165)
 	}
 
+	func testConfigSyntax() {
+		loadProfile("#post\t=\tPath a\tb -> x\r\n" +
+			"#precmd = a\0b\n" +
+			"#post = Path  c -> d\n" +
+			"#post = Path e -> f -> g\n" +
+			"#post = Path  -> y\n" +
+			" #symlink = Path l -> t\n" +
+			"#symlink =Path l -> t\n" +
+			"#encrypted = Path e -> aes-256-gcm:k\n" +
+			"#iopressure = 7.5\n" +
+			"fastercheckUNSAFE = true\n" +
+			"copyonconflict = true\n" +
+			"#postcmd = last")
+		// tabs are blanks, carriage returns stay in the argument, NUL bytes are dropped
+		XCTAssertEqual(String(cString: config.post.pointee.pattern.string), "a\tb")
+		XCTAssertEqual(String(cString: config.post.pointee.command), "x\r")
+		XCTAssertEqual(String(cString: config.pre_command), "ab")
+		// repetitions match greedily and need at least one occurrence
+		XCTAssertEqual(String(cString: config.post.pointee.next.pointee.pattern.string), "c")
+		XCTAssertEqual(String(cString: config.post.pointee.next.pointee.command), "d")
+		XCTAssertEqual(String(cString: config.post.pointee.next.pointee.next.pointee.pattern.string), "e")
+		XCTAssertEqual(String(cString: config.post.pointee.next.pointee.next.pointee.command), "f -> g")
+		XCTAssertNil(config.post.pointee.next.pointee.next.pointee.next)
+		// keywords start the line and are followed by a blank, longer Unison options are skipped
+		XCTAssertNil(config.symlink)
+		XCTAssertNil(config.encrypt)
+		XCTAssertEqual(configThrottling(0), 750)
+		// the final line needs no newline
+		XCTAssertEqual(String(cString: config.post_command), "last")
+	}
+
+	func testConfigBaseline() {
+		// results of the per-character parser that the line parser replaced
+		let cases: [(String, [String])] = [
+			("root = /x", ["root /x"]),
+			("root\t=\t/x", ["root /x"]),
+			("root=/x", []),
+			("root =/x", []),
+			("root= /x", []),
+			(" root = /x", []),
+			("\troot = /x", []),
+			("rootx = /x", []),
+			("roo = /x", []),
+			("root = /x\r", ["root /x\r"]),
+			("root = /a\0b", ["root /ab"]),
+			("root = \0", []),
+			("root = ", []),
+			("root =  \t /x y  ", ["root /x y"]),
+			("root = /a\nroot = /b\nroot = /c", ["root /a", "root /b"]),
+			("#precmd = make all  ", ["precmd make all"]),
+			("#postcmd = last", ["postcmd last"]),
+			("#postcmd=last", []),
+			("#precmd = = x", ["precmd = x"]),
+			("#post = Path a -> b", ["post a -> b"]),
+			("#post = Path  -> y", []),
+			("#post = Path a ->", []),
+			("#post = Path a -> b -> c", ["post a -> b -> c"]),
+			("#post =Path a -> b", []),
+			("#post = Patha -> b", []),
+			("#post = Path a", []),
+			("#post = Path\ta\t->\tb", []),
+			("#post = Path  a -> b", ["post a -> b"]),
+			("#post = path a -> b", []),
+			("#symlink = Path l -> t", ["symlink l -> t"]),
+			("#symlink = Path l", []),
+			("#symlink = Path l -> t -> u", ["symlink l -> t -> u"]),
+			("#encrypt = Path e -> aes-256-gcm:k", ["encrypt e 0 8254c329"]),
+			("#encrypt = Path e -> aes-256-gcm-v2:k", ["encrypt e 1 8254c329"]),
+			("#encrypt = Path e -> aes-256-gcm-cdc:k", ["encrypt e 2 8254c329"]),
+			("#encrypt = Path e -> aes-128:k", []),
+			("#encrypt = Path e", []),
+			("#encrypted = Path e -> aes-256-gcm:k", []),
+			("#compress = Path c -> zlib", ["compress c 0"]),
+			("#compress = Path c -> gzip", []),
+			("#compress = Path c", []),
+			("#iopressure = 10 20", ["iopressure 1000 2000"]),
+			("#iopressure = 7.5", ["iopressure 750 0"]),
+			("#iopressure = 10", ["iopressure 1000 0"]),
+			("#iolimit = 5", ["iolimit 5242880 0"]),
+			("#iolimit = 5 5 5", []),
+			("#iolimit = 0 50", ["iolimit 0 52428800"]),
+			("#pos = Path a -> b", []),
+			("#postc = x", []),
+			("#\troot = /x", []),
+			("# root = /x", []),
+			("#", []),
+			("= Path a -> b", []),
+			("", []),
+			("fastercheckUNSAFE = true", []),
+			("copyonconflict = true", []),
+			("ignore = Path build", [])
+		]
+		let profileFile = Tests.root.appendingPathComponent(".unison/default.prf")
+		try! files.createDirectory(at: profileFile.deletingLastPathComponent(), withIntermediateDirectories: true)
+		let buffer = UnsafeMutableRawBufferPointer.allocate(byteCount: 64, alignment: 1)
+		defer { buffer.deallocate() }
+		for (profile, expected) in cases {
+			config_reset()
+			try! profile.write(to: profileFile, atomically: false, encoding: .utf8)
+			let fd = interceptOpen(profileFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+			while read(fd, buffer.baseAddress, buffer.count) > 0 {}
+			XCTAssertEqual(close(fd), 0)
+			XCTAssertEqual(dumpConfig(), expected, profile.debugDescription)
+		}
+	}
+
+	func testConfigChunked() {
+		// profiles from random fragments, including near misses and broken lines
+		var random = Generator(state: 0x2545f4914f6cdd1d)
+		let keywords = ["root", "#precmd", "#postcmd", "#post", "#symlink", "#encrypt", "#compress", "#iopressure", "#iolimit",
+			"roo", "rootx", "#pos", "#postc", "#encrypted", "ignore", "#", "", "path", "#iolimi", "#\troot", " root"]
+		let blanks = ["", " ", "  ", "\t", " \t ", "\t\t"]
+		let arguments = ["Path a/b -> x", "Path   a -> aes-256-gcm:secret", "Path q -> aes-256-gcm-v2:k", "Path z -> aes-256-gcm-cdc:k",
+			"Path c -> zlib", "Path c -> gzip", "/root/dir//", "/x", "rel", "10 20", "5", "5 5 5", "0 50", "7.5", "Path", "Path ",
+			"Pathx -> y", "Path a ->", "Path  -> y", "cmd arg  ", "a\tb", "a\r", "x\0y", "\0", "-> ", "Path a -> b -> c", " Path a",
+			"= Path a -> b"]
+		func generate() -> [UInt8] {
+			var profile: [UInt8] = []
+			let lines = Int.random(in: 0..<30, using: &random)
+			for line in 0..<lines {
+				if Int.random(in: 0..<10, using: &random) < 8 {
+					profile += keywords.randomElement(using: &random)!.utf8
+					profile += blanks.randomElement(using: &random)!.utf8
+					profile += (Int.random(in: 0..<8, using: &random) > 0 ? "=" : blanks.randomElement(using: &random)!).utf8
+					profile += blanks.randomElement(using: &random)!.utf8
+				}
+				profile += arguments.randomElement(using: &random)!.utf8
+				if Int.random(in: 0..<10, using: &random) == 0 {
+					profile[Int.random(in: 0..<profile.count, using: &random)] = Array("\n \t=#\0x".utf8).randomElement(using: &random)!
+				}
+				if line + 1 < lines || Bool.random(using: &random) {
+					profile += (Int.random(in: 0..<10, using: &random) > 0 || Bool.random(using: &random) ? "\n" : "\r").utf8
+				}
+				if Int.random(in: 0..<20, using: &random) == 0 { profile += "\n".utf8 }
+			}
+			return profile
+		}
+
+		let buffer = UnsafeMutableRawBufferPointer.allocate(byteCount: 64 * 1024, alignment: 1)
+		let extra = UnsafeMutableRawBufferPointer.allocate(byteCount: 8, alignment: 1)
+		defer {
+			buffer.deallocate()
+			extra.deallocate()
+		}
+		let configDir = Tests.root.appendingPathComponent(".unison")
+		try! files.createDirectory(at: configDir, withIntermediateDirectories: true)
+
+		// the parsed configuration must not depend on how reads split the profiles
+		func parse(_ profiles: [(URL, [UInt8])], chunked: Bool) -> [String] {
+			config_reset()
+			for (file, profile) in profiles {
+				try! Data(profile).write(to: file)
+				let fd = interceptOpen(file.path, FileDescriptor.AccessMode.readOnly.rawValue)
+				let mode = Int.random(in: 0..<3, using: &random)
+				var chunk = 1 + Int.random(in: 0..<(Bool.random(using: &random) ? 8 : 200), using: &random)
+				while true {
+					let result: Int
+					if !chunked {
+						result = read(fd, buffer.baseAddress, buffer.count)
+					} else if mode == 0 {
+						result = read(fd, buffer.baseAddress, chunk)
+					} else {
+						var vector = [
+							iovec(iov_base: buffer.baseAddress, iov_len: chunk),
+							iovec(iov_base: extra.baseAddress, iov_len: Int.random(in: 1...extra.count, using: &random))
+						]
+						result = readv(fd, &vector, Int32(vector.count))
+						if mode == 2 { chunk = Int.random(in: 1...300, using: &random) }
+					}
+					if result <= 0 { break }
+				}
+				XCTAssertEqual(close(fd), 0)
+			}
+
+			return dumpConfig()
+		}
+
+		let names = ["default.prf", "other.prf"].map { configDir.appendingPathComponent($0) }
+		for _ in 0..<2000 {
+			let profiles = (0..<Int.random(in: 1...3, using: &random)).map { _ in
+				(names.randomElement(using: &random)!, generate())
+			}
+			let whole = parse(profiles, chunked: false)
+			XCTAssertEqual(parse(profiles, chunked: true), whole)
+		}
+	}
+
 	func testPrePost() {
 		loadProfile("""
 			#precmd  = run 1
@@ -235,4 +472,437 @@ extension Tests {
 
 		buffer.deallocate()
 	}
+
+	func testEncryptSegmented() {
+		let testFile = Tests.root.appendingPathComponent("test")
+		let content = String(repeating: "Segmented Test ", count: 10000)
+		try! content.write(toFile: testFile.path, atomically: false, encoding: .utf8)
+		loadProfile("""
+			root = \(Tests.root.path)
+			#encrypt = Path test -> aes-256-gcm-v2:LJrNEGtg0a
+			""")
+
+		let archiveFile = Tests.root.appendingPathComponent(".unison/ar00000000000000000000000000000000")
+		touch(archiveFile)
+
+		// header, then three segments of at most 64 KiB, each followed by its tag
+		let header = 32 + 8 + 16
+		let stride = 65536 + 16
+		let size = header + content.count + 3 * 16
+		let buffer = UnsafeMutableRawBufferPointer.allocate(byteCount: size, alignment: 1)
+		let slice = UnsafeMutableRawBufferPointer.allocate(byteCount: 100, alignment: 1)
+		defer {
+			buffer.deallocate()
+			slice.deallocate()
+		}
+
+		// segments can be read at any position
+		let readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(read(readFd, buffer.baseAddress, buffer.count), size)
+		XCTAssertEqual(pread(readFd, slice.baseAddress, slice.count, 70000), slice.count)
+		XCTAssertEqual(Array(slice), Array(buffer[70000..<70100]))
+		XCTAssertEqual(close(readFd), 0)
+
+		// segments can be written in any order after the header
+		var writeFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+		XCTAssertEqual(write(writeFd, buffer.baseAddress, header), header)
+		// the header cannot be rewritten
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress, header, 0), -1)
+		XCTAssertEqual(errno, Errno.invalidArgument.rawValue)
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress! + 10, 10, 10), -1)
+		XCTAssertEqual(errno, Errno.invalidArgument.rawValue)
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress! + header + stride, size - header - stride, off_t(header + stride)), size - header - stride)
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress! + header, stride, off_t(header)), stride)
+		XCTAssertEqual(close(writeFd), 0)
+		XCTAssertEqual(try! String(contentsOf: testFile), content)
+
+		// a manipulated segment fails as soon as it is complete
+		buffer[header + 1] ^= 1
+		writeFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+		XCTAssertEqual(write(writeFd, buffer.baseAddress, header + stride), -1)
+		XCTAssertEqual(errno, Errno.ioError.rawValue)
+		XCTAssertEqual(try! String(contentsOf: testFile), "")
+		XCTAssertEqual(close(writeFd), -1)
+		XCTAssertEqual(errno, Errno.ioError.rawValue)
+	}
+
+	func testEncryptChunked() {
+		let testFile = Tests.root.appendingPathComponent("test")
+		let editedFile = Tests.root.appendingPathComponent("edited")
+		// incompressible content, the edited copy has a few bytes inserted in the middle
+		let content = Data((0..<1_000_000).map { _ in UInt8.random(in: 0...255) })
+		var edited = content
+		edited.insert(contentsOf: [1, 2, 3], at: 500_000)
+		try! content.write(to: testFile)
+		try! edited.write(to: editedFile)
+		loadProfile("""
+			root = \(Tests.root.path)
+			#encrypt = Path test -> aes-256-gcm-cdc:LJrNEGtg0a
+			#encrypt = Path edited -> aes-256-gcm-cdc:LJrNEGtg0a
+			""")
+
+		let archiveFile = Tests.root.appendingPathComponent(".unison/ar00000000000000000000000000000000")
+		touch(archiveFile)
+
+		// header, then room for one chunk per 16 KiB with its header and tag, then the trailer
+		let header = 32 + 8 + 16
+		let size = { (length: Int) in header + length + (length + 16383) / 16384 * (16 + 8 + 16) + 16 }
+		let buffer = UnsafeMutableRawBufferPointer.allocate(byteCount: size(content.count), alignment: 1)
+		let editedBuffer = UnsafeMutableRawBufferPointer.allocate(byteCount: size(edited.count), alignment: 1)
+		defer {
+			buffer.deallocate()
+			editedBuffer.deallocate()
+		}
+
+		var readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(read(readFd, buffer.baseAddress, buffer.count), buffer.count)
+		XCTAssertEqual(close(readFd), 0)
+		readFd = interceptOpen(editedFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(read(readFd, editedBuffer.baseAddress, editedBuffer.count), editedBuffer.count)
+		XCTAssertEqual(close(readFd), 0)
+
+		// chunks away from the edit encrypt identically
+		func chunkIVs(_ encrypted: UnsafeMutableRawBufferPointer) -> [[UInt8]] {
+			var ivs: [[UInt8]] = []
+			var position = header
+			while position + 24 <= encrypted.count {
+				let length = Int(encrypted.loadUnaligned(fromByteOffset: position + 16, as: UInt64.self))
+				if length == 0 { break }
+				ivs.append(Array(encrypted[position..<position + 16]))
+				position += 24 + length + 16
+			}
+			return ivs
+		}
+		let original = chunkIVs(buffer)
+		let changed = chunkIVs(editedBuffer).filter { !original.contains($0) }
+		XCTAssertGreaterThan(original.count, 4)
+		XCTAssertLessThanOrEqual(changed.count, 2)
+
+		// chunks are written sequentially and restore the content
+		var writeFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+		XCTAssertEqual(write(writeFd, buffer.baseAddress, 100), 100)
+		XCTAssertEqual(write(writeFd, buffer.baseAddress! + 100, buffer.count - 100), buffer.count - 100)
+		XCTAssertEqual(close(writeFd), 0)
+		XCTAssertEqual(try! Data(contentsOf: testFile), content)
+
+		// a manipulated chunk fails as soon as it is complete
+		buffer[header + 30] ^= 1
+		writeFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+		XCTAssertEqual(write(writeFd, buffer.baseAddress, buffer.count), -1)
+		XCTAssertEqual(errno, Errno.ioError.rawValue)
+		XCTAssertEqual(try! Data(contentsOf: testFile), Data())
+		XCTAssertEqual(close(writeFd), -1)
+		XCTAssertEqual(errno, Errno.ioError.rawValue)
+	}
+
+	func testEncryptVectored() {
+		let testFile = Tests.root.appendingPathComponent("test")
+		try! "Vectored Test".write(toFile: testFile.path, atomically: false, encoding: .utf8)
+		loadProfile("""
+			root = \(Tests.root.path)
+			#encrypt = Path test -> aes-256-gcm:LJrNEGtg0a
+			""")
+
+		let archiveFile = Tests.root.appendingPathComponent(".unison/ar00000000000000000000000000000000")
+		touch(archiveFile)
+
+		let size = 32 + 8 + "Vectored Test".count + 16
+		let expected = UnsafeMutableRawBufferPointer.allocate(byteCount: size, alignment: 1)
+		let buffer = UnsafeMutableRawBufferPointer.allocate(byteCount: size, alignment: 1)
+		defer {
+			expected.deallocate()
+			buffer.deallocate()
+		}
+
+		var readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(read(readFd, expected.baseAddress, expected.count), size)
+		XCTAssertEqual(close(readFd), 0)
+
+		// split the vector inside the header and inside the content
+		var vector = [
+			iovec(iov_base: buffer.baseAddress, iov_len: 20),
+			iovec(iov_base: buffer.baseAddress! + 20, iov_len: 25),
+			iovec(iov_base: buffer.baseAddress! + 45, iov_len: size - 45)
+		]
+		readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(readv(readFd, &vector, Int32(vector.count)), size)
+		XCTAssertEqual(close(readFd), 0)
+		XCTAssertEqual(Array(buffer), Array(expected))
+
+		// positional writes must continue where the previous one ended
+		let writeFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress, 45, 0), 45)
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress! + 45, size - 45, 0), -1)
+		XCTAssertEqual(errno, Errno.invalidArgument.rawValue)
+		XCTAssertEqual(pwrite(writeFd, buffer.baseAddress! + 45, size - 45, 45), size - 45)
+		XCTAssertEqual(close(writeFd), 0)
+		XCTAssertEqual(try! String(contentsOf: testFile), "Vectored Test")
+	}
+
+	func testEncryptRacyRewrite() {
+		let testFile = Tests.root.appendingPathComponent("test")
+		try! "Racy".write(toFile: testFile.path, atomically: false, encoding: .utf8)
+		loadProfile("""
+			root = \(Tests.root.path)
+			#encrypt = Path test -> aes-256-gcm:LJrNEGtg0a
+			""")
+
+		let archiveFile = Tests.root.appendingPathComponent(".unison/ar00000000000000000000000000000000")
+		touch(archiveFile)
+
+		let size = 32 + 8 + "Racy".count + 16
+		let first = UnsafeMutableRawBufferPointer.allocate(byteCount: size, alignment: 1)
+		let second = UnsafeMutableRawBufferPointer.allocate(byteCount: size, alignment: 1)
+		defer {
+			first.deallocate()
+			second.deallocate()
+		}
+
+		var readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(read(readFd, first.baseAddress, first.count), size)
+		XCTAssertEqual(close(readFd), 0)
+
+		// rewrite within the same timestamp tick, keeping size and modification time
+		let times = testFile.withUnsafeFileSystemRepresentation {
+			let statBuffer = UnsafeMutablePointer<stat>.allocate(capacity: 1)
+			defer { statBuffer.deallocate() }
+			stat($0!, statBuffer)
+			return [statBuffer.pointee.st_atimespec, statBuffer.pointee.st_mtimespec]
+		}
+		try! "Fast".write(toFile: testFile.path, atomically: false, encoding: .utf8)
+		testFile.withUnsafeFileSystemRepresentation {
+			XCTAssertEqual(utimensat(AT_FDCWD, $0!, times, 0), 0)
+		}
+
+		// the IV must be derived from the new content, not taken from the cache
+		readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+		XCTAssertEqual(read(readFd, second.baseAddress, second.count), size)
+		XCTAssertEqual(close(readFd), 0)
+		XCTAssertNotEqual(Array(first[0..<32]), Array(second[0..<32]))
+	}
+
+	func testEncryptPipeline() {
+		let testFile = Tests.root.appendingPathComponent("test")
+		// large enough to be encrypted ahead of the reader on worker threads
+		let size = 33 * 1024 * 1024 + 123
+		let content = (0..<size).map { UInt8(truncatingIfNeeded: $0 &* 7 &+ $0 / 251) }
+		try! Data(content).write(to: testFile)
+		loadProfile("""
+			root = \(Tests.root.path)
+			#encrypt = Path test -> aes-256-gcm:LJrNEGtg0a
+			""")
+
+		let archiveFile = Tests.root.appendingPathComponent(".unison/ar00000000000000000000000000000000")
+		touch(archiveFile)
+
+		let encryptedSize = 32 + 8 + size + 16
+		func encrypt(threads: CUnsignedInt) -> [UInt8] {
+			workers_restrict(threads)
+			let buffer = UnsafeMutableRawBufferPointer.allocate(byteCount: encryptedSize + 1, alignment: 1)
+			defer { buffer.deallocate() }
+			let readFd = interceptOpen(testFile.path, FileDescriptor.AccessMode.readOnly.rawValue)
+			var filled = 0
+			while filled < buffer.count {
+				let result = read(readFd, buffer.baseAddress! + filled, min(1024 * 1024, buffer.count - filled))
+				if result <= 0 { break }
+				filled += result
+			}
+			XCTAssertEqual(close(readFd), 0)
+			XCTAssertEqual(filled, encryptedSize)
+			return Array(buffer[0..<filled])
+		}
+
+		// ciphertext and tag must not depend on the pipeline
+		let limit = workers_limit()
+		defer { workers_restrict(limit) }
+		let serial = encrypt(threads: 1)
+		let parallel = encrypt(threads: 4)
+		XCTAssertTrue(serial == parallel)
+	}
+
+	func testEncryptLengthLimit() throws {
+		var gcm = gcm_s()
+		gcm_init(&gcm)
+		defer { gcm_free(&gcm) }
+		// only pieces reach the limit quickly, by joining a long run of blocks
+		try XCTSkipUnless(gcm_parallel(&gcm), "\(String(cString: gcm_backend_name(gcm.backend))) processes no pieces")
+
+		let key = [UInt8](repeating: 0, count: 32)
+		let iv = [UInt8](repeating: 0, count: 12)
+		var input = [UInt8](repeating: 0, count: 32)
+		var output = [UInt8](repeating: 0, count: 32)
+		var written = 0
+		XCTAssertEqual(gcm_setkey(&gcm, key), 0)
+		XCTAssertEqual(gcm_starts(&gcm, MBEDTLS_GCM_ENCRYPT, iv, iv.count), 0)
+		gcm_join(&gcm, [UInt8](repeating: 0, count: 16), Int(GCM_LENGTH_MAX) - 48)
+
+		// the counter must not wrap, text past the limit is refused like mbedtls does
+		XCTAssertEqual(gcm_update(&gcm, &input, 32, &output, 32, &written), 0)
+		XCTAssertEqual(gcm_update(&gcm, &input, 17, &output, 32, &written), MBEDTLS_ERR_GCM_BAD_INPUT)
+		XCTAssertEqual(gcm_update(&gcm, &input, 16, &output, 32, &written), 0)
+		XCTAssertEqual(gcm_update(&gcm, &input, 1, &output, 32, &written), MBEDTLS_ERR_GCM_BAD_INPUT)
+	}
+
+	func testEncryptRuleIndex() {
+		// reproducible pseudo-random rules and paths
+		var random = Generator(state: 0x9e3779b97f4a7c15)
+		let components = ["a", "b", "ab", "dir", "x.txt", "y.c"]
+		let wildcards = ["*", "?", "[ab]", "*.txt", "d?r", "a*"]
+		func component(wild: Bool) -> String {
+			wild && Int.random(in: 0..<4, using: &random) == 0 ?
+				wildcards.randomElement(using: &random)! : components.randomElement(using: &random)!
+		}
+
+		var profile = "root = \(Tests.root.path)\n"
+		for rule in 0..<300 {
+			let depth = Int.random(in: 2...4, using: &random)
+			var pattern = (0..<depth).map { _ in component(wild: true) }.joined(separator: "/")
+			if Int.random(in: 0..<10, using: &random) == 0 { pattern = Tests.root.path + "/" + pattern }
+			profile += "#encrypt = Path \(pattern) -> aes-256-gcm:key\(rule)\n"
+		}
+		loadProfile(profile)
+
+		// the most specific rule is the first match in the list, as matched before the index existed
+		func linear(_ path: String) -> UnsafePointer<encrypt_s>? {
+			var rule = config.encrypt
+			while let current = rule {
+				for candidate in [current.pointee.path, current.pointee.prefixed_path, current.pointee.suffixed_path] {
+					var pattern = String(cString: candidate.string)
+					if pattern.first != "/", let root = config.root.0.string {
+						pattern = String(cString: root) + "/" + pattern
+					} else if pattern == "/" {
+						pattern = ""
+					}
+					if fnmatch(pattern, path, FNM_PATHNAME | FNM_LEADING_DIR) == 0 { return UnsafePointer(current) }
+				}
+				rule = current.pointee.next
+			}
+			return nil
+		}
+
+		for _ in 0..<10000 {
+			let depth = Int.random(in: 1...5, using: &random)
+			var names = (0..<depth).map { _ in component(wild: false) }
+			switch Int.random(in: 0..<4, using: &random) {
+			case 0: names[depth - 1] = ".unison." + names[depth - 1] + ".tmp"
+			case 1: names[depth - 1] += ".unison.tmp"
+			default: break
+			}
+			let path = Tests.root.path + "/" + names.joined(separator: "/")
+			XCTAssertEqual(config_encrypt_rule(path), linear(path), path)
+		}
+	}
+
+	func testCompress() {
+		let textFile = Tests.root.appendingPathComponent("text")
+		let noiseFile = Tests.root.appendingPathComponent("noise")
+		let bothFile = Tests.root.appendingPathComponent("both")
+		let lockedFile = Tests.root.appendingPathComponent("locked")
+		let text = (0..<5000).map { "line \($0) of a compressible test file\n" }.joined()
+		try! text.write(toFile: textFile.path, atomically: false, encoding: .utf8)
+		try! text.write(toFile: bothFile.path, atomically: false, encoding: .utf8)
+		var state: UInt64 = 0x2545f4914f6cdd1d
+		let noise = (0..<100_000).map { _ -> UInt8 in
+			state ^= state << 13
+			state ^= state >> 7
+			state ^= state << 17
+			return UInt8(truncatingIfNeeded: state)
+		}
+		try! Data(noise).write(to: noiseFile)
+		loadProfile("""
+			root = \(Tests.root.path)
+			#compress = Path text -> zlib
+			#compress = Path noise -> zlib
+			#compress = Path both -> zlib
+			#compress = Path locked -> zlib
+			#encrypt = Path both -> aes-256-gcm:LJrNEGtg0a
+			""")
+
+		let archiveFile = Tests.root.appendingPathComponent(".unison/ar00000000000000000000000000000000")
+		touch(archiveFile)
+
+		func size(_ file: URL) -> Int {
+			file.withUnsafeFileSystemRepresentation {
+				let statBuffer = UnsafeMutablePointer<stat>.allocate(capacity: 1)
+				defer { statBuffer.deallocate() }
+				stat($0!, statBuffer)
+				return Int(statBuffer.pointee.st_size)
+			}
+		}
+		// use POSIX open()/read() so the intercept layers produce the view
+		func readView(_ file: URL) -> [UInt8] {
+			let readFd = interceptOpen(file.path, FileDescriptor.AccessMode.readOnly.rawValue)
+			var statBuffer = stat()
+			XCTAssertEqual(fstat(readFd, &statBuffer), 0)
+			var view: [UInt8] = []
+			var chunk = [UInt8](repeating: 0, count: 7777)
+			while true {
+				let result = read(readFd, &chunk, chunk.count)
+				if result <= 0 { break }
+				view += chunk[0..<result]
+			}
+			XCTAssertEqual(close(readFd), 0)
+			XCTAssertEqual(Int(statBuffer.st_size), view.count)
+			return view
+		}
+		// the result of close() tells whether the view was accepted
+		func writeView(_ file: URL, _ view: ArraySlice<UInt8>) -> Int32 {
+			let writeFd = interceptOpen(file.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+			for start in stride(from: view.startIndex, to: view.endIndex, by: 4096) {
+				let end = min(start + 4096, view.endIndex)
+				let written = view[start..<end].withUnsafeBytes { write(writeFd, $0.baseAddress, $0.count) }
+				XCTAssertEqual(written, end - start)
+			}
+			return close(writeFd)
+		}
+		let magic = Array("UNCZ".utf8)
+
+		// compressible content is presented as a zlib stream
+		var view = readView(textFile)
+		XCTAssertEqual(size(textFile), view.count)
+		XCTAssertEqual(Array(view[0..<8]), magic + [1, 0, 0, 0])
+		XCTAssertLessThan(view.count, text.utf8.count / 4)
+		XCTAssertEqual(writeView(textFile, view[...]), 0)
+		XCTAssertEqual(try! String(contentsOf: textFile), text)
+
+		// incompressible content follows the header unchanged
+		view = readView(noiseFile)
+		XCTAssertEqual(size(noiseFile), view.count)
+		XCTAssertEqual(Array(view[0..<8]), magic + [0, 0, 0, 0])
+		XCTAssertEqual(Array(view[16...]), noise)
+		XCTAssertEqual(writeView(noiseFile, view[...]), 0)
+		XCTAssertEqual([UInt8](try! Data(contentsOf: noiseFile)), noise)
+
+		// content is compressed before it is encrypted
+		view = readView(bothFile)
+		XCTAssertEqual(size(bothFile), view.count)
+		XCTAssertLessThan(view.count, text.utf8.count / 4)
+		XCTAssertEqual(writeView(bothFile, view[...]), 0)
+		XCTAssertEqual(try! String(contentsOf: bothFile), text)
+
+		// a view cut short is rejected and leaves an empty file
+		view = readView(textFile)
+		XCTAssertEqual(writeView(textFile, view.dropLast()), -1)
+		XCTAssertEqual(errno, Errno.ioError.rawValue)
+		XCTAssertEqual(try! String(contentsOf: textFile), "")
+
+		// so is a view written out of order
+		try! text.write(toFile: textFile.path, atomically: false, encoding: .utf8)
+		view = readView(textFile)
+		let writeFd = interceptOpen(textFile.path, FileDescriptor.AccessMode.writeOnly.rawValue | O_TRUNC)
+		XCTAssertEqual(write(writeFd, view, 100), 100)
+		XCTAssertEqual(view.withUnsafeBytes { pwrite(writeFd, $0.baseAddress! + 200, 100, 200) }, -1)
+		XCTAssertEqual(errno, Errno.invalidArgument.rawValue)
+		XCTAssertEqual(close(writeFd), -1)
+		XCTAssertEqual(errno, Errno.ioError.rawValue)
+		XCTAssertEqual(try! String(contentsOf: textFile), "")
+
+		// an unreadable file keeps its size on disk, opening it reports the error
+		try! text.write(toFile: lockedFile.path, atomically: false, encoding: .utf8)
+		XCTAssertEqual(chmod(lockedFile.path, 0), 0)
+		defer { chmod(lockedFile.path, S_IRUSR | S_IWUSR) }
+		XCTAssertEqual(size(lockedFile), text.utf8.count)
+		XCTAssertEqual(interceptOpen(lockedFile.path, FileDescriptor.AccessMode.readOnly.rawValue), -1)
+		XCTAssertEqual(errno, Errno.permissionDenied.rawValue)
+	}
 }
@@ -0,0 +1,48 @@
+/* binary trace of the calls Unison makes into the intercept stack
+ *
+ * A trace starts with a header, followed by the HOME and working directory of
+ * the recording process. Then follows one record per intercepted call, each
+ * trailed by the path arguments of the call. Strings are not NUL-terminated.
+ * File contents are never recorded. All fields are stored in the byte order of
+ * the recording machine. */
+
+#include <stdint.h>
+
+/* all intercepted functions, used to number them in traces and statistics */
+#define INTERCEPT_FUNCTIONS(X) \
+	X(open) X(close) X(read) X(write) X(pread) X(pwrite) X(readv) X(writev) X(preadv) X(pwritev) \
+	X(copy_file_range) X(sendfile) X(stat) X(lstat) X(getattrlist) X(rename) X(symlink) X(unlink) \
+	X(opendir) X(closedir) X(mkdir) X(rmdir) X(openat) X(fstatat) X(statx) X(renameat) X(renameat2) \
+	X(unlinkat) X(mkdirat) X(lseek) X(fstat) X(ftruncate)
+
+enum intercept_function {
+#define INTERCEPT_ENUM(function) INTERCEPT_##function,
+	INTERCEPT_FUNCTIONS(INTERCEPT_ENUM)
+#undef INTERCEPT_ENUM
+	INTERCEPT_FUNCTION_COUNT
+};
+
+#define TRACE_MAGIC "UNITRACE"
+#define TRACE_VERSION 1
+
+struct trace_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t home_length;
+	uint32_t cwd_length;
+};
+
+struct trace_record_s {
+	uint64_t time;            // nanoseconds since the start of the recording
+	int64_t offset[2];        // file offsets before positional calls, -1 otherwise
+	uint64_t size;            // requested bytes, st_size after successful stat calls, length for ftruncate()
+	int64_t result;           // return value, descriptor of the stream for opendir()
+	int32_t fd[2];            // file descriptor arguments, directory descriptor for *at() calls
+	int32_t flags;            // open(), *at() or copy flags, iovcnt for vectored calls
+	uint32_t mode;            // creation mode, st_mode after successful stat calls
+	int32_t error;            // errno after failed calls
+	uint32_t thread;          // threads are numbered in the order of their first call
+	uint16_t function;        // enum intercept_function
+	uint16_t path_length[2];  // lengths of the path arguments following the record
+	uint16_t reserved;        // zero, keeps the record free of padding
+};
@@ -9,9 +9,11 @@
 #include <assert.h>
 
 #include "config.h"
+#include "fdmap.h"
 #include "umask.h"
 
 
+static mode_t mode_restrict_at(int dirfd, const char *path, mode_t mode);
 static mode_t mode_restrict(const char *path, mode_t mode);
 
 
@@ -52,9 +54,41 @@ int umask_symlink(const char *target, const char *path)
 	return result;
 }
 
+int umask_openat(int dirfd, const char *path, int flags, ...)
+{
+	int result;
+	va_list arg;
+	va_start(arg, flags);
+
+	if (flags & O_CREAT) {
+		mode_t mode = (mode_t)va_arg(arg, unsigned);
+		mode = mode_restrict_at(dirfd, path, mode);
+		result = openat(dirfd, path, flags, mode);
+	} else {
+		result = openat(dirfd, path, flags);
+	}
+
+	va_end(arg);
+	return result;
+}
+
+int umask_mkdirat(int dirfd, const char *path, mode_t mode)
+{
+	mode = mode_restrict_at(dirfd, path, mode);
+	return mkdirat(dirfd, path, mode);
+}
+
 
 /* MARK: - Helper Functions */
 
+static mode_t mode_restrict_at(int dirfd, const char *path, mode_t mode)
+{
+	char *resolved = fdmap_path(dirfd, path, 0);
+	mode = mode_restrict(resolved ? resolved : path, mode);
+	free(resolved);
+	return mode;
+}
+
 static mode_t mode_restrict(const char *path, mode_t mode)
 {
 	static struct string_s home = { .string = NULL, .length = 0 };
@@ -5,3 +5,5 @@
 [[nodiscard]] int umask_open(const char *path, int flags, ...);
 [[nodiscard]] int umask_mkdir(const char *path, mode_t mode);
 [[nodiscard]] int umask_symlink(const char *target, const char *path);
+[[nodiscard]] int umask_openat(int dirfd, const char *path, int flags, ...);
+[[nodiscard]] int umask_mkdirat(int dirfd, const char *path, mode_t mode);
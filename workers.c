@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <assert.h>
+
+#include "workers.h"
+
+
+#define WORKERS_MAX 64
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	unsigned limit;
+	unsigned started;
+	struct job_s {
+		void (*function)(void *argument);
+		void *argument;
+		struct job_s *next;
+	} *first, **last;
+} workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.available = PTHREAD_COND_INITIALIZER,
+	.first = NULL,
+	.last = &workers.first
+};
+
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+
+static void workers_initialize(void);
+static void workers_forked(void);
+static void *worker(void *argument);
+
+
+void workers_submit(void (*function)(void *argument), void *argument)
+{
+	pthread_once(&workers_once, workers_initialize);
+
+	struct job_s *job = malloc(sizeof(struct job_s));
+	assert(job);
+	job->function = function;
+	job->argument = argument;
+	job->next = NULL;
+
+	pthread_mutex_lock(&workers.lock);
+	*workers.last = job;
+	workers.last = &job->next;
+
+	if (workers.started < workers.limit) {
+		// only synchronous faults reach workers, the application handles all other signals
+		sigset_t blocked, previous;
+		sigfillset(&blocked);
+		sigdelset(&blocked, SIGBUS);
+		sigdelset(&blocked, SIGSEGV);
+		pthread_sigmask(SIG_SETMASK, &blocked, &previous);
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, NULL) == 0) {
+			pthread_detach(thread);
+			workers.started++;
+		}
+		pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	}
+
+	if (workers.started == 0) {
+		// without any worker, the job runs right away
+		workers.first = NULL;
+		workers.last = &workers.first;
+		pthread_mutex_unlock(&workers.lock);
+		function(argument);
+		free(job);
+		return;
+	}
+
+	pthread_cond_signal(&workers.available);
+	pthread_mutex_unlock(&workers.lock);
+}
+
+unsigned workers_limit(void)
+{
+	pthread_once(&workers_once, workers_initialize);
+	pthread_mutex_lock(&workers.lock);
+	const unsigned limit = workers.limit;
+	pthread_mutex_unlock(&workers.lock);
+	return limit;
+}
+
+void workers_restrict(unsigned limit)
+{
+	pthread_once(&workers_once, workers_initialize);
+	pthread_mutex_lock(&workers.lock);
+	workers.limit = limit > WORKERS_MAX ? WORKERS_MAX : limit;
+	pthread_mutex_unlock(&workers.lock);
+}
+
+
+/* MARK: - Helper Functions */
+
+static void workers_initialize(void)
+{
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	workers.limit = processors > 0 ? (unsigned)processors : 1;
+
+	const char *requested = getenv("UNISON_INTERCEPT_THREADS");
+	if (requested && *requested) workers.limit = (unsigned)strtoul(requested, NULL, 10);
+	if (workers.limit > WORKERS_MAX) workers.limit = WORKERS_MAX;
+
+	pthread_atfork(NULL, NULL, workers_forked);
+}
+
+/* threads do not survive fork(), so the child starts its own ones */
+static void workers_forked(void)
+{
+	pthread_mutex_init(&workers.lock, NULL);
+	pthread_cond_init(&workers.available, NULL);
+	workers.started = 0;
+	while (workers.first) {
+		struct job_s *job = workers.first;
+		workers.first = job->next;
+		free(job);
+	}
+	workers.last = &workers.first;
+}
+
+static void *worker(void *argument)
+{
+	(void)argument;
+	pthread_mutex_lock(&workers.lock);
+	for (;;) {
+		while (!workers.first) pthread_cond_wait(&workers.available, &workers.lock);
+		struct job_s *job = workers.first;
+		workers.first = job->next;
+		if (!workers.first) workers.last = &workers.first;
+		pthread_mutex_unlock(&workers.lock);
+
+		job->function(job->argument);
+		free(job);
+
+		pthread_mutex_lock(&workers.lock);
+	}
+	return NULL;
+}
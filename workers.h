@@ -0,0 +1,14 @@
+/* process-wide pool of worker threads
+ *
+ * Layers hand independent pieces of work to the pool, which runs them on up
+ * to UNISON_INTERCEPT_THREADS threads, by default one per processor. The
+ * threads are started on first use and never call intercepted functions. */
+
+#include <stdbool.h>
+
+/* run the function on a worker thread at some later time */
+void workers_submit(void (*function)(void *argument), void *argument);
+/* number of worker threads, one or less disables parallel processing */
+[[nodiscard]] unsigned workers_limit(void);
+/* change the number of worker threads, already started threads keep running */
+void workers_restrict(unsigned limit);